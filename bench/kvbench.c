@@ -0,0 +1,105 @@
+/*
+ * key/value store throughput benchmark.
+ * runs a mixed get/set workload against the store with 1 up to the given number of threads,
+ * first with a single shard (the equivalent of one global lock) and then with the given number of shards.
+ *
+ * usage: kvbench [threads] [shards] [seconds] [keys] [set percentage] [ttl in milliseconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "kv.h"
+
+typedef struct {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long ops;
+} worker;
+
+static volatile int RUNNING;
+static int KEYS = 100000;
+static int SETPCT = 20;
+static int TTL = 0;
+
+static void *work(void *arg) {
+	worker *w = arg;
+	char key[32];
+	sds buf = sdsempty(),found;
+	int n,len;
+
+	while (RUNNING) {
+		n = rand_r(&w->seed) % KEYS;
+		len = snprintf(key,sizeof(key),"key:%d",n);
+		if ((int)(rand_r(&w->seed) % 100) < SETPCT) {
+			if (kv_put(key,len,key,len,KV_STRING,TTL,0) < 1) fprintf(stderr,"set failed\n");
+		} else {
+			if ((found = kv_copy(key,len,buf,NULL)) != NULL) buf = found;
+		}
+		w->ops++;
+	}
+	sdsfree(buf);
+	return NULL;
+}
+
+static double run(int threads, int seconds) {
+	worker *workers;
+	unsigned long total = 0;
+	struct timespec start,end;
+	int i;
+
+	workers = calloc(threads,sizeof(worker));
+	RUNNING = 1;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i = 0; i < threads; i++) {
+		workers[i].seed = i + 1;
+		pthread_create(&workers[i].thread,NULL,work,&workers[i]);
+	}
+	sleep(seconds);
+	RUNNING = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread,NULL);
+		total += workers[i].ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	free(workers);
+	return total / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv) {
+	int threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int shards = argc > 2 ? atoi(argv[2]) : KV_DEFAULT_SHARDS;
+	int seconds = argc > 3 ? atoi(argv[3]) : 2;
+	int configs[2],c,t,i,len;
+	char key[32];
+	double base = 0,ops;
+
+	if (argc > 4) KEYS = atoi(argv[4]);
+	if (argc > 5) SETPCT = atoi(argv[5]);
+	if (argc > 6) TTL = atoi(argv[6]);
+	if (threads < 1) threads = 1;
+	configs[0] = 1;
+	configs[1] = shards;
+
+	printf("%d keys, %d%% sets, %dms ttl, %d seconds per run\n",KEYS,SETPCT,TTL,seconds);
+	for (c = 0; c < 2; c++) {
+		if (kv_init(configs[c]) != 0) {
+			fprintf(stderr,"kv_init failed\n");
+			return 1;
+		}
+		for (i = 0; i < KEYS; i++) {
+			len = snprintf(key,sizeof(key),"key:%d",i);
+			kv_put(key,len,key,len,KV_STRING,TTL,0);
+		}
+		printf("\n%u shard(s), %zu bytes per key\nthreads        ops/s  speedup\n",kv_shards(),kv_memory(NULL) / KEYS);
+		for (t = 1; t <= threads; t++) {
+			ops = run(t,seconds);
+			if (t == 1) base = ops;
+			printf("%7d %12.0f %7.2fx\n",t,ops,ops / base);
+		}
+		kv_destroy();
+	}
+	return 0;
+}
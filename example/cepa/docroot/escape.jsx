@@ -0,0 +1,44 @@
+// compares the native escaping functions with their javascript equivalents
+cgi.setHeader("Content-Type","text/plain;charset=UTF-8");
+cgi.setHeader("Cache-Control","private, max-age=0, no-cache");
+var ITERATIONS = Number(cgi.getQuery("n")) || 2000;
+var HTML = { "&":"&amp;", "<":"&lt;", ">":"&gt;", '"':"&quot;", "'":"&#39;" };
+var text = "", plain = "", i;
+
+for (i = 0; i < 40; i++) {
+	text += "<p class=\"row\">Tom & Jerry's line " + i + " café 50% off\tnow</p>\n";
+	plain += "the quick brown fox jumps over the lazy dog " + i + " ";
+}
+
+var tests = [
+	[ "escapeHTML", cgi.escapeHTML,
+		function(s) { return s.replace(/[&<>"']/g,function(c) { return HTML[c]; }); } ],
+	[ "escapeURL", cgi.escapeURL,
+		function(s) {
+			return encodeURIComponent(s).replace(/[!'()*]/g,function(c) {
+				return "%" + c.charCodeAt(0).toString(16).toUpperCase();
+			});
+		} ],
+	[ "unescapeURL", function(s) { return cgi.unescapeURL(s); },
+		function(s) { return decodeURIComponent(s.replace(/\+/g," ")); } ],
+	[ "escapeJSONString", cgi.escapeJSONString,
+		function(s) { return JSON.stringify(s).slice(1,-1); } ]
+];
+
+function time(fn,input) {
+	var start = Date.now(),j;
+	for (j = 0; j < ITERATIONS; j++) fn(input);
+	return Date.now() - start;
+}
+
+cgi.print(ITERATIONS," iterations per test, input ",text.length," characters\n\n");
+tests.forEach(function(t) {
+	[ [ "markup", text ], [ "plain", plain ] ].forEach(function(input) {
+		var s = input[1],native,js;
+		if (t[0] == "unescapeURL") s = cgi.escapeURL(s);
+		native = time(t[1],s);
+		js = time(t[2],s);
+		cgi.print(t[0]," (",input[0],"): native ",native,"ms, javascript ",js,"ms, ",
+			(t[1](s) === t[2](s)) ? "outputs match" : "OUTPUTS DIFFER","\n");
+	});
+});
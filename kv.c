@@ -0,0 +1,4646 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sds.h>
+#include "kv.h"
+#include "kv_types.h"
+#include "kv_shm.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define CEPA_SIMD_X86
+#endif
+
+/*
+ * each shard is an open addressing table in the style of SwissTable:
+ * a control byte per slot holds 7 bits of the hash (or EMPTY/DELETED), and probing
+ * tests a group of 16 control bytes at once, so most lookups touch one cache line of
+ * control bytes and then exactly one entry. entries are a single allocation holding
+ * the full hash, the key, and (for values set by scripts) the value.
+ *
+ * readers take no locks. writers serialize on the shard mutex and never modify an entry
+ * or a table that readers can reach: they publish a replacement and retire the old one,
+ * which is freed by epoch based reclamation once every thread that was pinned when it
+ * was unlinked has unpinned.
+ *
+ * expiry is lazy on access, and entries with a ttl are also filed in a per shard hierarchical
+ * timing wheel that a single expiry thread advances every KV_TICK milliseconds, so setting a
+ * ttl is O(1) and involves no kernel timers or signals.
+ *
+ * every allocation the store makes is charged against its memory budget, and entries also
+ * against the budget of their namespace. a write that would exceed either first evicts,
+ * picking the worst of KV_SAMPLES entries sampled from a shard according to the policy.
+ *
+ * when persistence is configured, every change is appended to a log under the shard lock,
+ * so the log orders changes to a key as they were applied. a snapshot first rotates the log, then dumps
+ * each shard under its lock, and until a shard is dumped, its changes still go to the rotated log, so that
+ * each change is either in the snapshot or in the new log, never both; once written, the rotated log is deleted.
+ * without a log, snapshots walk each shard pinned, like any reader.
+ * both files are the magic followed by records: an op byte, the value's type, and varints for the
+ * key length and, for sets, the value length and the absolute expiry in unix milliseconds,
+ * then the key and the value.
+ *
+ * with the index enabled, each shard also keeps its keys in a skiplist, in memcmp order, under the shard
+ * lock. scans lock one shard at a time, merging what each has past the cursor, so no lock is held between pages.
+ *
+ * collections (see kv_types.c) are external values that change in place, so unlike other values they are
+ * only read and written under the shard lock. changes are commands, encoded as a command byte followed by
+ * varint length prefixed arguments, numbers being 8 bytes little endian; the log records the command,
+ * and snapshots the serialized collection.
+ *
+ * threads waiting for a key to change park on a condition variable of their own, filed in the shard of the key
+ * and waited on with the shard lock, so every write that finds waiters in its shard wakes those of its key
+ * while it still holds the lock, and no change between checking a key and parking can be missed.
+ *
+ * a primary replicates to its follower over a socket, with the records of the log: for each shard in turn, it
+ * dumps the shard under its lock, and from then on queues the records of changes to the shard as they are made,
+ * so the follower gets every key exactly once, and every later change after it. writers stall while the queue
+ * is full, before they take a shard lock, and if it stays full, the follower is dropped, and synced anew once
+ * it is reached again. a change made under the lock is never held up: if it would overflow the queue, the
+ * follower is dropped at once.
+ *
+ * with peers, keys are partitioned among them by jump consistent hashing, and the keys of other peers are sent
+ * to their owner over a connection each thread keeps to it. requests and replies are framed by a varint length, and
+ * made of arguments like those of commands: a request is the op byte, the type, the key and the op's arguments, and
+ * a reply is the result and the type (or errno), then any values. batches are pipelined.
+ *
+ * keys starting with the shared prefix, if there is one, bypass all of the above and live in a shared memory
+ * segment (see kv_shm.c) that other processes on the host map as well. they only hold plain values.
+ */
+#define KV_GROUP   16
+#define KV_EMPTY   ((int8_t)-128)
+#define KV_DELETED ((int8_t)-2)
+
+// the low bits of the hash pick the shard, so the table uses the high ones
+#define KV_H1(h) ((size_t)((h) >> 16))
+#define KV_H2(h) ((int8_t)((h) >> 57))
+
+#define KV_INLINE(e) ((e)->value == (e)->data + (e)->klen + 1)
+
+// a thread frees what it retired every KV_COLLECT retirements
+#define KV_COLLECT 64
+
+// 4 levels of 256 slots, each 1ms wide at the lowest level, cover about 49 days; longer ttls are parked in the last slot and refiled.
+// the expiry thread advances the wheels every KV_TICK milliseconds, so entries are reclaimed up to that late; reads expire them on time
+#define KV_WHEEL_BITS   8
+#define KV_WHEEL_SLOTS  (1 << KV_WHEEL_BITS)
+#define KV_WHEEL_LEVELS 4
+#define KV_WHEEL_SPAN   (1ULL << (KV_WHEEL_BITS * KV_WHEEL_LEVELS))
+#define KV_TICK         10
+
+#define KV_SAMPLES   5
+#define KV_LFU_INIT  5  // the counter new keys start at, so they aren't evicted before they are used
+#define KV_LFU_LOG   10 // higher makes the logarithmic counter saturate later
+#define KV_LFU_DECAY 60 // seconds without access per decrement of the counter
+
+#define KV_MAGIC     "CEPAKV1\n"
+#define KV_MAGIC_LEN 8
+#define KV_OP_END    0
+#define KV_OP_SET    1
+#define KV_OP_DEL    2
+#define KV_OP_CMD    3 // a command applied to a collection
+#define KV_HEADER    32 // enough for a record's op, type and varints
+
+#define KV_CMD_LPUSH 1
+#define KV_CMD_RPUSH 2
+#define KV_CMD_LPOP  3
+#define KV_CMD_RPOP  4
+#define KV_CMD_HSET  5
+#define KV_CMD_HDEL  6
+#define KV_CMD_ZADD  7
+#define KV_CMD_ZREM  8
+#define KV_CMD_PFADD 9
+
+#define KV_REPL_BUFFER (64 << 20) // bytes of changes queued for the follower before writers stall
+#define KV_REPL_LIMIT  (2 * KV_REPL_BUFFER) // bytes queued, writers that got past the stall included, that drop the follower
+#define KV_REPL_STALL  1000 // milliseconds a writer stalls on a full queue before the follower is dropped
+#define KV_REPL_RETRY  1 // seconds between attempts to reach the follower
+
+#define KV_PEER_MAGIC    "CEPAKP1\n"
+#define KV_PEER_PIPELINE 65536 // bytes of requests sent to a peer before its replies are read
+#define KV_PEER_TIMEOUT  2000 // milliseconds a peer has to take a request or reply to it
+#define KV_PEER_GET      1
+#define KV_PEER_PUT      2
+#define KV_PEER_DEL      3
+#define KV_PEER_ADD      4
+#define KV_PEER_CONCAT   5
+#define KV_PEER_SWAP     6
+#define KV_PEER_EXCHANGE 7
+#define KV_PEER_REFRESH  8
+#define KV_PEER_CMD      9
+#define KV_PEER_RANGE    10
+#define KV_PEER_FIELD    11
+#define KV_PEER_SCORE    12
+#define KV_PEER_MRANGE   13
+#define KV_PEER_DCOUNT   14
+#define KV_PEER_LEN      15
+
+#define KV_LEVELS 16 // skiplist levels, each with a quarter of the nodes of the one below
+
+#define KV_WAIT_BUCKETS 20 // of the lock wait histogram: no wait, then under 2, 4 ... microseconds, and longer
+
+typedef struct kv_entry {
+	uint64_t hash;
+	void *value;
+	void (*ffn)(void *);
+	uint64_t expires; // CLOCK_MONOTONIC milliseconds, 0 for never
+	struct kv_entry *next; // timing wheel links, only touched under the shard lock
+	struct kv_entry **prev;
+	struct kv_node *node; // in the shard's index, if enabled
+	uint32_t klen;
+	uint32_t vlen;
+	uint32_t atime; // kv_clock() of the last access
+	uint16_t ns;
+	uint8_t freq; // logarithmic access counter, decayed by idle time
+	uint8_t type; // KV_STRING to KV_HLL
+	char data[]; // key, NUL, and when inline, value, NUL
+} kv_entry;
+
+typedef struct {
+	kv_entry *slots[KV_WHEEL_LEVELS][KV_WHEEL_SLOTS];
+	uint64_t now;
+	size_t count;
+} kv_wheel;
+
+typedef struct {
+	size_t mask;
+	size_t used;
+	size_t growth; // slots that can still be taken from EMPTY before a rehash
+	kv_entry **slots;
+	int8_t ctrl[]; // capacity + KV_GROUP bytes, the last group mirrors the first
+} kv_table;
+
+// the key is the entry's, which moves to the entry that replaces it
+typedef struct kv_node {
+	kv_entry *entry;
+	unsigned int height;
+	struct kv_node *next[];
+} kv_node;
+
+// a thread parked in kv_await, on its own stack
+typedef struct kv_waiter {
+	pthread_cond_t cond;
+	uint64_t hash;
+	const char *key;
+	size_t klen;
+	int woken;
+	struct kv_waiter *next;
+} kv_waiter;
+
+// padded so that neighbouring shard locks don't share a cache line
+typedef struct {
+	pthread_mutex_t lock;
+	kv_table *table;
+	kv_wheel *wheel; // allocated with the shard's first ttl
+	kv_node *index; // the skiplist's head, when the index is enabled
+	kv_waiter *waiters;
+	size_t changes; // written under the lock, and read without it by the persistence thread
+	int replicated; // dumped to the follower, whose changes are then queued for it
+	int dumped; // by the snapshot being written, whose changes then go to the new log
+	char pad[64 - (sizeof(pthread_mutex_t) + sizeof(kv_table *) + sizeof(kv_wheel *) + sizeof(kv_node *) + sizeof(kv_waiter *) + sizeof(size_t) + 2 * sizeof(int)) % 64];
+} kv_shard;
+
+typedef struct {
+	char *prefix;
+	size_t plen;
+	size_t maxmemory; // 0 for no budget of its own
+	int policy;
+	size_t used;
+	size_t keys;
+} kv_namespace;
+
+typedef struct {
+	void *ptr;
+	void (*fn)(void *);
+	uint64_t epoch;
+} kv_retired;
+
+// one key's update, as prepared outside the shard lock
+typedef struct {
+	const char *key;
+	size_t klen;
+	uint64_t hash;
+	kv_entry *e; // the new entry, NULL to delete
+	kv_entry *gone;
+	kv_table *table;
+	kv_node *node; // for a new key, if the index is enabled
+	int quiet; // not logged, as the command that creates the entry is
+	int rc;
+} kv_op;
+
+typedef struct {
+	int op;
+	int type;
+	const char *key;
+	size_t klen;
+	const char *value;
+	size_t vlen;
+	uint64_t expires;
+} kv_record;
+
+// a namespace's counters in a thread's record
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+} kv_counters;
+
+// per thread reclamation state and counters; records are reused by later threads and only freed by kv_destroy
+typedef struct kv_thread {
+	uint64_t state; // epoch << 1 | 1 while pinned, 0 otherwise
+	unsigned int nest;
+	int used;
+	kv_retired *limbo;
+	size_t nlimbo;
+	size_t limbo_size;
+	uint64_t seed; // for sampling and the LFU counter
+	int *peers; // connections to the other peers, opened on first use
+	kv_counters counters[KV_MAX_NAMESPACES];
+	uint64_t waits[KV_WAIT_BUCKETS]; // shard lock acquisitions by how long they waited
+	uint64_t waited; // microseconds, in all
+	struct kv_thread *next;
+} kv_thread;
+
+// a connection from another peer, served by a thread of its own
+typedef struct kv_conn {
+	pthread_t thread;
+	int fd;
+	int done;
+	struct kv_conn *next;
+} kv_conn;
+
+static kv_shard *SHARDS = NULL;
+static unsigned int NSHARDS = 0;
+static uint64_t EPOCH = 0;
+static kv_thread *THREADS = NULL;
+static pthread_key_t THREAD_KEY;
+static __thread kv_thread *SELF = NULL;
+static pthread_t EXPIRY;
+static pthread_mutex_t EXPIRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t EXPIRY_COND;
+static int EXPIRY_STOP;
+static size_t TIMED = 0; // entries filed in any wheel; the expiry thread sleeps while there are none
+static kv_namespace NAMESPACES[KV_MAX_NAMESPACES]; // the first holds keys no prefix matches
+static unsigned int NNAMESPACES = 1;
+static size_t MAXMEMORY = 0;
+static int POLICY = KV_NOEVICTION;
+static size_t USED = 0;
+static int INDEXED = 0;
+static unsigned int MAXWAITERS = KV_DEFAULT_WAITERS;
+static unsigned int WAITING = 0;
+static char *SHARED = NULL; // the prefix of keys kept in the shared segment, when there is one
+static size_t SHARED_LEN;
+static char *SNAPSHOT = NULL;
+static char *AOF_PATH = NULL;
+static int AOF = -1;
+static off_t AOF_SIZE;
+static int AOF_DIRTY;
+static int AOF_OLD = -1; // the rotated log, while a snapshot is written
+static off_t AOF_OLD_SIZE;
+static int FSYNC = KV_FSYNC_EVERYSEC;
+static int INTERVAL;
+static pthread_mutex_t AOF_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t PERSIST;
+static pthread_mutex_t PERSIST_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PERSIST_COND;
+static int PERSIST_STOP = -1; // -1 while there is no persistence thread
+static char *REPL_ADDRESS = NULL; // of the follower
+static pthread_t REPL;
+static pthread_mutex_t REPL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t REPL_DATA; // changes were queued, or the queue was dropped
+static pthread_cond_t REPL_SPACE;
+static int REPL_STOP = -1; // -1 while there is no replication thread
+static int REPL_ACTIVE; // changes are queued while set; written under REPL_LOCK, read without it by writers
+static int REPL_FD = -1; // the connection to the follower
+static sds REPL_QUEUE = NULL;
+static size_t REPL_QUEUED; // the length of REPL_QUEUE, for writers to check without REPL_LOCK
+static pthread_t FOLLOW;
+static int FOLLOW_STOP;
+static int FOLLOW_LISTEN = -1;
+static int FOLLOW_FD = -1; // the connection from the primary
+static int FOLLOWER = 0;
+static __thread int APPLYING = 0; // set on the thread applying the changes of the primary
+static char **PEERS = NULL; // addresses, listed in the same order by every peer
+static unsigned int NPEERS = 0;
+static unsigned int SELF_PEER;
+static int PEER_LISTEN = -1;
+static pthread_t PEER;
+static pthread_mutex_t PEER_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int PEER_STOP;
+static kv_conn *CONNS = NULL;
+static __thread int SERVING = 0; // set on the threads serving other peers, whose keys are all kept here
+
+static void kv_destroy_shards(void);
+static void kv_forward_expiry(const char *key, size_t klen);
+static long kv_command(const char *key, size_t klen, int type, const unsigned char *cmd, size_t len, sds **out);
+static int kv_owner(const char *key, size_t klen);
+static long kv_remote_rc(int peer, sds body);
+static int kv_remote_put(int peer, const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx);
+static long kv_remote_value(int peer, sds body, sds buf, sds *value, int *type);
+static long kv_remote_number(int peer, sds body, uint64_t *n);
+static long kv_remote_values(int peer, sds body, sds **values);
+static int kv_remote_batch(const int *owners, const kv_item *items, size_t n, int64_t ttl, sds *values, int *types, long *count);
+static sds kv_peer_req(int op, int type, const char *key, size_t klen);
+static sds kv_cmd_append(sds cmd, const void *p, size_t len);
+static sds kv_cmd_arg(sds cmd, const char *arg, size_t len);
+static sds kv_cmd_number(sds cmd, uint64_t n);
+
+static uint64_t kv_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t kv_wall(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// seconds, for access times; cheap enough for every read
+static uint32_t kv_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+	return ts.tv_sec;
+}
+
+// FNV-1a, finished with the murmur3 mixer so both ends of the hash are usable
+static uint64_t kv_hash(const char *key, size_t klen) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < klen; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// bit i is set when control byte i of the group equals c
+static inline unsigned int kv_match(const int8_t *ctrl, int8_t c) {
+#ifdef CEPA_SIMD_X86
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ctrl),_mm_set1_epi8(c)));
+#else
+	unsigned int i,m = 0;
+
+	for (i = 0; i < KV_GROUP; i++) if (ctrl[i] == c) m |= 1u << i;
+	return m;
+#endif
+}
+
+// bit i is set when slot i of the group is EMPTY or DELETED
+static inline unsigned int kv_match_free(const int8_t *ctrl) {
+#ifdef CEPA_SIMD_X86
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+	unsigned int i,m = 0;
+
+	for (i = 0; i < KV_GROUP; i++) if (ctrl[i] < 0) m |= 1u << i;
+	return m;
+#endif
+}
+
+static kv_thread *kv_self(void) {
+	kv_thread *t;
+	int used;
+
+	if (SELF != NULL) return SELF;
+	for (t = __atomic_load_n(&THREADS,__ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+		used = 0;
+		if (__atomic_compare_exchange_n(&t->used,&used,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) break;
+	}
+	if (t == NULL) {
+		if ((t = calloc(1,sizeof(kv_thread))) == NULL) return NULL;
+		t->used = 1;
+		t->seed = (uintptr_t)t ^ kv_now();
+		t->next = __atomic_load_n(&THREADS,__ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&THREADS,&t->next,t,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+	}
+	pthread_setspecific(THREAD_KEY,t);
+	return SELF = t;
+}
+
+// xorshift64
+static uint64_t kv_random(kv_thread *t) {
+	t->seed ^= t->seed << 13;
+	t->seed ^= t->seed >> 7;
+	t->seed ^= t->seed << 17;
+	return t->seed;
+}
+
+// counters are only written by the thread holding the record, so they need no atomic increment, only to be read whole by kv_stats
+static void kv_tally(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED) + n,__ATOMIC_RELAXED);
+}
+
+// takes the shard lock, timing the wait only when it is contended
+static void kv_acquire(kv_shard *shard) {
+	struct timespec start,end;
+	kv_thread *self;
+	uint64_t us;
+	unsigned int i;
+
+	self = kv_self();
+	if (pthread_mutex_trylock(&shard->lock) == 0) {
+		if (self != NULL) kv_tally(&self->waits[0],1);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	pthread_mutex_lock(&shard->lock);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	if (self == NULL) return;
+	us = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 + end.tv_nsec / 1000 - start.tv_nsec / 1000;
+	for (i = 1; i < KV_WAIT_BUCKETS - 1 && us >= (1ULL << i); i++);
+	kv_tally(&self->waits[i],1);
+	kv_tally(&self->waited,us);
+}
+
+// pthread key destructor; what the thread retired is freed by the next thread to take the record
+static void kv_thread_exit(void *arg) {
+	kv_thread *t = arg;
+
+	t->nest = 0;
+	__atomic_store_n(&t->state,0,__ATOMIC_RELEASE);
+	__atomic_store_n(&t->used,0,__ATOMIC_RELEASE);
+}
+
+int kv_pin(void) {
+	kv_thread *t;
+
+	if ((t = kv_self()) == NULL) return -1;
+	if (t->nest++ == 0) {
+		__atomic_store_n(&t->state,__atomic_load_n(&EPOCH,__ATOMIC_RELAXED) << 1 | 1,__ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+void kv_unpin(void) {
+	kv_thread *t = SELF;
+
+	if (t == NULL || t->nest == 0) return;
+	if (--t->nest == 0) __atomic_store_n(&t->state,0,__ATOMIC_RELEASE);
+}
+
+// the epoch moves on once every pinned thread has seen the current one
+static void kv_advance(void) {
+	uint64_t epoch,state;
+	kv_thread *t;
+
+	epoch = __atomic_load_n(&EPOCH,__ATOMIC_SEQ_CST);
+	for (t = __atomic_load_n(&THREADS,__ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+		state = __atomic_load_n(&t->state,__ATOMIC_SEQ_CST);
+		if ((state & 1) && (state >> 1) != epoch) return;
+	}
+	__atomic_compare_exchange_n(&EPOCH,&epoch,epoch + 1,0,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED);
+}
+
+// anything retired two epochs ago can no longer be reached by a pinned reader
+static void kv_collect(kv_thread *t) {
+	uint64_t epoch;
+	size_t i;
+
+	kv_advance();
+	epoch = __atomic_load_n(&EPOCH,__ATOMIC_SEQ_CST);
+	for (i = 0; i < t->nlimbo && t->limbo[i].epoch + 2 <= epoch; i++) t->limbo[i].fn(t->limbo[i].ptr);
+	memmove(t->limbo,t->limbo + i,(t->nlimbo - i) * sizeof(kv_retired));
+	t->nlimbo -= i;
+}
+
+// makes room for n retirements up front, so that a writer never has to fail after unlinking
+static int kv_reserve(kv_thread *t, size_t n) {
+	kv_retired *limbo;
+	size_t size;
+
+	if (t->nlimbo + n <= t->limbo_size) return 0;
+	size = t->limbo_size ? t->limbo_size * 2 : KV_COLLECT * 2;
+	while (size < t->nlimbo + n) size *= 2;
+	if ((limbo = realloc(t->limbo,size * sizeof(kv_retired))) == NULL) return -1;
+	t->limbo = limbo;
+	t->limbo_size = size;
+	return 0;
+}
+
+static void kv_retire(kv_thread *t, void *ptr, void (*fn)(void *)) {
+	t->limbo[t->nlimbo].ptr = ptr;
+	t->limbo[t->nlimbo].fn = fn;
+	t->limbo[t->nlimbo].epoch = __atomic_load_n(&EPOCH,__ATOMIC_SEQ_CST);
+	if (++t->nlimbo % KV_COLLECT == 0) kv_collect(t);
+}
+
+/*
+ * readers race with the shard's writer, so every control byte and slot is stored with release
+ * semantics, slot before control byte, and a slot may be NULL or hold an entry that was since
+ * retired; both are rejected by the key comparison or the NULL check.
+ */
+static void kv_set_ctrl(kv_table *t, size_t i, int8_t c) {
+	__atomic_store_n(&t->ctrl[i],c,__ATOMIC_RELEASE);
+	if (i < KV_GROUP) __atomic_store_n(&t->ctrl[t->mask + 1 + i],c,__ATOMIC_RELEASE);
+}
+
+static void kv_set_slot(kv_table *t, size_t i, kv_entry *e) {
+	__atomic_store_n(&t->slots[i],e,__ATOMIC_RELEASE);
+}
+
+static kv_entry *kv_find(kv_table *t, uint64_t hash, const char *key, size_t klen, size_t *at) {
+	size_t pos,step = 0,i;
+	unsigned int m,empty;
+	kv_entry *e;
+
+	if (t == NULL) return NULL;
+	pos = KV_H1(hash) & t->mask;
+	for (;;) {
+		m = kv_match(t->ctrl + pos,KV_H2(hash));
+		empty = kv_match(t->ctrl + pos,KV_EMPTY);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		for (; m; m &= m - 1) {
+			i = (pos + __builtin_ctz(m)) & t->mask;
+			if ((e = __atomic_load_n(&t->slots[i],__ATOMIC_ACQUIRE)) == NULL) continue;
+			if (e->hash == hash && e->klen == klen && memcmp(e->data,key,klen) == 0) {
+				if (at != NULL) *at = i;
+				return e;
+			}
+		}
+		if (empty) return NULL;
+		step += KV_GROUP;
+		pos = (pos + step) & t->mask;
+	}
+}
+
+// the first EMPTY or DELETED slot on the probe sequence of hash; there always is one
+static size_t kv_free_slot(kv_table *t, uint64_t hash) {
+	size_t pos,step = 0;
+	unsigned int m;
+
+	pos = KV_H1(hash) & t->mask;
+	while ((m = kv_match_free(t->ctrl + pos)) == 0) {
+		step += KV_GROUP;
+		pos = (pos + step) & t->mask;
+	}
+	return (pos + __builtin_ctz(m)) & t->mask;
+}
+
+// builds a rehashed copy of t, which stays intact for readers until it is retired
+static kv_table *kv_resize(kv_table *t, size_t capacity) {
+	kv_table *n;
+	size_t i,j;
+
+	if ((n = malloc(sizeof(kv_table) + capacity + KV_GROUP + capacity * sizeof(kv_entry *))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	n->slots = (kv_entry **)(n->ctrl + capacity + KV_GROUP);
+	memset(n->ctrl,KV_EMPTY,capacity + KV_GROUP);
+	memset(n->slots,0,capacity * sizeof(kv_entry *));
+	n->mask = capacity - 1;
+	n->used = t != NULL ? t->used : 0;
+	n->growth = capacity - capacity / 8 - n->used;
+	for (i = 0; t != NULL && i <= t->mask; i++) {
+		if (t->ctrl[i] < 0) continue;
+		j = kv_free_slot(n,t->slots[i]->hash);
+		kv_set_ctrl(n,j,t->ctrl[i]);
+		n->slots[j] = t->slots[i];
+	}
+	return n;
+}
+
+// makes room in the shard's table for one more entry, setting *old to the table that replaced, if any
+static int kv_grow(kv_shard *shard, kv_table **old) {
+	kv_table *t = shard->table,*n;
+	size_t capacity;
+
+	*old = NULL;
+	if (t == NULL || t->growth == 0) {
+		// grow when at least 7/16 full, otherwise the table is mostly tombstones and a same size rehash clears them
+		capacity = t == NULL ? KV_GROUP : t->mask + 1;
+		if (t != NULL && t->used >= capacity * 7 / 16) capacity *= 2;
+		if ((n = kv_resize(t,capacity)) == NULL) return -1;
+		__atomic_store_n(&shard->table,n,__ATOMIC_RELEASE);
+		__atomic_add_fetch(&USED,KV_ALLOCATED(n),__ATOMIC_RELAXED);
+		if (t != NULL) __atomic_sub_fetch(&USED,KV_ALLOCATED(t),__ATOMIC_RELAXED);
+		*old = t;
+	}
+	return 0;
+}
+
+// after kv_grow
+static void kv_place(kv_table *t, kv_entry *e) {
+	size_t i;
+
+	i = kv_free_slot(t,e->hash);
+	if (t->ctrl[i] == KV_EMPTY) t->growth--;
+	kv_set_slot(t,i,e);
+	kv_set_ctrl(t,i,KV_H2(e->hash));
+	t->used++;
+}
+
+static void kv_erase(kv_table *t, size_t i) {
+	unsigned int after,before;
+
+	after = kv_match(t->ctrl + i,KV_EMPTY);
+	before = kv_match(t->ctrl + ((i - KV_GROUP) & t->mask),KV_EMPTY);
+	t->used--;
+	// if no window of KV_GROUP slots around i is full, no probe ever went past it and it can be EMPTY again
+	if (after && before && __builtin_ctz(after) + __builtin_clz(before) - (32 - KV_GROUP) < KV_GROUP) {
+		kv_set_ctrl(t,i,KV_EMPTY);
+		t->growth++;
+	} else {
+		kv_set_ctrl(t,i,KV_DELETED);
+	}
+	kv_set_slot(t,i,NULL);
+}
+
+static int kv_keycmp(const char *a, size_t alen, const char *b, size_t blen) {
+	int c = memcmp(a,b,alen < blen ? alen : blen);
+
+	return c != 0 ? c : (alen > blen) - (alen < blen);
+}
+
+static kv_node *kv_node_new(kv_thread *self, unsigned int height) {
+	uint64_t r;
+	kv_node *n;
+
+	if (height == 0) {
+		// a random height, each level a quarter as likely as the last
+		r = kv_random(self);
+		for (height = 1; height < KV_LEVELS && (r & 3) == 0; height++) r >>= 2;
+	}
+	if ((n = calloc(1,sizeof(kv_node) + height * sizeof(kv_node *))) == NULL) return NULL;
+	n->height = height;
+	return n;
+}
+
+// the first node with a key not below key; preds, if given, gets the last node before it on each level
+static kv_node *kv_seek(kv_node *head, const char *key, size_t klen, kv_node **preds) {
+	kv_node *n = head,*next = NULL;
+	int level;
+
+	for (level = KV_LEVELS - 1; level >= 0; level--) {
+		while ((next = n->next[level]) != NULL && kv_keycmp(next->entry->data,next->entry->klen,key,klen) < 0) n = next;
+		if (preds != NULL) preds[level] = n;
+	}
+	return next;
+}
+
+static void kv_index_add(kv_shard *shard, kv_node *n, kv_entry *e) {
+	kv_node *preds[KV_LEVELS];
+	unsigned int level;
+
+	kv_seek(shard->index,e->data,e->klen,preds);
+	for (level = 0; level < n->height; level++) {
+		n->next[level] = preds[level]->next[level];
+		preds[level]->next[level] = n;
+	}
+	n->entry = e;
+	e->node = n;
+	__atomic_add_fetch(&USED,KV_ALLOCATED(n),__ATOMIC_RELAXED);
+}
+
+static void kv_index_del(kv_shard *shard, kv_entry *e) {
+	kv_node *preds[KV_LEVELS],*n = e->node;
+	unsigned int level;
+
+	if (n == NULL) return;
+	kv_seek(shard->index,e->data,e->klen,preds);
+	for (level = 0; level < n->height; level++) {
+		if (preds[level]->next[level] == n) preds[level]->next[level] = n->next[level];
+	}
+	e->node = NULL;
+	__atomic_sub_fetch(&USED,KV_ALLOCATED(n),__ATOMIC_RELAXED);
+	free(n);
+}
+
+// under the shard lock, after key changed
+static void kv_wake(kv_shard *shard, uint64_t hash, const char *key, size_t klen) {
+	kv_waiter *w;
+
+	for (w = shard->waiters; w != NULL; w = w->next) {
+		if (w->hash == hash && !w->woken && kv_keycmp(w->key,w->klen,key,klen) == 0) {
+			w->woken = 1;
+			pthread_cond_signal(&w->cond);
+		}
+	}
+}
+
+// the longest matching prefix wins
+static unsigned int kv_namespace_of(const char *key, size_t klen) {
+	unsigned int i,ns = 0;
+
+	for (i = 1; i < NNAMESPACES; i++) {
+		if (NAMESPACES[i].plen <= klen && NAMESPACES[i].plen > NAMESPACES[ns].plen && memcmp(NAMESPACES[i].prefix,key,NAMESPACES[i].plen) == 0) ns = i;
+	}
+	return ns;
+}
+
+// a follower's store only changes with its primary's
+static int kv_readonly(void) {
+	if (!FOLLOWER || APPLYING) return 0;
+	errno = EROFS;
+	return 1;
+}
+
+static int kv_shared(const char *key, size_t klen) {
+	return SHARED != NULL && klen >= SHARED_LEN && memcmp(key,SHARED,SHARED_LEN) == 0;
+}
+
+static kv_entry *kv_entry_new(uint64_t hash, const char *key, size_t klen, const char *inl, size_t vlen, int type, void *value, void (*ffn)(void *)) {
+	kv_entry *e;
+
+	if (klen > UINT32_MAX || vlen > UINT32_MAX) {
+		errno = E2BIG;
+		return NULL;
+	}
+	if ((e = malloc(sizeof(kv_entry) + klen + 1 + (inl != NULL ? vlen + 1 : 0))) == NULL) return NULL;
+	e->hash = hash;
+	e->expires = 0;
+	e->klen = klen;
+	e->atime = kv_clock();
+	e->ns = kv_namespace_of(key,klen);
+	e->freq = KV_LFU_INIT;
+	e->type = type;
+	e->node = NULL;
+	memcpy(e->data,key,klen);
+	e->data[klen] = '\0';
+	if (inl != NULL) {
+		e->value = e->data + klen + 1;
+		e->vlen = vlen;
+		e->ffn = NULL;
+		memcpy(e->value,inl,vlen);
+		e->data[klen + 1 + vlen] = '\0';
+	} else {
+		e->value = value;
+		e->vlen = 0;
+		e->ffn = ffn;
+	}
+	return e;
+}
+
+static void kv_entry_free(void *ptr) {
+	kv_entry *e = ptr;
+
+	if (e->ffn != NULL) e->ffn(e->value);
+	free(e);
+}
+
+// expires is only written under the shard lock, but kv_refresh changes it in place under readers
+static int kv_expired(kv_entry *e, uint64_t now) {
+	uint64_t expires = __atomic_load_n(&e->expires,__ATOMIC_RELAXED);
+
+	return expires != 0 && expires <= now;
+}
+
+static size_t kv_length(kv_entry *e) {
+	return KV_INLINE(e) ? e->vlen : strlen(e->value);
+}
+
+// external values aren't charged, as their size is unknown, except for collections, which count their bytes
+static size_t kv_size(kv_entry *e) {
+	return KV_ALLOCATED(e) + (e->type >= KV_LIST ? kv_type_bytes(e->type,e->value) : 0);
+}
+
+static void kv_charge(kv_entry *e) {
+	__atomic_add_fetch(&USED,kv_size(e),__ATOMIC_RELAXED);
+	__atomic_add_fetch(&NAMESPACES[e->ns].used,kv_size(e),__ATOMIC_RELAXED);
+	__atomic_add_fetch(&NAMESPACES[e->ns].keys,1,__ATOMIC_RELAXED);
+}
+
+static void kv_discharge(kv_entry *e) {
+	__atomic_sub_fetch(&USED,kv_size(e),__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&NAMESPACES[e->ns].used,kv_size(e),__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&NAMESPACES[e->ns].keys,1,__ATOMIC_RELAXED);
+}
+
+// after a collection changed in place, from the size it had before
+static void kv_recharge(kv_entry *e, size_t before) {
+	size_t after = kv_size(e);
+
+	__atomic_add_fetch(&USED,after - before,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&NAMESPACES[e->ns].used,after - before,__ATOMIC_RELAXED);
+}
+
+static unsigned int kv_freq(kv_entry *e, uint32_t clock) {
+	unsigned int freq,periods;
+
+	freq = __atomic_load_n(&e->freq,__ATOMIC_RELAXED);
+	periods = (clock - __atomic_load_n(&e->atime,__ATOMIC_RELAXED)) / KV_LFU_DECAY;
+	return periods < freq ? freq - periods : 0;
+}
+
+/*
+ * called by readers, so it races with other readers of e; a lost update only makes the counters a little less accurate.
+ * the fields are only written when they change, to keep hot entries from bouncing between caches.
+ */
+static void kv_hit(kv_thread *self, kv_entry *e) {
+	unsigned int freq,base;
+	uint32_t clock;
+
+	clock = kv_clock();
+	freq = kv_freq(e,clock);
+	base = freq > KV_LFU_INIT ? freq - KV_LFU_INIT : 0;
+	if (freq < 255 && kv_random(self) % (base * KV_LFU_LOG + 1) == 0) freq++;
+	if (freq != __atomic_load_n(&e->freq,__ATOMIC_RELAXED)) __atomic_store_n(&e->freq,freq,__ATOMIC_RELAXED);
+	if (clock != __atomic_load_n(&e->atime,__ATOMIC_RELAXED)) __atomic_store_n(&e->atime,clock,__ATOMIC_RELAXED);
+}
+
+// higher is a better candidate for eviction
+static uint64_t kv_score(kv_entry *e, int policy, uint32_t clock) {
+	switch (policy) {
+	case KV_ALLKEYS_LRU:
+		return clock - __atomic_load_n(&e->atime,__ATOMIC_RELAXED);
+	case KV_ALLKEYS_LFU:
+		return 255 - kv_freq(e,clock);
+	default:
+		return UINT64_MAX - e->expires;
+	}
+}
+
+static kv_wheel *kv_wheel_for(kv_shard *shard) {
+	kv_wheel *w;
+
+	if (shard->wheel != NULL) return shard->wheel;
+	if ((w = calloc(1,sizeof(kv_wheel))) == NULL) return NULL;
+	w->now = kv_now();
+	__atomic_store_n(&shard->wheel,w,__ATOMIC_RELEASE);
+	__atomic_add_fetch(&USED,KV_ALLOCATED(w),__ATOMIC_RELAXED);
+	return w;
+}
+
+// files e by the level of its distance from now, and within it by the bits of its expiry for that level
+static void kv_wheel_add(kv_wheel *w, kv_entry *e) {
+	kv_entry **slot;
+	uint64_t at;
+	int level;
+
+	at = e->expires > w->now ? e->expires : w->now;
+	if (at - w->now >= KV_WHEEL_SPAN) at = w->now + KV_WHEEL_SPAN - 1;
+	for (level = 0; level < KV_WHEEL_LEVELS - 1 && at - w->now >= 1ULL << (KV_WHEEL_BITS * (level + 1)); level++);
+	slot = &w->slots[level][(at >> (KV_WHEEL_BITS * level)) & (KV_WHEEL_SLOTS - 1)];
+	if ((e->next = *slot) != NULL) e->next->prev = &e->next;
+	e->prev = slot;
+	*slot = e;
+	w->count++;
+}
+
+static void kv_wheel_del(kv_wheel *w, kv_entry *e) {
+	if ((*e->prev = e->next) != NULL) e->next->prev = e->prev;
+	w->count--;
+}
+
+static void kv_timed(kv_shard *shard, kv_entry *e, uint64_t now) {
+	// an empty wheel may have been left behind by the expiry thread
+	if (shard->wheel->count == 0 && shard->wheel->now < now) shard->wheel->now = now;
+	kv_wheel_add(shard->wheel,e);
+	if (__atomic_fetch_add(&TIMED,1,__ATOMIC_RELAXED) == 0) {
+		pthread_mutex_lock(&EXPIRY_LOCK);
+		pthread_cond_signal(&EXPIRY_COND);
+		pthread_mutex_unlock(&EXPIRY_LOCK);
+	}
+}
+
+static void kv_untimed(kv_shard *shard, kv_entry *e) {
+	if (e->expires == 0) return;
+	kv_wheel_del(shard->wheel,e);
+	__atomic_fetch_sub(&TIMED,1,__ATOMIC_RELAXED);
+}
+
+// moves the wheel up to now, cascading higher levels down as the lower ones wrap, and returns what fell due
+static kv_entry *kv_wheel_advance(kv_wheel *w, uint64_t now) {
+	kv_entry *e,*next,*due = NULL;
+	int level;
+
+	while (w->now < now && w->count > 0) {
+		w->now++;
+		for (level = 1; level < KV_WHEEL_LEVELS && (w->now & ((1ULL << (KV_WHEEL_BITS * level)) - 1)) == 0; level++) {
+			e = w->slots[level][(w->now >> (KV_WHEEL_BITS * level)) & (KV_WHEEL_SLOTS - 1)];
+			w->slots[level][(w->now >> (KV_WHEEL_BITS * level)) & (KV_WHEEL_SLOTS - 1)] = NULL;
+			for (; e != NULL; e = next) {
+				next = e->next;
+				w->count--;
+				kv_wheel_add(w,e);
+			}
+		}
+		e = w->slots[0][w->now & (KV_WHEEL_SLOTS - 1)];
+		w->slots[0][w->now & (KV_WHEEL_SLOTS - 1)] = NULL;
+		for (; e != NULL; e = next) {
+			next = e->next;
+			w->count--;
+			if (kv_expired(e,w->now)) {
+				e->next = due;
+				due = e;
+			} else {
+				kv_wheel_add(w,e);
+			}
+		}
+	}
+	if (w->now < now) w->now = now;
+	return due;
+}
+
+static void kv_expire(kv_thread *self, kv_shard *shard, uint64_t now) {
+	kv_entry *e,*next,*due;
+	size_t i,n = 0;
+
+	kv_acquire(shard);
+	due = kv_wheel_advance(shard->wheel,now);
+	for (e = due; e != NULL; e = e->next) n++;
+	if (n > 0 && kv_reserve(self,n) == -1) {
+		// refiled, to be retried on a later pass; reads expire them lazily meanwhile
+		for (e = due; e != NULL; e = next) {
+			next = e->next;
+			kv_wheel_add(shard->wheel,e);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+	for (e = due; e != NULL; e = e->next) {
+		if (kv_find(shard->table,e->hash,e->data,e->klen,&i) == e) {
+			kv_index_del(shard,e);
+			kv_erase(shard->table,i);
+			kv_wake(shard,e->hash,e->data,e->klen);
+			kv_forward_expiry(e->data,e->klen);
+			kv_tally(&self->counters[e->ns].expired,1);
+		}
+		kv_discharge(e);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	__atomic_fetch_sub(&TIMED,n,__ATOMIC_RELAXED);
+	for (e = due; e != NULL; e = next) {
+		next = e->next;
+		kv_retire(self,e,kv_entry_free);
+	}
+}
+
+static void *kv_expiry(void *arg) {
+	kv_thread *self;
+	struct timespec ts;
+	unsigned int i;
+	uint64_t now;
+
+	pthread_mutex_lock(&EXPIRY_LOCK);
+	while (!EXPIRY_STOP) {
+		if (__atomic_load_n(&TIMED,__ATOMIC_RELAXED) == 0) {
+			pthread_cond_wait(&EXPIRY_COND,&EXPIRY_LOCK);
+			continue;
+		}
+		pthread_mutex_unlock(&EXPIRY_LOCK);
+		if ((self = kv_self()) != NULL) {
+			now = kv_now();
+			for (i = 0; i < NSHARDS; i++) {
+				if (__atomic_load_n(&SHARDS[i].wheel,__ATOMIC_ACQUIRE) != NULL) kv_expire(self,&SHARDS[i],now);
+			}
+		}
+		pthread_mutex_lock(&EXPIRY_LOCK);
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		ts.tv_nsec += KV_TICK * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (!EXPIRY_STOP) pthread_cond_timedwait(&EXPIRY_COND,&EXPIRY_LOCK,&ts);
+	}
+	pthread_mutex_unlock(&EXPIRY_LOCK);
+	return NULL;
+}
+
+static size_t kv_varint(unsigned char *p, uint64_t n) {
+	size_t i = 0;
+
+	while (n >= 0x80) {
+		p[i++] = n | 0x80;
+		n >>= 7;
+	}
+	p[i++] = n;
+	return i;
+}
+
+// returns the length of the varint, or 0 if it is truncated or too long
+static size_t kv_get_varint(const unsigned char *p, size_t len, uint64_t *n) {
+	size_t i;
+
+	*n = 0;
+	for (i = 0; i < len && i < 10; i++) {
+		*n |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0) return i + 1;
+	}
+	return 0;
+}
+
+// the expiry of e in wall clock time, given the monotonic and wall clocks of now
+static uint64_t kv_wall_expiry(kv_entry *e, uint64_t now, uint64_t wall) {
+	uint64_t expires = __atomic_load_n(&e->expires,__ATOMIC_RELAXED);
+
+	return expires != 0 ? expires - now + wall : 0;
+}
+
+static size_t kv_header(unsigned char *hdr, int op, int type, size_t klen, size_t vlen, uint64_t expires) {
+	size_t n = 0;
+
+	hdr[n++] = op;
+	hdr[n++] = type;
+	n += kv_varint(hdr + n,klen);
+	if (op != KV_OP_DEL) {
+		n += kv_varint(hdr + n,vlen);
+		n += kv_varint(hdr + n,expires);
+	}
+	return n;
+}
+
+// returns the length of the record at p, 0 if it is truncated, or -1 if it is malformed
+static ssize_t kv_decode(const unsigned char *p, size_t len, kv_record *r) {
+	uint64_t klen,vlen = 0;
+	size_t n = 2,m;
+
+	if (len < 1) return 0;
+	if ((r->op = p[0]) == KV_OP_END) return 1;
+	if (r->op != KV_OP_SET && r->op != KV_OP_DEL && r->op != KV_OP_CMD) return -1;
+	if (len < 2) return 0;
+	if ((r->type = p[1]) > KV_HLL || (r->op == KV_OP_CMD && r->type < KV_LIST)) return -1;
+	if ((m = kv_get_varint(p + n,len - n,&klen)) == 0) return len - n >= 10 ? -1 : 0;
+	n += m;
+	r->expires = 0;
+	if (r->op != KV_OP_DEL) {
+		if ((m = kv_get_varint(p + n,len - n,&vlen)) == 0) return len - n >= 10 ? -1 : 0;
+		n += m;
+		if ((m = kv_get_varint(p + n,len - n,&r->expires)) == 0) return len - n >= 10 ? -1 : 0;
+		n += m;
+	}
+	if (klen > UINT32_MAX || vlen > UINT32_MAX) return -1;
+	if (len - n < klen + vlen) return 0;
+	r->key = (const char *)p + n;
+	r->klen = klen;
+	r->value = r->key + klen;
+	r->vlen = vlen;
+	return n + klen + vlen;
+}
+
+// while a snapshot is written, the changes of shards it hasn't dumped yet go to the rotated log
+static int kv_aof_write(int dumped, const struct iovec *iov, ssize_t total) {
+	off_t *size = &AOF_SIZE;
+	ssize_t n;
+	int fd,err;
+
+	pthread_mutex_lock(&AOF_LOCK);
+	fd = AOF;
+	if (!dumped && AOF_OLD >= 0) {
+		fd = AOF_OLD;
+		size = &AOF_OLD_SIZE;
+	}
+	n = writev(fd,iov,3);
+	if (n == total && FSYNC == KV_FSYNC_ALWAYS && fdatasync(fd) == -1) n = -1;
+	if (n != total) {
+		err = n < 0 ? errno : EIO;
+		if (ftruncate(fd,*size) == -1) {}
+		pthread_mutex_unlock(&AOF_LOCK);
+		errno = err;
+		return -1;
+	}
+	*size += total;
+	AOF_DIRTY = 1;
+	pthread_mutex_unlock(&AOF_LOCK);
+	return 0;
+}
+
+// whether changes to key are queued for the follower; under the shard lock of key
+static int kv_forwarded(const char *key, size_t klen) {
+	return __atomic_load_n(&REPL_ACTIVE,__ATOMIC_RELAXED) && SHARDS[kv_hash(key,klen) & (NSHARDS - 1)].replicated;
+}
+
+// drops the follower, which the replication thread notices; needs REPL_LOCK
+static void kv_repl_drop(void) {
+	__atomic_store_n(&REPL_ACTIVE,0,__ATOMIC_RELAXED);
+	if (REPL_FD >= 0) shutdown(REPL_FD,SHUT_RDWR);
+	pthread_cond_broadcast(&REPL_DATA);
+	pthread_cond_broadcast(&REPL_SPACE);
+}
+
+// queues a record for the follower, or drops the follower if the queue would hold more than KV_REPL_LIMIT
+static void kv_forward(const struct iovec *iov, size_t total) {
+	sds queue = NULL;
+	int i;
+
+	pthread_mutex_lock(&REPL_LOCK);
+	if (REPL_ACTIVE && (sdslen(REPL_QUEUE) == 0 || sdslen(REPL_QUEUE) + total <= KV_REPL_LIMIT)) {
+		for (i = 0, queue = REPL_QUEUE; i < 3 && queue != NULL; i++) queue = sdscatlen(queue,iov[i].iov_base,iov[i].iov_len);
+		if (queue != NULL) REPL_QUEUE = queue;
+	}
+	if (REPL_ACTIVE && queue == NULL) {
+		kv_repl_drop();
+	} else if (REPL_ACTIVE) {
+		__atomic_store_n(&REPL_QUEUED,sdslen(REPL_QUEUE),__ATOMIC_RELAXED);
+		pthread_cond_signal(&REPL_DATA);
+	}
+	pthread_mutex_unlock(&REPL_LOCK);
+}
+
+/*
+ * stalls a writer while the follower's queue is full, for KV_REPL_STALL at most, after which the follower is
+ * dropped; called before taking any shard lock, so that readers and other writers of the shard aren't held up.
+ */
+static void kv_throttle(void) {
+	struct timespec ts;
+	int rc = 0;
+
+	if (!__atomic_load_n(&REPL_ACTIVE,__ATOMIC_RELAXED) || __atomic_load_n(&REPL_QUEUED,__ATOMIC_RELAXED) <= KV_REPL_BUFFER) return;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	ts.tv_sec += KV_REPL_STALL / 1000;
+	ts.tv_nsec += KV_REPL_STALL % 1000 * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&REPL_LOCK);
+	while (REPL_ACTIVE && sdslen(REPL_QUEUE) > KV_REPL_BUFFER && rc != ETIMEDOUT) {
+		rc = pthread_cond_timedwait(&REPL_SPACE,&REPL_LOCK,&ts);
+	}
+	if (REPL_ACTIVE && sdslen(REPL_QUEUE) > KV_REPL_BUFFER) kv_repl_drop();
+	pthread_mutex_unlock(&REPL_LOCK);
+}
+
+/*
+ * queues the deletion of an expired key for the follower, so that its copy goes even if the clocks disagree;
+ * called under the shard lock of key. the log is left alone, as replaying it drops keys that have expired.
+ */
+static void kv_forward_expiry(const char *key, size_t klen) {
+	unsigned char hdr[KV_HEADER];
+	struct iovec iov[3];
+
+	if (!kv_forwarded(key,klen)) return;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = kv_header(hdr,KV_OP_DEL,KV_STRING,klen,0,0);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = klen;
+	iov[2].iov_base = NULL;
+	iov[2].iov_len = 0;
+	kv_forward(iov,iov[0].iov_len + klen);
+}
+
+/*
+ * appends a record to the log, and queues it for the follower; called under the shard lock of key.
+ * returns 0, or -1 with errno set, in which case the log is as it was. the follower is dropped rather than failing.
+ */
+static int kv_append_record(int op, int type, const char *key, size_t klen, const void *value, size_t vlen, uint64_t expires) {
+	unsigned char hdr[KV_HEADER];
+	struct iovec iov[3];
+	kv_shard *shard;
+	ssize_t total;
+	int forward;
+
+	shard = &SHARDS[kv_hash(key,klen) & (NSHARDS - 1)];
+	forward = __atomic_load_n(&REPL_ACTIVE,__ATOMIC_RELAXED) && shard->replicated;
+	if (__atomic_load_n(&AOF,__ATOMIC_RELAXED) < 0 && !forward) return 0;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = kv_header(hdr,op,type,klen,vlen,expires);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = klen;
+	iov[2].iov_base = (void *)value;
+	iov[2].iov_len = vlen;
+	total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+	if (__atomic_load_n(&AOF,__ATOMIC_RELAXED) >= 0 && kv_aof_write(shard->dumped,iov,total) == -1) return -1;
+	if (forward) kv_forward(iov,total);
+	return 0;
+}
+
+/*
+ * logs the change of key to e, or its deletion when e is NULL; called under the shard lock.
+ * values stored by pointer are logged as deletions, as they can't be restored, and collections serialized.
+ */
+static int kv_log(const char *key, size_t klen, kv_entry *e) {
+	sds value;
+	int rc;
+
+	if (__atomic_load_n(&AOF,__ATOMIC_RELAXED) < 0 && !kv_forwarded(key,klen)) return 0;
+	if (e == NULL || (!KV_INLINE(e) && e->type < KV_LIST)) return kv_append_record(KV_OP_DEL,KV_STRING,key,klen,NULL,0,0);
+	if (KV_INLINE(e)) return kv_append_record(KV_OP_SET,e->type,key,klen,e->value,e->vlen,kv_wall_expiry(e,kv_now(),kv_wall()));
+	if ((value = sdsempty()) == NULL || (value = kv_type_encode(e->type,e->value,value)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rc = kv_append_record(KV_OP_SET,e->type,key,klen,value,sdslen(value),kv_wall_expiry(e,kv_now(),kv_wall()));
+	sdsfree(value);
+	return rc;
+}
+
+// opens a log for appending, writing the magic if it is new
+static int kv_aof_open(const char *path, off_t *size) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path,O_WRONLY | O_APPEND | O_CREAT,0600)) == -1) return -1;
+	if (fstat(fd,&st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		if (write(fd,KV_MAGIC,KV_MAGIC_LEN) != KV_MAGIC_LEN) {
+			close(fd);
+			if (errno == 0) errno = EIO;
+			return -1;
+		}
+		st.st_size = KV_MAGIC_LEN;
+	}
+	*size = st.st_size;
+	return fd;
+}
+
+static void kv_aof_sync(void) {
+	int fd = -1,old = -1;
+
+	pthread_mutex_lock(&AOF_LOCK);
+	if (AOF >= 0 && AOF_DIRTY) {
+		fd = dup(AOF);
+		if (AOF_OLD >= 0) old = dup(AOF_OLD);
+		AOF_DIRTY = 0;
+	}
+	pthread_mutex_unlock(&AOF_LOCK);
+	if (old >= 0) {
+		fdatasync(old);
+		close(old);
+	}
+	if (fd < 0) return;
+	fdatasync(fd);
+	close(fd);
+}
+
+// appends the records of the current log to the rotated one left by a failed snapshot, and empties the current log
+static int kv_fold(const char *old) {
+	char buf[65536];
+	ssize_t n;
+	int in,out,rc = 0;
+
+	if ((out = open(old,O_WRONLY | O_APPEND)) == -1) return -1;
+	if ((in = open(AOF_PATH,O_RDONLY)) == -1) {
+		close(out);
+		return -1;
+	}
+	lseek(in,KV_MAGIC_LEN,SEEK_SET);
+	while ((n = read(in,buf,sizeof(buf))) > 0) {
+		if (write(out,buf,n) != n) {
+			rc = -1;
+			break;
+		}
+	}
+	if (n < 0 || fsync(out) == -1) rc = -1;
+	close(in);
+	close(out);
+	if (rc == 0 && ftruncate(AOF,KV_MAGIC_LEN) == -1) rc = -1;
+	if (rc == 0) AOF_SIZE = KV_MAGIC_LEN;
+	return rc;
+}
+
+/*
+ * starts a new log, keeping the current one as path.old until the snapshot that follows is written,
+ * and open as AOF_OLD until kv_unrotate, for the changes of shards that the snapshot hasn't dumped yet.
+ */
+static int kv_rotate(sds old) {
+	struct stat st;
+	off_t size;
+	int fd,rc = 0;
+
+	pthread_mutex_lock(&AOF_LOCK);
+	if (access(old,F_OK) == 0) {
+		if ((rc = kv_fold(old)) == 0 && ((AOF_OLD = open(old,O_WRONLY | O_APPEND)) == -1 || fstat(AOF_OLD,&st) == -1)) rc = -1;
+		if (rc == 0) AOF_OLD_SIZE = st.st_size;
+	} else if (fdatasync(AOF) == -1 || rename(AOF_PATH,old) == -1) {
+		rc = -1;
+	} else if ((fd = kv_aof_open(AOF_PATH,&size)) == -1) {
+		rename(old,AOF_PATH);
+		rc = -1;
+	} else {
+		AOF_OLD = AOF;
+		AOF_OLD_SIZE = AOF_SIZE;
+		__atomic_store_n(&AOF,fd,__ATOMIC_RELAXED);
+		AOF_SIZE = size;
+	}
+	if (rc == -1 && AOF_OLD >= 0) {
+		close(AOF_OLD);
+		AOF_OLD = -1;
+	}
+	pthread_mutex_unlock(&AOF_LOCK);
+	return rc;
+}
+
+// once every shard is dumped, or the snapshot failed, changes all go to the new log
+static void kv_unrotate(void) {
+	pthread_mutex_lock(&AOF_LOCK);
+	if (AOF_OLD >= 0) {
+		fdatasync(AOF_OLD);
+		close(AOF_OLD);
+		AOF_OLD = -1;
+	}
+	pthread_mutex_unlock(&AOF_LOCK);
+}
+
+// a collection is serialized under the shard lock, if it is still live
+static sds kv_dump_collection(kv_shard *shard, kv_entry *e, sds buf) {
+	kv_acquire(shard);
+	if (kv_find(shard->table,e->hash,e->data,e->klen,NULL) == e) buf = kv_type_encode(e->type,e->value,buf);
+	pthread_mutex_unlock(&shard->lock);
+	return buf;
+}
+
+// writes the entries of one shard to buf, pinned so that the shard's table and entries stay valid, or under its lock if locked
+static sds kv_dump_shard(kv_shard *shard, sds buf, uint64_t now, uint64_t wall, int locked) {
+	unsigned char hdr[KV_HEADER];
+	kv_table *t;
+	kv_entry *e;
+	sds value;
+	size_t i;
+
+	if (kv_pin() == -1) return NULL;
+	if ((value = sdsempty()) == NULL) {
+		kv_unpin();
+		return NULL;
+	}
+	t = __atomic_load_n(&shard->table,__ATOMIC_ACQUIRE);
+	for (i = 0; t != NULL && i <= t->mask && buf != NULL; i++) {
+		if (__atomic_load_n(&t->ctrl[i],__ATOMIC_ACQUIRE) < 0) continue;
+		if ((e = __atomic_load_n(&t->slots[i],__ATOMIC_ACQUIRE)) == NULL || kv_expired(e,now)) continue;
+		if (KV_INLINE(e)) {
+			buf = sdscatlen(buf,hdr,kv_header(hdr,KV_OP_SET,e->type,e->klen,e->vlen,kv_wall_expiry(e,now,wall)));
+			if (buf != NULL) buf = sdscatlen(buf,e->data,e->klen);
+			if (buf != NULL) buf = sdscatlen(buf,e->value,e->vlen);
+		} else if (e->type >= KV_LIST) {
+			sdsclear(value);
+			if ((value = locked ? kv_type_encode(e->type,e->value,value) : kv_dump_collection(shard,e,value)) == NULL) break;
+			if (sdslen(value) == 0) continue;
+			buf = sdscatlen(buf,hdr,kv_header(hdr,KV_OP_SET,e->type,e->klen,sdslen(value),kv_wall_expiry(e,now,wall)));
+			if (buf != NULL) buf = sdscatlen(buf,e->data,e->klen);
+			if (buf != NULL) buf = sdscatlen(buf,value,sdslen(value));
+		}
+	}
+	kv_unpin();
+	if (value == NULL) {
+		sdsfree(buf);
+		return NULL;
+	}
+	sdsfree(value);
+	return buf;
+}
+
+/*
+ * writes a snapshot without stopping writers for more than a shard at a time. with a log, each shard is dumped under
+ * its lock, and marked, so that its changes go to the new log from then on, and before to the rotated one, which
+ * the snapshot replaces. collections change in place by commands that can't be applied twice, so a change must
+ * never be in both. without a log, the shards are only walked pinned.
+ */
+static int kv_snapshot(void) {
+	unsigned int i;
+	uint64_t now,wall;
+	sds tmp,old = NULL,buf;
+	FILE *f = NULL;
+	int rc = -1;
+
+	if ((tmp = sdscatprintf(sdsempty(),"%s.tmp",SNAPSHOT)) == NULL) return -1;
+	if ((buf = sdsempty()) == NULL) goto done;
+	if (AOF_PATH != NULL) {
+		if ((old = sdscatprintf(sdsempty(),"%s.old",AOF_PATH)) == NULL) goto done;
+		for (i = 0; i < NSHARDS; i++) {
+			kv_acquire(&SHARDS[i]);
+			SHARDS[i].dumped = 0;
+			pthread_mutex_unlock(&SHARDS[i].lock);
+		}
+		if (kv_rotate(old) == -1) goto done;
+	}
+	if ((f = fopen(tmp,"w")) == NULL || fwrite(KV_MAGIC,KV_MAGIC_LEN,1,f) != 1) goto done;
+	for (i = 0; i < NSHARDS; i++) {
+		sdsclear(buf);
+		if (old != NULL) kv_acquire(&SHARDS[i]);
+		now = kv_now();
+		wall = kv_wall();
+		buf = kv_dump_shard(&SHARDS[i],buf,now,wall,old != NULL);
+		if (old != NULL) {
+			SHARDS[i].dumped = 1;
+			pthread_mutex_unlock(&SHARDS[i].lock);
+		}
+		if (buf == NULL || (sdslen(buf) > 0 && fwrite(buf,sdslen(buf),1,f) != 1)) goto done;
+	}
+	if (fputc(KV_OP_END,f) == EOF || fflush(f) == EOF || fsync(fileno(f)) == -1) goto done;
+	rc = fclose(f);
+	f = NULL;
+	if (rc == 0 && (rc = rename(tmp,SNAPSHOT)) == 0 && old != NULL) unlink(old);
+done:
+	if (old != NULL) kv_unrotate();
+	if (f != NULL) fclose(f);
+	if (rc != 0) unlink(tmp);
+	sdsfree(tmp);
+	sdsfree(old);
+	sdsfree(buf);
+	return rc;
+}
+
+// applies a record of a snapshot, a log, or the primary
+static int kv_replay(kv_record *r, uint64_t wall) {
+	if (r->op == KV_OP_CMD) return kv_command(r->key,r->klen,r->type,(const unsigned char *)r->value,r->vlen,NULL) == -1 && errno != EINVAL ? -1 : 0;
+	if (r->op == KV_OP_DEL || (r->expires != 0 && r->expires <= wall)) {
+		kv_put(r->key,r->klen,NULL,0,KV_STRING,0,0);
+		return 0;
+	}
+	return kv_put(r->key,r->klen,r->value,r->vlen,r->type,r->expires != 0 ? (int64_t)(r->expires - wall) : -1,0) == -1 ? -1 : 0;
+}
+
+/*
+ * applies the records of a snapshot or log. expiries are restored relative to the wall clock, and records that
+ * have expired since are applied as deletions. the torn tail of a log is cut off; anything else malformed is an error.
+ */
+static int kv_load(const char *path, int log) {
+	struct stat st;
+	unsigned char *p;
+	kv_record r;
+	uint64_t wall;
+	ssize_t n = 0;
+	size_t off;
+	int fd,rc = 0;
+
+	if ((fd = open(path,O_RDWR)) == -1) return errno == ENOENT ? 0 : -1;
+	if (fstat(fd,&st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	if ((p = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	wall = kv_wall();
+	off = KV_MAGIC_LEN;
+	r.op = -1;
+	if (st.st_size < KV_MAGIC_LEN || memcmp(p,KV_MAGIC,KV_MAGIC_LEN) != 0) {
+		n = -1;
+		off = st.st_size;
+	}
+	while (off < (size_t)st.st_size && (n = kv_decode(p + off,st.st_size - off,&r)) > 0) {
+		off += n;
+		if (r.op == KV_OP_END) break;
+		if ((rc = kv_replay(&r,wall)) == -1) break;
+	}
+	munmap(p,st.st_size);
+	if (rc == 0 && n < 0) {
+		errno = EINVAL;
+		rc = -1;
+	} else if (rc == 0 && log && off < (size_t)st.st_size) {
+		rc = ftruncate(fd,off);
+	} else if (rc == 0 && !log && r.op != KV_OP_END) {
+		errno = EINVAL;
+		rc = -1;
+	}
+	close(fd);
+	return rc;
+}
+
+static size_t kv_changes(void) {
+	size_t changes = 0;
+	unsigned int i;
+
+	for (i = 0; i < NSHARDS; i++) changes += __atomic_load_n(&SHARDS[i].changes,__ATOMIC_RELAXED);
+	return changes;
+}
+
+static void *kv_persister(void *arg) {
+	struct timespec ts;
+	uint64_t last;
+	size_t changes,saved;
+
+	last = kv_now();
+	saved = kv_changes();
+	pthread_mutex_lock(&PERSIST_LOCK);
+	while (!PERSIST_STOP) {
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&PERSIST_COND,&PERSIST_LOCK,&ts);
+		if (PERSIST_STOP) break;
+		pthread_mutex_unlock(&PERSIST_LOCK);
+		if (FSYNC == KV_FSYNC_EVERYSEC) kv_aof_sync();
+		if (SNAPSHOT != NULL && kv_now() - last >= (uint64_t)INTERVAL * 1000 && (changes = kv_changes()) != saved) {
+			// a failed snapshot is retried after another interval
+			if (kv_snapshot() == 0) saved = changes;
+			last = kv_now();
+		}
+		pthread_mutex_lock(&PERSIST_LOCK);
+	}
+	pthread_mutex_unlock(&PERSIST_LOCK);
+	return NULL;
+}
+
+/*
+ * evicts one entry, of namespace ns or of any when ns is negative, by sampling the shards
+ * in turn from a random one. returns 0 when there was nothing to evict.
+ */
+static int kv_evict(kv_thread *self, int ns, int policy) {
+	kv_shard *shard;
+	kv_table *t;
+	kv_entry *e,*best;
+	uint64_t score,top = 0;
+	uint32_t clock;
+	size_t i,j,at = 0,start,n;
+	unsigned int first,s;
+
+	if (policy == KV_NOEVICTION || kv_reserve(self,1) == -1) return 0;
+	clock = kv_clock();
+	first = kv_random(self);
+	for (s = 0; s < NSHARDS; s++) {
+		shard = &SHARDS[(first + s) & (NSHARDS - 1)];
+		kv_acquire(shard);
+		best = NULL;
+		if ((t = shard->table) != NULL) {
+			start = kv_random(self);
+			for (j = n = 0; j <= t->mask && n < KV_SAMPLES; j++) {
+				i = (start + j) & t->mask;
+				if (t->ctrl[i] < 0) continue;
+				e = t->slots[i];
+				if ((ns >= 0 && e->ns != ns) || (policy == KV_VOLATILE_TTL && e->expires == 0)) continue;
+				n++;
+				score = kv_score(e,policy,clock);
+				if (best == NULL || score > top) {
+					best = e;
+					top = score;
+					at = i;
+				}
+			}
+		}
+		if (best != NULL && kv_log(best->data,best->klen,NULL) == -1) best = NULL;
+		if (best != NULL) {
+			__atomic_store_n(&shard->changes,shard->changes + 1,__ATOMIC_RELAXED);
+			kv_untimed(shard,best);
+			kv_index_del(shard,best);
+			kv_erase(t,at);
+			kv_wake(shard,best->hash,best->data,best->klen);
+			kv_discharge(best);
+			pthread_mutex_unlock(&shard->lock);
+			kv_tally(&self->counters[best->ns].evicted,1);
+			kv_retire(self,best,kv_entry_free);
+			return 1;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return 0;
+}
+
+// whether need more bytes in namespace i would exceed either budget
+static int kv_over(unsigned int i, size_t need) {
+	kv_namespace *ns = &NAMESPACES[i];
+
+	return (ns->maxmemory != 0 && __atomic_load_n(&ns->used,__ATOMIC_RELAXED) + need > ns->maxmemory) ||
+		(MAXMEMORY != 0 && __atomic_load_n(&USED,__ATOMIC_RELAXED) + need > MAXMEMORY);
+}
+
+// evicts until need more bytes in namespace i fit both budgets, and fails if they run out of candidates
+static int kv_make_room(kv_thread *self, unsigned int i, size_t need) {
+	kv_namespace *ns = &NAMESPACES[i];
+
+	for (;;) {
+		if (ns->maxmemory != 0 && __atomic_load_n(&ns->used,__ATOMIC_RELAXED) + need > ns->maxmemory) {
+			if (!kv_evict(self,i,ns->policy)) return -1;
+		} else if (MAXMEMORY != 0 && __atomic_load_n(&USED,__ATOMIC_RELAXED) + need > MAXMEMORY) {
+			if (!kv_evict(self,-1,POLICY)) return -1;
+		} else {
+			return 0;
+		}
+	}
+}
+
+/*
+ * the part of an update done under the shard lock, which has to be held. op->e is the new entry, or NULL to delete.
+ * what it replaces is left in op->gone and op->table for kv_done.
+ */
+static int kv_apply(kv_shard *shard, kv_op *op, int64_t ttl, int nx, uint64_t now) {
+	kv_entry *e = op->e,*old;
+	size_t i;
+	int rc = 1;
+
+	old = kv_find(shard->table,op->hash,op->key,op->klen,&i);
+	if (e != NULL) e->expires = ttl > 0 ? now + ttl : ttl == 0 && old != NULL && !kv_expired(old,now) ? old->expires : 0;
+
+	if (e != NULL && e->expires != 0 && kv_wheel_for(shard) == NULL) {
+		errno = ENOMEM;
+		rc = -1;
+	} else if (old == NULL) {
+		if (e == NULL) {
+			rc = 0;
+		} else if (kv_grow(shard,&op->table) == -1 || (!op->quiet && kv_log(op->key,op->klen,e) == -1)) {
+			rc = -1;
+		} else {
+			kv_place(shard->table,e);
+			kv_charge(e);
+			if (e->expires != 0) kv_timed(shard,e,now);
+			if (op->node != NULL) kv_index_add(shard,op->node,e);
+			op->node = NULL;
+		}
+	} else if (e == NULL && !kv_expired(old,now) && kv_log(op->key,op->klen,NULL) == -1) {
+		rc = -1;
+	} else if (e == NULL) {
+		if (kv_expired(old,now)) {
+			if (SELF != NULL) kv_tally(&SELF->counters[old->ns].expired,1);
+			rc = 0;
+		}
+		kv_untimed(shard,old);
+		kv_index_del(shard,old);
+		kv_erase(shard->table,i);
+		kv_discharge(old);
+		op->gone = old;
+	} else if (nx && !kv_expired(old,now)) {
+		rc = 0;
+	} else if (!op->quiet && kv_log(op->key,op->klen,e) == -1) {
+		rc = -1;
+	} else {
+		// overwriting counts as an access, not as a new key
+		if (!kv_expired(old,now)) e->freq = kv_freq(old,e->atime);
+		else if (SELF != NULL) kv_tally(&SELF->counters[old->ns].expired,1);
+		kv_untimed(shard,old);
+		kv_set_slot(shard->table,i,e);
+		kv_discharge(old);
+		kv_charge(e);
+		if (e->expires != 0) kv_timed(shard,e,now);
+		if ((e->node = old->node) != NULL) e->node->entry = e;
+		old->node = NULL;
+		op->gone = old;
+	}
+	if (rc == 1) {
+		__atomic_store_n(&shard->changes,shard->changes + 1,__ATOMIC_RELAXED);
+		kv_wake(shard,op->hash,op->key,op->klen);
+	}
+	return rc;
+}
+
+// after the shard lock is released; needs two limbo slots
+static void kv_done(kv_thread *self, kv_op *op, int rc) {
+	free(op->node);
+	if (op->table != NULL) kv_retire(self,op->table,free);
+	if (op->gone != NULL) kv_retire(self,op->gone,kv_entry_free);
+	if (rc != 1 && op->e != NULL) {
+		// the value is still the caller's
+		op->e->ffn = NULL;
+		kv_entry_free(op->e);
+	}
+}
+
+static void kv_op_init(kv_op *op, const char *key, size_t klen) {
+	op->key = key;
+	op->klen = klen;
+	op->hash = kv_hash(key,klen);
+	op->e = op->gone = NULL;
+	op->table = NULL;
+	op->node = NULL;
+	op->quiet = 0;
+}
+
+/*
+ * deletes key when both inl and value are NULL, otherwise stores a new entry for it,
+ * with the value copied inline from inl, or the external value and its ffn.
+ * a positive ttl sets the expiry that many milliseconds from now, a negative one clears it,
+ * and zero keeps that of the entry being replaced. an expired entry counts as absent.
+ * the replacement is allocated before the shard lock is taken, and what it replaced is retired after it is released.
+ */
+static int kv_update(const char *key, size_t klen, const char *inl, size_t vlen, int type, void *value, void (*ffn)(void *), int64_t ttl, int nx) {
+	kv_shard *shard;
+	kv_thread *self;
+	kv_op op;
+	int rc;
+
+	if (kv_readonly()) return -1;
+	if (kv_shared(key,klen)) {
+		// external values can't be shared, nor collections, which are external too
+		if (value != NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		return kv_shm_put(kv_hash(key,klen),key,klen,inl,vlen,type,ttl,nx,NULL);
+	}
+	kv_throttle();
+	if ((self = kv_self()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	kv_op_init(&op,key,klen);
+	shard = &SHARDS[op.hash & (NSHARDS - 1)];
+	if ((inl != NULL || value != NULL) && (op.e = kv_entry_new(op.hash,key,klen,inl,vlen,type,value,ffn)) == NULL) return -1;
+	if ((op.e != NULL && kv_make_room(self,op.e->ns,kv_size(op.e)) == -1) || kv_reserve(self,2) == -1 ||
+		(op.e != NULL && INDEXED && (op.node = kv_node_new(self,0)) == NULL)) {
+		free(op.e);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (ttl > (int64_t)KV_WHEEL_SPAN * 1024) ttl = KV_WHEEL_SPAN * 1024;
+
+	kv_acquire(shard);
+	rc = kv_apply(shard,&op,ttl,nx,kv_now());
+	pthread_mutex_unlock(&shard->lock);
+
+	kv_done(self,&op,rc);
+	return rc;
+}
+
+static int kv_op_order(const void *a, const void *b) {
+	const kv_op *x = a,*y = b;
+	size_t i = x->hash & (NSHARDS - 1),j = y->hash & (NSHARDS - 1);
+
+	if (i != j) return i < j ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * applies n sets (or deletes, for ops without an entry), taking each shard's lock once.
+ * ops are sorted by shard, each one's rc left in op->rc. returns how many set or deleted a key,
+ * or -1 with errno set, in which case the ops applied before the failure stand.
+ */
+static long kv_batch(kv_op *ops, size_t n, int64_t ttl) {
+	kv_shard *shard;
+	kv_thread *self;
+	uint64_t now;
+	size_t i,j;
+	long count = 0;
+	int err = 0;
+
+	if ((self = kv_self()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	kv_throttle();
+	for (i = 0; i < n; i++) {
+		if (ops[i].e != NULL && kv_make_room(self,ops[i].e->ns,kv_size(ops[i].e)) == -1) break;
+	}
+	if (i == n && kv_reserve(self,2 * n) == 0) {
+		for (i = 0; i < n; i++) {
+			if (ops[i].e != NULL && INDEXED && (ops[i].node = kv_node_new(self,0)) == NULL) break;
+		}
+	}
+	if (i < n) {
+		for (i = 0; i < n; i++) {
+			free(ops[i].e);
+			free(ops[i].node);
+		}
+		errno = ENOMEM;
+		return -1;
+	}
+	if (ttl > (int64_t)KV_WHEEL_SPAN * 1024) ttl = KV_WHEEL_SPAN * 1024;
+	qsort(ops,n,sizeof(kv_op),kv_op_order);
+
+	for (i = 0; i < n; i = j) {
+		shard = &SHARDS[ops[i].hash & (NSHARDS - 1)];
+		now = kv_now();
+		kv_acquire(shard);
+		for (j = i; j < n && &SHARDS[ops[j].hash & (NSHARDS - 1)] == shard; j++) {
+			if ((ops[j].rc = err ? -1 : kv_apply(shard,&ops[j],ttl,0,now)) == -1 && !err) err = errno;
+		}
+		pthread_mutex_unlock(&shard->lock);
+		for (j = i; j < n && &SHARDS[ops[j].hash & (NSHARDS - 1)] == shard; j++) {
+			kv_done(self,&ops[j],ops[j].rc);
+			if (ops[j].rc == 1) count++;
+		}
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return count;
+}
+
+int kv_init(unsigned int shards) {
+	pthread_condattr_t attr;
+	unsigned int i;
+
+	if (shards == 0) shards = KV_DEFAULT_SHARDS;
+	if (shards > KV_MAX_SHARDS) shards = KV_MAX_SHARDS;
+	for (NSHARDS = 1; NSHARDS < shards; NSHARDS <<= 1);
+
+	if (pthread_key_create(&THREAD_KEY,kv_thread_exit) != 0) return -1;
+
+	if ((SHARDS = calloc(NSHARDS,sizeof(kv_shard))) == NULL) {
+		pthread_key_delete(THREAD_KEY);
+		return -1;
+	}
+	for (i = 0; i < NSHARDS; i++) {
+		if (pthread_mutex_init(&SHARDS[i].lock,NULL) != 0) {
+			while (i-- > 0) pthread_mutex_destroy(&SHARDS[i].lock);
+			free(SHARDS);
+			SHARDS = NULL;
+			pthread_key_delete(THREAD_KEY);
+			return -1;
+		}
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&EXPIRY_COND,&attr);
+	pthread_cond_init(&REPL_DATA,&attr);
+	pthread_cond_init(&REPL_SPACE,&attr);
+	pthread_condattr_destroy(&attr);
+	EXPIRY_STOP = 0;
+	if (pthread_create(&EXPIRY,NULL,kv_expiry,NULL) != 0) {
+		pthread_cond_destroy(&EXPIRY_COND);
+		pthread_cond_destroy(&REPL_DATA);
+		pthread_cond_destroy(&REPL_SPACE);
+		kv_destroy_shards();
+		return -1;
+	}
+	return 0;
+}
+
+// no other thread may be using the store
+void kv_destroy(void) {
+	kv_conn *c,*next;
+	unsigned int i;
+
+	if (SHARDS == NULL) return;
+	if (PEER_LISTEN >= 0) {
+		pthread_mutex_lock(&PEER_LOCK);
+		PEER_STOP = 1;
+		shutdown(PEER_LISTEN,SHUT_RDWR);
+		for (c = CONNS; c != NULL; c = c->next) shutdown(c->fd,SHUT_RDWR);
+		pthread_mutex_unlock(&PEER_LOCK);
+		pthread_join(PEER,NULL);
+		for (c = CONNS; c != NULL; c = next) {
+			next = c->next;
+			pthread_join(c->thread,NULL);
+			close(c->fd);
+			free(c);
+		}
+		CONNS = NULL;
+		close(PEER_LISTEN);
+		PEER_LISTEN = -1;
+	}
+	if (REPL_STOP == 0) {
+		pthread_mutex_lock(&REPL_LOCK);
+		REPL_STOP = 1;
+		kv_repl_drop();
+		pthread_mutex_unlock(&REPL_LOCK);
+		pthread_join(REPL,NULL);
+	}
+	REPL_STOP = -1;
+	free(REPL_ADDRESS);
+	sdsfree(REPL_QUEUE);
+	REPL_ADDRESS = NULL;
+	REPL_QUEUE = NULL;
+	if (FOLLOW_LISTEN >= 0) {
+		pthread_mutex_lock(&REPL_LOCK);
+		FOLLOW_STOP = 1;
+		shutdown(FOLLOW_LISTEN,SHUT_RDWR);
+		if (FOLLOW_FD >= 0) shutdown(FOLLOW_FD,SHUT_RDWR);
+		pthread_mutex_unlock(&REPL_LOCK);
+		pthread_join(FOLLOW,NULL);
+		close(FOLLOW_LISTEN);
+		FOLLOW_LISTEN = -1;
+		FOLLOWER = 0;
+	}
+	if (PERSIST_STOP == 0) {
+		pthread_mutex_lock(&PERSIST_LOCK);
+		PERSIST_STOP = 1;
+		pthread_cond_signal(&PERSIST_COND);
+		pthread_mutex_unlock(&PERSIST_LOCK);
+		pthread_join(PERSIST,NULL);
+		pthread_cond_destroy(&PERSIST_COND);
+	}
+	PERSIST_STOP = -1;
+	if (SNAPSHOT != NULL) kv_snapshot();
+	if (AOF >= 0) {
+		fdatasync(AOF);
+		close(AOF);
+		AOF = -1;
+	}
+	free(SNAPSHOT);
+	free(AOF_PATH);
+	SNAPSHOT = AOF_PATH = NULL;
+	pthread_mutex_lock(&EXPIRY_LOCK);
+	EXPIRY_STOP = 1;
+	pthread_cond_signal(&EXPIRY_COND);
+	pthread_mutex_unlock(&EXPIRY_LOCK);
+	pthread_join(EXPIRY,NULL);
+	pthread_cond_destroy(&EXPIRY_COND);
+	pthread_cond_destroy(&REPL_DATA);
+	pthread_cond_destroy(&REPL_SPACE);
+	kv_shm_close();
+	free(SHARED);
+	SHARED = NULL;
+	kv_destroy_shards();
+	for (i = 0; i < NPEERS; i++) free(PEERS[i]);
+	free(PEERS);
+	PEERS = NULL;
+	NPEERS = 0;
+}
+
+static void kv_destroy_shards(void) {
+	kv_thread *t,*next;
+	kv_node *node,*next_node;
+	kv_table *table;
+	unsigned int i;
+	size_t j;
+
+	for (t = THREADS; t != NULL; t = next) {
+		next = t->next;
+		for (j = 0; j < t->nlimbo; j++) t->limbo[j].fn(t->limbo[j].ptr);
+		for (j = 0; t->peers != NULL && j < NPEERS; j++) {
+			if (t->peers[j] >= 0) close(t->peers[j]);
+		}
+		free(t->limbo);
+		free(t->peers);
+		free(t);
+	}
+	THREADS = NULL;
+	SELF = NULL;
+	pthread_key_delete(THREAD_KEY);
+	for (i = 0; i < NSHARDS; i++) {
+		if ((table = SHARDS[i].table) != NULL) {
+			for (j = 0; j <= table->mask; j++) {
+				if (table->ctrl[j] >= 0) kv_entry_free(table->slots[j]);
+			}
+			free(table);
+		}
+		free(SHARDS[i].wheel);
+		for (node = SHARDS[i].index; node != NULL; node = next_node) {
+			next_node = node->next[0];
+			free(node);
+		}
+		pthread_mutex_destroy(&SHARDS[i].lock);
+	}
+	free(SHARDS);
+	SHARDS = NULL;
+	TIMED = 0;
+	for (i = 1; i < NNAMESPACES; i++) free(NAMESPACES[i].prefix);
+	memset(NAMESPACES,0,sizeof(NAMESPACES));
+	NNAMESPACES = 1;
+	MAXMEMORY = 0;
+	POLICY = KV_NOEVICTION;
+	USED = 0;
+	INDEXED = 0;
+}
+
+unsigned int kv_shards(void) {
+	return NSHARDS;
+}
+
+int kv_policy(const char *name) {
+	static const char *names[] = { "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl", NULL };
+	int i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(name,names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+int kv_limit(const char *prefix, size_t maxmemory, int policy) {
+	unsigned int i;
+
+	if (policy < KV_NOEVICTION || policy > KV_VOLATILE_TTL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (prefix == NULL) {
+		MAXMEMORY = maxmemory;
+		POLICY = policy;
+		return 0;
+	}
+	for (i = 1; i < NNAMESPACES && strcmp(NAMESPACES[i].prefix,prefix) != 0; i++);
+	if (i == NNAMESPACES) {
+		if (i == KV_MAX_NAMESPACES || *prefix == '\0') {
+			errno = EINVAL;
+			return -1;
+		}
+		if ((NAMESPACES[i].prefix = strdup(prefix)) == NULL) return -1;
+		NAMESPACES[i].plen = strlen(prefix);
+		NNAMESPACES++;
+	}
+	NAMESPACES[i].maxmemory = maxmemory;
+	NAMESPACES[i].policy = policy;
+	return 0;
+}
+
+size_t kv_memory(const char *prefix) {
+	unsigned int i;
+
+	if (prefix == NULL) return __atomic_load_n(&USED,__ATOMIC_RELAXED);
+	if (SHARED != NULL && strcmp(prefix,SHARED) == 0) return kv_shm_memory();
+	for (i = 1; i < NNAMESPACES; i++) {
+		if (strcmp(NAMESPACES[i].prefix,prefix) == 0) return __atomic_load_n(&NAMESPACES[i].used,__ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+// appends to out, freeing it on failure as kv_cmd_append does; fmt only formats numbers, so the result is short
+static sds kv_printf(sds out, const char *fmt, ...) {
+	char buf[128];
+	va_list ap;
+	int n;
+
+	va_start(ap,fmt);
+	n = vsnprintf(buf,sizeof(buf),fmt,ap);
+	va_end(ap);
+	return kv_cmd_append(out,buf,n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+static sds kv_json_string(sds out, const char *s) {
+	out = kv_cmd_append(out,"\"",1);
+	for (; out != NULL && *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') out = kv_printf(out,"\\%c",*s);
+		else if ((unsigned char)*s < 0x20) out = kv_printf(out,"\\u%04x",*s);
+		else out = kv_cmd_append(out,s,1);
+	}
+	return kv_cmd_append(out,"\"",1);
+}
+
+static sds kv_json_counters(sds out, const kv_counters *c, size_t keys, size_t memory, size_t maxmemory) {
+	return kv_printf(out,"\"hits\":%llu,\"misses\":%llu,\"expired\":%llu,\"evicted\":%llu,\"keys\":%zu,\"memory\":%zu,\"maxmemory\":%zu",
+		(unsigned long long)c->hits,(unsigned long long)c->misses,(unsigned long long)c->expired,(unsigned long long)c->evicted,keys,memory,maxmemory);
+}
+
+char *kv_stats(void) {
+	kv_counters sum[KV_MAX_NAMESPACES],total;
+	uint64_t waits[KV_WAIT_BUCKETS],waited = 0;
+	kv_thread *t;
+	unsigned int i,n = NNAMESPACES;
+	size_t keys = 0;
+	char *json;
+	sds out;
+
+	memset(sum,0,sizeof(sum));
+	memset(&total,0,sizeof(total));
+	memset(waits,0,sizeof(waits));
+	for (t = __atomic_load_n(&THREADS,__ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+		for (i = 0; i < n; i++) {
+			sum[i].hits += __atomic_load_n(&t->counters[i].hits,__ATOMIC_RELAXED);
+			sum[i].misses += __atomic_load_n(&t->counters[i].misses,__ATOMIC_RELAXED);
+			sum[i].expired += __atomic_load_n(&t->counters[i].expired,__ATOMIC_RELAXED);
+			sum[i].evicted += __atomic_load_n(&t->counters[i].evicted,__ATOMIC_RELAXED);
+		}
+		for (i = 0; i < KV_WAIT_BUCKETS; i++) waits[i] += __atomic_load_n(&t->waits[i],__ATOMIC_RELAXED);
+		waited += __atomic_load_n(&t->waited,__ATOMIC_RELAXED);
+	}
+	for (i = 0; i < n; i++) {
+		total.hits += sum[i].hits;
+		total.misses += sum[i].misses;
+		total.expired += sum[i].expired;
+		total.evicted += sum[i].evicted;
+		keys += __atomic_load_n(&NAMESPACES[i].keys,__ATOMIC_RELAXED);
+	}
+
+	out = kv_json_counters(sdsnew("{"),&total,keys,kv_memory(NULL),MAXMEMORY);
+	out = kv_printf(out,",\"lockWaits\":[");
+	for (i = 0; i < KV_WAIT_BUCKETS; i++) out = kv_printf(out,i > 0 ? ",%llu" : "%llu",(unsigned long long)waits[i]);
+	out = kv_printf(out,"],\"lockWaitTime\":%llu",(unsigned long long)waited);
+	if (SHARED != NULL) out = kv_printf(out,",\"shared\":%zu",kv_shm_memory());
+	out = kv_printf(out,",\"namespaces\":{");
+	for (i = 1; i < n; i++) {
+		if (i > 1) out = kv_cmd_append(out,",",1);
+		out = kv_cmd_append(kv_json_string(out,NAMESPACES[i].prefix),":{",2);
+		out = kv_json_counters(out,&sum[i],__atomic_load_n(&NAMESPACES[i].keys,__ATOMIC_RELAXED),__atomic_load_n(&NAMESPACES[i].used,__ATOMIC_RELAXED),NAMESPACES[i].maxmemory);
+		out = kv_cmd_append(out,"}",1);
+	}
+	if ((out = kv_cmd_append(out,"}}",2)) == NULL) return NULL;
+	if ((json = malloc(sdslen(out) + 1)) != NULL) memcpy(json,out,sdslen(out) + 1);
+	sdsfree(out);
+	return json;
+}
+
+int kv_persist(const char *snapshot, int interval, const char *aof, int fsync) {
+	pthread_condattr_t attr;
+	sds old;
+	int rc;
+
+	if (SHARDS == NULL || PERSIST_STOP != -1 || snapshot == NULL || fsync < KV_FSYNC_NO || fsync > KV_FSYNC_ALWAYS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((SNAPSHOT = strdup(snapshot)) == NULL) return -1;
+	if (aof != NULL && (AOF_PATH = strdup(aof)) == NULL) return -1;
+	FSYNC = fsync;
+	INTERVAL = interval > 0 ? interval : KV_SNAPSHOT_INTERVAL;
+	if (kv_load(SNAPSHOT,0) == -1) return -1;
+	if (AOF_PATH != NULL) {
+		if ((old = sdscatprintf(sdsempty(),"%s.old",AOF_PATH)) == NULL) return -1;
+		rc = kv_load(old,1);
+		sdsfree(old);
+		if (rc == -1 || kv_load(AOF_PATH,1) == -1) return -1;
+		if ((AOF = kv_aof_open(AOF_PATH,&AOF_SIZE)) == -1) return -1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&PERSIST_COND,&attr);
+	pthread_condattr_destroy(&attr);
+	PERSIST_STOP = 0;
+	if (pthread_create(&PERSIST,NULL,kv_persister,NULL) != 0) {
+		pthread_cond_destroy(&PERSIST_COND);
+		PERSIST_STOP = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// "unix:path", or "host:port" with an IPv6 host in brackets; an empty host listens on every address
+static int kv_socket(const char *address, int listening) {
+	struct sockaddr_un un;
+	struct addrinfo hints,*res,*ai;
+	char host[256];
+	const char *port;
+	size_t hlen;
+	int fd = -1,on = 1,rc;
+
+	if (strncmp(address,"unix:",5) == 0) {
+		if (strlen(address + 5) >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&un,0,sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path,address + 5);
+		if ((fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) == -1) return -1;
+		if (listening) unlink(un.sun_path);
+		if (listening) rc = bind(fd,(struct sockaddr *)&un,sizeof(un)) == -1 || listen(fd,SOMAXCONN) == -1;
+		else rc = connect(fd,(struct sockaddr *)&un,sizeof(un)) == -1;
+		if (rc) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	if ((port = strrchr(address,':')) == NULL || (hlen = port - address) >= sizeof(host)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (hlen >= 2 && address[0] == '[' && address[hlen - 1] == ']') {
+		memcpy(host,address + 1,hlen - 2);
+		host[hlen - 2] = '\0';
+	} else {
+		memcpy(host,address,hlen);
+		host[hlen] = '\0';
+	}
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	if (getaddrinfo(*host != '\0' ? host : NULL,port + 1,&hints,&res) != 0) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family,ai->ai_socktype | SOCK_CLOEXEC,ai->ai_protocol)) == -1) continue;
+		if (listening) {
+			setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+			if (bind(fd,ai->ai_addr,ai->ai_addrlen) == 0 && listen(fd,SOMAXCONN) == 0) break;
+		} else {
+			setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+			if (connect(fd,ai->ai_addr,ai->ai_addrlen) == 0) break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int kv_send(int fd, const char *p, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd,p,len,MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * sends the follower a copy of the store, a shard at a time. each shard is dumped under its lock and marked,
+ * so that its changes are queued from then on and the follower sees every change exactly once.
+ */
+static int kv_sync(int fd) {
+	uint64_t now,wall;
+	unsigned int i;
+	sds buf;
+	int rc = 0;
+
+	if ((buf = sdsempty()) == NULL) return -1;
+	pthread_mutex_lock(&REPL_LOCK);
+	sdsclear(REPL_QUEUE);
+	__atomic_store_n(&REPL_QUEUED,0,__ATOMIC_RELAXED);
+	REPL_FD = fd;
+	__atomic_store_n(&REPL_ACTIVE,!REPL_STOP,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&REPL_LOCK);
+	if (kv_send(fd,KV_MAGIC,KV_MAGIC_LEN) == -1) rc = -1;
+	for (i = 0; i < NSHARDS && rc == 0; i++) {
+		sdsclear(buf);
+		kv_acquire(&SHARDS[i]);
+		now = kv_now();
+		wall = kv_wall();
+		if ((buf = kv_dump_shard(&SHARDS[i],buf,now,wall,1)) != NULL) SHARDS[i].replicated = 1;
+		pthread_mutex_unlock(&SHARDS[i].lock);
+		if (buf == NULL || kv_send(fd,buf,sdslen(buf)) == -1) rc = -1;
+	}
+	sdsfree(buf);
+	return rc;
+}
+
+// sends the queued changes as they come, until the follower is dropped or replication stops
+static void kv_stream(int fd) {
+	sds out,queue;
+	int rc;
+
+	if ((out = sdsempty()) == NULL) return;
+	pthread_mutex_lock(&REPL_LOCK);
+	while (REPL_ACTIVE && !REPL_STOP) {
+		if (sdslen(REPL_QUEUE) == 0) {
+			pthread_cond_wait(&REPL_DATA,&REPL_LOCK);
+			continue;
+		}
+		queue = REPL_QUEUE;
+		REPL_QUEUE = out;
+		out = queue;
+		__atomic_store_n(&REPL_QUEUED,0,__ATOMIC_RELAXED);
+		pthread_cond_broadcast(&REPL_SPACE);
+		pthread_mutex_unlock(&REPL_LOCK);
+		rc = kv_send(fd,out,sdslen(out));
+		sdsclear(out);
+		pthread_mutex_lock(&REPL_LOCK);
+		if (rc == -1) break;
+	}
+	pthread_mutex_unlock(&REPL_LOCK);
+	sdsfree(out);
+}
+
+// stops queueing changes, for the next follower to start over with a new copy
+static void kv_unsync(void) {
+	unsigned int i;
+
+	pthread_mutex_lock(&REPL_LOCK);
+	__atomic_store_n(&REPL_ACTIVE,0,__ATOMIC_RELAXED);
+	REPL_FD = -1;
+	sdsclear(REPL_QUEUE);
+	__atomic_store_n(&REPL_QUEUED,0,__ATOMIC_RELAXED);
+	pthread_cond_broadcast(&REPL_SPACE);
+	pthread_mutex_unlock(&REPL_LOCK);
+	for (i = 0; i < NSHARDS; i++) {
+		kv_acquire(&SHARDS[i]);
+		SHARDS[i].replicated = 0;
+		pthread_mutex_unlock(&SHARDS[i].lock);
+	}
+}
+
+static void *kv_replicator(void *arg) {
+	struct timespec ts;
+	int fd;
+
+	pthread_mutex_lock(&REPL_LOCK);
+	while (!REPL_STOP) {
+		pthread_mutex_unlock(&REPL_LOCK);
+		if ((fd = kv_socket(REPL_ADDRESS,0)) >= 0) {
+			if (kv_sync(fd) == 0) kv_stream(fd);
+			kv_unsync();
+			close(fd);
+		}
+		pthread_mutex_lock(&REPL_LOCK);
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		ts.tv_sec += KV_REPL_RETRY;
+		if (!REPL_STOP) pthread_cond_timedwait(&REPL_DATA,&REPL_LOCK,&ts);
+	}
+	pthread_mutex_unlock(&REPL_LOCK);
+	return NULL;
+}
+
+// deletes every key, for a follower about to be sent a new copy of the store
+static void kv_flush(void) {
+	kv_table *t;
+	kv_entry *e;
+	unsigned int s;
+	size_t i;
+
+	for (s = 0; s < NSHARDS; s++) {
+		if (kv_pin() == -1) return;
+		t = __atomic_load_n(&SHARDS[s].table,__ATOMIC_ACQUIRE);
+		for (i = 0; t != NULL && i <= t->mask; i++) {
+			if (__atomic_load_n(&t->ctrl[i],__ATOMIC_ACQUIRE) < 0) continue;
+			if ((e = __atomic_load_n(&t->slots[i],__ATOMIC_ACQUIRE)) != NULL) kv_put(e->data,e->klen,NULL,0,KV_STRING,0,0);
+		}
+		kv_unpin();
+	}
+}
+
+/*
+ * applies what the primary sends until it goes away, sends something malformed, or connects again,
+ * in which case the old connection is given up for the new one.
+ */
+static void kv_receive(int fd) {
+	struct pollfd pfd[2];
+	char chunk[65536];
+	kv_record r;
+	uint64_t wall;
+	sds buf,grown;
+	ssize_t n,m = 0;
+	size_t off;
+	int synced = 0;
+
+	if ((buf = sdsempty()) == NULL) return;
+	pfd[0].fd = fd;
+	pfd[1].fd = FOLLOW_LISTEN;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (m == 0) {
+		if (poll(pfd,2,-1) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (pfd[1].revents != 0) break;
+		if ((n = recv(fd,chunk,sizeof(chunk),0)) == -1 && errno == EINTR) continue;
+		if (n <= 0 || (grown = sdscatlen(buf,chunk,n)) == NULL) break;
+		buf = grown;
+		if (!synced) {
+			if (sdslen(buf) < KV_MAGIC_LEN) continue;
+			if (memcmp(buf,KV_MAGIC,KV_MAGIC_LEN) != 0) break;
+			kv_flush();
+			sdsrange(buf,KV_MAGIC_LEN,-1);
+			synced = 1;
+		}
+		wall = kv_wall();
+		for (off = 0; (m = kv_decode((unsigned char *)buf + off,sdslen(buf) - off,&r)) > 0; off += m) {
+			if (r.op == KV_OP_END || kv_replay(&r,wall) == -1) break;
+		}
+		sdsrange(buf,off,-1);
+	}
+	sdsfree(buf);
+}
+
+static void *kv_follower(void *arg) {
+	int fd;
+
+	APPLYING = 1;
+	for (;;) {
+		if ((fd = accept(FOLLOW_LISTEN,NULL,NULL)) >= 0) fcntl(fd,F_SETFD,FD_CLOEXEC);
+		pthread_mutex_lock(&REPL_LOCK);
+		if (FOLLOW_STOP) {
+			pthread_mutex_unlock(&REPL_LOCK);
+			if (fd >= 0) close(fd);
+			break;
+		}
+		FOLLOW_FD = fd;
+		pthread_mutex_unlock(&REPL_LOCK);
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) sleep(KV_REPL_RETRY);
+			continue;
+		}
+		kv_receive(fd);
+		pthread_mutex_lock(&REPL_LOCK);
+		FOLLOW_FD = -1;
+		pthread_mutex_unlock(&REPL_LOCK);
+		close(fd);
+	}
+	return NULL;
+}
+
+int kv_replicate(const char *address) {
+	int rc;
+
+	if (SHARDS == NULL || REPL_STOP != -1 || address == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((REPL_ADDRESS = strdup(address)) == NULL || (REPL_QUEUE = sdsempty()) == NULL) {
+		free(REPL_ADDRESS);
+		REPL_ADDRESS = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	REPL_STOP = 0;
+	if ((rc = pthread_create(&REPL,NULL,kv_replicator,NULL)) != 0) {
+		REPL_STOP = -1;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int kv_follow(const char *address) {
+	int rc;
+
+	if (SHARDS == NULL || FOLLOW_LISTEN >= 0 || address == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((FOLLOW_LISTEN = kv_socket(address,1)) == -1) return -1;
+	FOLLOW_STOP = 0;
+	FOLLOWER = 1;
+	if ((rc = pthread_create(&FOLLOW,NULL,kv_follower,NULL)) != 0) {
+		close(FOLLOW_LISTEN);
+		FOLLOW_LISTEN = -1;
+		FOLLOWER = 0;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int kv_share(const char *prefix, const char *name, size_t size) {
+	char *copy;
+
+	if (SHARED != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	if ((copy = strdup(prefix)) == NULL) return -1;
+	if (kv_shm_open(name,size) == -1) {
+		free(copy);
+		return -1;
+	}
+	SHARED = copy;
+	SHARED_LEN = strlen(copy);
+	return 0;
+}
+
+void kv_waiters(unsigned int max) {
+	__atomic_store_n(&MAXWAITERS,max,__ATOMIC_RELAXED);
+}
+
+int kv_index(void) {
+	kv_thread *self;
+	kv_shard *shard;
+	kv_table *t;
+	kv_node *n;
+	unsigned int i;
+	size_t j;
+	int rc = 0;
+
+	if (INDEXED) return 0;
+	if ((self = kv_self()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < NSHARDS; i++) {
+		if ((SHARDS[i].index = kv_node_new(self,KV_LEVELS)) == NULL) {
+			while (i-- > 0) free(SHARDS[i].index);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	INDEXED = 1;
+	// index the keys already there
+	for (i = 0; i < NSHARDS && rc == 0; i++) {
+		shard = &SHARDS[i];
+		kv_acquire(shard);
+		for (t = shard->table, j = 0; t != NULL && j <= t->mask; j++) {
+			if (t->ctrl[j] < 0 || t->slots[j]->node != NULL) continue;
+			if ((n = kv_node_new(self,0)) == NULL) {
+				errno = ENOMEM;
+				rc = -1;
+				break;
+			}
+			kv_index_add(shard,n,t->slots[j]);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return rc;
+}
+
+typedef struct {
+	const char *key;
+	size_t klen;
+} kv_key;
+
+static int kv_key_order(const void *a, const void *b) {
+	const kv_key *x = a,*y = b;
+
+	return kv_keycmp(x->key,x->klen,y->key,y->klen);
+}
+
+long kv_scan(const char *prefix, size_t plen, const char *after, size_t alen, size_t limit, sds *buf, size_t *lens) {
+	kv_shard *shard;
+	kv_node *n;
+	kv_entry *e;
+	kv_key *keys = NULL,*grown;
+	sds found,out;
+	size_t count = 0,size = 0,i,taken,offset;
+	uint64_t now;
+	unsigned int s;
+
+	if (!INDEXED) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (limit == 0) return 0;
+	if (after != NULL && kv_keycmp(after,alen,prefix,plen) < 0) after = NULL;
+	if ((found = sdsempty()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	// up to limit candidates from each shard, their lengths in keys[] until the buffer stops moving
+	for (s = 0; s < NSHARDS && found != NULL; s++) {
+		shard = &SHARDS[s];
+		now = kv_now();
+		kv_acquire(shard);
+		n = after != NULL ? kv_seek(shard->index,after,alen,NULL) : kv_seek(shard->index,prefix,plen,NULL);
+		for (taken = 0; n != NULL && taken < limit && found != NULL; n = n->next[0]) {
+			e = n->entry;
+			if (e->klen < plen || memcmp(e->data,prefix,plen) != 0) break;
+			if ((after != NULL && kv_keycmp(e->data,e->klen,after,alen) == 0) || kv_expired(e,now)) continue;
+			if (count == size) {
+				size = size ? size * 2 : 64;
+				if ((grown = realloc(keys,size * sizeof(kv_key))) == NULL) {
+					sdsfree(found);
+					found = NULL;
+					break;
+				}
+				keys = grown;
+			}
+			keys[count].klen = e->klen;
+			count++;
+			taken++;
+			found = sdscatlen(found,e->data,e->klen);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	if (found == NULL) {
+		free(keys);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0, offset = 0; i < count; offset += keys[i].klen, i++) keys[i].key = found + offset;
+	qsort(keys,count,sizeof(kv_key),kv_key_order);
+	if (count > limit) count = limit;
+
+	out = *buf;
+	sdsclear(out);
+	for (i = 0; i < count && out != NULL; i++) {
+		out = sdscatlen(out,keys[i].key,keys[i].klen);
+		lens[i] = keys[i].klen;
+	}
+	free(keys);
+	sdsfree(found);
+	if (out == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*buf = out;
+	return count;
+}
+
+long kv_count(const char *prefix, size_t plen) {
+	kv_shard *shard;
+	kv_node *n;
+	kv_entry *e;
+	uint64_t now;
+	unsigned int s;
+	long count = 0;
+
+	if (!INDEXED) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	for (s = 0; s < NSHARDS; s++) {
+		shard = &SHARDS[s];
+		now = kv_now();
+		kv_acquire(shard);
+		for (n = kv_seek(shard->index,prefix,plen,NULL); n != NULL; n = n->next[0]) {
+			e = n->entry;
+			if (e->klen < plen || memcmp(e->data,prefix,plen) != 0) break;
+			if (!kv_expired(e,now)) count++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return count;
+}
+
+// values given by reference can't be sent to another peer, but keys can be deleted there
+int kv_store(const char *key, size_t klen, void *value, void (*ffn)(void *), int64_t ttl, int nx) {
+	int peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		if (value == NULL) return kv_remote_put(peer,key,klen,NULL,0,KV_STRING,ttl,nx);
+		errno = EINVAL;
+		return -1;
+	}
+	return kv_update(key,klen,NULL,0,KV_STRING,value,ffn,ttl,nx);
+}
+
+int kv_put(const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx) {
+	void *c;
+	int rc,peer;
+
+	if (type < KV_STRING || type > KV_HLL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_put(peer,key,klen,value,vlen,type,ttl,nx);
+	if (type < KV_LIST || value == NULL) return kv_update(key,klen,value,vlen,type,NULL,NULL,ttl,nx);
+	if ((c = kv_type_decode(type,value,vlen)) == NULL) return -1;
+	if ((rc = kv_update(key,klen,NULL,0,type,c,kv_type_free(type),ttl,nx)) != 1) kv_type_free(type)(c);
+	return rc;
+}
+
+// must be called pinned; the entry stays valid until kv_unpin
+static kv_entry *kv_lookup(const char *key, size_t klen) {
+	kv_entry *e;
+	uint64_t hash;
+
+	hash = kv_hash(key,klen);
+	e = kv_find(__atomic_load_n(&SHARDS[hash & (NSHARDS - 1)].table,__ATOMIC_ACQUIRE),hash,key,klen,NULL);
+	if (e == NULL || kv_expired(e,kv_now())) return NULL;
+	kv_hit(SELF,e);
+	return e;
+}
+
+// counts a read of key as a hit on its entry e, or a miss if e is NULL
+static void kv_tally_read(kv_thread *self, const char *key, size_t klen, kv_entry *e) {
+	if (self == NULL) return;
+	if (e != NULL) kv_tally(&self->counters[e->ns].hits,1);
+	else kv_tally(&self->counters[kv_namespace_of(key,klen)].misses,1);
+}
+
+// kv_lookup for readers, counted
+static kv_entry *kv_read(const char *key, size_t klen) {
+	kv_entry *e = kv_lookup(key,klen);
+
+	kv_tally_read(SELF,key,klen,e);
+	return e;
+}
+
+// locks the shard of key, leaving its live entry, or NULL, in *e, which with hit counts as an access
+static kv_shard *kv_lock(const char *key, size_t klen, kv_entry **e, int hit) {
+	kv_shard *shard;
+	kv_thread *self;
+	uint64_t hash;
+
+	hash = kv_hash(key,klen);
+	shard = &SHARDS[hash & (NSHARDS - 1)];
+	kv_acquire(shard);
+	*e = kv_find(shard->table,hash,key,klen,NULL);
+	if (*e != NULL && kv_expired(*e,kv_now())) *e = NULL;
+	if (hit && (self = kv_self()) != NULL) {
+		if (*e != NULL) kv_hit(self,*e);
+		kv_tally_read(self,key,klen,*e);
+	}
+	return shard;
+}
+
+// collections change in place, so they are copied under the shard lock, by which time key may hold something else
+static sds kv_copy_locked(const char *key, size_t klen, sds buf, int *type) {
+	kv_shard *shard;
+	kv_entry *e;
+	sds copy = NULL,value = NULL;
+
+	shard = kv_lock(key,klen,&e,0);
+	if (e != NULL && e->type >= KV_LIST) {
+		if ((value = sdsempty()) != NULL) value = kv_type_encode(e->type,e->value,value);
+		if (value != NULL) copy = sdscatlen(buf,value,sdslen(value));
+	} else if (e != NULL) {
+		copy = sdscatlen(buf,e->value,kv_length(e));
+	}
+	if (e != NULL && copy == NULL) errno = ENOMEM;
+	if (e != NULL && type != NULL) *type = e->type;
+	pthread_mutex_unlock(&shard->lock);
+	sdsfree(value);
+	return copy;
+}
+
+sds kv_copy(const char *key, size_t klen, sds buf, int *type) {
+	kv_entry *e;
+	sds copy = NULL;
+	int peer;
+
+	if (kv_shared(key,klen)) return kv_shm_copy(kv_hash(key,klen),key,klen,buf,type,NULL);
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		kv_remote_value(peer,kv_peer_req(KV_PEER_GET,KV_STRING,key,klen),buf,&copy,type);
+		return copy;
+	}
+	if (kv_pin() == -1) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((e = kv_read(key,klen)) != NULL) {
+		sdsclear(buf);
+		if (e->type >= KV_LIST) copy = kv_copy_locked(key,klen,buf,type);
+		else if ((copy = sdscatlen(buf,e->value,kv_length(e))) == NULL) errno = ENOMEM;
+		if (e->type < KV_LIST && type != NULL) *type = e->type;
+	}
+	kv_unpin();
+	return copy;
+}
+
+int64_t kv_expires(const char *key, size_t klen) {
+	kv_entry *e;
+	uint64_t now,expires;
+	int64_t ttl = 0;
+
+	if (kv_shared(key,klen)) return kv_shm_expires(kv_hash(key,klen),key,klen);
+	if (kv_owner(key,klen) >= 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (kv_pin() == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	now = kv_now();
+	if ((e = kv_lookup(key,klen)) != NULL && (expires = __atomic_load_n(&e->expires,__ATOMIC_RELAXED)) > now) ttl = expires - now;
+	kv_unpin();
+	return ttl;
+}
+
+/*
+ * read-modify-write. fn computes the new value of key into *value from its live entry, NULL if there is none,
+ * and returns 1 to store it, 2 to delete the key, 0 to leave it alone, or -1 with errno set.
+ * fn runs under the shard lock, and what it returns is stored before the lock is released.
+ */
+typedef int (*kv_modifier)(kv_entry *e, sds *value, int *type, void *arg);
+
+/*
+ * the same for a shared key, which has no lock of ours: fn sees its value in a private copy, and the write
+ * only succeeds if the key's version is still the one read, or fn runs again.
+ */
+static int kv_modify_shared(const char *key, size_t klen, kv_modifier fn, void *arg) {
+	kv_entry *e;
+	uint64_t hash,version;
+	sds value,old,found;
+	int rc,type;
+
+	hash = kv_hash(key,klen);
+	value = sdsempty();
+	if ((old = sdsempty()) == NULL || value == NULL) {
+		sdsfree(value);
+		sdsfree(old);
+		errno = ENOMEM;
+		return -1;
+	}
+	do {
+		errno = 0;
+		e = NULL;
+		type = KV_STRING;
+		if ((found = kv_shm_copy(hash,key,klen,old,&type,&version)) != NULL) {
+			old = found;
+			e = kv_entry_new(hash,key,klen,old,sdslen(old),type,NULL,NULL);
+		}
+		if ((found == NULL && errno == ENOMEM) || (found != NULL && e == NULL)) {
+			errno = ENOMEM;
+			rc = -1;
+			break;
+		}
+		sdsclear(value);
+		rc = fn(e,&value,&type,arg);
+		free(e);
+		if (rc == 1) rc = kv_shm_put(hash,key,klen,value,sdslen(value),type,0,0,&version);
+		else if (rc == 2) rc = kv_shm_put(hash,key,klen,NULL,0,KV_STRING,0,0,&version);
+	} while (rc == -1 && errno == EAGAIN);
+	sdsfree(value);
+	sdsfree(old);
+	return rc;
+}
+
+/*
+ * evicting takes the locks of other shards, so it can't be done under the lock: if the new value doesn't fit,
+ * the lock is released, room made for it, and fn run again, which only happens while the store is full.
+ */
+static int kv_modify(const char *key, size_t klen, kv_modifier fn, void *arg) {
+	kv_shard *shard;
+	kv_thread *self;
+	kv_entry *e;
+	kv_op op;
+	sds value;
+	size_t need = 0;
+	int rc,type;
+
+	if (kv_readonly()) return -1;
+	if (kv_shared(key,klen)) return kv_modify_shared(key,klen,fn,arg);
+	kv_throttle();
+	if ((self = kv_self()) == NULL || kv_reserve(self,2) == -1 || (value = sdsempty()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	kv_op_init(&op,key,klen);
+	if (INDEXED && (op.node = kv_node_new(self,0)) == NULL) {
+		sdsfree(value);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (;;) {
+		if (need > 0 && kv_make_room(self,kv_namespace_of(key,klen),need) == -1) {
+			errno = ENOMEM;
+			rc = -1;
+			break;
+		}
+		shard = kv_lock(key,klen,&e,0);
+		if (e != NULL) kv_hit(self,e);
+		type = e != NULL ? e->type : KV_STRING;
+		sdsclear(value);
+		if ((rc = fn(e,&value,&type,arg)) == 1 && (op.e = kv_entry_new(op.hash,key,klen,value,sdslen(value),type,NULL,NULL)) == NULL) rc = -1;
+		if (rc == 1 && need == 0 && kv_over(op.e->ns,kv_size(op.e))) {
+			pthread_mutex_unlock(&shard->lock);
+			need = kv_size(op.e);
+			free(op.e);
+			op.e = NULL;
+			continue;
+		}
+		if (rc == 1 || rc == 2) rc = kv_apply(shard,&op,0,0,kv_now());
+		pthread_mutex_unlock(&shard->lock);
+		break;
+	}
+	kv_done(self,&op,rc);
+	sdsfree(value);
+	return rc;
+}
+
+// reads an integer, in decimal or as a CBOR integer
+static int kv_integer(kv_entry *e, int64_t *n) {
+	const unsigned char *p = (const unsigned char *)e->value;
+	size_t len,i,bytes;
+	uint64_t u = 0;
+	char digits[24],*end;
+
+	if (e->type > KV_CBOR) return -1;
+	len = kv_length(e);
+	if (e->type == KV_STRING) {
+		if (len == 0 || len >= sizeof(digits)) return -1;
+		memcpy(digits,p,len);
+		digits[len] = '\0';
+		errno = 0;
+		*n = strtoll(digits,&end,10);
+		// strtoll would also take leading whitespace and a plus sign
+		if (digits[0] != '-' && (digits[0] < '0' || digits[0] > '9')) return -1;
+		return *end != '\0' || errno != 0 ? -1 : 0;
+	}
+	if (e->type != KV_CBOR || len == 0 || (p[0] >> 5) > 1) return -1;
+	if ((p[0] & 0x1f) < 24) {
+		bytes = 0;
+		u = p[0] & 0x1f;
+	} else if ((p[0] & 0x1f) <= 27) {
+		bytes = 1 << ((p[0] & 0x1f) - 24);
+	} else {
+		return -1;
+	}
+	if (len != bytes + 1) return -1;
+	for (i = 1; i <= bytes; i++) u = u << 8 | p[i];
+	if (u > INT64_MAX) return -1;
+	*n = (p[0] >> 5) ? -1 - (int64_t)u : (int64_t)u;
+	return 0;
+}
+
+static sds kv_cbor_integer(sds s, int64_t n) {
+	unsigned char head[9];
+	uint64_t u = n < 0 ? (uint64_t)(-1 - n) : (uint64_t)n;
+	int i,bytes;
+
+	head[0] = n < 0 ? 0x20 : 0;
+	if (u < 24) {
+		head[0] |= u;
+		return sdscatlen(s,head,1);
+	}
+	bytes = u <= 0xff ? 1 : u <= 0xffff ? 2 : u <= 0xffffffffULL ? 4 : 8;
+	head[0] |= bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27;
+	for (i = bytes; i > 0; i--, u >>= 8) head[i] = u & 0xff;
+	return sdscatlen(s,head,bytes + 1);
+}
+
+typedef struct {
+	int64_t delta;
+	int64_t result;
+} kv_add_arg;
+
+static int kv_add_fn(kv_entry *e, sds *value, int *type, void *arg) {
+	kv_add_arg *a = arg;
+	int64_t n = 0;
+
+	if (e != NULL && kv_integer(e,&n) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__builtin_add_overflow(n,a->delta,&a->result)) {
+		errno = ERANGE;
+		return -1;
+	}
+	*value = *type == KV_CBOR ? kv_cbor_integer(*value,a->result) : sdscatprintf(*value,"%lld",(long long)a->result);
+	if (*value == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 1;
+}
+
+int kv_add(const char *key, size_t klen, int64_t delta, int64_t *result) {
+	kv_add_arg arg = { delta, 0 };
+	uint64_t n;
+	int rc,peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		if ((rc = kv_remote_number(peer,kv_cmd_number(kv_peer_req(KV_PEER_ADD,KV_STRING,key,klen),delta),&n)) == 1 && result != NULL) *result = n;
+		return rc;
+	}
+	if ((rc = kv_modify(key,klen,kv_add_fn,&arg)) == 1 && result != NULL) *result = arg.result;
+	return rc;
+}
+
+typedef struct {
+	const char *value;
+	size_t vlen;
+	int type;
+	size_t length;
+} kv_concat_arg;
+
+static int kv_concat_fn(kv_entry *e, sds *value, int *type, void *arg) {
+	kv_concat_arg *a = arg;
+
+	if (e != NULL && e->type >= KV_CBOR) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (e == NULL) *type = a->type;
+	if (e != NULL) *value = sdscatlen(*value,e->value,kv_length(e));
+	if (*value != NULL) *value = sdscatlen(*value,a->value,a->vlen);
+	if (*value == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	a->length = sdslen(*value);
+	return 1;
+}
+
+int kv_concat(const char *key, size_t klen, const char *value, size_t vlen, int type, size_t *length) {
+	kv_concat_arg arg = { value, vlen, type, 0 };
+	uint64_t n;
+	int rc,peer;
+
+	if (type != KV_STRING && type != KV_BUFFER) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		if ((rc = kv_remote_number(peer,kv_cmd_arg(kv_peer_req(KV_PEER_CONCAT,type,key,klen),value,vlen),&n)) == 1 && length != NULL) *length = n;
+		return rc;
+	}
+	if ((rc = kv_modify(key,klen,kv_concat_fn,&arg)) == 1 && length != NULL) *length = arg.length;
+	return rc;
+}
+
+typedef struct {
+	const char *expected;
+	size_t elen;
+	int etype;
+	const char *value;
+	size_t vlen;
+	int type;
+	sds *old; // for kv_exchange
+	int otype;
+	int found;
+} kv_swap_arg;
+
+static int kv_swap_fn(kv_entry *e, sds *value, int *type, void *arg) {
+	kv_swap_arg *a = arg;
+
+	if (e != NULL && e->type >= KV_LIST) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (a->old != NULL) {
+		// kv_exchange: always swaps, keeping what was there
+		if ((a->found = e != NULL)) {
+			sdsclear(*a->old);
+			if ((*a->old = sdscatlen(*a->old,e->value,kv_length(e))) == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			a->otype = e->type;
+		}
+	} else if (a->expected == NULL ? e != NULL : e == NULL || e->type != a->etype || kv_length(e) != a->elen || memcmp(e->value,a->expected,a->elen) != 0) {
+		return 0;
+	}
+	if (a->value == NULL) return e != NULL ? 2 : 0;
+	*type = a->type;
+	if ((*value = sdscatlen(*value,a->value,a->vlen)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 1;
+}
+
+int kv_swap(const char *key, size_t klen, const char *expected, size_t elen, int etype, const char *value, size_t vlen, int type) {
+	kv_swap_arg arg = { expected, elen, etype, value, vlen, type, NULL, 0, 0 };
+	sds body;
+	int peer;
+
+	if (type < KV_STRING || type > KV_CBOR) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		body = kv_cmd_number(kv_peer_req(KV_PEER_SWAP,type,key,klen),(expected != NULL) | (value != NULL) << 1);
+		body = kv_cmd_arg(kv_cmd_number(kv_cmd_arg(body,expected,elen),etype),value,vlen);
+		return kv_remote_rc(peer,body);
+	}
+	return kv_modify(key,klen,kv_swap_fn,&arg);
+}
+
+int kv_exchange(const char *key, size_t klen, const char *value, size_t vlen, int type, sds *old, int *otype) {
+	kv_swap_arg arg = { NULL, 0, 0, value, vlen, type, old, KV_STRING, 0 };
+	sds found;
+	long rc;
+	int peer;
+
+	if (type < KV_STRING || type > KV_CBOR) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		rc = kv_remote_value(peer,kv_cmd_arg(kv_cmd_number(kv_peer_req(KV_PEER_EXCHANGE,type,key,klen),value != NULL),value,vlen),*old,&found,otype);
+		if (found != NULL) *old = found;
+		return rc;
+	}
+	if (kv_modify(key,klen,kv_swap_fn,&arg) == -1) return -1;
+	if (otype != NULL) *otype = arg.otype;
+	return arg.found;
+}
+
+// changes the expiry of a live entry in place, as its value stays the same
+int kv_refresh(const char *key, size_t klen, int64_t ttl) {
+	kv_shard *shard;
+	kv_entry *e;
+	uint64_t hash,now,expires;
+	int rc = 1,peer;
+
+	if (kv_readonly()) return -1;
+	hash = kv_hash(key,klen);
+	if (kv_shared(key,klen)) return kv_shm_refresh(hash,key,klen,ttl);
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_rc(peer,kv_cmd_number(kv_peer_req(KV_PEER_REFRESH,KV_STRING,key,klen),ttl));
+	kv_throttle();
+	shard = &SHARDS[hash & (NSHARDS - 1)];
+	if (ttl > (int64_t)KV_WHEEL_SPAN * 1024) ttl = KV_WHEEL_SPAN * 1024;
+	now = kv_now();
+
+	kv_acquire(shard);
+	e = kv_find(shard->table,hash,key,klen,NULL);
+	if (e == NULL || kv_expired(e,now)) {
+		rc = 0;
+	} else if (ttl != 0) {
+		expires = e->expires;
+		__atomic_store_n(&e->expires,ttl > 0 ? now + ttl : 0,__ATOMIC_RELAXED);
+		if (ttl > 0 && kv_wheel_for(shard) == NULL) {
+			errno = ENOMEM;
+			rc = -1;
+		} else if (kv_log(key,klen,e) == -1) {
+			rc = -1;
+		}
+		if (rc == -1) {
+			__atomic_store_n(&e->expires,expires,__ATOMIC_RELAXED);
+		} else {
+			if (expires != 0) {
+				kv_wheel_del(shard->wheel,e);
+				__atomic_fetch_sub(&TIMED,1,__ATOMIC_RELAXED);
+			}
+			if (ttl > 0) kv_timed(shard,e,now);
+			__atomic_store_n(&shard->changes,shard->changes + 1,__ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return rc;
+}
+
+// shared keys are set one at a time, as they come
+long kv_mput(const kv_item *items, size_t n, int64_t ttl) {
+	kv_op *ops;
+	int *owners = NULL;
+	size_t i,m = 0;
+	long rc,shared = 0,remote = 0;
+
+	if (n == 0) return 0;
+	if (kv_readonly()) return -1;
+	if ((ops = malloc(n * sizeof(kv_op))) == NULL) return -1;
+	if (NPEERS > 0 && (owners = malloc(n * sizeof(int))) == NULL) {
+		free(ops);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		rc = 0;
+		if (owners != NULL) owners[i] = -1;
+		if (items[i].value != NULL && (items[i].type < KV_STRING || items[i].type > KV_CBOR)) {
+			errno = EINVAL;
+			rc = -1;
+		} else if (owners != NULL && (owners[i] = kv_owner(items[i].key,items[i].klen)) >= 0) {
+			remote++;
+		} else if (kv_shared(items[i].key,items[i].klen)) {
+			if ((rc = kv_update(items[i].key,items[i].klen,items[i].value,items[i].vlen,items[i].type,NULL,NULL,ttl,0)) == 1) shared++;
+		} else {
+			kv_op_init(&ops[m],items[i].key,items[i].klen);
+			if (items[i].value != NULL && (ops[m].e = kv_entry_new(ops[m].hash,items[i].key,items[i].klen,items[i].value,items[i].vlen,items[i].type,NULL,NULL)) == NULL) rc = -1;
+			m++;
+		}
+		if (rc == -1) {
+			while (m-- > 0) free(ops[m].e);
+			free(ops);
+			free(owners);
+			return -1;
+		}
+	}
+	rc = m > 0 ? kv_batch(ops,m,ttl) : 0;
+	free(ops);
+	if (rc != -1 && remote > 0) {
+		remote = 0;
+		if (kv_remote_batch(owners,items,n,ttl,NULL,NULL,&remote) == -1) rc = -1;
+	}
+	free(owners);
+	return rc == -1 ? -1 : rc + shared + remote;
+}
+
+// lookups don't lock, so this only saves pinning for every key; keys of other peers are fetched together after
+int kv_mcopy(kv_item *items, size_t n, sds *values) {
+	kv_entry *e = NULL;
+	sds value;
+	size_t i;
+	int shared,*owners = NULL,remote = 0,rc,err;
+
+	if (NPEERS > 0 && (owners = malloc(2 * n * sizeof(int))) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (kv_pin() == -1) {
+		free(owners);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < n; i++) values[i] = NULL;
+	for (i = 0; i < n; i++) {
+		if (owners != NULL && (owners[i] = kv_owner(items[i].key,items[i].klen)) >= 0) {
+			remote = 1;
+			continue;
+		}
+		if (!(shared = kv_shared(items[i].key,items[i].klen)) && (e = kv_read(items[i].key,items[i].klen)) == NULL) continue;
+		if (!shared) items[i].type = e->type;
+		if (shared || e->type >= KV_LIST) {
+			if ((value = sdsempty()) == NULL) break;
+			errno = 0;
+			if (shared) values[i] = kv_shm_copy(kv_hash(items[i].key,items[i].klen),items[i].key,items[i].klen,value,&items[i].type,NULL);
+			else values[i] = kv_copy_locked(items[i].key,items[i].klen,value,&items[i].type);
+			if (values[i] == NULL) sdsfree(value);
+			if (values[i] == NULL && errno == ENOMEM) break;
+		} else if ((values[i] = sdsnewlen(e->value,kv_length(e))) == NULL) {
+			break;
+		}
+	}
+	kv_unpin();
+	rc = i == n ? 0 : -1;
+	err = ENOMEM;
+	if (rc == 0 && remote && (rc = kv_remote_batch(owners,items,n,0,values,owners + n,NULL)) == -1) err = errno;
+	for (i = 0; rc == 0 && remote && i < n; i++) {
+		if (values[i] != NULL && owners[i] >= 0) items[i].type = owners[n + i];
+	}
+	free(owners);
+	if (rc == 0) return 0;
+	// local copies and whatever peers sent before the failure
+	for (i = 0; i < n; i++) {
+		sdsfree(values[i]);
+		values[i] = NULL;
+	}
+	errno = err;
+	return -1;
+}
+
+// the type of collection a command applies to
+static int kv_command_type(int cmd) {
+	switch (cmd) {
+	case KV_CMD_LPUSH: case KV_CMD_RPUSH: case KV_CMD_LPOP: case KV_CMD_RPOP:
+		return KV_LIST;
+	case KV_CMD_HSET: case KV_CMD_HDEL:
+		return KV_HASH;
+	case KV_CMD_ZADD: case KV_CMD_ZREM:
+		return KV_ZSET;
+	case KV_CMD_PFADD:
+		return KV_HLL;
+	}
+	return -1;
+}
+
+static uint64_t kv_get64(const unsigned char *p) {
+	uint64_t n = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--) n = n << 8 | p[i];
+	return n;
+}
+
+// the next argument of a command, or -1 if there are no more
+static int kv_arg(const unsigned char **p, const unsigned char *end, const char **arg, size_t *len) {
+	uint64_t n;
+	size_t m;
+
+	if (*p >= end || (m = kv_get_varint(*p,end - *p,&n)) == 0 || n > (uint64_t)(end - *p) - m) return -1;
+	*arg = (const char *)*p + m;
+	*len = n;
+	*p += m + n;
+	return 0;
+}
+
+/*
+ * applies cmd to the collection c, of the type it applies to, leaving values it pops in *out unless out is NULL.
+ * returns the command's result, or -1 with errno set to ENOMEM, in which case the arguments before the failure stand.
+ */
+static long kv_exec(kv_thread *self, void *c, const unsigned char *cmd, size_t len, sds **out) {
+	const unsigned char *p = cmd + 1,*end = cmd + len;
+	const char *arg,*value;
+	size_t alen,vlen,count,i;
+	uint64_t bits,h;
+	double score;
+	long rc = 0;
+	int r;
+	sds s;
+
+	switch (cmd[0]) {
+	case KV_CMD_LPUSH:
+	case KV_CMD_RPUSH:
+		while (kv_arg(&p,end,&arg,&alen) == 0) {
+			if (kv_list_push(c,cmd[0] == KV_CMD_LPUSH,arg,alen) == -1) goto nomem;
+		}
+		return ((kv_list *)c)->count;
+	case KV_CMD_LPOP:
+	case KV_CMD_RPOP:
+		if (kv_arg(&p,end,&arg,&alen) == -1 || alen != 8) return 0;
+		if ((count = kv_get64((const unsigned char *)arg)) > ((kv_list *)c)->count) count = ((kv_list *)c)->count;
+		if (out != NULL && count > 0 && (*out = malloc(count * sizeof(sds))) == NULL) goto nomem;
+		for (i = 0; i < count; i++) {
+			s = kv_list_pop(c,cmd[0] == KV_CMD_LPOP);
+			if (out != NULL) (*out)[i] = s;
+			else sdsfree(s);
+		}
+		return count;
+	case KV_CMD_HSET:
+		while (kv_arg(&p,end,&arg,&alen) == 0 && kv_arg(&p,end,&value,&vlen) == 0) {
+			if ((r = kv_dict_set(c,arg,alen,value,vlen)) == -1) goto nomem;
+			rc += r;
+		}
+		return rc;
+	case KV_CMD_HDEL:
+		while (kv_arg(&p,end,&arg,&alen) == 0) rc += kv_dict_del(c,arg,alen);
+		return rc;
+	case KV_CMD_ZADD:
+		while (kv_arg(&p,end,&arg,&alen) == 0 && kv_arg(&p,end,&value,&vlen) == 0 && vlen == 8) {
+			bits = kv_get64((const unsigned char *)value);
+			memcpy(&score,&bits,sizeof(score));
+			if ((r = kv_zset_add(c,arg,alen,score,kv_random(self))) == -1) goto nomem;
+			rc += r;
+		}
+		return rc;
+	case KV_CMD_ZREM:
+		while (kv_arg(&p,end,&arg,&alen) == 0) rc += kv_zset_del(c,arg,alen);
+		return rc;
+	case KV_CMD_PFADD:
+		while (kv_arg(&p,end,&arg,&alen) == 0) {
+			// kv_hash only mixes enough for a table; registers take both its low and its high bits
+			h = kv_hash(arg,alen);
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			rc |= kv_hll_add(c,h);
+		}
+		return rc;
+	}
+nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * runs a command on the collection of the given type at key, under the shard lock: creating the collection if
+ * the command adds to it, and deleting key once it is empty. the command is logged rather than its effect.
+ * returns the command's result, 0 if there is no such collection, or -1 with errno set, EINVAL if key holds another type.
+ */
+static long kv_command(const char *key, size_t klen, int type, const unsigned char *cmd, size_t len, sds **out) {
+	kv_shard *shard;
+	kv_thread *self;
+	kv_entry *e,*gone = NULL;
+	kv_op op;
+	void *c;
+	size_t before,i;
+	uint64_t now;
+	long rc = 0;
+	int adds,applied = 0;
+
+	if (len == 0 || kv_command_type(cmd[0]) != type) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kv_readonly()) return -1;
+	if (kv_shared(key,klen)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if ((self = kv_self()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	kv_throttle();
+	adds = cmd[0] != KV_CMD_LPOP && cmd[0] != KV_CMD_RPOP && cmd[0] != KV_CMD_HDEL && cmd[0] != KV_CMD_ZREM;
+	kv_op_init(&op,key,klen);
+	op.quiet = 1;
+	shard = &SHARDS[op.hash & (NSHARDS - 1)];
+	if (adds) {
+		if ((c = kv_type_new(type)) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if ((op.e = kv_entry_new(op.hash,key,klen,NULL,0,type,c,kv_type_free(type))) == NULL) {
+			kv_type_free(type)(c);
+			return -1;
+		}
+	}
+	if ((adds && kv_make_room(self,op.e->ns,kv_size(op.e) + len) == -1) || kv_reserve(self,3) == -1 ||
+		(adds && INDEXED && (op.node = kv_node_new(self,0)) == NULL)) {
+		if (op.e != NULL) kv_entry_free(op.e);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	kv_acquire(shard);
+	now = kv_now();
+	if ((e = kv_find(shard->table,op.hash,key,klen,NULL)) != NULL && kv_expired(e,now)) e = NULL;
+	if (e != NULL && e->type != type) {
+		errno = EINVAL;
+		rc = -1;
+	} else if (e == NULL && !adds) {
+		rc = 0;
+	} else if (e == NULL && kv_apply(shard,&op,-1,0,now) != 1) {
+		rc = -1;
+	} else {
+		if (e == NULL) {
+			e = op.e;
+			applied = 1;
+		}
+		if ((rc = kv_append_record(KV_OP_CMD,type,key,klen,cmd,len,0)) == 0) {
+			before = kv_size(e);
+			rc = kv_exec(self,e->value,cmd,len,out);
+			kv_recharge(e,before);
+			__atomic_store_n(&shard->changes,shard->changes + 1,__ATOMIC_RELAXED);
+			kv_wake(shard,op.hash,key,klen);
+		}
+		if (kv_type_count(type,e->value) == 0) {
+			kv_find(shard->table,op.hash,key,klen,&i);
+			kv_untimed(shard,e);
+			kv_index_del(shard,e);
+			kv_erase(shard->table,i);
+			kv_discharge(e);
+			gone = e;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (!applied && op.e != NULL) {
+		kv_entry_free(op.e);
+		op.e = NULL;
+	}
+	kv_done(self,&op,applied);
+	if (gone != NULL) kv_retire(self,gone,kv_entry_free);
+	return rc;
+}
+
+// the writers free cmd on failure
+static sds kv_cmd_append(sds cmd, const void *p, size_t len) {
+	sds s;
+
+	if (cmd != NULL && (s = sdscatlen(cmd,p,len)) != NULL) return s;
+	sdsfree(cmd);
+	return NULL;
+}
+
+static sds kv_cmd_arg(sds cmd, const char *arg, size_t len) {
+	unsigned char hdr[10];
+
+	if ((cmd = kv_cmd_append(cmd,hdr,kv_varint(hdr,len))) == NULL) return NULL;
+	return kv_cmd_append(cmd,arg,len);
+}
+
+static sds kv_cmd_number(sds cmd, uint64_t n) {
+	unsigned char b[8];
+	int i;
+
+	for (i = 0; i < 8; i++) b[i] = n >> (8 * i);
+	return kv_cmd_arg(cmd,(const char *)b,8);
+}
+
+static sds kv_cmd_args(sds cmd, const char **args, const size_t *lens, size_t n) {
+	size_t i;
+
+	for (i = 0; cmd != NULL && i < n; i++) cmd = kv_cmd_arg(cmd,args[i],lens[i]);
+	return cmd;
+}
+
+static long kv_run(const char *key, size_t klen, int type, sds cmd, sds **out) {
+	long rc;
+	int peer;
+
+	if (cmd == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if ((peer = kv_owner(key,klen)) >= 0) rc = kv_remote_values(peer,kv_cmd_arg(kv_peer_req(KV_PEER_CMD,type,key,klen),cmd,sdslen(cmd)),out);
+	else rc = kv_command(key,klen,type,(const unsigned char *)cmd,sdslen(cmd),out);
+	sdsfree(cmd);
+	return rc;
+}
+
+static sds kv_cmd(int cmd) {
+	unsigned char c = cmd;
+
+	return sdsnewlen(&c,1);
+}
+
+// Lamping and Veach's jump consistent hash: a peer added at the end of the list only takes keys from the others
+static unsigned int kv_jump(uint64_t h, unsigned int buckets) {
+	int64_t b = -1,j = 0;
+
+	while (j < buckets) {
+		b = j;
+		h = h * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((h >> 33) + 1));
+	}
+	return b;
+}
+
+// the peer key belongs to, or -1 if it is kept here; shared keys always are
+static int kv_owner(const char *key, size_t klen) {
+	unsigned int peer;
+
+	if (NPEERS == 0 || SERVING || APPLYING || kv_shared(key,klen)) return -1;
+	peer = kv_jump(kv_hash(key,klen),NPEERS);
+	return peer == SELF_PEER ? -1 : (int)peer;
+}
+
+static int kv_arg64(const unsigned char **p, const unsigned char *end, uint64_t *n) {
+	const char *arg;
+	size_t len;
+
+	if (kv_arg(p,end,&arg,&len) == -1 || len != 8) return -1;
+	*n = kv_get64((const unsigned char *)arg);
+	return 0;
+}
+
+// the length of the frame at p, or 0 if it hasn't all arrived yet, or -1 if it is malformed
+static ssize_t kv_frame(const unsigned char *p, size_t len) {
+	uint64_t n;
+	size_t m;
+
+	if ((m = kv_get_varint(p,len,&n)) == 0) return len >= 10 ? -1 : 0;
+	if (n > UINT32_MAX + 64ULL) return -1;
+	return len - m < n ? 0 : (ssize_t)(m + n);
+}
+
+// adds body to the requests or replies in out as a frame, freeing it
+static sds kv_frame_add(sds out, sds body) {
+	if (body == NULL) {
+		sdsfree(out);
+		return NULL;
+	}
+	out = kv_cmd_arg(out,body,sdslen(body));
+	sdsfree(body);
+	return out;
+}
+
+// a request: the op, the type, and the key, followed by the op's arguments
+static sds kv_peer_req(int op, int type, const char *key, size_t klen) {
+	unsigned char hdr[2];
+
+	hdr[0] = op;
+	hdr[1] = type;
+	return kv_cmd_arg(sdsnewlen(hdr,2),key,klen);
+}
+
+// a reply: rc, and the type of the value, or errno when rc is -1, followed by any values
+static sds kv_reply_new(long rc, uint64_t aux) {
+	return kv_cmd_number(kv_cmd_number(sdsempty(),rc),aux);
+}
+
+typedef struct {
+	int64_t rc;
+	uint64_t aux;
+	const unsigned char *p; // the values, read with kv_arg
+	const unsigned char *end;
+} kv_reply;
+
+static int kv_reply_parse(const unsigned char **p, const unsigned char *end, kv_reply *r) {
+	const char *body;
+	size_t len;
+	uint64_t rc;
+
+	if (kv_arg(p,end,&body,&len) == -1) return -1;
+	r->p = (const unsigned char *)body;
+	r->end = r->p + len;
+	if (kv_arg64(&r->p,r->end,&rc) == -1 || kv_arg64(&r->p,r->end,&r->aux) == -1) return -1;
+	r->rc = (int64_t)rc;
+	return 0;
+}
+
+// this thread's connection to peer, connecting if there is none
+static int kv_peer_fd(kv_thread *self, unsigned int peer) {
+	struct timeval tv = { KV_PEER_TIMEOUT / 1000, KV_PEER_TIMEOUT % 1000 * 1000 };
+	unsigned int i;
+	int fd;
+
+	if (self->peers == NULL) {
+		if ((self->peers = malloc(NPEERS * sizeof(int))) == NULL) return -1;
+		for (i = 0; i < NPEERS; i++) self->peers[i] = -1;
+	}
+	if (self->peers[peer] >= 0) return self->peers[peer];
+	if ((fd = kv_socket(PEERS[peer],0)) == -1) return -1;
+	setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+	setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+	if (kv_send(fd,KV_PEER_MAGIC,KV_MAGIC_LEN) == -1) {
+		close(fd);
+		return -1;
+	}
+	return self->peers[peer] = fd;
+}
+
+/*
+ * sends n framed requests to peer and reads their n replies into *in. a connection kept from before that the peer
+ * turns out to have closed is opened anew, once, so a restarted peer costs no failure.
+ */
+static int kv_peer_exchange(unsigned int peer, const char *req, size_t len, size_t n, sds *in) {
+	kv_thread *self;
+	sds grown;
+	size_t got,off;
+	ssize_t m;
+	int fd,fresh,tries;
+
+	if ((self = kv_self()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (tries = 0; tries < 2; tries++) {
+		fresh = self->peers == NULL || self->peers[peer] < 0;
+		if ((fd = kv_peer_fd(self,peer)) == -1) return -1;
+		sdsclear(*in);
+		got = off = 0;
+		if (kv_send(fd,req,len) == 0) {
+			while (got < n) {
+				if ((m = kv_frame((const unsigned char *)*in + off,sdslen(*in) - off)) > 0) {
+					off += m;
+					got++;
+					continue;
+				}
+				if (m == -1) {
+					errno = EPROTO;
+					break;
+				}
+				if ((grown = sdsMakeRoomFor(*in,65536)) == NULL) {
+					errno = ENOMEM;
+					break;
+				}
+				*in = grown;
+				if ((m = recv(fd,*in + sdslen(*in),sdsavail(*in),0)) == -1 && errno == EINTR) continue;
+				if (m <= 0) {
+					if (m == 0) errno = ECONNRESET;
+					break;
+				}
+				sdsIncrLen(*in,m);
+			}
+			if (got == n) return 0;
+		}
+		close(fd);
+		self->peers[peer] = -1;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) errno = ETIMEDOUT;
+		if (fresh || sdslen(*in) > 0 || (errno != ECONNRESET && errno != EPIPE)) break;
+	}
+	return -1;
+}
+
+/*
+ * sends a request to peer, freeing it, and parses the reply, which *in holds and r points into; free *in after.
+ * returns the reply's rc, with errno set to its error if -1, or -1 if the peer can't be reached or makes no sense.
+ */
+static long kv_remote(int peer, sds body, sds *in, kv_reply *r) {
+	const unsigned char *p;
+	sds req;
+	long rc = -1;
+
+	*in = NULL;
+	if ((req = kv_frame_add(sdsempty(),body)) == NULL || (*in = sdsempty()) == NULL) {
+		sdsfree(req);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (kv_peer_exchange(peer,req,sdslen(req),1,in) == 0) {
+		p = (const unsigned char *)*in;
+		if (kv_reply_parse(&p,p + sdslen(*in),r) == -1) errno = EPROTO;
+		else if ((rc = r->rc) == -1) errno = r->aux;
+	}
+	sdsfree(req);
+	return rc;
+}
+
+// for requests whose reply is only rc
+static long kv_remote_rc(int peer, sds body) {
+	kv_reply r;
+	sds in;
+	long rc;
+
+	rc = kv_remote(peer,body,&in,&r);
+	sdsfree(in);
+	return rc;
+}
+
+static int kv_remote_put(int peer, const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx) {
+	if (value == NULL) return kv_remote_rc(peer,kv_peer_req(KV_PEER_DEL,KV_STRING,key,klen));
+	return kv_remote_rc(peer,kv_cmd_number(kv_cmd_number(kv_cmd_arg(kv_peer_req(KV_PEER_PUT,type,key,klen),value,vlen),ttl),nx));
+}
+
+// for requests whose reply holds a value when rc is 1, which replaces the contents of buf, and its type in *type
+static long kv_remote_value(int peer, sds body, sds buf, sds *value, int *type) {
+	const char *v;
+	size_t vlen;
+	kv_reply r;
+	sds in;
+	long rc;
+
+	*value = NULL;
+	if ((rc = kv_remote(peer,body,&in,&r)) == 1) {
+		if (kv_arg(&r.p,r.end,&v,&vlen) == -1) {
+			errno = EPROTO;
+			rc = -1;
+		} else {
+			sdsclear(buf);
+			if ((*value = sdscatlen(buf,v,vlen)) == NULL) errno = ENOMEM;
+			if (*value == NULL) rc = -1;
+			else if (type != NULL) *type = r.aux;
+		}
+	}
+	sdsfree(in);
+	return rc;
+}
+
+// for requests whose reply holds a number when rc is 1
+static long kv_remote_number(int peer, sds body, uint64_t *n) {
+	kv_reply r;
+	sds in;
+	long rc;
+
+	if ((rc = kv_remote(peer,body,&in,&r)) == 1 && kv_arg64(&r.p,r.end,n) == -1) {
+		errno = EPROTO;
+		rc = -1;
+	}
+	sdsfree(in);
+	return rc;
+}
+
+// for requests whose reply holds rc values, which end up in *values unless values is NULL
+static long kv_remote_values(int peer, sds body, sds **values) {
+	const char *v;
+	size_t vlen;
+	kv_reply r;
+	sds in;
+	long rc,i;
+
+	if (values != NULL) *values = NULL;
+	if ((rc = kv_remote(peer,body,&in,&r)) > 0 && values != NULL && r.p < r.end) {
+		if ((*values = calloc(rc,sizeof(sds))) == NULL) {
+			errno = ENOMEM;
+			rc = -1;
+		}
+		for (i = 0; rc > 0 && i < rc; i++) {
+			if (kv_arg(&r.p,r.end,&v,&vlen) == -1) errno = EPROTO;
+			else if (((*values)[i] = sdsnewlen(v,vlen)) == NULL) errno = ENOMEM;
+			if ((*values)[i] == NULL) {
+				kv_free_values(*values,i);
+				*values = NULL;
+				rc = -1;
+			}
+		}
+	}
+	sdsfree(in);
+	return rc;
+}
+
+// for KV_PEER_MRANGE, whose reply holds rc members and then their scores
+static long kv_remote_members(int peer, const char *key, size_t klen, double min, double max, size_t offset, size_t limit, int reverse, sds **members, double **scores) {
+	const char *v;
+	size_t vlen;
+	uint64_t lo,hi,bits;
+	kv_reply r;
+	sds in,body;
+	long rc,i;
+	int err = 0;
+
+	memcpy(&lo,&min,sizeof(lo));
+	memcpy(&hi,&max,sizeof(hi));
+	body = kv_cmd_number(kv_cmd_number(kv_peer_req(KV_PEER_MRANGE,KV_ZSET,key,klen),lo),hi);
+	body = kv_cmd_number(kv_cmd_number(kv_cmd_number(body,offset),limit),reverse);
+	if ((rc = kv_remote(peer,body,&in,&r)) > 0) {
+		*members = calloc(rc,sizeof(sds));
+		*scores = malloc(rc * sizeof(double));
+		if (*members == NULL || *scores == NULL) err = ENOMEM;
+		for (i = 0; !err && i < rc; i++) {
+			if (kv_arg(&r.p,r.end,&v,&vlen) == -1) err = EPROTO;
+			else if (((*members)[i] = sdsnewlen(v,vlen)) == NULL) err = ENOMEM;
+		}
+		for (i = 0; !err && i < rc; i++) {
+			if (kv_arg64(&r.p,r.end,&bits) == -1) err = EPROTO;
+			else memcpy(&(*scores)[i],&bits,sizeof(bits));
+		}
+		if (err) {
+			if (*members != NULL) kv_free_values(*members,rc);
+			free(*scores);
+			*members = NULL;
+			*scores = NULL;
+			errno = err;
+			rc = -1;
+		}
+	}
+	sdsfree(in);
+	return rc;
+}
+
+/*
+ * gets (when values isn't NULL, with their types in types) or sets the items that belong to other peers, as given in owners. each peer is sent
+ * its requests KV_PEER_PIPELINE bytes at a time, which its socket can take without reading, and they are all replied to
+ * before the next ones are sent, so neither end ever blocks writing to the other. the keys set are added to *count.
+ */
+static int kv_remote_batch(const int *owners, const kv_item *items, size_t n, int64_t ttl, sds *values, int *types, long *count) {
+	const unsigned char *p,*end;
+	const char *v;
+	size_t i,j,k,sent,vlen;
+	unsigned int peer;
+	kv_reply r;
+	sds req,in,body;
+	int err = 0;
+
+	if ((req = sdsempty()) == NULL || (in = sdsempty()) == NULL) {
+		sdsfree(req);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (peer = 0; peer < NPEERS && !err; peer++) {
+		for (i = 0; i < n && !err; i = j) {
+			sdsclear(req);
+			for (j = i, sent = 0; j < n && req != NULL && sdslen(req) < KV_PEER_PIPELINE; j++) {
+				if (owners[j] != (int)peer) continue;
+				if (values != NULL) body = kv_peer_req(KV_PEER_GET,KV_STRING,items[j].key,items[j].klen);
+				else if (items[j].value == NULL) body = kv_peer_req(KV_PEER_DEL,KV_STRING,items[j].key,items[j].klen);
+				else body = kv_cmd_number(kv_cmd_number(kv_cmd_arg(kv_peer_req(KV_PEER_PUT,items[j].type,items[j].key,items[j].klen),items[j].value,items[j].vlen),ttl),0);
+				req = kv_frame_add(req,body);
+				sent++;
+			}
+			if (req == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			if (sent == 0) continue;
+			if (kv_peer_exchange(peer,req,sdslen(req),sent,&in) == -1) {
+				err = errno;
+				break;
+			}
+			p = (const unsigned char *)in;
+			end = p + sdslen(in);
+			for (k = i; k < j && !err; k++) {
+				if (owners[k] != (int)peer) continue;
+				if (kv_reply_parse(&p,end,&r) == -1) {
+					err = EPROTO;
+				} else if (r.rc == -1) {
+					err = r.aux;
+				} else if (values == NULL) {
+					if (r.rc == 1) (*count)++;
+				} else if (r.rc == 1) {
+					if (kv_arg(&r.p,r.end,&v,&vlen) == -1) err = EPROTO;
+					else if ((values[k] = sdsnewlen(v,vlen)) == NULL) err = ENOMEM;
+					else types[k] = r.aux;
+				}
+			}
+		}
+	}
+	sdsfree(req);
+	sdsfree(in);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+// the arguments each op takes after the key: s for a string, n for a number
+static const char *PEER_ARGS[] = {
+	[KV_PEER_GET] = "",
+	[KV_PEER_PUT] = "snn",
+	[KV_PEER_DEL] = "",
+	[KV_PEER_ADD] = "n",
+	[KV_PEER_CONCAT] = "s",
+	[KV_PEER_SWAP] = "nsns",
+	[KV_PEER_EXCHANGE] = "ns",
+	[KV_PEER_REFRESH] = "n",
+	[KV_PEER_CMD] = "s",
+	[KV_PEER_RANGE] = "nn",
+	[KV_PEER_FIELD] = "s",
+	[KV_PEER_SCORE] = "s",
+	[KV_PEER_MRANGE] = "nnnnn",
+	[KV_PEER_DCOUNT] = "",
+	[KV_PEER_LEN] = ""
+};
+
+// runs a request from another peer, returning the reply, or NULL if out of memory
+static sds kv_serve(const unsigned char *p, size_t len) {
+	const unsigned char *end = p + len;
+	const char *key,*arg[5];
+	size_t klen,alen[5],length;
+	uint64_t n[5] = { 0 },u;
+	unsigned int nargs = 0;
+	int op,type,otype = KV_STRING;
+	sds reply = NULL,value = NULL,found,*values = NULL;
+	double *scores = NULL,min,max;
+	int64_t result;
+	long rc = -1,i;
+
+	if (len < 2 || (op = p[0]) < KV_PEER_GET || op > KV_PEER_LEN) return kv_reply_new(-1,EINVAL);
+	type = p[1];
+	p += 2;
+	if (kv_arg(&p,end,&key,&klen) == -1) return kv_reply_new(-1,EINVAL);
+	while (nargs < 5 && p < end && kv_arg(&p,end,&arg[nargs],&alen[nargs]) == 0) nargs++;
+	if (p < end || nargs != strlen(PEER_ARGS[op])) return kv_reply_new(-1,EINVAL);
+	for (i = 0; i < nargs; i++) {
+		if (PEER_ARGS[op][i] != 'n') continue;
+		if (alen[i] != 8) return kv_reply_new(-1,EINVAL);
+		n[i] = kv_get64((const unsigned char *)arg[i]);
+	}
+
+	errno = 0;
+	switch (op) {
+	case KV_PEER_GET:
+		if ((value = sdsempty()) == NULL) return NULL;
+		if ((found = kv_copy(key,klen,value,&otype)) != NULL) value = found;
+		if ((rc = found != NULL ? 1 : errno == ENOMEM ? -1 : 0) != -1) reply = kv_reply_new(rc,otype);
+		if (rc == 1) reply = kv_cmd_arg(reply,value,sdslen(value));
+		break;
+	case KV_PEER_FIELD:
+		if ((rc = kv_field_copy(key,klen,arg[0],alen[0],&value)) != -1) reply = kv_reply_new(rc,0);
+		if (rc == 1) reply = kv_cmd_arg(reply,value,sdslen(value));
+		break;
+	case KV_PEER_EXCHANGE:
+		if ((value = sdsempty()) == NULL) return NULL;
+		if ((rc = kv_exchange(key,klen,n[0] ? arg[1] : NULL,alen[1],type,&value,&otype)) != -1) reply = kv_reply_new(rc,otype);
+		if (rc == 1) reply = kv_cmd_arg(reply,value,sdslen(value));
+		break;
+	case KV_PEER_PUT:
+		if ((rc = kv_put(key,klen,arg[0],alen[0],type,(int64_t)n[1],n[2])) != -1) reply = kv_reply_new(rc,0);
+		break;
+	case KV_PEER_DEL:
+		if ((rc = kv_put(key,klen,NULL,0,KV_STRING,0,0)) != -1) reply = kv_reply_new(rc,0);
+		break;
+	case KV_PEER_ADD:
+		if ((rc = kv_add(key,klen,(int64_t)n[0],&result)) != -1) reply = kv_reply_new(rc,0);
+		if (rc == 1) reply = kv_cmd_number(reply,result);
+		break;
+	case KV_PEER_CONCAT:
+		if ((rc = kv_concat(key,klen,arg[0],alen[0],type,&length)) != -1) reply = kv_reply_new(rc,0);
+		if (rc == 1) reply = kv_cmd_number(reply,length);
+		break;
+	case KV_PEER_SWAP:
+		if ((rc = kv_swap(key,klen,n[0] & 1 ? arg[1] : NULL,alen[1],n[2],n[0] & 2 ? arg[3] : NULL,alen[3],type)) != -1) reply = kv_reply_new(rc,0);
+		break;
+	case KV_PEER_REFRESH:
+		if ((rc = kv_refresh(key,klen,(int64_t)n[0])) != -1) reply = kv_reply_new(rc,0);
+		break;
+	case KV_PEER_CMD:
+	case KV_PEER_RANGE:
+	case KV_PEER_MRANGE:
+		if (op == KV_PEER_CMD) {
+			rc = kv_command(key,klen,type,(const unsigned char *)arg[0],alen[0],&values);
+		} else if (op == KV_PEER_RANGE) {
+			rc = kv_range(key,klen,(int64_t)n[0],(int64_t)n[1],&values);
+		} else {
+			memcpy(&min,&n[0],sizeof(min));
+			memcpy(&max,&n[1],sizeof(max));
+			rc = kv_member_range(key,klen,min,max,n[2],n[3],n[4],&values,&scores);
+		}
+		if (rc != -1) reply = kv_reply_new(rc,0);
+		for (i = 0; values != NULL && i < rc; i++) reply = kv_cmd_arg(reply,values[i],sdslen(values[i]));
+		for (i = 0; scores != NULL && i < rc; i++) {
+			memcpy(&u,&scores[i],sizeof(u));
+			reply = kv_cmd_number(reply,u);
+		}
+		if (values != NULL) kv_free_values(values,rc);
+		free(scores);
+		break;
+	case KV_PEER_SCORE:
+		if ((rc = kv_member_score(key,klen,arg[0],alen[0],&min)) != -1) reply = kv_reply_new(rc,0);
+		memcpy(&u,&min,sizeof(u));
+		if (rc == 1) reply = kv_cmd_number(reply,u);
+		break;
+	case KV_PEER_DCOUNT:
+		if ((rc = kv_distinct_count(key,klen)) != -1) reply = kv_reply_new(rc,0);
+		break;
+	case KV_PEER_LEN:
+		if ((rc = kv_len(key,klen)) != -1) reply = kv_reply_new(rc,0);
+		break;
+	}
+	if (rc == -1) reply = kv_reply_new(-1,errno);
+	sdsfree(value);
+	return reply;
+}
+
+// serves one peer's requests, as many as have arrived, then sends the replies together
+static void *kv_peer_conn(void *arg) {
+	kv_conn *c = arg;
+	const unsigned char *p,*end;
+	const char *body;
+	size_t blen;
+	ssize_t n;
+	sds in,out,grown;
+	int greeted = 0;
+
+	SERVING = 1;
+	in = sdsempty();
+	out = sdsempty();
+	while (in != NULL && out != NULL) {
+		if ((grown = sdsMakeRoomFor(in,65536)) == NULL) break;
+		in = grown;
+		if ((n = recv(c->fd,in + sdslen(in),sdsavail(in),0)) == -1 && errno == EINTR) continue;
+		if (n <= 0) break;
+		sdsIncrLen(in,n);
+		p = (const unsigned char *)in;
+		end = p + sdslen(in);
+		if (!greeted) {
+			if (sdslen(in) < KV_MAGIC_LEN) continue;
+			if (memcmp(in,KV_PEER_MAGIC,KV_MAGIC_LEN) != 0) break;
+			p += KV_MAGIC_LEN;
+			greeted = 1;
+		}
+		while (out != NULL && (n = kv_frame(p,end - p)) > 0) {
+			kv_arg(&p,end,&body,&blen);
+			out = kv_frame_add(out,kv_serve((const unsigned char *)body,blen));
+		}
+		if (n == -1 || out == NULL) break;
+		sdsrange(in,p - (const unsigned char *)in,-1);
+		if (sdslen(out) > 0 && kv_send(c->fd,out,sdslen(out)) == -1) break;
+		sdsclear(out);
+	}
+	sdsfree(in);
+	sdsfree(out);
+	pthread_mutex_lock(&PEER_LOCK);
+	c->done = 1;
+	pthread_mutex_unlock(&PEER_LOCK);
+	return NULL;
+}
+
+// accepts other peers, reaping the threads of those that went away as it goes
+static void *kv_peer_accept(void *arg) {
+	kv_conn *c,**pc;
+	int fd,err,on = 1;
+
+	for (;;) {
+		err = (fd = accept(PEER_LISTEN,NULL,NULL)) == -1 ? errno : 0;
+		pthread_mutex_lock(&PEER_LOCK);
+		for (pc = &CONNS; (c = *pc) != NULL;) {
+			if (!c->done) {
+				pc = &c->next;
+				continue;
+			}
+			*pc = c->next;
+			pthread_join(c->thread,NULL);
+			close(c->fd);
+			free(c);
+		}
+		if (PEER_STOP) {
+			pthread_mutex_unlock(&PEER_LOCK);
+			if (fd >= 0) close(fd);
+			break;
+		}
+		if (fd >= 0 && (c = calloc(1,sizeof(kv_conn))) != NULL) {
+			fcntl(fd,F_SETFD,FD_CLOEXEC);
+			setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+			c->fd = fd;
+			if (pthread_create(&c->thread,NULL,kv_peer_conn,c) == 0) {
+				c->next = CONNS;
+				CONNS = c;
+				fd = -1;
+			} else {
+				free(c);
+			}
+		}
+		pthread_mutex_unlock(&PEER_LOCK);
+		if (fd >= 0) close(fd);
+		else if (err != 0 && err != EINTR && err != ECONNABORTED) sleep(KV_REPL_RETRY);
+	}
+	return NULL;
+}
+
+int kv_peers(const char **addresses, unsigned int n, unsigned int self, const char *listen) {
+	unsigned int i;
+	int rc;
+
+	if (SHARDS == NULL || NPEERS != 0 || addresses == NULL || self >= n) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((PEERS = calloc(n,sizeof(char *))) == NULL) return -1;
+	for (i = 0; i < n; i++) {
+		if ((PEERS[i] = strdup(addresses[i])) == NULL) break;
+	}
+	if (i < n || (PEER_LISTEN = kv_socket(listen != NULL ? listen : addresses[self],1)) == -1) {
+		rc = i < n ? ENOMEM : errno;
+		while (i-- > 0) free(PEERS[i]);
+		free(PEERS);
+		PEERS = NULL;
+		errno = rc;
+		return -1;
+	}
+	PEER_STOP = 0;
+	SELF_PEER = self;
+	NPEERS = n;
+	if ((rc = pthread_create(&PEER,NULL,kv_peer_accept,NULL)) != 0) {
+		close(PEER_LISTEN);
+		PEER_LISTEN = -1;
+		NPEERS = 0;
+		for (i = 0; i < n; i++) free(PEERS[i]);
+		free(PEERS);
+		PEERS = NULL;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+long kv_push(const char *key, size_t klen, int left, const char **values, const size_t *lens, size_t n) {
+	return kv_run(key,klen,KV_LIST,kv_cmd_args(kv_cmd(left ? KV_CMD_LPUSH : KV_CMD_RPUSH),values,lens,n),NULL);
+}
+
+long kv_pop(const char *key, size_t klen, int left, size_t count, sds **values) {
+	*values = NULL;
+	if (count == 0) return 0;
+	return kv_run(key,klen,KV_LIST,kv_cmd_number(kv_cmd(left ? KV_CMD_LPOP : KV_CMD_RPOP),count),values);
+}
+
+long kv_range(const char *key, size_t klen, long start, long stop, sds **values) {
+	kv_shard *shard;
+	kv_entry *e;
+	kv_list *l;
+	long n = 0,i;
+	int peer;
+
+	*values = NULL;
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_values(peer,kv_cmd_number(kv_cmd_number(kv_peer_req(KV_PEER_RANGE,KV_LIST,key,klen),start),stop),values);
+	shard = kv_lock(key,klen,&e,1);
+	if (e != NULL && e->type != KV_LIST) {
+		errno = EINVAL;
+		n = -1;
+	} else if (e != NULL) {
+		l = e->value;
+		if (start < 0) start += l->count;
+		if (stop < 0) stop += l->count;
+		if (start < 0) start = 0;
+		if (stop >= (long)l->count) stop = l->count - 1;
+		if (start <= stop && (*values = malloc((stop - start + 1) * sizeof(sds))) == NULL) n = -1;
+		for (i = start; n >= 0 && i <= stop; i++) {
+			if (((*values)[n] = sdsdup(kv_list_at(l,i))) == NULL) {
+				kv_free_values(*values,n);
+				*values = NULL;
+				n = -1;
+			} else {
+				n++;
+			}
+		}
+		if (n == -1) errno = ENOMEM;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return n;
+}
+
+long kv_field_put(const char *key, size_t klen, const char **fields, const size_t *flens, const char **values, const size_t *vlens, size_t n) {
+	sds cmd = kv_cmd(KV_CMD_HSET);
+	size_t i;
+
+	for (i = 0; cmd != NULL && i < n; i++) {
+		if ((cmd = kv_cmd_arg(cmd,fields[i],flens[i])) != NULL) cmd = kv_cmd_arg(cmd,values[i],vlens[i]);
+	}
+	return kv_run(key,klen,KV_HASH,cmd,NULL);
+}
+
+int kv_field_copy(const char *key, size_t klen, const char *field, size_t flen, sds *value) {
+	kv_shard *shard;
+	kv_entry *e;
+	kv_field *f;
+	sds buf;
+	int rc = 0,peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		if ((buf = sdsempty()) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if ((rc = kv_remote_value(peer,kv_cmd_arg(kv_peer_req(KV_PEER_FIELD,KV_HASH,key,klen),field,flen),buf,value,NULL)) != 1) sdsfree(buf);
+		return rc;
+	}
+	shard = kv_lock(key,klen,&e,1);
+	if (e != NULL && e->type != KV_HASH) {
+		errno = EINVAL;
+		rc = -1;
+	} else if (e != NULL && (f = kv_dict_get(e->value,field,flen)) != NULL) {
+		if ((*value = sdsdup(f->value)) == NULL) errno = ENOMEM;
+		rc = *value != NULL ? 1 : -1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return rc;
+}
+
+long kv_field_del(const char *key, size_t klen, const char **fields, const size_t *flens, size_t n) {
+	return kv_run(key,klen,KV_HASH,kv_cmd_args(kv_cmd(KV_CMD_HDEL),fields,flens,n),NULL);
+}
+
+long kv_member_add(const char *key, size_t klen, const char **members, const size_t *lens, const double *scores, size_t n) {
+	sds cmd = kv_cmd(KV_CMD_ZADD);
+	uint64_t bits;
+	size_t i;
+
+	for (i = 0; cmd != NULL && i < n; i++) {
+		memcpy(&bits,&scores[i],sizeof(bits));
+		if ((cmd = kv_cmd_arg(cmd,members[i],lens[i])) != NULL) cmd = kv_cmd_number(cmd,bits);
+	}
+	return kv_run(key,klen,KV_ZSET,cmd,NULL);
+}
+
+long kv_member_del(const char *key, size_t klen, const char **members, const size_t *lens, size_t n) {
+	return kv_run(key,klen,KV_ZSET,kv_cmd_args(kv_cmd(KV_CMD_ZREM),members,lens,n),NULL);
+}
+
+int kv_member_score(const char *key, size_t klen, const char *member, size_t mlen, double *score) {
+	kv_shard *shard;
+	kv_entry *e;
+	kv_znode *n;
+	uint64_t bits;
+	int rc = 0,peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) {
+		if ((rc = kv_remote_number(peer,kv_cmd_arg(kv_peer_req(KV_PEER_SCORE,KV_ZSET,key,klen),member,mlen),&bits)) == 1) memcpy(score,&bits,sizeof(bits));
+		return rc;
+	}
+	shard = kv_lock(key,klen,&e,1);
+	if (e != NULL && e->type != KV_ZSET) {
+		errno = EINVAL;
+		rc = -1;
+	} else if (e != NULL && (n = kv_zset_get(e->value,member,mlen)) != NULL) {
+		*score = n->score;
+		rc = 1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return rc;
+}
+
+// finding the first member is O(log n), and each one after O(1)
+long kv_member_range(const char *key, size_t klen, double min, double max, size_t offset, size_t limit, int reverse, sds **members, double **scores) {
+	kv_shard *shard;
+	kv_entry *e;
+	kv_znode *n = NULL;
+	sds *m;
+	double *d;
+	size_t size = 0;
+	long count = 0;
+	int err = 0,peer;
+
+	*members = NULL;
+	*scores = NULL;
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_members(peer,key,klen,min,max,offset,limit,reverse,members,scores);
+	shard = kv_lock(key,klen,&e,1);
+	if (e != NULL && e->type != KV_ZSET) {
+		errno = EINVAL;
+		count = -1;
+	} else if (e != NULL) {
+		n = reverse ? kv_zset_to(e->value,max) : kv_zset_from(e->value,min);
+	}
+	for (; n != NULL && offset > 0 && (reverse ? n->score >= min : n->score <= max); offset--) n = reverse ? n->back : n->next[0];
+	for (; n != NULL && (reverse ? n->score >= min : n->score <= max) && (limit == 0 || (size_t)count < limit); n = reverse ? n->back : n->next[0]) {
+		if ((size_t)count == size) {
+			size = size ? size * 2 : 16;
+			if ((m = realloc(*members,size * sizeof(sds))) != NULL) *members = m;
+			if ((d = realloc(*scores,size * sizeof(double))) != NULL) *scores = d;
+			if ((err = m == NULL || d == NULL)) break;
+		}
+		if ((err = ((*members)[count] = sdsdup(n->member)) == NULL)) break;
+		(*scores)[count++] = n->score;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (err) {
+		kv_free_values(*members,count);
+		free(*scores);
+		*members = NULL;
+		*scores = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	return count;
+}
+
+long kv_distinct_add(const char *key, size_t klen, const char **elements, const size_t *lens, size_t n) {
+	return kv_run(key,klen,KV_HLL,kv_cmd_args(kv_cmd(KV_CMD_PFADD),elements,lens,n),NULL);
+}
+
+long kv_distinct_count(const char *key, size_t klen) {
+	kv_shard *shard;
+	kv_entry *e;
+	long count = 0;
+	int peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_rc(peer,kv_peer_req(KV_PEER_DCOUNT,KV_HLL,key,klen));
+	shard = kv_lock(key,klen,&e,1);
+	if (e != NULL && e->type != KV_HLL) {
+		errno = EINVAL;
+		count = -1;
+	} else if (e != NULL) {
+		count = kv_hll_count(e->value);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return count;
+}
+
+long kv_len(const char *key, size_t klen) {
+	kv_shard *shard;
+	kv_entry *e;
+	long count = 0;
+	int peer;
+
+	if ((peer = kv_owner(key,klen)) >= 0) return kv_remote_rc(peer,kv_peer_req(KV_PEER_LEN,KV_STRING,key,klen));
+	shard = kv_lock(key,klen,&e,0);
+	if (e != NULL && (e->type < KV_LIST || e->type == KV_HLL)) {
+		errno = EINVAL;
+		count = -1;
+	} else if (e != NULL) {
+		count = kv_type_count(e->type,e->value);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return count;
+}
+
+void kv_free_values(sds *values, size_t n) {
+	size_t i;
+
+	if (values == NULL) return;
+	for (i = 0; i < n; i++) sdsfree(values[i]);
+	free(values);
+}
+
+// whether e, NULL if key doesn't exist, holds expected as kv_swap compares them; collections by their serialization
+static int kv_holds(kv_entry *e, const char *expected, size_t elen, int etype) {
+	sds value;
+	int rc;
+
+	if (e == NULL || expected == NULL) return e == NULL && expected == NULL;
+	if (e->type < KV_LIST) return e->type == etype && kv_length(e) == elen && memcmp(e->value,expected,elen) == 0;
+	if (etype != (e->type == KV_HLL ? KV_BUFFER : KV_CBOR)) return 0;
+	if ((value = sdsempty()) == NULL || (value = kv_type_encode(e->type,e->value,value)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rc = sdslen(value) == elen && memcmp(value,expected,elen) == 0;
+	sdsfree(value);
+	return rc;
+}
+
+int kv_await(const char *key, size_t klen, const char *expected, size_t elen, int etype, int64_t timeout) {
+	pthread_condattr_t attr;
+	struct timespec ts;
+	kv_shard *shard;
+	kv_waiter w,**p;
+	kv_entry *e;
+	int rc = 0;
+
+	if (kv_shared(key,klen) || kv_owner(key,klen) >= 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	shard = kv_lock(key,klen,&e,0);
+	if (etype >= 0 && (rc = kv_holds(e,expected,elen,etype)) != -1) rc = !rc;
+	if (rc != 0 || timeout <= 0) {
+		pthread_mutex_unlock(&shard->lock);
+		return rc;
+	}
+	if (__atomic_add_fetch(&WAITING,1,__ATOMIC_RELAXED) > __atomic_load_n(&MAXWAITERS,__ATOMIC_RELAXED)) {
+		__atomic_sub_fetch(&WAITING,1,__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&shard->lock);
+		errno = EBUSY;
+		return -1;
+	}
+	if (timeout > (int64_t)KV_WHEEL_SPAN * 1024) timeout = KV_WHEEL_SPAN * 1024;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += timeout % 1000 * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&w.cond,&attr);
+	pthread_condattr_destroy(&attr);
+	w.hash = kv_hash(key,klen);
+	w.key = key;
+	w.klen = klen;
+	w.woken = 0;
+	w.next = shard->waiters;
+	shard->waiters = &w;
+	while (!w.woken && pthread_cond_timedwait(&w.cond,&shard->lock,&ts) != ETIMEDOUT);
+	for (p = &shard->waiters; *p != &w; p = &(*p)->next);
+	*p = w.next;
+	pthread_mutex_unlock(&shard->lock);
+	pthread_cond_destroy(&w.cond);
+	__atomic_sub_fetch(&WAITING,1,__ATOMIC_RELAXED);
+	return w.woken;
+}
+
+int kv_set(const char *key, void *value, void *ffn, int expiry, int nx) {
+	if (key == NULL) return 0;
+	return kv_store(key,strlen(key),value,ffn,expiry > 0 ? expiry * 1000LL : expiry,nx) > 0;
+}
+
+const char *kv_get(const char *key) {
+	kv_entry *e;
+
+	if (key == NULL || kv_owner(key,strlen(key)) >= 0 || kv_pin() == -1) return NULL;
+	e = kv_read(key,strlen(key));
+	kv_unpin();
+	return e != NULL && e->type < KV_LIST ? (const char *)e->value : NULL;
+}
+
+int kv_write(const char *key, size_t klen, const char *value, size_t vlen, int type, int expiry, int nx) {
+	if (key == NULL || type > KV_CBOR) {
+		errno = EINVAL;
+		return -1;
+	}
+	return kv_put(key,klen,value,vlen,type,expiry > 0 ? expiry * 1000LL : expiry,nx);
+}
+
+// values that can't be read in place are copied for fn, and collections aren't values fn could read
+int kv_view(const char *key, size_t klen, void (*fn)(const char *value, size_t vlen, int type, void *arg), void *arg) {
+	kv_entry *e;
+	sds value,found;
+	int type;
+
+	if (key == NULL || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kv_shared(key,klen) || kv_owner(key,klen) >= 0) {
+		if ((value = sdsempty()) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		errno = 0;
+		if ((found = kv_copy(key,klen,value,&type)) == NULL) {
+			sdsfree(value);
+			return errno != 0 ? -1 : 0;
+		}
+		fn(found,sdslen(found),type,arg);
+		sdsfree(found);
+		return 1;
+	}
+	if (kv_pin() == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if ((e = kv_read(key,klen)) != NULL && e->type >= KV_LIST) {
+		kv_unpin();
+		errno = EINVAL;
+		return -1;
+	}
+	if (e != NULL) fn(e->value,kv_length(e),e->type,arg);
+	kv_unpin();
+	return e != NULL;
+}
+
+// shared values, and those of other peers, can only be copied
+static char *kv_dup_copy(const char *key) {
+	sds value,found;
+	char *copy = NULL;
+
+	if ((value = sdsempty()) == NULL) return NULL;
+	if ((found = kv_copy(key,strlen(key),value,NULL)) != NULL) {
+		value = found;
+		if ((copy = malloc(sdslen(value) + 1)) != NULL) memcpy(copy,value,sdslen(value) + 1);
+	}
+	sdsfree(value);
+	return copy;
+}
+
+char *kv_dup(const char *key) {
+	kv_entry *e;
+	char *copy = NULL;
+	size_t len;
+
+	if (key != NULL && (kv_shared(key,strlen(key)) || kv_owner(key,strlen(key)) >= 0)) return kv_dup_copy(key);
+	if (key == NULL || kv_pin() == -1) return NULL;
+	if ((e = kv_read(key,strlen(key))) != NULL && e->type < KV_LIST) {
+		len = kv_length(e);
+		if ((copy = malloc(len + 1)) != NULL) {
+			memcpy(copy,e->value,len);
+			copy[len] = '\0';
+		}
+	}
+	kv_unpin();
+	return copy;
+}
+
+int kv_incr(const char *key, long long delta, long long *result) {
+	int64_t n;
+
+	if (key == NULL || kv_add(key,strlen(key),delta,&n) != 1) return 0;
+	if (result != NULL) *result = n;
+	return 1;
+}
+
+int kv_append(const char *key, const char *value) {
+	if (key == NULL || value == NULL) return 0;
+	return kv_concat(key,strlen(key),value,strlen(value),KV_STRING,NULL) == 1;
+}
+
+int kv_cas(const char *key, const char *expected, const char *value) {
+	if (key == NULL) return 0;
+	return kv_swap(key,strlen(key),expected,expected != NULL ? strlen(expected) : 0,KV_STRING,value,value != NULL ? strlen(value) : 0,KV_STRING) == 1;
+}
+
+char *kv_getset(const char *key, const char *value) {
+	sds old;
+	char *copy = NULL;
+
+	if (key == NULL || (old = sdsempty()) == NULL) return NULL;
+	if (kv_exchange(key,strlen(key),value,value != NULL ? strlen(value) : 0,KV_STRING,&old,NULL) == 1 && (copy = malloc(sdslen(old) + 1)) != NULL) {
+		memcpy(copy,old,sdslen(old) + 1);
+	}
+	sdsfree(old);
+	return copy;
+}
+
+int kv_touch(const char *key, int expiry) {
+	if (key == NULL) return 0;
+	return kv_refresh(key,strlen(key),expiry > 0 ? expiry * 1000LL : expiry) == 1;
+}
+
+int kv_mget(const char **keys, int n, char **values) {
+	kv_entry *e;
+	size_t len;
+	int i,found = 0;
+
+	if (n <= 0) return 0;
+	// shared and remote keys first, unpinned, as copying them waits on other processes and peers
+	for (i = 0; i < n; i++) {
+		values[i] = NULL;
+		if (keys[i] != NULL && (kv_shared(keys[i],strlen(keys[i])) || kv_owner(keys[i],strlen(keys[i])) >= 0)) {
+			if ((values[i] = kv_dup_copy(keys[i])) != NULL) found++;
+		}
+	}
+	if (kv_pin() == -1) return found;
+	for (i = 0; i < n; i++) {
+		if (keys[i] == NULL || kv_shared(keys[i],strlen(keys[i])) || kv_owner(keys[i],strlen(keys[i])) >= 0) continue;
+		if ((e = kv_read(keys[i],strlen(keys[i]))) == NULL || e->type >= KV_LIST) continue;
+		len = kv_length(e);
+		if ((values[i] = malloc(len + 1)) == NULL) continue;
+		memcpy(values[i],e->value,len);
+		values[i][len] = '\0';
+		found++;
+	}
+	kv_unpin();
+	return found;
+}
+
+static long kv_mupdate(const char **keys, const char **values, int n, int expiry) {
+	kv_item *items;
+	long rc;
+	int i;
+
+	if (n <= 0 || (items = malloc(n * sizeof(kv_item))) == NULL) return 0;
+	for (i = 0; i < n; i++) {
+		if (keys[i] == NULL) {
+			free(items);
+			return 0;
+		}
+		items[i].key = keys[i];
+		items[i].klen = strlen(keys[i]);
+		items[i].value = values != NULL ? values[i] : NULL;
+		items[i].vlen = items[i].value != NULL ? strlen(items[i].value) : 0;
+		items[i].type = KV_STRING;
+	}
+	rc = kv_mput(items,n,expiry > 0 ? expiry * 1000LL : expiry);
+	free(items);
+	return rc > 0 ? rc : 0;
+}
+
+int kv_mset(const char **keys, const char **values, int n, int expiry) {
+	return kv_mupdate(keys,values,n,expiry);
+}
+
+int kv_mdel(const char **keys, int n) {
+	return kv_mupdate(keys,NULL,n,0);
+}
+
+static long kv_push1(const char *key, int left, const char *value) {
+	size_t len;
+	long rc;
+
+	if (key == NULL || value == NULL) return 0;
+	len = strlen(value);
+	rc = kv_push(key,strlen(key),left,&value,&len,1);
+	return rc > 0 ? rc : 0;
+}
+
+long kv_lpush(const char *key, const char *value) {
+	return kv_push1(key,1,value);
+}
+
+long kv_rpush(const char *key, const char *value) {
+	return kv_push1(key,0,value);
+}
+
+static char *kv_pop1(const char *key, int left) {
+	sds *values;
+	char *copy = NULL;
+
+	if (key == NULL || kv_pop(key,strlen(key),left,1,&values) != 1) return NULL;
+	if ((copy = malloc(sdslen(values[0]) + 1)) != NULL) memcpy(copy,values[0],sdslen(values[0]) + 1);
+	kv_free_values(values,1);
+	return copy;
+}
+
+char *kv_lpop(const char *key) {
+	return kv_pop1(key,1);
+}
+
+char *kv_rpop(const char *key) {
+	return kv_pop1(key,0);
+}
+
+int kv_hset(const char *key, const char *field, const char *value) {
+	size_t flen,vlen;
+
+	if (key == NULL || field == NULL || value == NULL) return 0;
+	flen = strlen(field);
+	vlen = strlen(value);
+	return kv_field_put(key,strlen(key),&field,&flen,&value,&vlen,1) >= 0;
+}
+
+char *kv_hget(const char *key, const char *field) {
+	sds value;
+	char *copy = NULL;
+
+	if (key == NULL || field == NULL || kv_field_copy(key,strlen(key),field,strlen(field),&value) != 1) return NULL;
+	if ((copy = malloc(sdslen(value) + 1)) != NULL) memcpy(copy,value,sdslen(value) + 1);
+	sdsfree(value);
+	return copy;
+}
+
+int kv_hdel(const char *key, const char *field) {
+	size_t flen;
+
+	if (key == NULL || field == NULL) return 0;
+	flen = strlen(field);
+	return kv_field_del(key,strlen(key),&field,&flen,1) == 1;
+}
+
+int kv_zadd(const char *key, const char *member, double score) {
+	size_t mlen;
+
+	if (key == NULL || member == NULL) return 0;
+	mlen = strlen(member);
+	return kv_member_add(key,strlen(key),&member,&mlen,&score,1) >= 0;
+}
+
+int kv_zscore(const char *key, const char *member, double *score) {
+	if (key == NULL || member == NULL || score == NULL) return 0;
+	return kv_member_score(key,strlen(key),member,strlen(member),score) == 1;
+}
+
+int kv_zrem(const char *key, const char *member) {
+	size_t mlen;
+
+	if (key == NULL || member == NULL) return 0;
+	mlen = strlen(member);
+	return kv_member_del(key,strlen(key),&member,&mlen,1) == 1;
+}
+
+int kv_pfadd(const char *key, const char *element) {
+	size_t len;
+
+	if (key == NULL || element == NULL) return 0;
+	len = strlen(element);
+	return kv_distinct_add(key,strlen(key),&element,&len,1) == 1;
+}
+
+long long kv_pfcount(const char *key) {
+	long count;
+
+	if (key == NULL) return 0;
+	count = kv_distinct_count(key,strlen(key));
+	return count > 0 ? count : 0;
+}
+
+int kv_wait(const char *key, const char *expected, int timeout) {
+	if (key == NULL) return 0;
+	return kv_await(key,strlen(key),expected,expected != NULL ? strlen(expected) : 0,KV_STRING,timeout > 0 ? timeout * 1000LL : 0) == 1;
+}
@@ -0,0 +1,308 @@
+#ifndef CEPA_KV_H
+#define CEPA_KV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sds.h>
+
+#define KV_DEFAULT_SHARDS 16
+#define KV_MAX_SHARDS     1024
+#define KV_MAX_NAMESPACES 64
+
+#define KV_SNAPSHOT_INTERVAL 300
+
+#define KV_DEFAULT_WAITERS 8
+#define KV_SHARED_SIZE     ((size_t)64 << 20) // of a shared segment, unless given
+
+// when the log is flushed to disk
+#define KV_FSYNC_NO       0
+#define KV_FSYNC_EVERYSEC 1
+#define KV_FSYNC_ALWAYS   2
+
+// value types, telling scripts how to decode a value
+#define KV_STRING 0
+#define KV_BUFFER 1
+#define KV_CBOR   2
+// collections, see kv_push and below
+#define KV_LIST   3
+#define KV_HASH   4
+#define KV_ZSET   5
+#define KV_HLL    6
+
+// eviction policies
+#define KV_NOEVICTION   0
+#define KV_ALLKEYS_LRU  1
+#define KV_ALLKEYS_LFU  2
+#define KV_VOLATILE_TTL 3
+
+/*
+ * the store is split into a power of two number of shards, each with its own lock,
+ * selected by a hash of the key. shards is rounded up, and clamped to KV_MAX_SHARDS.
+ * returns 0 on success.
+ */
+int kv_init(unsigned int shards);
+void kv_destroy(void);
+unsigned int kv_shards(void);
+
+/*
+ * maps a policy name ("noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl") to its number, or -1.
+ */
+int kv_policy(const char *name);
+
+/*
+ * sets the memory budget, in bytes and 0 for none, and eviction policy of the whole store when prefix is NULL,
+ * or of the namespace of keys starting with prefix, which is created if need be.
+ * keys belong to the namespace with the longest matching prefix; call this before storing any.
+ * writes that would exceed a budget evict by its policy first, and fail with ENOMEM if that isn't enough.
+ * returns 0, or -1 with errno set.
+ */
+int kv_limit(const char *prefix, size_t maxmemory, int policy);
+
+/*
+ * loads the snapshot, and the append-only log if aof is given, and from then on writes a snapshot
+ * every interval seconds (KV_SNAPSHOT_INTERVAL if 0) that the store changed, and when it is destroyed.
+ * with aof, every change is also logged, and flushed to disk according to fsync.
+ * call once, after kv_init and kv_limit. returns 0, or -1 with errno set.
+ */
+int kv_persist(const char *snapshot, int interval, const char *aof, int fsync);
+
+/*
+ * keeps the keys starting with prefix ("" for all) in the shared memory segment name, as shm_open names it,
+ * so that every process on the host sharing it sees the same keys. the segment is created with size bytes
+ * if it doesn't exist yet, and outlives the processes until it is unlinked.
+ * shared keys only hold values that can be copied in: kv_store fails with EINVAL for them, collections and kv_await
+ * with ENOTSUP, and they aren't indexed, persisted, or counted against memory budgets, only against the segment.
+ * when it is full, writes fail with ENOMEM once expired keys are swept. call once, after kv_init and kv_limit.
+ * returns 0, or -1 with errno set.
+ */
+int kv_share(const char *prefix, const char *name, size_t size);
+
+/*
+ * replication, to one follower that keeps a read-only copy of the store. kv_replicate connects to the follower
+ * at address, "host:port" or "unix:path", sends it a copy of the store and then every change as it happens,
+ * reconnecting and starting over when the connection is lost. a writer stalls while 64MB of changes
+ * are waiting to be sent, for a second at most and before locking anything, after which the follower is dropped;
+ * it is dropped at once if 128MB pile up regardless.
+ * kv_follow listens on address, empties the store each time the primary connects, and from then on applies what
+ * it sends. writes other than its own then fail with EROFS; a follower may itself replicate to another.
+ * only what kv_persist would log is sent: keys holding values kv_store was given, and shared keys, are left out.
+ * keys that expire are deleted on the follower as the primary reclaims them, besides expiring there on their own.
+ * each is called once, after kv_persist if at all. returns 0, or -1 with errno set.
+ */
+int kv_replicate(const char *address);
+int kv_follow(const char *address);
+
+/*
+ * partitions keys among n peers, by jump consistent hashing, each given by its address as kv_replicate takes it.
+ * every peer must list the same addresses in the same order; self is this one's position in the list, and it
+ * listens on listen, or its own address if listen is NULL. the keys of other peers are sent to them, from each thread
+ * over a connection of its own, and batches are pipelined. shared keys stay here. for keys of other peers,
+ * kv_store only deletes, failing with EINVAL for a value, and kv_await fails with ENOTSUP; kv_scan and kv_count only
+ * see the keys kept here. a peer that can't be reached fails the call with errno set, ETIMEDOUT if it doesn't reply
+ * within two seconds. call once, after kv_persist and kv_share. returns 0, or -1 with errno set.
+ */
+int kv_peers(const char **addresses, unsigned int n, unsigned int self, const char *listen);
+
+/*
+ * bytes allocated by the store as a whole when prefix is NULL, or for the entries of a namespace,
+ * or in the shared segment, by all processes, for the shared prefix.
+ */
+size_t kv_memory(const char *prefix);
+
+/*
+ * the store's counters and gauges as a JSON object, in memory the caller frees, or NULL if it couldn't be allocated.
+ * hits and misses count reads, expired and evicted the keys dropped for each reason, and keys, memory and maxmemory
+ * are as they stand; the object has these for the whole store, and under namespaces, for each namespace by prefix.
+ * lockWaits counts shard lock acquisitions: the first element those that didn't wait, element i those that waited
+ * under 2^i microseconds, and the last the longer waits; lockWaitTime is the microseconds waited in all.
+ * counters are kept per thread and summed here, so they cost writers nothing shared. shared keys aren't counted,
+ * but with a shared segment, shared is the memory in use there.
+ */
+char *kv_stats(void);
+
+/*
+ * creates, updates, or deletes (when value is NULL) key.
+ * a positive ttl expires key that many milliseconds from now, a negative one makes it persistent,
+ * and zero leaves the expiry of an existing key as it is.
+ * on success the store owns value, and calls ffn on it when it is replaced or deleted.
+ * returns 1 on success, 0 when nx was given and key exists or there was nothing to delete,
+ * and -1 with errno set on failure. value still belongs to the caller unless 1 is returned.
+ */
+int kv_store(const char *key, size_t klen, void *value, void (*ffn)(void *), int64_t ttl, int nx);
+
+/*
+ * as kv_store, but vlen bytes of value, of the given type, are copied into the entry itself, next to the key.
+ * for a collection type, value is its serialization as kv_copy gives it, and fails with EINVAL if malformed.
+ */
+int kv_put(const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx);
+
+/*
+ * copies the value of key into buf, and its type into *type unless type is NULL.
+ * values stored with kv_store must be strings, and are KV_STRING. collections are serialized: lists as a CBOR
+ * array of strings, hashes as a CBOR map, sorted sets as a CBOR array of [member,score] pairs in order,
+ * and HyperLogLogs as their registers.
+ * returns the (possibly reallocated) buf, or NULL, leaving buf untouched, if key is not in the store,
+ * or with errno set to ENOMEM if buf could not be grown, or as kv_peers says if key's peer couldn't be asked.
+ */
+sds kv_copy(const char *key, size_t klen, sds buf, int *type);
+
+/*
+ * returns the milliseconds until key expires, 0 if it never does or is not in the store,
+ * or -1 with errno set to ENOTSUP for a key on another peer, whose expiry isn't sent along with its value.
+ */
+int64_t kv_expires(const char *key, size_t klen);
+
+/*
+ * atomic read-modify-write operations, each applied under the key's shard lock, or for shared keys, retried
+ * until the key didn't change between reading and writing it. they keep the expiry of key.
+ * they return 1 on success, 0 where noted, or -1 with errno set.
+ *
+ * kv_add adds delta to the integer value of key, in decimal or CBOR, or to 0 if key doesn't exist,
+ * storing the result in *result. fails with EINVAL if the value isn't an integer, ERANGE on overflow.
+ * kv_concat appends vlen bytes of value, a KV_STRING or KV_BUFFER, to the value of key, creating it
+ * with that type if need be, and stores the new length in *length. fails with EINVAL on CBOR values.
+ * kv_swap sets key to value (deleting it if value is NULL) only if its value is expected, with type etype,
+ * or if expected is NULL, only if key doesn't exist; it returns 0 otherwise.
+ * kv_exchange sets key to value (deleting it if value is NULL) and copies the old value into *old, and its
+ * type into *otype; it returns 0 if there was no old value.
+ * kv_refresh changes the expiry of key as kv_store's ttl does, returning 0 if key doesn't exist.
+ */
+int kv_add(const char *key, size_t klen, int64_t delta, int64_t *result);
+int kv_concat(const char *key, size_t klen, const char *value, size_t vlen, int type, size_t *length);
+int kv_swap(const char *key, size_t klen, const char *expected, size_t elen, int etype, const char *value, size_t vlen, int type);
+int kv_exchange(const char *key, size_t klen, const char *value, size_t vlen, int type, sds *old, int *otype);
+int kv_refresh(const char *key, size_t klen, int64_t ttl);
+
+typedef struct {
+	const char *key;
+	size_t klen;
+	const char *value; // NULL to delete
+	size_t vlen;
+	int type;
+} kv_item;
+
+/*
+ * sets or deletes n keys, as kv_put does, all with the same ttl, taking each shard's lock once.
+ * returns how many keys were set or deleted, or -1 with errno set; keys handled before a failure stay so.
+ */
+long kv_mput(const kv_item *items, size_t n, int64_t ttl);
+
+/*
+ * looks up n keys at once, leaving a copy of each value in values[i], and its type in items[i].type,
+ * or NULL if the key is not in the store. returns 0, or -1 with errno set to ENOMEM, or as kv_peers says.
+ */
+int kv_mcopy(kv_item *items, size_t n, sds *values);
+
+/*
+ * collections, created by the first push or add and deleted once empty, with the expiry given by kv_refresh.
+ * each call runs under the key's shard lock, and fails with errno set to EINVAL if key holds another type.
+ * counts and lengths are returned as a long, 0 if key doesn't exist, and -1 with errno set on failure.
+ * values, members and lens are parallel arrays of n; results are arrays that kv_free_values frees.
+ *
+ * kv_push adds values to the front (left) or back of a list, the first value first, and returns its length.
+ * kv_pop removes up to count values from the front or back into *values, and returns how many.
+ * kv_range copies values start to stop, both included, where negative positions count from the back.
+ */
+long kv_push(const char *key, size_t klen, int left, const char **values, const size_t *lens, size_t n);
+long kv_pop(const char *key, size_t klen, int left, size_t count, sds **values);
+long kv_range(const char *key, size_t klen, long start, long stop, sds **values);
+
+/*
+ * kv_field_put sets n fields, fields[i] to values[i], and returns how many were new.
+ * kv_field_del returns how many fields were removed.
+ * kv_field_copy copies the value of field into *value, returning 1, or 0 if there is none.
+ */
+long kv_field_put(const char *key, size_t klen, const char **fields, const size_t *flens, const char **values, const size_t *vlens, size_t n);
+int kv_field_copy(const char *key, size_t klen, const char *field, size_t flen, sds *value);
+long kv_field_del(const char *key, size_t klen, const char **fields, const size_t *flens, size_t n);
+
+/*
+ * kv_member_add adds members, or updates their scores, and returns how many were new.
+ * kv_member_del returns how many members were removed.
+ * kv_member_score stores the score of member in *score, returning 1, or 0 if there is none.
+ * kv_member_range copies up to limit (0 for all) members scoring min to max, with their scores, in ascending order,
+ * or descending if reverse is set, skipping the first offset, and returns how many.
+ */
+long kv_member_add(const char *key, size_t klen, const char **members, const size_t *lens, const double *scores, size_t n);
+long kv_member_del(const char *key, size_t klen, const char **members, const size_t *lens, size_t n);
+int kv_member_score(const char *key, size_t klen, const char *member, size_t mlen, double *score);
+long kv_member_range(const char *key, size_t klen, double min, double max, size_t offset, size_t limit, int reverse, sds **members, double **scores);
+
+/*
+ * kv_distinct_add adds elements to a HyperLogLog, returning 1 if its estimate may have changed.
+ * kv_distinct_count returns the estimated number of distinct elements added.
+ */
+long kv_distinct_add(const char *key, size_t klen, const char **elements, const size_t *lens, size_t n);
+long kv_distinct_count(const char *key, size_t klen);
+
+// the number of values in a list, fields in a hash, or members of a sorted set
+long kv_len(const char *key, size_t klen);
+void kv_free_values(sds *values, size_t n);
+
+/*
+ * blocks the calling thread until key is set, deleted, changed or expired by anyone, or timeout milliseconds pass.
+ * unless etype is negative, returns at once if key doesn't hold expected, of type etype, compared as by kv_swap,
+ * with collections compared by their serialization; an expected of NULL stands for no value.
+ * passing what was last read as expected closes the gap between reading key and waiting for it.
+ * returns 1 if key changed, or doesn't hold expected, and 0 if it timed out, or right away if timeout isn't positive.
+ * fails with EBUSY if kv_waiters threads are already waiting, so that waiting can't tie up every worker.
+ */
+int kv_await(const char *key, size_t klen, const char *expected, size_t elen, int etype, int64_t timeout);
+
+// the most threads that may wait in kv_await at once, KV_DEFAULT_WAITERS unless set
+void kv_waiters(unsigned int max);
+
+/*
+ * keeps the keys of each shard ordered, for kv_scan and kv_count. call once, after kv_init and before
+ * the store is used by other threads; keys already in the store are indexed. returns 0, or -1 with errno set.
+ */
+int kv_index(void);
+
+/*
+ * finds, in memcmp order, up to limit keys that start with prefix and sort after after, when it isn't NULL.
+ * the keys are copied into buf one after another, their lengths into lens. no lock is held between calls,
+ * so passing the last key as after pages through keys even as the store changes.
+ * returns how many keys were found, or -1 with errno set to ENOTSUP if the index isn't enabled, or ENOMEM.
+ */
+long kv_scan(const char *prefix, size_t plen, const char *after, size_t alen, size_t limit, sds *buf, size_t *lens);
+
+// the number of keys starting with prefix, or -1 with errno set to ENOTSUP if the index isn't enabled
+long kv_count(const char *prefix, size_t plen);
+
+/*
+ * reads don't lock; values are reclaimed only once no thread that could have seen them is still pinned.
+ * pins nest, and every successful kv_pin must be paired with a kv_unpin on the same thread.
+ * kv_pin returns 0, or -1 if the thread could not be registered.
+ */
+int kv_pin(void);
+void kv_unpin(void);
+
+// module API, see README.md
+int kv_set(const char *key, void *value, void *ffn, int expiry, int nx);
+const char *kv_get(const char *key);
+char *kv_dup(const char *key);
+int kv_incr(const char *key, long long delta, long long *result);
+int kv_append(const char *key, const char *value);
+int kv_cas(const char *key, const char *expected, const char *value);
+char *kv_getset(const char *key, const char *value);
+int kv_touch(const char *key, int expiry);
+int kv_mget(const char **keys, int n, char **values);
+int kv_mset(const char **keys, const char **values, int n, int expiry);
+int kv_mdel(const char **keys, int n);
+long kv_lpush(const char *key, const char *value);
+long kv_rpush(const char *key, const char *value);
+char *kv_lpop(const char *key);
+char *kv_rpop(const char *key);
+int kv_hset(const char *key, const char *field, const char *value);
+char *kv_hget(const char *key, const char *field);
+int kv_hdel(const char *key, const char *field);
+int kv_zadd(const char *key, const char *member, double score);
+int kv_zscore(const char *key, const char *member, double *score);
+int kv_zrem(const char *key, const char *member);
+int kv_pfadd(const char *key, const char *element);
+long long kv_pfcount(const char *key);
+int kv_wait(const char *key, const char *expected, int timeout);
+int kv_write(const char *key, size_t klen, const char *value, size_t vlen, int type, int expiry, int nx);
+int kv_view(const char *key, size_t klen, void (*fn)(const char *value, size_t vlen, int type, void *arg), void *arg);
+
+#endif
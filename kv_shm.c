@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "kv.h"
+#include "kv_shm.h"
+
+/*
+ * the segment is a header, a table of buckets and a heap, and since every process maps it at its own address,
+ * entries link to each other by their offset from its start. each bucket is a chain of entries, guarded by one
+ * of KV_SHM_STRIPES locks; reads take the lock too, as entries are freed as soon as they are unlinked.
+ *
+ * the locks are process shared and robust, so a process dying while holding one doesn't block the others.
+ * writers link an entry only once it is complete, so chains stay intact whenever a process dies.
+ *
+ * the heap hands out power of two blocks, with a free list per size, under a lock of its own. blocks are never
+ * split or merged, so memory freed by entries of one size only serves entries of that size.
+ * expiries are CLOCK_MONOTONIC milliseconds, which all processes share; expired entries are dropped when found,
+ * and swept from the whole table when the heap runs out.
+ */
+#define KV_SHM_MAGIC   0x31766b6170656301ULL
+#define KV_SHM_CLASSES 48
+#define KV_SHM_MIN     6 // the smallest block, 64 bytes
+#define KV_SHM_WAIT    1000 // milliseconds to wait for another process to finish creating the segment
+
+#define KV_SHM_AT(off) ((kv_shm_entry *)((char *)SHM + (off)))
+
+typedef struct {
+	uint64_t magic; // set last, once the segment is ready
+	uint64_t size;
+	uint64_t nbuckets;
+	uint64_t version; // the last one given to an entry
+	uint64_t top; // the part of the heap not handed out yet starts here
+	uint64_t used;
+	uint64_t free[KV_SHM_CLASSES];
+	pthread_mutex_t heap;
+	pthread_mutex_t stripes[KV_SHM_STRIPES];
+	uint64_t buckets[];
+} kv_shm_header;
+
+typedef struct {
+	uint64_t next;
+	uint64_t hash;
+	uint64_t version;
+	uint64_t expires; // 0 for never
+	uint32_t klen;
+	uint32_t vlen;
+	uint8_t type;
+	uint8_t class; // of the block
+	char data[]; // key, NUL, value, NUL
+} kv_shm_entry;
+
+static kv_shm_header *SHM = NULL;
+
+static uint64_t kv_shm_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int kv_shm_mutex(pthread_mutex_t *m) {
+	pthread_mutexattr_t attr;
+	int rc;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+	rc = pthread_mutex_init(m,&attr);
+	pthread_mutexattr_destroy(&attr);
+	return rc;
+}
+
+// a lock whose owner died is taken over as it is, since writers leave the chains intact
+static void kv_shm_lock(pthread_mutex_t *m) {
+	if (pthread_mutex_lock(m) == EOWNERDEAD) pthread_mutex_consistent(m);
+}
+
+static pthread_mutex_t *kv_shm_stripe(uint64_t hash) {
+	return &SHM->stripes[hash & (KV_SHM_STRIPES - 1)];
+}
+
+static int kv_shm_expired(kv_shm_entry *e, uint64_t now) {
+	return e->expires != 0 && e->expires <= now;
+}
+
+// the link to the entry of key, which links to nothing if there is none. needs the stripe lock
+static uint64_t *kv_shm_find(uint64_t hash, const char *key, size_t klen) {
+	uint64_t *link;
+	kv_shm_entry *e;
+
+	for (link = &SHM->buckets[hash & (SHM->nbuckets - 1)]; *link != 0; link = &e->next) {
+		e = KV_SHM_AT(*link);
+		if (e->hash == hash && e->klen == klen && memcmp(e->data,key,klen) == 0) break;
+	}
+	return link;
+}
+
+static uint64_t kv_shm_alloc(size_t len) {
+	unsigned int c;
+	uint64_t off;
+
+	for (c = KV_SHM_MIN; c < KV_SHM_CLASSES && ((uint64_t)1 << c) < len; c++);
+	if (c == KV_SHM_CLASSES) return 0;
+	kv_shm_lock(&SHM->heap);
+	if ((off = SHM->free[c]) != 0) {
+		SHM->free[c] = KV_SHM_AT(off)->next;
+	} else if (SHM->top + ((uint64_t)1 << c) <= SHM->size) {
+		off = SHM->top;
+		SHM->top += (uint64_t)1 << c;
+	}
+	if (off != 0) SHM->used += (uint64_t)1 << c;
+	pthread_mutex_unlock(&SHM->heap);
+	if (off != 0) KV_SHM_AT(off)->class = c;
+	return off;
+}
+
+static void kv_shm_free(uint64_t off) {
+	kv_shm_entry *e = KV_SHM_AT(off);
+
+	kv_shm_lock(&SHM->heap);
+	e->next = SHM->free[e->class];
+	SHM->free[e->class] = off;
+	SHM->used -= (uint64_t)1 << e->class;
+	pthread_mutex_unlock(&SHM->heap);
+}
+
+// drops every expired entry, a stripe at a time
+static void kv_shm_sweep(void) {
+	uint64_t *link,now,off;
+	size_t i;
+	unsigned int s;
+
+	for (s = 0; s < KV_SHM_STRIPES; s++) {
+		kv_shm_lock(&SHM->stripes[s]);
+		now = kv_shm_now();
+		for (i = s; i < SHM->nbuckets; i += KV_SHM_STRIPES) {
+			for (link = &SHM->buckets[i]; (off = *link) != 0;) {
+				if (kv_shm_expired(KV_SHM_AT(off),now)) {
+					*link = KV_SHM_AT(off)->next;
+					kv_shm_free(off);
+				} else {
+					link = &KV_SHM_AT(off)->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&SHM->stripes[s]);
+	}
+}
+
+// a bucket per 1KB of segment, the table taking up less than 1% of it
+static int kv_shm_create(kv_shm_header *h, size_t size) {
+	size_t nbuckets,heap;
+	unsigned int i;
+
+	for (nbuckets = KV_SHM_STRIPES; nbuckets * 2 * 1024 <= size; nbuckets *= 2);
+	heap = (sizeof(kv_shm_header) + nbuckets * sizeof(uint64_t) + 63) & ~(size_t)63;
+	if (heap + ((size_t)1 << KV_SHM_MIN) > size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kv_shm_mutex(&h->heap) != 0) return -1;
+	for (i = 0; i < KV_SHM_STRIPES; i++) {
+		if (kv_shm_mutex(&h->stripes[i]) != 0) return -1;
+	}
+	h->size = size;
+	h->nbuckets = nbuckets;
+	h->top = heap;
+	__atomic_store_n(&h->magic,KV_SHM_MAGIC,__ATOMIC_RELEASE);
+	return 0;
+}
+
+int kv_shm_open(const char *name, size_t size) {
+	kv_shm_header *h;
+	struct stat st;
+	int fd,created = 1,i;
+
+	if (SHM != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	if ((fd = shm_open(name,O_RDWR | O_CREAT | O_EXCL,0600)) == -1) {
+		if (errno != EEXIST || (fd = shm_open(name,O_RDWR,0600)) == -1) return -1;
+		created = 0;
+	}
+	if (created && ftruncate(fd,size) == -1) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	// a segment another process has only just created may not have its size yet
+	for (i = 0; !created && fstat(fd,&st) == 0 && st.st_size == 0 && i < KV_SHM_WAIT; i++) usleep(1000);
+	if (!created && (fstat(fd,&st) == -1 || (size = st.st_size) < sizeof(kv_shm_header))) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	h = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		if (created) shm_unlink(name);
+		return -1;
+	}
+	if (created && kv_shm_create(h,size) == -1) {
+		munmap(h,size);
+		shm_unlink(name);
+		return -1;
+	}
+	for (i = 0; !created && __atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != KV_SHM_MAGIC && i < KV_SHM_WAIT; i++) usleep(1000);
+	if (__atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != KV_SHM_MAGIC || h->size != size) {
+		munmap(h,size);
+		errno = EINVAL;
+		return -1;
+	}
+	SHM = h;
+	return 0;
+}
+
+// the segment stays, for the other processes and the next start, until it is unlinked
+void kv_shm_close(void) {
+	if (SHM == NULL) return;
+	munmap(SHM,SHM->size);
+	SHM = NULL;
+}
+
+int kv_shm_put(uint64_t hash, const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx, const uint64_t *expect) {
+	pthread_mutex_t *lock;
+	kv_shm_entry *e = NULL,*old;
+	uint64_t *link,off = 0,gone = 0,now;
+	size_t len;
+	int live,rc = 1;
+
+	if (value != NULL) {
+		len = sizeof(kv_shm_entry) + klen + vlen + 2;
+		if (klen > UINT32_MAX || vlen > UINT32_MAX || len > SHM->size) {
+			errno = E2BIG;
+			return -1;
+		}
+		if ((off = kv_shm_alloc(len)) == 0) {
+			kv_shm_sweep();
+			off = kv_shm_alloc(len);
+		}
+		if (off == 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		e = KV_SHM_AT(off);
+		e->hash = hash;
+		e->klen = klen;
+		e->vlen = vlen;
+		e->type = type;
+		memcpy(e->data,key,klen);
+		e->data[klen] = '\0';
+		memcpy(e->data + klen + 1,value,vlen);
+		e->data[klen + 1 + vlen] = '\0';
+	}
+
+	lock = kv_shm_stripe(hash);
+	kv_shm_lock(lock);
+	now = kv_shm_now();
+	link = kv_shm_find(hash,key,klen);
+	old = *link != 0 ? KV_SHM_AT(*link) : NULL;
+	live = old != NULL && !kv_shm_expired(old,now);
+	if (expect != NULL && (live ? old->version : 0) != *expect) {
+		errno = EAGAIN;
+		rc = -1;
+	} else if ((nx && live) || (e == NULL && !live)) {
+		rc = 0;
+	}
+	if (rc == 1 && e != NULL) {
+		e->expires = ttl > 0 ? now + ttl : ttl == 0 && live ? old->expires : 0;
+		e->version = __atomic_add_fetch(&SHM->version,1,__ATOMIC_RELAXED);
+		e->next = old != NULL ? old->next : 0;
+		gone = *link;
+		*link = off;
+		off = 0;
+	} else if (old != NULL && (rc == 1 || !live)) {
+		// deleted, or found expired
+		gone = *link;
+		*link = old->next;
+	}
+	pthread_mutex_unlock(lock);
+
+	if (gone != 0) kv_shm_free(gone);
+	if (off != 0) kv_shm_free(off);
+	return rc;
+}
+
+sds kv_shm_copy(uint64_t hash, const char *key, size_t klen, sds buf, int *type, uint64_t *version) {
+	pthread_mutex_t *lock;
+	kv_shm_entry *e;
+	uint64_t *link;
+	sds copy = NULL;
+
+	lock = kv_shm_stripe(hash);
+	kv_shm_lock(lock);
+	link = kv_shm_find(hash,key,klen);
+	e = *link != 0 ? KV_SHM_AT(*link) : NULL;
+	if (e != NULL && kv_shm_expired(e,kv_shm_now())) e = NULL;
+	if (version != NULL) *version = e != NULL ? e->version : 0;
+	if (e != NULL) {
+		sdsclear(buf);
+		if ((copy = sdscatlen(buf,e->data + e->klen + 1,e->vlen)) == NULL) errno = ENOMEM;
+		if (type != NULL) *type = e->type;
+	}
+	pthread_mutex_unlock(lock);
+	return copy;
+}
+
+int kv_shm_refresh(uint64_t hash, const char *key, size_t klen, int64_t ttl) {
+	pthread_mutex_t *lock;
+	kv_shm_entry *e;
+	uint64_t *link,now;
+	int rc = 1;
+
+	lock = kv_shm_stripe(hash);
+	kv_shm_lock(lock);
+	now = kv_shm_now();
+	link = kv_shm_find(hash,key,klen);
+	e = *link != 0 ? KV_SHM_AT(*link) : NULL;
+	if (e == NULL || kv_shm_expired(e,now)) rc = 0;
+	else if (ttl != 0) e->expires = ttl > 0 ? now + ttl : 0;
+	pthread_mutex_unlock(lock);
+	return rc;
+}
+
+int64_t kv_shm_expires(uint64_t hash, const char *key, size_t klen) {
+	pthread_mutex_t *lock;
+	kv_shm_entry *e;
+	uint64_t *link,now;
+	int64_t ttl = 0;
+
+	lock = kv_shm_stripe(hash);
+	kv_shm_lock(lock);
+	now = kv_shm_now();
+	link = kv_shm_find(hash,key,klen);
+	e = *link != 0 ? KV_SHM_AT(*link) : NULL;
+	if (e != NULL && !kv_shm_expired(e,now) && e->expires != 0) ttl = e->expires - now;
+	pthread_mutex_unlock(lock);
+	return ttl;
+}
+
+size_t kv_shm_memory(void) {
+	return SHM != NULL ? __atomic_load_n(&SHM->used,__ATOMIC_RELAXED) : 0;
+}
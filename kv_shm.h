@@ -0,0 +1,31 @@
+#ifndef CEPA_KV_SHM_H
+#define CEPA_KV_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sds.h>
+
+#define KV_SHM_STRIPES 64
+
+/*
+ * a table of plain values (KV_STRING to KV_CBOR) in a shared memory segment, seen by every process that maps it.
+ * kv_shm_open maps the segment name, creating it with size bytes if it doesn't exist, or taking the size it has.
+ * keys are hashed by the caller. every entry has a version, unique within the segment, and 0 stands for no entry.
+ *
+ * kv_shm_put sets key to value, or deletes it if value is NULL, with ttl as kv_store takes it; it returns 1,
+ * 0 if nx was given and key exists or there was nothing to delete, or -1 with errno set: EAGAIN if expect
+ * isn't NULL and the version of key isn't *expect, ENOMEM if the segment is full, E2BIG if the entry can't fit in it.
+ * kv_shm_copy copies the value into buf, as kv_copy does, and its version into *version unless version is NULL.
+ * kv_shm_refresh changes the expiry of key as kv_refresh does, and kv_shm_expires returns it as kv_expires does.
+ */
+int kv_shm_open(const char *name, size_t size);
+void kv_shm_close(void);
+int kv_shm_put(uint64_t hash, const char *key, size_t klen, const char *value, size_t vlen, int type, int64_t ttl, int nx, const uint64_t *expect);
+sds kv_shm_copy(uint64_t hash, const char *key, size_t klen, sds buf, int *type, uint64_t *version);
+int kv_shm_refresh(uint64_t hash, const char *key, size_t klen, int64_t ttl);
+int64_t kv_shm_expires(uint64_t hash, const char *key, size_t klen);
+
+// bytes of the segment's heap in use, by all processes
+size_t kv_shm_memory(void);
+
+#endif
@@ -0,0 +1,535 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "kv.h"
+#include "kv_types.h"
+
+/*
+ * the collections a key can hold: lists are a ring buffer of values, so pushing and popping at either
+ * end is O(1); hashes are a uthash table of fields; sorted sets are a skiplist ordered by score and then
+ * member, with a uthash table from member to node, so adds, removes and range starts are O(log n); and
+ * HyperLogLogs are 2^14 registers of 6 bits, 12KB for any number of elements and a standard error of 0.8%.
+ *
+ * none of this locks: kv.c only touches a collection under its shard's lock. each collection counts the
+ * bytes it has allocated, for the store to charge against its budgets.
+ */
+
+static size_t kv_sds_bytes(sds s) {
+	return KV_ALLOCATED(sdsAllocPtr(s));
+}
+
+kv_list *kv_list_new(void) {
+	kv_list *l;
+
+	if ((l = calloc(1,sizeof(kv_list))) != NULL) l->bytes = KV_ALLOCATED(l);
+	return l;
+}
+
+void kv_list_free(void *ptr) {
+	kv_list *l = ptr;
+	size_t i;
+
+	for (i = 0; i < l->count; i++) sdsfree(kv_list_at(l,i));
+	free(l->items);
+	free(l);
+}
+
+sds kv_list_at(kv_list *l, size_t i) {
+	return l->items[(l->head + i) & (l->size - 1)];
+}
+
+static int kv_list_grow(kv_list *l) {
+	size_t size = l->size ? l->size * 2 : 8,i;
+	sds *items;
+
+	if ((items = malloc(size * sizeof(sds))) == NULL) return -1;
+	for (i = 0; i < l->count; i++) items[i] = kv_list_at(l,i);
+	if (l->items != NULL) l->bytes -= KV_ALLOCATED(l->items);
+	free(l->items);
+	l->items = items;
+	l->head = 0;
+	l->size = size;
+	l->bytes += KV_ALLOCATED(items);
+	return 0;
+}
+
+// returns 0, or -1 if out of memory
+int kv_list_push(kv_list *l, int left, const char *value, size_t len) {
+	sds s;
+
+	if (l->count == l->size && kv_list_grow(l) == -1) return -1;
+	if ((s = sdsnewlen(value,len)) == NULL) return -1;
+	if (left) {
+		l->head = (l->head - 1) & (l->size - 1);
+		l->items[l->head] = s;
+	} else {
+		l->items[(l->head + l->count) & (l->size - 1)] = s;
+	}
+	l->count++;
+	l->bytes += kv_sds_bytes(s);
+	return 0;
+}
+
+// the value, for the caller to free, or NULL if the list is empty
+sds kv_list_pop(kv_list *l, int left) {
+	sds s;
+
+	if (l->count == 0) return NULL;
+	if (left) {
+		s = l->items[l->head];
+		l->head = (l->head + 1) & (l->size - 1);
+	} else {
+		s = kv_list_at(l,l->count - 1);
+	}
+	l->count--;
+	l->bytes -= kv_sds_bytes(s);
+	return s;
+}
+
+kv_dict *kv_dict_new(void) {
+	kv_dict *d;
+
+	if ((d = calloc(1,sizeof(kv_dict))) != NULL) d->bytes = KV_ALLOCATED(d);
+	return d;
+}
+
+void kv_dict_free(void *ptr) {
+	kv_dict *d = ptr;
+	kv_field *f,*tmp;
+
+	HASH_ITER(hh,d->fields,f,tmp) {
+		HASH_DEL(d->fields,f);
+		sdsfree(f->name);
+		sdsfree(f->value);
+		free(f);
+	}
+	free(d);
+}
+
+kv_field *kv_dict_get(kv_dict *d, const char *name, size_t len) {
+	kv_field *f;
+
+	HASH_FIND(hh,d->fields,name,len,f);
+	return f;
+}
+
+// returns 1 if the field is new, 0 if it was replaced, or -1 if out of memory
+int kv_dict_set(kv_dict *d, const char *name, size_t len, const char *value, size_t vlen) {
+	kv_field *f;
+	sds v;
+
+	if ((v = sdsnewlen(value,vlen)) == NULL) return -1;
+	if ((f = kv_dict_get(d,name,len)) != NULL) {
+		d->bytes -= kv_sds_bytes(f->value);
+		sdsfree(f->value);
+		f->value = v;
+		d->bytes += kv_sds_bytes(v);
+		return 0;
+	}
+	if ((f = malloc(sizeof(kv_field))) == NULL || (f->name = sdsnewlen(name,len)) == NULL) {
+		free(f);
+		sdsfree(v);
+		return -1;
+	}
+	f->value = v;
+	HASH_ADD_KEYPTR(hh,d->fields,f->name,len,f);
+	d->count++;
+	d->bytes += KV_ALLOCATED(f) + kv_sds_bytes(f->name) + kv_sds_bytes(v);
+	return 1;
+}
+
+// returns 1 if the field was removed, 0 if there was none
+int kv_dict_del(kv_dict *d, const char *name, size_t len) {
+	kv_field *f;
+
+	if ((f = kv_dict_get(d,name,len)) == NULL) return 0;
+	HASH_DEL(d->fields,f);
+	d->count--;
+	d->bytes -= KV_ALLOCATED(f) + kv_sds_bytes(f->name) + kv_sds_bytes(f->value);
+	sdsfree(f->name);
+	sdsfree(f->value);
+	free(f);
+	return 1;
+}
+
+kv_zset *kv_zset_new(void) {
+	kv_zset *z;
+
+	if ((z = calloc(1,sizeof(kv_zset))) == NULL) return NULL;
+	if ((z->head = calloc(1,sizeof(kv_znode) + KV_ZLEVELS * sizeof(kv_znode *))) == NULL) {
+		free(z);
+		return NULL;
+	}
+	z->head->height = KV_ZLEVELS;
+	z->bytes = KV_ALLOCATED(z) + KV_ALLOCATED(z->head);
+	return z;
+}
+
+void kv_zset_free(void *ptr) {
+	kv_zset *z = ptr;
+	kv_znode *n,*next;
+
+	HASH_CLEAR(hh,z->members);
+	for (n = z->head->next[0]; n != NULL; n = next) {
+		next = n->next[0];
+		sdsfree(n->member);
+		free(n);
+	}
+	free(z->head);
+	free(z);
+}
+
+kv_znode *kv_zset_get(kv_zset *z, const char *member, size_t len) {
+	kv_znode *n;
+
+	HASH_FIND(hh,z->members,member,len,n);
+	return n;
+}
+
+static int kv_zset_before(kv_znode *n, double score, sds member) {
+	size_t len;
+	int c;
+
+	if (n->score != score) return n->score < score;
+	len = sdslen(n->member) < sdslen(member) ? sdslen(n->member) : sdslen(member);
+	if ((c = memcmp(n->member,member,len)) != 0) return c < 0;
+	return sdslen(n->member) < sdslen(member);
+}
+
+// fills preds with the last node before n on each level
+static void kv_zset_seek(kv_zset *z, kv_znode *n, kv_znode **preds) {
+	kv_znode *x = z->head;
+	int level;
+
+	for (level = KV_ZLEVELS - 1; level >= 0; level--) {
+		while (x->next[level] != NULL && kv_zset_before(x->next[level],n->score,n->member)) x = x->next[level];
+		preds[level] = x;
+	}
+}
+
+static void kv_zset_link(kv_zset *z, kv_znode *n) {
+	kv_znode *preds[KV_ZLEVELS];
+	unsigned int level;
+
+	kv_zset_seek(z,n,preds);
+	for (level = 0; level < n->height; level++) {
+		n->next[level] = preds[level]->next[level];
+		preds[level]->next[level] = n;
+	}
+	n->back = preds[0] == z->head ? NULL : preds[0];
+	if (n->next[0] != NULL) n->next[0]->back = n;
+	else z->tail = n;
+}
+
+static void kv_zset_unlink(kv_zset *z, kv_znode *n) {
+	kv_znode *preds[KV_ZLEVELS];
+	unsigned int level;
+
+	kv_zset_seek(z,n,preds);
+	for (level = 0; level < n->height; level++) preds[level]->next[level] = n->next[level];
+	if (n->next[0] != NULL) n->next[0]->back = n->back;
+	else z->tail = n->back;
+}
+
+// random supplies the node's height, a level per two bits set; returns 1 if member is new, 0 if its score was updated, or -1 if out of memory
+int kv_zset_add(kv_zset *z, const char *member, size_t len, double score, uint64_t random) {
+	unsigned int height = 1;
+	kv_znode *n;
+
+	if ((n = kv_zset_get(z,member,len)) != NULL) {
+		if (n->score != score) {
+			kv_zset_unlink(z,n);
+			n->score = score;
+			kv_zset_link(z,n);
+		}
+		return 0;
+	}
+	while (height < KV_ZLEVELS && (random & 3) == 3) {
+		height++;
+		random >>= 2;
+	}
+	if ((n = calloc(1,sizeof(kv_znode) + height * sizeof(kv_znode *))) == NULL) return -1;
+	if ((n->member = sdsnewlen(member,len)) == NULL) {
+		free(n);
+		return -1;
+	}
+	n->score = score;
+	n->height = height;
+	kv_zset_link(z,n);
+	HASH_ADD_KEYPTR(hh,z->members,n->member,len,n);
+	z->count++;
+	z->bytes += KV_ALLOCATED(n) + kv_sds_bytes(n->member);
+	return 1;
+}
+
+// returns 1 if member was removed, 0 if there was none
+int kv_zset_del(kv_zset *z, const char *member, size_t len) {
+	kv_znode *n;
+
+	if ((n = kv_zset_get(z,member,len)) == NULL) return 0;
+	kv_zset_unlink(z,n);
+	HASH_DEL(z->members,n);
+	z->count--;
+	z->bytes -= KV_ALLOCATED(n) + kv_sds_bytes(n->member);
+	sdsfree(n->member);
+	free(n);
+	return 1;
+}
+
+// the first member scoring min or more, or NULL
+kv_znode *kv_zset_from(kv_zset *z, double min) {
+	kv_znode *x = z->head;
+	int level;
+
+	for (level = KV_ZLEVELS - 1; level >= 0; level--) {
+		while (x->next[level] != NULL && x->next[level]->score < min) x = x->next[level];
+	}
+	return x->next[0];
+}
+
+// the last member scoring max or less, or NULL
+kv_znode *kv_zset_to(kv_zset *z, double max) {
+	kv_znode *x = z->head;
+	int level;
+
+	for (level = KV_ZLEVELS - 1; level >= 0; level--) {
+		while (x->next[level] != NULL && x->next[level]->score <= max) x = x->next[level];
+	}
+	return x == z->head ? NULL : x;
+}
+
+kv_hll *kv_hll_new(void) {
+	return calloc(1,sizeof(kv_hll));
+}
+
+static unsigned int kv_hll_get(const kv_hll *h, unsigned int i) {
+	size_t bit = (size_t)i * 6,at = bit >> 3;
+	unsigned int v = h->regs[at];
+
+	if (at + 1 < sizeof(h->regs)) v |= h->regs[at + 1] << 8;
+	return (v >> (bit & 7)) & 63;
+}
+
+static void kv_hll_set(kv_hll *h, unsigned int i, unsigned int r) {
+	size_t bit = (size_t)i * 6,at = bit >> 3;
+	unsigned int v = h->regs[at];
+
+	if (at + 1 < sizeof(h->regs)) v |= h->regs[at + 1] << 8;
+	v = (v & ~(63u << (bit & 7))) | (r << (bit & 7));
+	h->regs[at] = v & 0xff;
+	if (at + 1 < sizeof(h->regs)) h->regs[at + 1] = v >> 8;
+}
+
+// hash must be a well mixed 64 bit hash of the element; returns 1 if a register changed
+int kv_hll_add(kv_hll *h, uint64_t hash) {
+	unsigned int i = hash & (KV_HLL_SLOTS - 1),rank;
+	uint64_t rest = hash >> KV_HLL_BITS;
+
+	rank = rest ? __builtin_ctzll(rest) + 1 : 64 - KV_HLL_BITS + 1;
+	if (rank <= kv_hll_get(h,i)) return 0;
+	kv_hll_set(h,i,rank);
+	return 1;
+}
+
+// the estimate, by linear counting while registers are still empty and the harmonic mean after
+uint64_t kv_hll_count(const kv_hll *h) {
+	double m = KV_HLL_SLOTS,alpha = 0.7213 / (1 + 1.079 / m),sum = 0,estimate;
+	unsigned int i,r,zeros = 0;
+
+	for (i = 0; i < KV_HLL_SLOTS; i++) {
+		r = kv_hll_get(h,i);
+		sum += ldexp(1.0,-(int)r);
+		if (r == 0) zeros++;
+	}
+	estimate = alpha * m * m / sum;
+	if (estimate <= 2.5 * m && zeros) estimate = m * log(m / zeros);
+	return (uint64_t)(estimate + 0.5);
+}
+
+// CBOR heads, strings and doubles, as far as collections need them. the writers free s on failure
+static sds kv_cbor_append(sds s, const void *p, size_t len) {
+	sds t;
+
+	if ((t = sdscatlen(s,p,len)) == NULL) sdsfree(s);
+	return t;
+}
+
+static sds kv_cbor_head(sds s, int major, uint64_t n) {
+	unsigned char b[9];
+	size_t len = n < 24 ? 0 : n <= 0xff ? 1 : n <= 0xffff ? 2 : n <= 0xffffffff ? 4 : 8,i;
+
+	b[0] = major << 5 | (len == 0 ? n : len == 1 ? 24 : len == 2 ? 25 : len == 4 ? 26 : 27);
+	for (i = 0; i < len; i++) b[1 + i] = n >> (8 * (len - 1 - i));
+	return kv_cbor_append(s,b,len + 1);
+}
+
+static sds kv_cbor_string(sds s, sds str) {
+	if ((s = kv_cbor_head(s,3,sdslen(str))) == NULL) return NULL;
+	return kv_cbor_append(s,str,sdslen(str));
+}
+
+static sds kv_cbor_double(sds s, double d) {
+	unsigned char b[9];
+	uint64_t bits;
+	int i;
+
+	memcpy(&bits,&d,8);
+	b[0] = 0xfb;
+	for (i = 0; i < 8; i++) b[1 + i] = bits >> (56 - 8 * i);
+	return kv_cbor_append(s,b,9);
+}
+
+static int kv_cbor_get_head(const unsigned char **p, const unsigned char *end, int major, uint64_t *n) {
+	size_t len,i;
+
+	if (*p >= end || **p >> 5 != major) return -1;
+	if ((**p & 31) < 24) {
+		*n = *(*p)++ & 31;
+		return 0;
+	}
+	if ((**p & 31) > 27) return -1;
+	len = 1 << ((**p & 31) - 24);
+	if (end - *p < (ptrdiff_t)(len + 1)) return -1;
+	for (*n = 0, i = 1; i <= len; i++) *n = *n << 8 | (*p)[i];
+	*p += len + 1;
+	return 0;
+}
+
+static int kv_cbor_get_string(const unsigned char **p, const unsigned char *end, const char **s, size_t *len) {
+	uint64_t n;
+
+	if (kv_cbor_get_head(p,end,3,&n) == -1 || n > (uint64_t)(end - *p)) return -1;
+	*s = (const char *)*p;
+	*len = n;
+	*p += n;
+	return 0;
+}
+
+static int kv_cbor_get_double(const unsigned char **p, const unsigned char *end, double *d) {
+	uint64_t bits = 0;
+	int i;
+
+	if (end - *p < 9 || **p != 0xfb) return -1;
+	for (i = 1; i <= 8; i++) bits = bits << 8 | (*p)[i];
+	memcpy(d,&bits,8);
+	*p += 9;
+	return 0;
+}
+
+void *kv_type_new(int type) {
+	switch (type) {
+	case KV_LIST: return kv_list_new();
+	case KV_HASH: return kv_dict_new();
+	case KV_ZSET: return kv_zset_new();
+	case KV_HLL: return kv_hll_new();
+	}
+	return NULL;
+}
+
+void (*kv_type_free(int type))(void *) {
+	switch (type) {
+	case KV_LIST: return kv_list_free;
+	case KV_HASH: return kv_dict_free;
+	case KV_ZSET: return kv_zset_free;
+	}
+	return free;
+}
+
+size_t kv_type_bytes(int type, void *value) {
+	switch (type) {
+	case KV_LIST: return ((kv_list *)value)->bytes;
+	case KV_HASH: return ((kv_dict *)value)->bytes;
+	case KV_ZSET: return ((kv_zset *)value)->bytes;
+	}
+	return KV_ALLOCATED(value);
+}
+
+// the number of elements; HyperLogLogs are never empty
+size_t kv_type_count(int type, void *value) {
+	switch (type) {
+	case KV_LIST: return ((kv_list *)value)->count;
+	case KV_HASH: return ((kv_dict *)value)->count;
+	case KV_ZSET: return ((kv_zset *)value)->count;
+	}
+	return 1;
+}
+
+// lists as an array of strings, hashes as a map of strings, sorted sets as an array of [member,score] in order; frees out on failure
+sds kv_type_encode(int type, void *value, sds out) {
+	kv_list *l = value;
+	kv_dict *d = value;
+	kv_zset *z = value;
+	kv_field *f;
+	kv_znode *n;
+	size_t i;
+
+	switch (type) {
+	case KV_LIST:
+		out = kv_cbor_head(out,4,l->count);
+		for (i = 0; out != NULL && i < l->count; i++) out = kv_cbor_string(out,kv_list_at(l,i));
+		return out;
+	case KV_HASH:
+		out = kv_cbor_head(out,5,d->count);
+		for (f = d->fields; out != NULL && f != NULL; f = f->hh.next) {
+			if ((out = kv_cbor_string(out,f->name)) != NULL) out = kv_cbor_string(out,f->value);
+		}
+		return out;
+	case KV_ZSET:
+		out = kv_cbor_head(out,4,z->count);
+		for (n = z->head->next[0]; out != NULL && n != NULL; n = n->next[0]) {
+			if ((out = kv_cbor_head(out,4,2)) != NULL && (out = kv_cbor_string(out,n->member)) != NULL) out = kv_cbor_double(out,n->score);
+		}
+		return out;
+	}
+	return kv_cbor_append(out,((kv_hll *)value)->regs,sizeof(kv_hll));
+}
+
+void *kv_type_decode(int type, const char *p, size_t len) {
+	const unsigned char *at = (const unsigned char *)p,*end = at + len;
+	const char *name,*s;
+	size_t nlen,slen;
+	uint64_t n,i,pair,seed = 0x9e3779b97f4a7c15ULL;
+	double score;
+	void *value;
+	int rc = 0;
+
+	if (type == KV_HLL && len != sizeof(kv_hll)) rc = -1;
+	else if (type != KV_HLL && kv_cbor_get_head(&at,end,type == KV_HASH ? 5 : 4,&n) == -1) rc = -1;
+	if (rc == -1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((value = kv_type_new(type)) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (type == KV_HLL) {
+		memcpy(((kv_hll *)value)->regs,p,len);
+		return value;
+	}
+	for (i = 0; rc == 0 && i < n; i++) {
+		errno = EINVAL;
+		if (type == KV_ZSET && (kv_cbor_get_head(&at,end,4,&pair) == -1 || pair != 2)) rc = -1;
+		else if (kv_cbor_get_string(&at,end,&name,&nlen) == -1) rc = -1;
+		else if (type == KV_HASH && kv_cbor_get_string(&at,end,&s,&slen) == -1) rc = -1;
+		else if (type == KV_ZSET && kv_cbor_get_double(&at,end,&score) == -1) rc = -1;
+		else {
+			errno = ENOMEM;
+			if (type == KV_LIST) rc = kv_list_push(value,0,name,nlen);
+			else if (type == KV_HASH) rc = kv_dict_set(value,name,nlen,s,slen) == -1 ? -1 : 0;
+			else {
+				seed ^= seed << 13;
+				seed ^= seed >> 7;
+				seed ^= seed << 17;
+				rc = kv_zset_add(value,name,nlen,score,seed) == -1 ? -1 : 0;
+			}
+		}
+	}
+	if (rc == -1) {
+		kv_type_free(type)(value);
+		return NULL;
+	}
+	return value;
+}
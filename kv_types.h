@@ -0,0 +1,97 @@
+#ifndef CEPA_KV_TYPES_H
+#define CEPA_KV_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <sds.h>
+#include <uthash.h>
+
+// what an allocation really costs: its usable size plus the allocator's chunk header
+#define KV_ALLOCATED(p) (malloc_usable_size(p) + sizeof(size_t))
+
+#define KV_ZLEVELS   32
+#define KV_HLL_BITS  14
+#define KV_HLL_SLOTS (1 << KV_HLL_BITS)
+
+// values in a ring buffer
+typedef struct {
+	sds *items;
+	size_t head;
+	size_t count;
+	size_t size; // a power of two
+	size_t bytes;
+} kv_list;
+
+typedef struct {
+	sds name;
+	sds value;
+	UT_hash_handle hh;
+} kv_field;
+
+typedef struct {
+	kv_field *fields;
+	size_t count;
+	size_t bytes;
+} kv_dict;
+
+// ordered by score, then member
+typedef struct kv_znode {
+	sds member;
+	double score;
+	UT_hash_handle hh;
+	struct kv_znode *back;
+	unsigned int height;
+	struct kv_znode *next[];
+} kv_znode;
+
+typedef struct {
+	kv_znode *head;
+	kv_znode *tail;
+	kv_znode *members;
+	size_t count;
+	size_t bytes;
+} kv_zset;
+
+// 6 bit registers, packed
+typedef struct {
+	uint8_t regs[KV_HLL_SLOTS * 6 / 8];
+} kv_hll;
+
+kv_list *kv_list_new(void);
+void kv_list_free(void *ptr);
+int kv_list_push(kv_list *l, int left, const char *value, size_t len);
+sds kv_list_pop(kv_list *l, int left);
+sds kv_list_at(kv_list *l, size_t i);
+
+kv_dict *kv_dict_new(void);
+void kv_dict_free(void *ptr);
+kv_field *kv_dict_get(kv_dict *d, const char *name, size_t len);
+int kv_dict_set(kv_dict *d, const char *name, size_t len, const char *value, size_t vlen);
+int kv_dict_del(kv_dict *d, const char *name, size_t len);
+
+kv_zset *kv_zset_new(void);
+void kv_zset_free(void *ptr);
+kv_znode *kv_zset_get(kv_zset *z, const char *member, size_t len);
+int kv_zset_add(kv_zset *z, const char *member, size_t len, double score, uint64_t random);
+int kv_zset_del(kv_zset *z, const char *member, size_t len);
+kv_znode *kv_zset_from(kv_zset *z, double min);
+kv_znode *kv_zset_to(kv_zset *z, double max);
+
+kv_hll *kv_hll_new(void);
+int kv_hll_add(kv_hll *h, uint64_t hash);
+uint64_t kv_hll_count(const kv_hll *h);
+
+/*
+ * by type (KV_LIST, KV_HASH, KV_ZSET or KV_HLL): an empty collection, the function that frees one,
+ * the bytes one has allocated, and its serialization, which is CBOR except for HyperLogLogs, whose
+ * registers are copied as they are. kv_type_decode returns NULL with errno set to EINVAL or ENOMEM.
+ */
+void *kv_type_new(int type);
+void (*kv_type_free(int type))(void *);
+size_t kv_type_bytes(int type, void *value);
+size_t kv_type_count(int type, void *value);
+sds kv_type_encode(int type, void *value, sds out);
+void *kv_type_decode(int type, const char *p, size_t len);
+
+#endif
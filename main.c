@@ -1,9 +1,13 @@
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dlfcn.h>
 #include <pthread.h>
 #include <time.h>
@@ -14,18 +18,49 @@
 #include <onion/shortcuts.h>
 #include <onion/exportlocal.h>
 #include <onion/dict.h>
+#include <onion/block.h>
 #include <sds.h>
 #include <ezxml.h>
 #include <duktape.h>
 #include <utlist.h>
 #include <uthash.h>
 #include <sqlite3.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include "kv.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CEPA_SIMD_X86
+#endif
 
 #define CEPA_DEFAULT_CHDIR  "/"
 #define CEPA_DEFAULT_PORT   "8080"
 #define CEPA_PATH_MAX       128
 #define CEPA_USE_INDEX_HTML 1
 
+#define CEPA_ESCAPE_HTML  0
+#define CEPA_ESCAPE_URL   1
+#define CEPA_ESCAPE_UNURL 2
+#define CEPA_ESCAPE_JSON  3
+
+#define CEPA_JSON_MAX_DEPTH 1000
+#define CEPA_JSON_BODY_MAX  (1024 * 1024)
+
+#define CEPA_FORMAT_JSON    0
+#define CEPA_FORMAT_CBOR    1
+#define CEPA_FORMAT_MSGPACK 2
+
+#define CEPA_RANDOM_MAX     65536
+
+#define CEPA_KV_SCAN_LIMIT 100
+#define CEPA_KV_SCAN_MAX   10000
+
+#define CEPA_KV_ABI 2 // the version of the key/value functions in module_context
+
+#define CEPA_CACHE_WAIT  10 // seconds a producer may hold its key, and others wait for it, unless given
+#define CEPA_CACHE_POLL  10 // milliseconds between looks at a key that can't be waited on
+#define CEPA_CACHE_TOKEN 16
+
 typedef struct module {
 	char *name;
 	char *url;
@@ -60,6 +95,8 @@ typedef struct {
 	const char *jslibpath;
 	jslib *jslibs;
 	int rc;
+	void *body;
+	size_t body_len;
 } context;
 
 typedef struct {
@@ -70,13 +107,22 @@ typedef struct {
 	UT_hash_handle hh;
 } bytecode;
 
+// a url whose key is served straight from the store
 typedef struct {
-	char *key;
-	void *value;
-	timer_t timer;
-	void (*ffn)(void *);
-	UT_hash_handle hh;
-} keyvalue;
+	sds prefix;
+	char *type; // served for every key, if set
+	int methods; // 1 << OR_GET and so on
+	sds allow;
+	int64_t ttl; // milliseconds, for PUTs without X-TTL
+	size_t maxsize;
+} kv_route;
+
+typedef struct {
+	size_t (*html)(const char *str, size_t len);
+	size_t (*json)(const char *str, size_t len);
+	size_t (*url)(const char *str, size_t len);
+	size_t (*unurl)(const char *str, size_t len);
+} escapers;
 
 typedef struct {
 	onion *server;
@@ -90,20 +136,55 @@ typedef struct {
 	char *modules_path;
 	int (*kv_set)(const char *key,void *value,void *ffn,int expiry,int nx);
 	const char *(*kv_get)(const char *key);
+	// version 1 ends here; version 2 on, only appended to, so that modules built against an older layout keep working
+	int kv_abi;
+	int (*kv_pin)(void);
+	void (*kv_unpin)(void);
+	char *(*kv_dup)(const char *key);
+	int (*kv_incr)(const char *key,long long delta,long long *result);
+	int (*kv_append)(const char *key,const char *value);
+	int (*kv_cas)(const char *key,const char *expected,const char *value);
+	char *(*kv_getset)(const char *key,const char *value);
+	int (*kv_touch)(const char *key,int expiry);
+	int (*kv_mget)(const char **keys,int n,char **values);
+	int (*kv_mset)(const char **keys,const char **values,int n,int expiry);
+	int (*kv_mdel)(const char **keys,int n);
+	long (*kv_lpush)(const char *key,const char *value);
+	long (*kv_rpush)(const char *key,const char *value);
+	char *(*kv_lpop)(const char *key);
+	char *(*kv_rpop)(const char *key);
+	int (*kv_hset)(const char *key,const char *field,const char *value);
+	char *(*kv_hget)(const char *key,const char *field);
+	int (*kv_hdel)(const char *key,const char *field);
+	int (*kv_zadd)(const char *key,const char *member,double score);
+	int (*kv_zscore)(const char *key,const char *member,double *score);
+	int (*kv_zrem)(const char *key,const char *member);
+	int (*kv_pfadd)(const char *key,const char *element);
+	long long (*kv_pfcount)(const char *key);
+	int (*kv_wait)(const char *key,const char *expected,int timeout);
+	char *(*kv_stats)(void);
+	int (*kv_write)(const char *key,size_t klen,const char *value,size_t vlen,int type,int expiry,int nx);
+	int (*kv_view)(const char *key,size_t klen,void (*fn)(const char *value,size_t vlen,int type,void *arg),void *arg);
 } module_context;
 
 static int DONE = 0;
 static char *JSLIBPATH = NULL;
-static keyvalue *kvs = NULL;
 static bytecode *cached_scripts = NULL;
-static pthread_rwlock_t kvs_lock;
 static pthread_rwlock_t scripts_lock;
 
-static int kv_set(const char *key,void *value,void *ffn,int expiry,int nx);
-static const char *kv_get(const char *key);
+static void escape_init(void);
+static int kv_configure(ezxml_t node);
+static int kv_route_add(onion_url *urls, ezxml_t node);
+static void kv_route_free(void *data);
+static int parse_size(const char *str, size_t *size);
+static int context_set_header(context *ctx, const char *key, const char *value);
+static int cbor_valid(const char *data, size_t len);
 
 static onion_connection_status index_handler(void *data, onion_request *request, onion_response *response);
 static onion_connection_status js_handler(void *data, onion_request *request, onion_response *response);
+static onion_connection_status kv_stats_handler(void *data, onion_request *request, onion_response *response);
+static onion_connection_status kv_route_handler(void *data, onion_request *request, onion_response *response);
+static int request_data(onion_request *request, void **map, size_t *map_len, const char **data, size_t *len);
 
 static duk_int_t duk_modsearch(duk_context *duk);
 static duk_int_t duk_print(duk_context *duk);
@@ -119,6 +200,26 @@ static duk_int_t duk_get_post(duk_context *duk);
 static duk_int_t duk_get_post2(duk_context *duk);
 static duk_int_t duk_get_file(duk_context *duk);
 static duk_int_t duk_get_cookie(duk_context *duk);
+static duk_int_t duk_escape_html(duk_context *duk);
+static duk_int_t duk_escape_url(duk_context *duk);
+static duk_int_t duk_unescape_url(duk_context *duk);
+static duk_int_t duk_escape_json(duk_context *duk);
+static duk_int_t duk_print_escaped(duk_context *duk);
+static duk_int_t duk_print_json(duk_context *duk);
+static duk_int_t duk_get_body(duk_context *duk);
+static duk_int_t duk_get_json(duk_context *duk);
+static duk_int_t duk_accepts(duk_context *duk);
+static duk_int_t duk_print_encoded(duk_context *duk);
+
+static duk_int_t duk_sb_factory(duk_context *duk);
+static duk_int_t duk_sb_append(duk_context *duk);
+static duk_int_t duk_sb_append_escaped(duk_context *duk);
+static duk_int_t duk_sb_join(duk_context *duk);
+static duk_int_t duk_sb_length(duk_context *duk);
+static duk_int_t duk_sb_clear(duk_context *duk);
+static duk_int_t duk_sb_flush(duk_context *duk);
+static duk_int_t duk_sb_to_string(duk_context *duk);
+static duk_int_t duk_sb_free(duk_context *duk);
 
 static duk_int_t duk_sqlite_factory(duk_context *duk);
 static duk_int_t duk_sqlite_query(duk_context *duk);
@@ -130,22 +231,84 @@ static duk_int_t duk_sqlite_finalize(duk_context *duk);
 
 static duk_int_t duk_kv_set(duk_context *duk);
 static duk_int_t duk_kv_get(duk_context *duk);
+static duk_int_t duk_kv_incr(duk_context *duk);
+static duk_int_t duk_kv_decr(duk_context *duk);
+static duk_int_t duk_kv_append(duk_context *duk);
+static duk_int_t duk_kv_cas(duk_context *duk);
+static duk_int_t duk_kv_getset(duk_context *duk);
+static duk_int_t duk_kv_touch(duk_context *duk);
+static duk_int_t duk_kv_mget(duk_context *duk);
+static duk_int_t duk_kv_mset(duk_context *duk);
+static duk_int_t duk_kv_mdel(duk_context *duk);
+static duk_int_t duk_kv_scan(duk_context *duk);
+static duk_int_t duk_kv_count(duk_context *duk);
+static duk_int_t duk_kv_lpush(duk_context *duk);
+static duk_int_t duk_kv_rpush(duk_context *duk);
+static duk_int_t duk_kv_lpop(duk_context *duk);
+static duk_int_t duk_kv_rpop(duk_context *duk);
+static duk_int_t duk_kv_lrange(duk_context *duk);
+static duk_int_t duk_kv_len(duk_context *duk);
+static duk_int_t duk_kv_hset(duk_context *duk);
+static duk_int_t duk_kv_hget(duk_context *duk);
+static duk_int_t duk_kv_hdel(duk_context *duk);
+static duk_int_t duk_kv_zadd(duk_context *duk);
+static duk_int_t duk_kv_zrem(duk_context *duk);
+static duk_int_t duk_kv_zscore(duk_context *duk);
+static duk_int_t duk_kv_zrange(duk_context *duk);
+static duk_int_t duk_kv_pfadd(duk_context *duk);
+static duk_int_t duk_kv_pfcount(duk_context *duk);
+static duk_int_t duk_kv_wait(duk_context *duk);
+static duk_int_t duk_kv_stats(duk_context *duk);
+
+static duk_int_t duk_cbor_encode(duk_context *duk);
+static duk_int_t duk_cbor_decode(duk_context *duk);
+static duk_int_t duk_msgpack_encode(duk_context *duk);
+static duk_int_t duk_msgpack_decode(duk_context *duk);
+
+static duk_int_t duk_cache_remember(duk_context *duk);
+
+static duk_int_t duk_crypto_hash(duk_context *duk);
+static duk_int_t duk_crypto_hmac(duk_context *duk);
+static duk_int_t duk_crypto_random(duk_context *duk);
+static duk_int_t duk_crypto_equal(duk_context *duk);
 
 static const duk_function_list_entry CGIBINDINGS[] = {
-	{ "print",           duk_print,        DUK_VARARGS },
-	{ "isSecure",        duk_is_secure,    0 },
-	{ "setResponseCode", duk_set_code,     1 },
-	{ "setHeader",       duk_set_header,   2 },
-	{ "getMethod",       duk_get_method,   0 },
-	{ "getHeader",       duk_get_header,   1 },
-	{ "getPath",         duk_get_path,     0 },
-	{ "getFullPath",     duk_get_fullpath, 0 },
-	{ "getQuery",        duk_get_query,    1 },
-	{ "getPost",         duk_get_post,     1 },
-	{ "getPostMulti",    duk_get_post2,    2 },
-	{ "getFile",         duk_get_file,     1 },
-	{ "getCookie",       duk_get_cookie,   1 },
-	{ NULL,              NULL,             0 }
+	{ "print",            duk_print,         DUK_VARARGS },
+	{ "isSecure",         duk_is_secure,     0 },
+	{ "setResponseCode",  duk_set_code,      1 },
+	{ "setHeader",        duk_set_header,    2 },
+	{ "getMethod",        duk_get_method,    0 },
+	{ "getHeader",        duk_get_header,    1 },
+	{ "getPath",          duk_get_path,      0 },
+	{ "getFullPath",      duk_get_fullpath,  0 },
+	{ "getQuery",         duk_get_query,     1 },
+	{ "getPost",          duk_get_post,      1 },
+	{ "getPostMulti",     duk_get_post2,     2 },
+	{ "getFile",          duk_get_file,      1 },
+	{ "getCookie",        duk_get_cookie,    1 },
+	{ "getBody",          duk_get_body,      0 },
+	{ "getJSON",          duk_get_json,      1 },
+	{ "accepts",          duk_accepts,       DUK_VARARGS },
+	{ "printEncoded",     duk_print_encoded, 1 },
+	{ "escapeHTML",       duk_escape_html,   1 },
+	{ "escapeURL",        duk_escape_url,    1 },
+	{ "unescapeURL",      duk_unescape_url,  1 },
+	{ "escapeJSONString", duk_escape_json,   1 },
+	{ "printEscaped",     duk_print_escaped, 2 },
+	{ "printJSON",        duk_print_json,    1 },
+	{ "StringBuilder",    duk_sb_factory,    0 },
+	{ NULL,               NULL,              0 }
+};
+
+static const duk_function_list_entry SBBINDINGS[] = {
+	{ "append",        duk_sb_append,         DUK_VARARGS },
+	{ "appendEscaped", duk_sb_append_escaped, DUK_VARARGS },
+	{ "join",          duk_sb_join,           2 },
+	{ "length",        duk_sb_length,         0 },
+	{ "clear",         duk_sb_clear,          0 },
+	{ "flush",         duk_sb_flush,          0 },
+	{ "toString",      duk_sb_to_string,      0 },
+	{ NULL,            NULL,                  0 }
 };
 
 static const duk_function_list_entry SQLITEBINDINGS[] = {
@@ -155,10 +318,63 @@ static const duk_function_list_entry SQLITEBINDINGS[] = {
 	{ NULL,      NULL,               0 }
 };
 
+static const duk_function_list_entry CBORBINDINGS[] = {
+	{ "encode", duk_cbor_encode, 1 },
+	{ "decode", duk_cbor_decode, 1 },
+	{ NULL,     NULL,            0 }
+};
+
+static const duk_function_list_entry MSGPACKBINDINGS[] = {
+	{ "encode", duk_msgpack_encode, 1 },
+	{ "decode", duk_msgpack_decode, 1 },
+	{ NULL,     NULL,               0 }
+};
+
+static const duk_function_list_entry CACHEBINDINGS[] = {
+	{ "remember", duk_cache_remember, 4 },
+	{ NULL,       NULL,               0 }
+};
+
+static const duk_function_list_entry CRYPTOBINDINGS[] = {
+	{ "hash",            duk_crypto_hash,   3 },
+	{ "hmac",            duk_crypto_hmac,   4 },
+	{ "randomBytes",     duk_crypto_random, 2 },
+	{ "timingSafeEqual", duk_crypto_equal,  2 },
+	{ NULL,              NULL,              0 }
+};
+
 static const duk_function_list_entry KVBINDINGS[] = {
-	{ "get", duk_kv_get, 1 },
-	{ "set", duk_kv_set, 4 },
-	{ NULL,  NULL,       0 }
+	{ "get",    duk_kv_get,    1 },
+	{ "set",    duk_kv_set,    4 },
+	{ "incr",   duk_kv_incr,   2 },
+	{ "decr",   duk_kv_decr,   2 },
+	{ "append", duk_kv_append, 2 },
+	{ "cas",    duk_kv_cas,    3 },
+	{ "getset", duk_kv_getset, 2 },
+	{ "touch",  duk_kv_touch,  2 },
+	{ "mget",   duk_kv_mget,   1 },
+	{ "mset",   duk_kv_mset,   2 },
+	{ "mdel",   duk_kv_mdel,   1 },
+	{ "scan",   duk_kv_scan,   3 },
+	{ "count",  duk_kv_count,  1 },
+	{ "lpush",  duk_kv_lpush,  DUK_VARARGS },
+	{ "rpush",  duk_kv_rpush,  DUK_VARARGS },
+	{ "lpop",   duk_kv_lpop,   2 },
+	{ "rpop",   duk_kv_rpop,   2 },
+	{ "lrange", duk_kv_lrange, 3 },
+	{ "len",    duk_kv_len,    1 },
+	{ "hset",   duk_kv_hset,   3 },
+	{ "hget",   duk_kv_hget,   2 },
+	{ "hdel",   duk_kv_hdel,   DUK_VARARGS },
+	{ "zadd",   duk_kv_zadd,   3 },
+	{ "zrem",   duk_kv_zrem,   DUK_VARARGS },
+	{ "zscore", duk_kv_zscore, 2 },
+	{ "zrange", duk_kv_zrange, 5 },
+	{ "pfadd",  duk_kv_pfadd,  DUK_VARARGS },
+	{ "pfcount",duk_kv_pfcount,1 },
+	{ "wait",   duk_kv_wait,   3 },
+	{ "stats",  duk_kv_stats,  0 },
+	{ NULL,     NULL,          0 }
 };
 
 static void sig_handler(int sig) {
@@ -176,25 +392,6 @@ static void close_modules(module *list) {
 	}
 }
 
-static void timer_handler(int sig, siginfo_t *si, void *uc) {
-	keyvalue *kv;
-	char *key = si->si_value.sival_ptr;
-
-	pthread_rwlock_rdlock(&kvs_lock);
-	HASH_FIND(hh,kvs,key,strlen(key),kv);
-	pthread_rwlock_unlock(&kvs_lock);
-
-	if (kv) {
-		pthread_rwlock_wrlock(&kvs_lock);
-		HASH_DEL(kvs,kv);
-		pthread_rwlock_unlock(&kvs_lock);
-		free(kv->key);
-		if (kv->ffn != NULL) kv->ffn(kv->value);
-		timer_delete(kv->timer);
-		free(kv);
-	}
-}
-
 int main(int argc, char **argv) {
 	onion *o;
 	onion_handler *root,*files = NULL,*module_handler;
@@ -202,7 +399,8 @@ int main(int argc, char **argv) {
 	onion_listen_point *ssl = NULL;
 	ezxml_t xml,sub,node;
 	const char *script_path,*global_script_ext,*libpath,*modpath;
-	const char *url,*name,*sslport = NULL,*sslcert = NULL,*sslkey = NULL;
+	const char *url,*name,*sslport = NULL,*sslcert = NULL,*sslkey = NULL,*attr;
+	int kvshards;
 	sds data,docroot = NULL,global_regex;
 	void *handle;
 	int (*init)(const char *path);
@@ -210,8 +408,6 @@ int main(int argc, char **argv) {
 	onion_connection_status (*dynhandler)(void *,onion_request *,onion_response *);
 	module *modules = NULL,*mod;
 	script *scripts = NULL,*scr;
-	struct sigaction sa;
-	keyvalue *kv,*kvt;
 	bytecode *bc,*bct;
 	
 	if (argc == 1) {
@@ -229,18 +425,7 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	sa.sa_flags = SA_SIGINFO;
-	sa.sa_sigaction = timer_handler;
-	sigemptyset(&sa.sa_mask);
-	if (sigaction(SIGRTMAX - 1,&sa,NULL) < 0) {
-		fprintf(stderr,"failed to intialize key/value store timeout mechanism\n");
-		return 1;
-	}
-
-	if (pthread_rwlock_init(&kvs_lock,NULL) < 0) {
-		fprintf(stderr,"failed to initialize key/value store read/write lock\n");
-		return 1;
-	}
+	escape_init();
 
 	if (pthread_rwlock_init(&scripts_lock,NULL) < 0) {
 		fprintf(stderr,"failed to initialze script cache lock\n");
@@ -271,6 +456,34 @@ int main(int argc, char **argv) {
 	mctx.jslib_path = NULL;
 	mctx.kv_set = kv_set;
 	mctx.kv_get = kv_get;
+	mctx.kv_pin = kv_pin;
+	mctx.kv_unpin = kv_unpin;
+	mctx.kv_dup = kv_dup;
+	mctx.kv_incr = kv_incr;
+	mctx.kv_append = kv_append;
+	mctx.kv_cas = kv_cas;
+	mctx.kv_getset = kv_getset;
+	mctx.kv_touch = kv_touch;
+	mctx.kv_mget = kv_mget;
+	mctx.kv_mset = kv_mset;
+	mctx.kv_mdel = kv_mdel;
+	mctx.kv_lpush = kv_lpush;
+	mctx.kv_rpush = kv_rpush;
+	mctx.kv_lpop = kv_lpop;
+	mctx.kv_rpop = kv_rpop;
+	mctx.kv_hset = kv_hset;
+	mctx.kv_hget = kv_hget;
+	mctx.kv_hdel = kv_hdel;
+	mctx.kv_zadd = kv_zadd;
+	mctx.kv_zscore = kv_zscore;
+	mctx.kv_zrem = kv_zrem;
+	mctx.kv_pfadd = kv_pfadd;
+	mctx.kv_pfcount = kv_pfcount;
+	mctx.kv_wait = kv_wait;
+	mctx.kv_abi = CEPA_KV_ABI;
+	mctx.kv_stats = kv_stats;
+	mctx.kv_write = kv_write;
+	mctx.kv_view = kv_view;
 
 	xml = ezxml_parse_file(argv[1]);
 	if (xml->name == NULL) {
@@ -302,6 +515,22 @@ int main(int argc, char **argv) {
 		mctx.port = strdup(CEPA_DEFAULT_PORT); // TODO null check
 	}
 
+	// <kv url> elements are routes, and the one without a url configures the store
+	kvshards = KV_DEFAULT_SHARDS;
+	for (node = ezxml_child(xml,"kv"); node != NULL && ezxml_attr(node,"url") != NULL; node = node->next);
+	if (node != NULL) {
+		if ((attr = ezxml_attr(node,"shards")) != NULL) kvshards = atoi(attr);
+	}
+	if (kv_init(kvshards) != 0) {
+		fprintf(stderr,"failed to initialize key/value store\n");
+		return 1;
+	}
+	if (node != NULL && kv_configure(node) != 0) return 1;
+	if (node != NULL && (attr = ezxml_attr(node,"stats")) != NULL) onion_url_add(urls,attr,kv_stats_handler);
+	for (sub = ezxml_child(xml,"kv"); sub != NULL; sub = sub->next) {
+		if (ezxml_attr(sub,"url") != NULL && kv_route_add(urls,sub) != 0) return 1;
+	}
+
 	if ((sub = ezxml_child(xml,"scripts")) != NULL) {
 		if ((script_path = ezxml_attr(sub,"path")) != NULL) {
 			mctx.scripts_path = strdup(script_path); // TODO null check
@@ -415,19 +644,12 @@ int main(int argc, char **argv) {
 	if (ssl != NULL) onion_listen_point_free(ssl);
 	close_modules(modules);
 	if (JSLIBPATH != NULL) free(JSLIBPATH);
-	HASH_ITER(hh,kvs,kv,kvt) {
-		HASH_DEL(kvs,kv);
-		timer_delete(kv->timer);
-		free(kv->key);
-		if (kv->ffn != NULL) kv->ffn(kv->value);
-		free(kv);
-	}
+	kv_destroy();
 	HASH_ITER(hh,cached_scripts,bc,bct) {
 		HASH_DEL(cached_scripts,bc);
 		free(bc->bytecode);
 		free(bc);
 	}
-	pthread_rwlock_destroy(&kvs_lock);
 	pthread_rwlock_destroy(&scripts_lock);
 	free(mctx.port);
 	free(mctx.sslport);
@@ -436,11 +658,390 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
+// memory limits and eviction policies of the store, and of its namespaces, sharing, persistence, replication, and peers
+static int kv_configure(ezxml_t node) {
+	ezxml_t ns,shared,repl,peers,peer;
+	const char *attr,*prefix,*snapshot,*aof,*name,**addresses;
+	size_t maxmemory,size;
+	int policy,interval,flush;
+	unsigned int n,self;
+
+	for (ns = node; ns != NULL; ns = ns == node ? ezxml_child(node,"namespace") : ns->next) {
+		prefix = ns == node ? NULL : ezxml_attr(ns,"prefix");
+		if (ns != node && (prefix == NULL || *prefix == '\0')) {
+			fprintf(stderr,"kv namespace needs a prefix\n");
+			return -1;
+		}
+		maxmemory = 0;
+		if ((attr = ezxml_attr(ns,"maxmemory")) != NULL && parse_size(attr,&maxmemory) != 0) {
+			fprintf(stderr,"invalid kv maxmemory '%s'\n",attr);
+			return -1;
+		}
+		policy = KV_NOEVICTION;
+		if ((attr = ezxml_attr(ns,"policy")) != NULL && (policy = kv_policy(attr)) < 0) {
+			fprintf(stderr,"unknown kv eviction policy '%s'\n",attr);
+			return -1;
+		}
+		if (kv_limit(prefix,maxmemory,policy) != 0) {
+			fprintf(stderr,"failed to configure kv namespace '%s': %s\n",prefix,strerror(errno));
+			return -1;
+		}
+	}
+
+	if ((shared = ezxml_child(node,"shared")) != NULL) {
+		if ((name = ezxml_attr(shared,"name")) == NULL || *name != '/') {
+			fprintf(stderr,"kv shared needs a name starting with '/'\n");
+			return -1;
+		}
+		size = KV_SHARED_SIZE;
+		if ((attr = ezxml_attr(shared,"size")) != NULL && parse_size(attr,&size) != 0) {
+			fprintf(stderr,"invalid kv shared size '%s'\n",attr);
+			return -1;
+		}
+		if ((prefix = ezxml_attr(shared,"prefix")) == NULL) prefix = "";
+		if (kv_share(prefix,name,size) != 0) {
+			fprintf(stderr,"failed to map kv shared segment '%s': %s\n",name,strerror(errno));
+			return -1;
+		}
+	}
+
+	if ((attr = ezxml_attr(node,"waiters")) != NULL) kv_waiters(atoi(attr));
+
+	if ((attr = ezxml_attr(node,"index")) != NULL && strcmp(attr,"true") == 0 && kv_index() != 0) {
+		fprintf(stderr,"failed to enable the kv index: %s\n",strerror(errno));
+		return -1;
+	}
+
+	snapshot = ezxml_attr(node,"snapshot");
+	aof = ezxml_attr(node,"aof");
+	if (snapshot == NULL && aof != NULL) {
+		fprintf(stderr,"kv aof needs a snapshot\n");
+		return -1;
+	}
+	if (snapshot != NULL) {
+		interval = (attr = ezxml_attr(node,"interval")) != NULL ? atoi(attr) : 0;
+		flush = KV_FSYNC_EVERYSEC;
+		if ((attr = ezxml_attr(node,"fsync")) != NULL) {
+			if (strcmp(attr,"always") == 0) flush = KV_FSYNC_ALWAYS;
+			else if (strcmp(attr,"no") == 0) flush = KV_FSYNC_NO;
+			else if (strcmp(attr,"everysec") != 0) {
+				fprintf(stderr,"unknown kv fsync policy '%s'\n",attr);
+				return -1;
+			}
+		}
+		if (kv_persist(snapshot,interval,aof,flush) != 0) {
+			fprintf(stderr,"failed to load kv store from '%s': %s\n",snapshot,strerror(errno));
+			return -1;
+		}
+	}
+
+	if ((repl = ezxml_child(node,"replicate")) != NULL) {
+		if ((attr = ezxml_attr(repl,"listen")) != NULL && kv_follow(attr) != 0) {
+			fprintf(stderr,"failed to listen for the kv primary on '%s': %s\n",attr,strerror(errno));
+			return -1;
+		}
+		if ((attr = ezxml_attr(repl,"to")) != NULL && kv_replicate(attr) != 0) {
+			fprintf(stderr,"failed to replicate kv store to '%s': %s\n",attr,strerror(errno));
+			return -1;
+		}
+	}
+
+	if ((peers = ezxml_child(node,"peers")) != NULL) {
+		if ((name = ezxml_attr(peers,"self")) == NULL) {
+			fprintf(stderr,"kv peers needs a self address\n");
+			return -1;
+		}
+		for (n = 0, peer = ezxml_child(peers,"peer"); peer != NULL; peer = peer->next) n++;
+		if (n == 0 || (addresses = calloc(n,sizeof(*addresses))) == NULL) {
+			fprintf(stderr,n == 0 ? "kv peers needs at least one peer\n" : "out of memory\n");
+			return -1;
+		}
+		self = n;
+		for (n = 0, peer = ezxml_child(peers,"peer"); peer != NULL; peer = peer->next, n++) {
+			if ((addresses[n] = ezxml_attr(peer,"address")) == NULL) {
+				fprintf(stderr,"kv peer needs an address\n");
+				free(addresses);
+				return -1;
+			}
+			if (strcmp(addresses[n],name) == 0) self = n;
+		}
+		if (self == n) {
+			fprintf(stderr,"kv peers doesn't list self '%s'\n",name);
+			free(addresses);
+			return -1;
+		}
+		if ((attr = ezxml_attr(peers,"listen")) == NULL) attr = name;
+		if (kv_peers(addresses,n,self,attr) != 0) {
+			fprintf(stderr,"failed to listen for kv peers on '%s': %s\n",attr,strerror(errno));
+			free(addresses);
+			return -1;
+		}
+		free(addresses);
+	}
+	return 0;
+}
+
+// a <kv url> route: the key is prefix followed by the url's first group, or the rest of the path without one
+static int kv_route_add(onion_url *urls, ezxml_t node) {
+	static const char *names[] = { "GET", "PUT", "DELETE" };
+	static const int methods[] = { OR_GET, OR_PUT, OR_DELETE };
+	const char *url,*attr,*p;
+	kv_route *route;
+	size_t len;
+	int i;
+
+	url = ezxml_attr(node,"url");
+	if ((route = calloc(1,sizeof(kv_route))) == NULL || (route->prefix = sdsnew((attr = ezxml_attr(node,"prefix")) != NULL ? attr : "")) == NULL ||
+		(route->allow = sdsempty()) == NULL || ((attr = ezxml_attr(node,"type")) != NULL && (route->type = strdup(attr)) == NULL)) {
+		fprintf(stderr,"out of memory\n");
+		kv_route_free(route);
+		return -1;
+	}
+	route->ttl = (attr = ezxml_attr(node,"ttl")) != NULL && atoi(attr) > 0 ? atoi(attr) * 1000LL : -1;
+	route->maxsize = (size_t)1 << 20;
+	if ((attr = ezxml_attr(node,"maxsize")) != NULL && parse_size(attr,&route->maxsize) != 0) {
+		fprintf(stderr,"invalid kv maxsize '%s'\n",attr);
+		kv_route_free(route);
+		return -1;
+	}
+	for (p = (attr = ezxml_attr(node,"methods")) != NULL ? attr : "GET"; *p != '\0'; p += len + (p[len] == ',')) {
+		len = strcspn(p,",");
+		for (i = 0; i < 3 && (strlen(names[i]) != len || strncasecmp(p,names[i],len) != 0); i++);
+		if (i == 3) {
+			fprintf(stderr,"unknown kv method in '%s'\n",attr);
+			kv_route_free(route);
+			return -1;
+		}
+		route->methods |= 1 << methods[i];
+	}
+	for (i = 0; i < 3; i++) {
+		if (!(route->methods & (1 << methods[i]))) continue;
+		if (sdslen(route->allow) > 0) route->allow = sdscat(route->allow,", ");
+		if (route->allow != NULL) route->allow = sdscat(route->allow,i == 0 ? "GET, HEAD" : names[i]);
+		if (route->allow == NULL) {
+			fprintf(stderr,"out of memory\n");
+			kv_route_free(route);
+			return -1;
+		}
+	}
+	onion_url_add_with_data(urls,url,kv_route_handler,route,kv_route_free);
+	return 0;
+}
+
+static void kv_route_free(void *data) {
+	kv_route *route = data;
+
+	if (route == NULL) return;
+	sdsfree(route->prefix);
+	sdsfree(route->allow);
+	free(route->type);
+	free(route);
+}
+
+// a byte count, optionally suffixed with k, m, or g
+static int parse_size(const char *str, size_t *size) {
+	unsigned long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoull(str,&end,10);
+	if (errno != 0 || end == str) return -1;
+	switch (tolower(*end)) {
+	case 'g':
+		n *= 1024;
+	case 'm':
+		n *= 1024;
+	case 'k':
+		n *= 1024;
+		end++;
+	}
+	if (*end != '\0') return -1;
+	*size = n;
+	return 0;
+}
+
 static onion_connection_status index_handler(void *data, onion_request *request, onion_response *response) {
 	onion_shortcut_response_file("index.html",request,response);
 	return OCS_PROCESSED;
 }
 
+// the kv store's statistics, only for clients on the loopback interface
+static onion_connection_status kv_stats_handler(void *data, onion_request *request, onion_response *response) {
+	const char *client;
+	char *json;
+	size_t len;
+
+	client = onion_request_get_client_description(request);
+	if (client == NULL || (strncmp(client,"127.",4) != 0 && strcmp(client,"::1") != 0 && strncmp(client,"::ffff:127.",11) != 0)) {
+		onion_shortcut_response("forbidden",403,request,response);
+		return OCS_PROCESSED;
+	}
+	if ((json = kv_stats()) == NULL) {
+		onion_shortcut_response("out of memory",500,request,response);
+		return OCS_PROCESSED;
+	}
+	len = strlen(json);
+	onion_response_set_header(response,"Content-Type","application/json");
+	onion_response_set_header(response,"Cache-Control","no-store");
+	onion_response_set_length(response,len);
+	onion_response_write(response,json,len);
+	free(json);
+	return OCS_PROCESSED;
+}
+
+// the value type a PUT body is stored as, by its content type
+static int kv_content_value(const char *type) {
+	if (type == NULL) return KV_BUFFER;
+	if (strncasecmp(type,"text/",5) == 0 || strstr(type,"json") != NULL || strstr(type,"charset=") != NULL) return KV_STRING;
+	if (strncasecmp(type,"application/cbor",16) == 0) return KV_CBOR;
+	return KV_BUFFER;
+}
+
+static onion_connection_status kv_route_error(onion_request *request, onion_response *response) {
+	int code;
+
+	switch (errno) {
+	case EINVAL:
+		code = 409;
+		break;
+	case E2BIG:
+		code = 413;
+		break;
+	case ENOMEM:
+		code = 507;
+		break;
+	case EROFS:
+	case ETIMEDOUT:
+	case ECONNREFUSED:
+	case ECONNRESET:
+		code = 503;
+		break;
+	default:
+		code = 500;
+	}
+	onion_shortcut_response(errno == EINVAL ? "key holds another type of value" : errno == E2BIG ? "value too large" : strerror(errno),code,request,response);
+	return OCS_PROCESSED;
+}
+
+// GET, HEAD, PUT and DELETE on a key, without a script
+static onion_connection_status kv_route_handler(void *data, onion_request *request, onion_response *response) {
+	static const char *types[] = { "text/plain; charset=utf-8", "application/octet-stream", "application/cbor" };
+	kv_route *route = data;
+	const char *name,*attr,*body;
+	sds key,value,found;
+	void *map = NULL;
+	size_t len,map_len = 0;
+	double seconds;
+	int64_t ttl;
+	int method,type,rc,valid;
+	char *end,cache[32];
+
+	method = onion_request_get_flags(request) & OR_METHODS;
+	if (method > OR_DELETE || !(route->methods & (1 << (method == OR_HEAD ? OR_GET : method)))) {
+		onion_response_set_header(response,"Allow",route->allow);
+		onion_shortcut_response("method not allowed",405,request,response);
+		return OCS_PROCESSED;
+	}
+	if ((name = onion_request_get_query(request,"1")) == NULL) name = onion_request_get_path(request);
+	if (name == NULL || *name == '\0') {
+		onion_shortcut_response("not found",404,request,response);
+		return OCS_PROCESSED;
+	}
+	if ((key = sdsdup(route->prefix)) == NULL || (key = sdscat(key,name)) == NULL) {
+		onion_shortcut_response("out of memory",500,request,response);
+		return OCS_PROCESSED;
+	}
+
+	if (method == OR_GET || method == OR_HEAD) {
+		errno = 0;
+		found = (value = sdsempty()) != NULL ? kv_copy(key,sdslen(key),value,&type) : NULL;
+		// caches may keep the value until it expires; keys on other peers don't say when that is
+		ttl = found != NULL ? kv_expires(key,sdslen(key)) : 0;
+		sdsfree(key);
+		if (found == NULL) {
+			sdsfree(value);
+			if (errno != 0) return kv_route_error(request,response);
+			onion_shortcut_response("not found",404,request,response);
+			return OCS_PROCESSED;
+		}
+		if (type > KV_CBOR) {
+			sdsfree(found);
+			errno = EINVAL;
+			return kv_route_error(request,response);
+		}
+		onion_response_set_code(response,200);
+		onion_response_set_header(response,"Content-Type",route->type != NULL ? route->type : types[type]);
+		if (ttl > 0) {
+			snprintf(cache,sizeof(cache),"max-age=%lld",(long long)(ttl / 1000));
+			onion_response_set_header(response,"Cache-Control",cache);
+		}
+		onion_response_set_length(response,sdslen(found));
+		if (method == OR_GET && sdslen(found) > 0) onion_response_write(response,found,sdslen(found));
+		sdsfree(found);
+		return OCS_PROCESSED;
+	}
+
+	if (method == OR_DELETE) {
+		rc = kv_put(key,sdslen(key),NULL,0,KV_STRING,0,0);
+		sdsfree(key);
+		if (rc == -1) return kv_route_error(request,response);
+		if (rc == 0) {
+			onion_shortcut_response("not found",404,request,response);
+			return OCS_PROCESSED;
+		}
+		onion_response_set_code(response,204);
+		onion_response_set_length(response,0);
+		return OCS_PROCESSED;
+	}
+
+	ttl = route->ttl;
+	if ((attr = onion_request_get_header(request,"X-TTL")) != NULL) {
+		seconds = strtod(attr,&end);
+		if (end == attr || *end != '\0' || !(seconds >= 0 && seconds < 1e12)) {
+			sdsfree(key);
+			onion_shortcut_response("invalid X-TTL",400,request,response);
+			return OCS_PROCESSED;
+		}
+		ttl = seconds > 0 ? (int64_t)ceil(seconds * 1000) : -1;
+	}
+	switch (request_data(request,&map,&map_len,&body,&len)) {
+	case -1:
+		sdsfree(key);
+		return kv_route_error(request,response);
+	case 0:
+		body = "";
+		len = 0;
+	}
+	type = kv_content_value(onion_request_get_header(request,"Content-Type"));
+	// CBOR that doesn't decode would make every kv.get of the key throw
+	valid = type == KV_CBOR && len <= route->maxsize ? cbor_valid(body,len) : 1;
+	if (len > route->maxsize) {
+		rc = -1;
+		errno = E2BIG;
+	} else if (valid != 1) {
+		rc = -1;
+		errno = ENOMEM;
+	} else {
+		// If-None-Match: * only creates
+		attr = onion_request_get_header(request,"If-None-Match");
+		rc = kv_put(key,sdslen(key),body,len,type,ttl,attr != NULL && strcmp(attr,"*") == 0);
+	}
+	if (map != NULL) munmap(map,map_len);
+	sdsfree(key);
+	if (valid == 0) {
+		onion_shortcut_response("invalid CBOR",400,request,response);
+		return OCS_PROCESSED;
+	}
+	if (rc == -1) return kv_route_error(request,response);
+	if (rc == 0) {
+		onion_shortcut_response("key exists",412,request,response);
+		return OCS_PROCESSED;
+	}
+	onion_response_set_code(response,204);
+	onion_response_set_length(response,0);
+	return OCS_PROCESSED;
+}
+
 static onion_connection_status js_handler(void *data, onion_request *request, onion_response *response) {
 	const char *spath = data,*msg;
 	char path[CEPA_PATH_MAX];
@@ -466,6 +1067,8 @@ static onion_connection_status js_handler(void *data, onion_request *request, on
 	ctx.buffer = sdsempty();
 	ctx.jslibs = NULL;
 	ctx.rc = 200;
+	ctx.body = NULL;
+	ctx.body_len = 0;
 
 	if ((duk = duk_create_heap_default()) == NULL) {
 		msg = "out of memory";
@@ -538,6 +1141,22 @@ static onion_connection_status js_handler(void *data, onion_request *request, on
 	duk_put_function_list(duk,-1,KVBINDINGS);
 	duk_put_global_string(duk,"kv");
 
+	duk_push_object(duk);
+	duk_put_function_list(duk,-1,CACHEBINDINGS);
+	duk_put_global_string(duk,"cache");
+
+	duk_push_object(duk);
+	duk_put_function_list(duk,-1,CBORBINDINGS);
+	duk_put_global_string(duk,"cbor");
+
+	duk_push_object(duk);
+	duk_put_function_list(duk,-1,MSGPACKBINDINGS);
+	duk_put_global_string(duk,"msgpack");
+
+	duk_push_object(duk);
+	duk_put_function_list(duk,-1,CRYPTOBINDINGS);
+	duk_put_global_string(duk,"crypto");
+
 	duk_push_global_object(duk);
 	duk_del_prop_string(duk,-1,"print");
 	duk_del_prop_string(duk,-1,"alert");
@@ -615,6 +1234,7 @@ static onion_connection_status js_handler(void *data, onion_request *request, on
 		dlclose(j->handle);
 		free(j);
 	}
+	if (ctx.body != NULL) munmap(ctx.body,ctx.body_len);
 	return OCS_PROCESSED;
 FAIL:
 	HASH_ITER(hh,ctx.headers,h,ht) {
@@ -633,6 +1253,7 @@ FAIL:
 	if (msg) onion_shortcut_response(msg,500,request,response);
 	else onion_shortcut_response("unknown error",500,request,response);
 	if (duk != NULL) duk_destroy_heap(duk);
+	if (ctx.body != NULL) munmap(ctx.body,ctx.body_len);
 	if (errfull != NULL) sdsfree(errfull);
 	return OCS_PROCESSED;
 }
@@ -750,10 +1371,38 @@ static duk_int_t duk_set_code(duk_context *duk) {
 	return 0;
 }
 
+// sets, or removes when value is NULL, a response header. returns 0 when out of memory
+static int context_set_header(context *ctx, const char *key, const char *value) {
+	header *h;
+
+	HASH_FIND(hh,ctx->headers,key,strlen(key),h);
+
+	if (h != NULL) {
+		free(h->value);
+		if (value != NULL && (h->value = strdup(value)) != NULL) return 1;
+		HASH_DEL(ctx->headers,h);
+		free(h->key);
+		free(h);
+		return value == NULL;
+	}
+	if (value == NULL) return 1;
+	if ((h = malloc(sizeof(header))) == NULL) return 0;
+	if ((h->key = strdup(key)) == NULL) {
+		free(h);
+		return 0;
+	}
+	if ((h->value = strdup(value)) == NULL) {
+		free(h->key);
+		free(h);
+		return 0;
+	}
+	HASH_ADD_KEYPTR(hh,ctx->headers,h->key,strlen(h->key),h);
+	return 1;
+}
+
 static duk_int_t duk_set_header(duk_context *duk) {
 	context *ctx;
 	const char *key,*value;
-	header *h;
 
 	duk_push_heap_stash(duk);
 	duk_get_prop_string(duk,-1,"__CTX");
@@ -764,28 +1413,11 @@ static duk_int_t duk_set_header(duk_context *duk) {
 	value = duk_safe_to_string(duk,1);
 	if (strcmp(value,"null") == 0 || strcmp(value,"undefined") == 0) value = NULL;
 
-	HASH_FIND(hh,ctx->headers,key,strlen(key),h);
-
-	if (h != NULL) {
-		free(h->value);
-		if (value != NULL) {
-			if ((h->value = strdup(value)) == NULL) goto FAIL;
-		} else {
-			HASH_DEL(ctx->headers,h);
-			free(h->key);
-			free(h);
-		}
-	} else {
-		if (value == NULL) return 0;
-		if ((h = malloc(sizeof(header))) == NULL) goto FAIL;
-		if ((h->key = strdup(key)) == NULL) goto FAIL;
-		if ((h->value = strdup(value)) == NULL) goto FAIL;
-		HASH_ADD_KEYPTR(hh,ctx->headers,h->key,strlen(h->key),h);
+	if (!context_set_header(ctx,key,value)) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
 	}
 	return 0;
-FAIL:
-	duk_push_string(duk,"out of memory");
-	duk_throw(duk);
 }
 
 static duk_int_t duk_get_method(duk_context *duk) {
@@ -992,507 +1624,3176 @@ static duk_int_t duk_get_cookie(duk_context *duk) {
 	return 1;
 }
 
-static duk_int_t duk_sqlite_factory(duk_context *duk) {
-	const char *path;
-	sqlite3 *db;
-	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,timeout = 50;
-	
-	path = duk_require_string(duk,0);
-	if (*path == '\0') return DUK_RET_API_ERROR;
-	if (duk_get_top(duk) > 1) timeout = duk_require_int(duk,1);
-	if (duk_get_top(duk) > 2) if (duk_get_boolean(duk,2)) flags |= SQLITE_OPEN_CREATE;
+/*
+ * byte scanners used by the escaping functions.
+ * each returns the number of leading bytes of str that can be copied through unchanged.
+ * the SSE2 versions are the default on x86-64; main() switches to the AVX2 versions when the cpu has them.
+ */
+static size_t scan_html_scalar(const char *str, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (str[i]) {
+			case '&': case '<': case '>': case '"': case '\'': return i;
+		}
+	}
+	return len;
+}
 
-	if (sqlite3_open_v2(path,&db,flags,NULL) != SQLITE_OK) {
-		duk_push_string(duk,sqlite3_errmsg(db));
-		duk_throw(duk);
+static size_t scan_json_scalar(const char *str, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((unsigned char)str[i] < 0x20 || str[i] == '"' || str[i] == '\\') return i;
 	}
+	return len;
+}
 
-	sqlite3_busy_timeout(db,timeout);
+static int url_unreserved(unsigned char c) {
+	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+		c == '-' || c == '_' || c == '.' || c == '~';
+}
 
-	duk_push_object(duk);
-	duk_push_pointer(duk,db);
-	duk_put_prop_string(duk,-2,"__PTR");
-	duk_put_function_list(duk,-1,SQLITEBINDINGS);
-	duk_push_c_function(duk,duk_sqlite_close,1);
-	duk_set_finalizer(duk,-2);
+static size_t scan_url_scalar(const char *str, size_t len) {
+	size_t i;
 
-	return 1;
+	for (i = 0; i < len; i++) {
+		if (!url_unreserved((unsigned char)str[i])) return i;
+	}
+	return len;
 }
 
-static int sqlite_execute(duk_context *duk, int headers, sqlite3 *db, sqlite3_stmt *stmt) {
-	int rc,done,row,count,index;
-	const void *blob;
-	void *buff;
+static size_t scan_unurl_scalar(const char *str, size_t len) {
+	size_t i;
 
-	done = row = count = 0;
-	duk_push_array(duk);
-	while (!done) {
-		switch (sqlite3_step(stmt)) {
-			case SQLITE_BUSY:
-				duk_pop(duk);
-				duk_push_string(duk,"sqlite timeout");
-				rc = 0;
-				done = 1;
-			break;
-			case SQLITE_DONE:
-				rc = 1;
-				done = 1;
-			break;
-			case SQLITE_ROW:
-				if (count == 0) {
-					count = sqlite3_column_count(stmt);
-					if (count == 0) {
-						duk_pop(duk);
-						duk_push_int(duk,sqlite3_changes(db));
-						rc = 1;
-						goto END;
-					}
-					if (headers) {
-						duk_push_array(duk);
-						for (index = 0; index < count; index++) {
-							duk_push_string(duk,sqlite3_column_name(stmt,index));
-							duk_put_prop_index(duk,-2,index);
-						}
-						duk_put_prop_index(duk,-2,row++);
-					}
-				}
-				duk_push_array(duk);
-				for (index = 0; index < count; index++) {
-					switch(sqlite3_column_type(stmt,index)) {
-						case SQLITE_INTEGER:
-							duk_push_number(duk,(duk_double_t)sqlite3_column_int64(stmt,index));
-						break;
-						case SQLITE_FLOAT:
-							duk_push_number(duk,(duk_double_t)sqlite3_column_double(stmt,index));
-						break;
-						case SQLITE_TEXT:
-							duk_push_string(duk,(char *)sqlite3_column_text(stmt,index));
-						break;
-						case SQLITE_BLOB:
-							rc = sqlite3_column_bytes(stmt,index);
-							if (rc > 0) {
-								buff = duk_push_fixed_buffer(duk,rc);
-								blob = sqlite3_column_blob(stmt,index);
-								memcpy(buff,blob,rc);
-							} else {
-								duk_push_null(duk);
-							}
-						break;
-						default:
-							duk_push_null(duk);
-					} // end inner switch
-					duk_put_prop_index(duk,-2,index);
+	for (i = 0; i < len; i++) {
+		if (str[i] == '%' || str[i] == '+') return i;
+	}
+	return len;
+}
+
+#ifdef CEPA_SIMD_X86
+static size_t scan_html_sse2(const char *str, size_t len) {
+	size_t i = 0;
+	__m128i x,m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(str + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8('&')),_mm_cmpeq_epi8(x,_mm_set1_epi8('<')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('>')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('"')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('\'')));
+		if ((mask = _mm_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_html_scalar(str + i,len - i);
+}
+
+static size_t scan_json_sse2(const char *str, size_t len) {
+	size_t i = 0;
+	__m128i x,m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(str + i));
+		m = _mm_cmpeq_epi8(_mm_max_epu8(x,_mm_set1_epi8(0x1f)),_mm_set1_epi8(0x1f));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('"')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('\\')));
+		if ((mask = _mm_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_json_scalar(str + i,len - i);
+}
+
+// signed compares are fine here: bytes >= 0x80 are negative, so they fall outside every range
+#define SSE2_IN_RANGE(x,lo,hi) \
+	_mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8((lo) - 1)),_mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1),x))
+
+static size_t scan_url_sse2(const char *str, size_t len) {
+	size_t i = 0;
+	__m128i x,m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(str + i));
+		m = _mm_or_si128(SSE2_IN_RANGE(x,'0','9'),SSE2_IN_RANGE(x,'A','Z'));
+		m = _mm_or_si128(m,SSE2_IN_RANGE(x,'a','z'));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('-')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('_')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('.')));
+		m = _mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('~')));
+		if ((mask = _mm_movemask_epi8(m) ^ 0xffff) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_url_scalar(str + i,len - i);
+}
+
+static size_t scan_unurl_sse2(const char *str, size_t len) {
+	size_t i = 0;
+	__m128i x,m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(str + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8('%')),_mm_cmpeq_epi8(x,_mm_set1_epi8('+')));
+		if ((mask = _mm_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_unurl_scalar(str + i,len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_html_avx2(const char *str, size_t len) {
+	size_t i = 0;
+	__m256i x,m;
+	unsigned int mask;
+
+	for (; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(str + i));
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('&')),_mm256_cmpeq_epi8(x,_mm256_set1_epi8('<')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('>')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('\'')));
+		if ((mask = (unsigned int)_mm256_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_html_sse2(str + i,len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_json_avx2(const char *str, size_t len) {
+	size_t i = 0;
+	__m256i x,m;
+	unsigned int mask;
+
+	for (; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(str + i));
+		m = _mm256_cmpeq_epi8(_mm256_max_epu8(x,_mm256_set1_epi8(0x1f)),_mm256_set1_epi8(0x1f));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('\\')));
+		if ((mask = (unsigned int)_mm256_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_json_sse2(str + i,len - i);
+}
+
+#define AVX2_IN_RANGE(x,lo,hi) \
+	_mm256_and_si256(_mm256_cmpgt_epi8(x,_mm256_set1_epi8((lo) - 1)),_mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1),x))
+
+__attribute__((target("avx2")))
+static size_t scan_url_avx2(const char *str, size_t len) {
+	size_t i = 0;
+	__m256i x,m;
+	unsigned int mask;
+
+	for (; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(str + i));
+		m = _mm256_or_si256(AVX2_IN_RANGE(x,'0','9'),AVX2_IN_RANGE(x,'A','Z'));
+		m = _mm256_or_si256(m,AVX2_IN_RANGE(x,'a','z'));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('-')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('_')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('.')));
+		m = _mm256_or_si256(m,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('~')));
+		if ((mask = ~(unsigned int)_mm256_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_url_sse2(str + i,len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_unurl_avx2(const char *str, size_t len) {
+	size_t i = 0;
+	__m256i x,m;
+	unsigned int mask;
+
+	for (; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(str + i));
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('%')),_mm256_cmpeq_epi8(x,_mm256_set1_epi8('+')));
+		if ((mask = (unsigned int)_mm256_movemask_epi8(m)) != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_unurl_sse2(str + i,len - i);
+}
+
+static escapers ESCAPE = { scan_html_sse2, scan_json_sse2, scan_url_sse2, scan_unurl_sse2 };
+
+static void escape_init(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ESCAPE.html = scan_html_avx2;
+		ESCAPE.json = scan_json_avx2;
+		ESCAPE.url = scan_url_avx2;
+		ESCAPE.unurl = scan_unurl_avx2;
+	}
+}
+#else
+static escapers ESCAPE = { scan_html_scalar, scan_json_scalar, scan_url_scalar, scan_unurl_scalar };
+
+static void escape_init(void) {
+}
+#endif
+
+static sds sdscathtml(sds s, const char *str, size_t len) {
+	size_t i = 0,n;
+	const char *rep;
+
+	s = sdsMakeRoomFor(s,len);
+	while (i < len) {
+		n = ESCAPE.html(str + i,len - i);
+		s = sdscatlen(s,str + i,n);
+		if ((i += n) == len) break;
+		switch (str[i++]) {
+			case '&': rep = "&amp;"; break;
+			case '<': rep = "&lt;"; break;
+			case '>': rep = "&gt;"; break;
+			case '"': rep = "&quot;"; break;
+			default: rep = "&#39;";
+		}
+		s = sdscat(s,rep);
+	}
+	return s;
+}
+
+// escapes str for use inside a JSON string literal; the quotes are not added
+static sds sdscatjson(sds s, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	size_t i = 0,n;
+	unsigned char c;
+	char esc[6] = { '\\', 'u', '0', '0' };
+
+	s = sdsMakeRoomFor(s,len);
+	while (i < len) {
+		n = ESCAPE.json(str + i,len - i);
+		s = sdscatlen(s,str + i,n);
+		if ((i += n) == len) break;
+		switch ((c = (unsigned char)str[i++])) {
+			case '"': s = sdscatlen(s,"\\\"",2); break;
+			case '\\': s = sdscatlen(s,"\\\\",2); break;
+			case '\b': s = sdscatlen(s,"\\b",2); break;
+			case '\f': s = sdscatlen(s,"\\f",2); break;
+			case '\n': s = sdscatlen(s,"\\n",2); break;
+			case '\r': s = sdscatlen(s,"\\r",2); break;
+			case '\t': s = sdscatlen(s,"\\t",2); break;
+			default:
+				esc[4] = hex[c >> 4];
+				esc[5] = hex[c & 0xf];
+				s = sdscatlen(s,esc,6);
+		}
+	}
+	return s;
+}
+
+// percent encodes everything but the RFC 3986 unreserved characters, the same as encodeURIComponent()
+static sds sdscaturl(sds s, const char *str, size_t len) {
+	static const char hex[] = "0123456789ABCDEF";
+	size_t i = 0,n;
+	unsigned char c;
+	char esc[3] = { '%' };
+
+	s = sdsMakeRoomFor(s,len);
+	while (i < len) {
+		n = ESCAPE.url(str + i,len - i);
+		s = sdscatlen(s,str + i,n);
+		if ((i += n) == len) break;
+		c = (unsigned char)str[i++];
+		esc[1] = hex[c >> 4];
+		esc[2] = hex[c & 0xf];
+		s = sdscatlen(s,esc,3);
+	}
+	return s;
+}
+
+static int hexval(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// decodes %XX sequences and '+' as a space; malformed sequences are copied as is
+static sds sdscatunurl(sds s, const char *str, size_t len) {
+	size_t i = 0,n;
+	int hi,lo;
+	char c;
+
+	s = sdsMakeRoomFor(s,len);
+	while (i < len) {
+		n = ESCAPE.unurl(str + i,len - i);
+		s = sdscatlen(s,str + i,n);
+		if ((i += n) == len) break;
+		if (str[i] == '+') {
+			c = ' ';
+			i++;
+		} else if (i + 2 < len && (hi = hexval(str[i + 1])) >= 0 && (lo = hexval(str[i + 2])) >= 0) {
+			c = (char)((hi << 4) | lo);
+			i += 3;
+		} else {
+			c = '%';
+			i++;
+		}
+		s = sdscatlen(s,&c,1);
+	}
+	return s;
+}
+
+static int escape_mode(duk_context *duk, duk_idx_t index) {
+	const char *mode;
+
+	if (duk_is_null_or_undefined(duk,index)) return CEPA_ESCAPE_HTML;
+	mode = duk_require_string(duk,index);
+	if (!strcmp(mode,"html")) return CEPA_ESCAPE_HTML;
+	if (!strcmp(mode,"url")) return CEPA_ESCAPE_URL;
+	if (!strcmp(mode,"unurl")) return CEPA_ESCAPE_UNURL;
+	if (!strcmp(mode,"json")) return CEPA_ESCAPE_JSON;
+	duk_push_sprintf(duk,"unknown escape mode '%s'",mode);
+	duk_throw(duk);
+	return 0; // compiler bodge
+}
+
+static sds sdscatescaped(sds s, int mode, const char *str, size_t len) {
+	switch (mode) {
+		case CEPA_ESCAPE_URL: return sdscaturl(s,str,len);
+		case CEPA_ESCAPE_UNURL: return sdscatunurl(s,str,len);
+		case CEPA_ESCAPE_JSON: return sdscatjson(s,str,len);
+		default: return sdscathtml(s,str,len);
+	}
+}
+
+static size_t escape_scan(int mode, const char *str, size_t len) {
+	switch (mode) {
+		case CEPA_ESCAPE_URL: return ESCAPE.url(str,len);
+		case CEPA_ESCAPE_UNURL: return ESCAPE.unurl(str,len);
+		case CEPA_ESCAPE_JSON: return ESCAPE.json(str,len);
+		default: return ESCAPE.html(str,len);
+	}
+}
+
+/*
+ * common body of the cgi.escapeXXX() functions.
+ * strings that need no escaping are returned as is, without a copy.
+ */
+static duk_int_t escape_string(duk_context *duk, int mode) {
+	const char *str;
+	duk_size_t len;
+	sds s;
+
+	str = duk_safe_to_lstring(duk,0,&len);
+	if (escape_scan(mode,str,len) == len) return 1;
+	if ((s = sdscatescaped(sdsempty(),mode,str,len)) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	duk_push_lstring(duk,s,sdslen(s));
+	sdsfree(s);
+	return 1;
+}
+
+static duk_int_t duk_escape_html(duk_context *duk) {
+	return escape_string(duk,CEPA_ESCAPE_HTML);
+}
+
+static duk_int_t duk_escape_url(duk_context *duk) {
+	return escape_string(duk,CEPA_ESCAPE_URL);
+}
+
+static duk_int_t duk_unescape_url(duk_context *duk) {
+	return escape_string(duk,CEPA_ESCAPE_UNURL);
+}
+
+static duk_int_t duk_escape_json(duk_context *duk) {
+	return escape_string(duk,CEPA_ESCAPE_JSON);
+}
+
+static duk_int_t duk_print_escaped(duk_context *duk) {
+	context *ctx;
+	const char *str;
+	duk_size_t len;
+	int mode;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	mode = escape_mode(duk,1);
+	str = duk_safe_to_lstring(duk,0,&len);
+	ctx->buffer = sdscatescaped(ctx->buffer,mode,str,len);
+	return 0;
+}
+
+// formats d the way JSON.stringify() does: the shortest digits that read back as the same double
+static sds sdscatnumber(sds s, double d) {
+	char num[32],digits[20],*p;
+	int precision,exp,n,i;
+
+	if (isnan(d) || isinf(d)) return sdscatlen(s,"null",4);
+	if (d == 0) return sdscatlen(s,"0",1);
+	if (d == floor(d) && fabs(d) < 1e15) return sdscatprintf(s,"%.0f",d);
+	for (precision = 1; precision <= 17; precision++) {
+		snprintf(num,sizeof(num),"%.*e",precision - 1,d);
+		if (strtod(num,NULL) == d) break;
+	}
+	if (d < 0) s = sdscatlen(s,"-",1);
+	for (n = 0,p = num + (d < 0); *p != 'e'; p++) if (*p != '.') digits[n++] = *p;
+	exp = atoi(p + 1);
+	if (exp >= 21 || exp < -6) {
+		s = sdscatlen(s,digits,1);
+		if (n > 1) {
+			s = sdscatlen(s,".",1);
+			s = sdscatlen(s,digits + 1,n - 1);
+		}
+		return sdscatprintf(s,"e%c%d",exp < 0 ? '-' : '+',abs(exp));
+	}
+	if (exp < 0) {
+		s = sdscatlen(s,"0.",2);
+		for (i = exp + 1; i < 0; i++) s = sdscatlen(s,"0",1);
+		return sdscatlen(s,digits,n);
+	}
+	if (n <= exp + 1) {
+		s = sdscatlen(s,digits,n);
+		for (i = n; i <= exp; i++) s = sdscatlen(s,"0",1);
+		return s;
+	}
+	s = sdscatlen(s,digits,exp + 1);
+	s = sdscatlen(s,".",1);
+	return sdscatlen(s,digits + exp + 1,n - exp - 1);
+}
+
+// replaces the value on top of the stack with the result of its toJSON() method, if it has one
+static void json_to_json(duk_context *duk, duk_idx_t key) {
+	if (!duk_is_object(duk,-1) || duk_is_function(duk,-1)) return;
+	key = duk_normalize_index(duk,key);
+	duk_get_prop_string(duk,-1,"toJSON");
+	if (duk_is_callable(duk,-1)) {
+		duk_dup(duk,-2);
+		duk_dup(duk,key);
+		duk_call_method(duk,1);
+		duk_remove(duk,-2);
+	} else {
+		duk_pop(duk);
+	}
+}
+
+// values that JSON.stringify() leaves out of objects, and writes as null in arrays
+static int json_skipped(duk_context *duk, duk_idx_t index) {
+	return duk_is_undefined(duk,index) || duk_is_function(duk,index);
+}
+
+/*
+ * encodes the value on top of the stack into out.
+ * ancestors of the value are kept in seen so that cycles throw like they do for JSON.stringify()
+ */
+static void json_write(duk_context *duk, sds *out, void **seen, int depth) {
+	duk_size_t i,n,len;
+	const char *str;
+	void *ptr;
+	int k,first = 1;
+
+	switch (duk_get_type(duk,-1)) {
+		case DUK_TYPE_BOOLEAN:
+			*out = duk_get_boolean(duk,-1) ? sdscatlen(*out,"true",4) : sdscatlen(*out,"false",5);
+		break;
+		case DUK_TYPE_NUMBER:
+			*out = sdscatnumber(*out,(double)duk_get_number(duk,-1));
+		break;
+		case DUK_TYPE_STRING:
+			str = duk_get_lstring(duk,-1,&len);
+			*out = sdscatlen(*out,"\"",1);
+			*out = sdscatjson(*out,str,len);
+			*out = sdscatlen(*out,"\"",1);
+		break;
+		case DUK_TYPE_OBJECT:
+			if (duk_is_function(duk,-1)) goto NUL;
+			if (depth >= CEPA_JSON_MAX_DEPTH) {
+				duk_push_string(duk,"printJSON: value nested too deeply");
+				duk_throw(duk);
+			}
+			ptr = duk_get_heapptr(duk,-1);
+			for (k = 0; k < depth; k++) {
+				if (seen[k] == ptr) {
+					duk_push_string(duk,"printJSON: cyclic value");
+					duk_throw(duk);
+				}
+			}
+			seen[depth] = ptr;
+			duk_require_stack(duk,4);
+			if (duk_is_array(duk,-1)) {
+				*out = sdscatlen(*out,"[",1);
+				n = duk_get_length(duk,-1);
+				for (i = 0; i < n; i++) {
+					if (i > 0) *out = sdscatlen(*out,",",1);
+					duk_push_number(duk,(duk_double_t)i);
+					duk_to_string(duk,-1);
+					duk_get_prop_index(duk,-2,(duk_uarridx_t)i);
+					json_to_json(duk,-2);
+					if (json_skipped(duk,-1)) *out = sdscatlen(*out,"null",4);
+					else json_write(duk,out,seen,depth + 1);
+					duk_pop_2(duk);
+				}
+				*out = sdscatlen(*out,"]",1);
+			} else {
+				*out = sdscatlen(*out,"{",1);
+				duk_enum(duk,-1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+				while (duk_next(duk,-1,1)) {
+					json_to_json(duk,-2);
+					if (!json_skipped(duk,-1)) {
+						if (!first) *out = sdscatlen(*out,",",1);
+						first = 0;
+						str = duk_get_lstring(duk,-2,&len);
+						*out = sdscatlen(*out,"\"",1);
+						*out = sdscatjson(*out,str,len);
+						*out = sdscatlen(*out,"\":",2);
+						json_write(duk,out,seen,depth + 1);
+					}
+					duk_pop_2(duk);
+				}
+				duk_pop(duk);
+				*out = sdscatlen(*out,"}",1);
+			}
+		break;
+		default:
+		NUL:
+			*out = sdscatlen(*out,"null",4);
+	}
+}
+
+/*
+ * locates the raw request body without copying it.
+ * onion keeps non-form POST bodies in memory, and writes PUT bodies to a
+ * temporary file which is mapped copy-on-write into *map, to be unmapped by the caller.
+ */
+static int request_data(onion_request *request, void **map, size_t *map_len, const char **data, size_t *len) {
+	const onion_block *block;
+	const char *path;
+	struct stat astat;
+	int fd;
+
+	if (*map != NULL) {
+		*data = *map;
+		*len = *map_len;
+		return 1;
+	}
+	if ((block = onion_request_get_data(request)) != NULL) {
+		*data = onion_block_data(block);
+		*len = (size_t)onion_block_size(block);
+		return *len > 0;
+	}
+	if ((onion_request_get_flags(request) & OR_METHODS) != OR_PUT) return 0;
+	if ((path = onion_request_get_file(request,"filename")) == NULL) return 0;
+	if ((fd = open(path,O_RDONLY)) == -1) return -1;
+	if (fstat(fd,&astat) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (astat.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	*map = mmap(NULL,astat.st_size,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (*map == MAP_FAILED) {
+		*map = NULL;
+		return -1;
+	}
+	*map_len = astat.st_size;
+	*data = *map;
+	*len = *map_len;
+	return 1;
+}
+
+// the body of a script's request, mapped for the life of the request
+static int request_body(context *ctx, const char **data, size_t *len) {
+	return request_data(ctx->request,&ctx->body,&ctx->body_len,data,len);
+}
+
+/*
+ * returns the request body as an external buffer that points at the request data,
+ * or undefined when there is no body. the buffer is only valid during the request.
+ */
+static duk_int_t duk_get_body(duk_context *duk) {
+	context *ctx;
+	const char *data;
+	size_t len;
+	int err;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	switch (request_body(ctx,&data,&len)) {
+		case 0:
+			return 0;
+		case -1:
+			err = errno;
+			duk_push_sprintf(duk,"failed to read request body: %s",strerror(err));
+			duk_throw(duk);
+	}
+	duk_push_external_buffer(duk);
+	duk_config_buffer(duk,-1,(void *)data,len);
+	return 1;
+}
+
+typedef struct {
+	const char *start;
+	const char *p;
+	const char *end;
+	sds scratch;
+	const char *error;
+} json_parser;
+
+static void json_skip_ws(json_parser *jp) {
+	while (jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')) jp->p++;
+}
+
+// surrogates from \u escapes are encoded individually, which is how duktape represents them internally
+static sds sdscatutf8(sds s, unsigned int cp) {
+	char out[3];
+
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return sdscatlen(s,out,1);
+	}
+	if (cp < 0x800) {
+		out[0] = (char)(0xc0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3f));
+		return sdscatlen(s,out,2);
+	}
+	out[0] = (char)(0xe0 | (cp >> 12));
+	out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+	out[2] = (char)(0x80 | (cp & 0x3f));
+	return sdscatlen(s,out,3);
+}
+
+static int json_hex4(json_parser *jp, unsigned int *cp) {
+	int i,h;
+
+	if (jp->end - jp->p < 4) return 0;
+	for (*cp = 0,i = 0; i < 4; i++) {
+		if ((h = hexval(jp->p[i])) < 0) return 0;
+		*cp = (*cp << 4) | h;
+	}
+	jp->p += 4;
+	return 1;
+}
+
+// pushes the string starting after the opening quote; strings without escapes are pushed straight from the body
+static int json_parse_string(duk_context *duk, json_parser *jp) {
+	size_t n;
+	unsigned int cp;
+	char c;
+
+	n = ESCAPE.json(jp->p,jp->end - jp->p);
+	if (jp->p + n < jp->end && jp->p[n] == '"') {
+		duk_push_lstring(duk,jp->p,n);
+		jp->p += n + 1;
+		return 1;
+	}
+	sdsclear(jp->scratch);
+	for (;;) {
+		n = ESCAPE.json(jp->p,jp->end - jp->p);
+		jp->scratch = sdscatlen(jp->scratch,jp->p,n);
+		jp->p += n;
+		if (jp->p >= jp->end) {
+			jp->error = "unterminated string";
+			return 0;
+		}
+		c = *jp->p++;
+		if (c == '"') break;
+		if (c != '\\' || jp->p >= jp->end) {
+			jp->error = "invalid character in string";
+			return 0;
+		}
+		switch ((c = *jp->p++)) {
+			case '"': case '\\': case '/': jp->scratch = sdscatlen(jp->scratch,&c,1); break;
+			case 'b': jp->scratch = sdscatlen(jp->scratch,"\b",1); break;
+			case 'f': jp->scratch = sdscatlen(jp->scratch,"\f",1); break;
+			case 'n': jp->scratch = sdscatlen(jp->scratch,"\n",1); break;
+			case 'r': jp->scratch = sdscatlen(jp->scratch,"\r",1); break;
+			case 't': jp->scratch = sdscatlen(jp->scratch,"\t",1); break;
+			case 'u':
+				if (!json_hex4(jp,&cp)) {
+					jp->error = "invalid unicode escape";
+					return 0;
+				}
+				jp->scratch = sdscatutf8(jp->scratch,cp);
+			break;
+			default:
+				jp->error = "invalid escape in string";
+				return 0;
+		}
+	}
+	duk_push_lstring(duk,jp->scratch,sdslen(jp->scratch));
+	return 1;
+}
+
+static int json_parse_number(duk_context *duk, json_parser *jp) {
+	const char *p = jp->p;
+	char num[64];
+
+	if (p < jp->end && *p == '-') p++;
+	if (p >= jp->end || !isdigit((unsigned char)*p)) goto FAIL;
+	if (*p == '0') p++;
+	else while (p < jp->end && isdigit((unsigned char)*p)) p++;
+	if (p < jp->end && *p == '.') {
+		if (++p >= jp->end || !isdigit((unsigned char)*p)) goto FAIL;
+		while (p < jp->end && isdigit((unsigned char)*p)) p++;
+	}
+	if (p < jp->end && (*p == 'e' || *p == 'E')) {
+		if (++p < jp->end && (*p == '+' || *p == '-')) p++;
+		if (p >= jp->end || !isdigit((unsigned char)*p)) goto FAIL;
+		while (p < jp->end && isdigit((unsigned char)*p)) p++;
+	}
+	if (p - jp->p < (ptrdiff_t)sizeof(num)) {
+		memcpy(num,jp->p,p - jp->p);
+		num[p - jp->p] = '\0';
+		duk_push_number(duk,strtod(num,NULL));
+	} else {
+		sdsclear(jp->scratch);
+		jp->scratch = sdscatlen(jp->scratch,jp->p,p - jp->p);
+		duk_push_number(duk,strtod(jp->scratch,NULL));
+	}
+	jp->p = p;
+	return 1;
+FAIL:
+	jp->error = "invalid number";
+	return 0;
+}
+
+static int json_parse_literal(json_parser *jp, const char *word, size_t len) {
+	if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p,word,len)) {
+		jp->error = "unexpected token";
+		return 0;
+	}
+	jp->p += len;
+	return 1;
+}
+
+static int json_parse_value(duk_context *duk, json_parser *jp, int depth) {
+	duk_uarridx_t index;
+
+	if (depth >= CEPA_JSON_MAX_DEPTH) {
+		jp->error = "value nested too deeply";
+		return 0;
+	}
+	duk_require_stack(duk,3);
+	json_skip_ws(jp);
+	if (jp->p >= jp->end) {
+		jp->error = "unexpected end of input";
+		return 0;
+	}
+	switch (*jp->p) {
+		case '{':
+			jp->p++;
+			duk_push_object(duk);
+			json_skip_ws(jp);
+			if (jp->p < jp->end && *jp->p == '}') {
+				jp->p++;
+				return 1;
+			}
+			for (;;) {
+				json_skip_ws(jp);
+				if (jp->p >= jp->end || *jp->p != '"') {
+					jp->error = "expected string key";
+					return 0;
+				}
+				jp->p++;
+				if (!json_parse_string(duk,jp)) return 0;
+				json_skip_ws(jp);
+				if (jp->p >= jp->end || *jp->p != ':') {
+					jp->error = "expected ':'";
+					return 0;
+				}
+				jp->p++;
+				if (!json_parse_value(duk,jp,depth + 1)) return 0;
+				duk_put_prop(duk,-3);
+				json_skip_ws(jp);
+				if (jp->p < jp->end && *jp->p == ',') {
+					jp->p++;
+					continue;
+				}
+				if (jp->p < jp->end && *jp->p == '}') {
+					jp->p++;
+					return 1;
+				}
+				jp->error = "expected ',' or '}'";
+				return 0;
+			}
+		case '[':
+			jp->p++;
+			duk_push_array(duk);
+			json_skip_ws(jp);
+			if (jp->p < jp->end && *jp->p == ']') {
+				jp->p++;
+				return 1;
+			}
+			for (index = 0;; index++) {
+				if (!json_parse_value(duk,jp,depth + 1)) return 0;
+				duk_put_prop_index(duk,-2,index);
+				json_skip_ws(jp);
+				if (jp->p < jp->end && *jp->p == ',') {
+					jp->p++;
+					continue;
+				}
+				if (jp->p < jp->end && *jp->p == ']') {
+					jp->p++;
+					return 1;
+				}
+				jp->error = "expected ',' or ']'";
+				return 0;
+			}
+		case '"':
+			jp->p++;
+			return json_parse_string(duk,jp);
+		case 't':
+			if (!json_parse_literal(jp,"true",4)) return 0;
+			duk_push_true(duk);
+			return 1;
+		case 'f':
+			if (!json_parse_literal(jp,"false",5)) return 0;
+			duk_push_false(duk);
+			return 1;
+		case 'n':
+			if (!json_parse_literal(jp,"null",4)) return 0;
+			duk_push_null(duk);
+			return 1;
+		default:
+			return json_parse_number(duk,jp);
+	}
+}
+
+/*
+ * parses the request body as JSON straight into javascript values.
+ * returns undefined when there is no body, and throws when the body is larger than limit bytes.
+ */
+static duk_int_t duk_get_json(duk_context *duk) {
+	context *ctx;
+	json_parser jp;
+	const char *data;
+	size_t len;
+	double limit = CEPA_JSON_BODY_MAX;
+	int err,rc;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	if (!duk_is_null_or_undefined(duk,0)) limit = duk_require_number(duk,0);
+	duk_set_top(duk,0);
+	switch (request_body(ctx,&data,&len)) {
+		case 0:
+			return 0;
+		case -1:
+			err = errno;
+			duk_push_sprintf(duk,"failed to read request body: %s",strerror(err));
+			duk_throw(duk);
+	}
+	if (len > limit) {
+		duk_push_sprintf(duk,"request body exceeds %.0f bytes",limit);
+		duk_throw(duk);
+	}
+
+	jp.start = jp.p = data;
+	jp.end = data + len;
+	jp.error = NULL;
+	if ((jp.scratch = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	rc = json_parse_value(duk,&jp,0);
+	if (rc) {
+		json_skip_ws(&jp);
+		if (jp.p < jp.end) {
+			jp.error = "trailing characters";
+			rc = 0;
+		}
+	}
+	sdsfree(jp.scratch);
+	if (!rc) {
+		duk_set_top(duk,0);
+		duk_push_sprintf(duk,"invalid JSON in request body at offset %ld: %s",(long)(jp.p - jp.start),jp.error);
+		duk_throw(duk);
+	}
+	return 1;
+}
+
+// plain buffers and buffer objects; returns NULL for anything else
+static const void *codec_buffer(duk_context *duk, duk_idx_t index, duk_size_t *len) {
+	const void *data;
+
+	if (duk_is_buffer(duk,index)) {
+		data = duk_get_buffer_data(duk,index,len);
+		return data != NULL ? data : "";
+	}
+	if (!duk_is_object(duk,index)) return NULL;
+	return duk_get_buffer_data(duk,index,len);
+}
+
+// like json_to_json(), except that buffers are left alone so they can be encoded as bytes
+static void codec_to_json(duk_context *duk, duk_idx_t key) {
+	duk_size_t len;
+
+	if (codec_buffer(duk,-1,&len) == NULL) json_to_json(duk,key);
+}
+
+static void codec_enter(duk_context *duk, void **seen, int depth) {
+	void *ptr;
+	int k;
+
+	if (depth >= CEPA_JSON_MAX_DEPTH) {
+		duk_push_string(duk,"encode: value nested too deeply");
+		duk_throw(duk);
+	}
+	ptr = duk_get_heapptr(duk,-1);
+	for (k = 0; k < depth; k++) {
+		if (seen[k] == ptr) {
+			duk_push_string(duk,"encode: cyclic value");
+			duk_throw(duk);
+		}
+	}
+	seen[depth] = ptr;
+	duk_require_stack(duk,4);
+}
+
+/*
+ * counts the members of the object on top of the stack that will be encoded, so maps can be written
+ * with a definite length. a member whose toJSON() turns out to return undefined is encoded as null.
+ */
+static duk_size_t codec_count_members(duk_context *duk) {
+	duk_size_t n = 0;
+
+	duk_enum(duk,-1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+	while (duk_next(duk,-1,1)) {
+		if (!json_skipped(duk,-1)) n++;
+		duk_pop_2(duk);
+	}
+	duk_pop(duk);
+	return n;
+}
+
+// true when d can be encoded as an integer without losing anything, -0 included
+static int codec_integer(double d) {
+	return d == floor(d) && fabs(d) < 18446744073709551616.0 && !(d == 0 && signbit(d));
+}
+
+static sds cbor_head(sds s, int major, uint64_t n) {
+	unsigned char head[9];
+	int i,len;
+
+	head[0] = (unsigned char)(major << 5);
+	if (n < 24) {
+		head[0] |= (unsigned char)n;
+		return sdscatlen(s,head,1);
+	}
+	if (n <= 0xff) len = 1;
+	else if (n <= 0xffff) len = 2;
+	else if (n <= 0xffffffffULL) len = 4;
+	else len = 8;
+	head[0] |= (unsigned char)(len == 1 ? 24 : len == 2 ? 25 : len == 4 ? 26 : 27);
+	for (i = len; i > 0; i--, n >>= 8) head[i] = (unsigned char)(n & 0xff);
+	return sdscatlen(s,head,len + 1);
+}
+
+static sds codec_float(sds s, unsigned char f32, unsigned char f64, double d) {
+	unsigned char out[9];
+	uint64_t bits;
+	uint32_t bits32;
+	float f = (float)d;
+	int i;
+
+	if ((double)f == d || isnan(d)) {
+		memcpy(&bits32,&f,4);
+		out[0] = f32;
+		for (i = 4; i > 0; i--, bits32 >>= 8) out[i] = (unsigned char)(bits32 & 0xff);
+		return sdscatlen(s,out,5);
+	}
+	memcpy(&bits,&d,8);
+	out[0] = f64;
+	for (i = 8; i > 0; i--, bits >>= 8) out[i] = (unsigned char)(bits & 0xff);
+	return sdscatlen(s,out,9);
+}
+
+/*
+ * encodes the value on top of the stack as CBOR (RFC 7049).
+ * objects are converted with toJSON() where present, as with printJSON(), and buffers become byte strings.
+ */
+static void cbor_write(duk_context *duk, sds *out, void **seen, int depth) {
+	duk_size_t i,n,len;
+	const char *str;
+	const void *data;
+	double d;
+
+	switch (duk_get_type(duk,-1)) {
+		case DUK_TYPE_UNDEFINED:
+			*out = sdscatlen(*out,"\xf7",1);
+		break;
+		case DUK_TYPE_BOOLEAN:
+			*out = sdscatlen(*out,duk_get_boolean(duk,-1) ? "\xf5" : "\xf4",1);
+		break;
+		case DUK_TYPE_NUMBER:
+			d = (double)duk_get_number(duk,-1);
+			if (codec_integer(d)) {
+				if (d >= 0) *out = cbor_head(*out,0,(uint64_t)d);
+				else if (d >= -9223372036854775808.0) *out = cbor_head(*out,1,(uint64_t)(-1 - (int64_t)d));
+				else *out = codec_float(*out,0xfa,0xfb,d);
+			} else {
+				*out = codec_float(*out,0xfa,0xfb,d);
+			}
+		break;
+		case DUK_TYPE_STRING:
+			str = duk_get_lstring(duk,-1,&len);
+			*out = cbor_head(*out,3,len);
+			*out = sdscatlen(*out,str,len);
+		break;
+		case DUK_TYPE_BUFFER:
+		case DUK_TYPE_OBJECT:
+			if ((data = codec_buffer(duk,-1,&len)) != NULL) {
+				*out = cbor_head(*out,2,len);
+				*out = sdscatlen(*out,data,len);
+				break;
+			}
+			if (duk_is_function(duk,-1)) goto NUL;
+			codec_enter(duk,seen,depth);
+			if (duk_is_array(duk,-1)) {
+				n = duk_get_length(duk,-1);
+				*out = cbor_head(*out,4,n);
+				for (i = 0; i < n; i++) {
+					duk_push_number(duk,(duk_double_t)i);
+					duk_to_string(duk,-1);
+					duk_get_prop_index(duk,-2,(duk_uarridx_t)i);
+					codec_to_json(duk,-2);
+					if (json_skipped(duk,-1)) *out = sdscatlen(*out,"\xf6",1);
+					else cbor_write(duk,out,seen,depth + 1);
+					duk_pop_2(duk);
+				}
+			} else {
+				*out = cbor_head(*out,5,codec_count_members(duk));
+				duk_enum(duk,-1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+				while (duk_next(duk,-1,1)) {
+					if (!json_skipped(duk,-1)) {
+						str = duk_get_lstring(duk,-2,&len);
+						*out = cbor_head(*out,3,len);
+						*out = sdscatlen(*out,str,len);
+						codec_to_json(duk,-2);
+						if (json_skipped(duk,-1)) *out = sdscatlen(*out,"\xf6",1);
+						else cbor_write(duk,out,seen,depth + 1);
+					}
+					duk_pop_2(duk);
+				}
+				duk_pop(duk);
+			}
+		break;
+		default:
+		NUL:
+			*out = sdscatlen(*out,"\xf6",1);
+	}
+}
+
+static sds msgpack_head(sds s, unsigned char fix, int fixbits, unsigned char base, int skip16, uint64_t n) {
+	unsigned char head[5];
+	int i,len;
+
+	if (fixbits && n < (1U << fixbits)) {
+		head[0] = (unsigned char)(fix | n);
+		return sdscatlen(s,head,1);
+	}
+	if (!skip16 && n <= 0xff) {
+		head[0] = base;
+		len = 1;
+	} else if (n <= 0xffff) {
+		head[0] = (unsigned char)(base + 1 - skip16);
+		len = 2;
+	} else {
+		head[0] = (unsigned char)(base + 2 - skip16);
+		len = 4;
+	}
+	for (i = len; i > 0; i--, n >>= 8) head[i] = (unsigned char)(n & 0xff);
+	return sdscatlen(s,head,len + 1);
+}
+
+static sds msgpack_int(sds s, double d) {
+	unsigned char out[9];
+	uint64_t u;
+	int64_t v;
+	int i,len;
+
+	if (d >= 0) {
+		u = (uint64_t)d;
+		if (u < 0x80) {
+			out[0] = (unsigned char)u;
+			return sdscatlen(s,out,1);
+		}
+		if (u <= 0xff) { out[0] = 0xcc; len = 1; }
+		else if (u <= 0xffff) { out[0] = 0xcd; len = 2; }
+		else if (u <= 0xffffffffULL) { out[0] = 0xce; len = 4; }
+		else { out[0] = 0xcf; len = 8; }
+	} else {
+		v = (int64_t)d;
+		if (v >= -32) {
+			out[0] = (unsigned char)(v & 0xff);
+			return sdscatlen(s,out,1);
+		}
+		if (v >= -128) { out[0] = 0xd0; len = 1; }
+		else if (v >= -32768) { out[0] = 0xd1; len = 2; }
+		else if (v >= -2147483648LL) { out[0] = 0xd2; len = 4; }
+		else { out[0] = 0xd3; len = 8; }
+		u = (uint64_t)v;
+	}
+	for (i = len; i > 0; i--, u >>= 8) out[i] = (unsigned char)(u & 0xff);
+	return sdscatlen(s,out,len + 1);
+}
+
+// encodes the value on top of the stack as MessagePack, with the same conversions as cbor_write()
+static void msgpack_write(duk_context *duk, sds *out, void **seen, int depth) {
+	duk_size_t i,n,len;
+	const char *str;
+	const void *data;
+	double d;
+
+	switch (duk_get_type(duk,-1)) {
+		case DUK_TYPE_BOOLEAN:
+			*out = sdscatlen(*out,duk_get_boolean(duk,-1) ? "\xc3" : "\xc2",1);
+		break;
+		case DUK_TYPE_NUMBER:
+			d = (double)duk_get_number(duk,-1);
+			if (codec_integer(d) && d >= -9223372036854775808.0) *out = msgpack_int(*out,d);
+			else *out = codec_float(*out,0xca,0xcb,d);
+		break;
+		case DUK_TYPE_STRING:
+			str = duk_get_lstring(duk,-1,&len);
+			*out = msgpack_head(*out,0xa0,5,0xd9,0,len);
+			*out = sdscatlen(*out,str,len);
+		break;
+		case DUK_TYPE_BUFFER:
+		case DUK_TYPE_OBJECT:
+			if ((data = codec_buffer(duk,-1,&len)) != NULL) {
+				*out = msgpack_head(*out,0,0,0xc4,0,len);
+				*out = sdscatlen(*out,data,len);
+				break;
+			}
+			if (duk_is_function(duk,-1)) goto NIL;
+			codec_enter(duk,seen,depth);
+			if (duk_is_array(duk,-1)) {
+				n = duk_get_length(duk,-1);
+				*out = msgpack_head(*out,0x90,4,0xdc,1,n);
+				for (i = 0; i < n; i++) {
+					duk_push_number(duk,(duk_double_t)i);
+					duk_to_string(duk,-1);
+					duk_get_prop_index(duk,-2,(duk_uarridx_t)i);
+					codec_to_json(duk,-2);
+					if (json_skipped(duk,-1)) *out = sdscatlen(*out,"\xc0",1);
+					else msgpack_write(duk,out,seen,depth + 1);
+					duk_pop_2(duk);
+				}
+			} else {
+				*out = msgpack_head(*out,0x80,4,0xde,1,codec_count_members(duk));
+				duk_enum(duk,-1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+				while (duk_next(duk,-1,1)) {
+					if (!json_skipped(duk,-1)) {
+						str = duk_get_lstring(duk,-2,&len);
+						*out = msgpack_head(*out,0xa0,5,0xd9,0,len);
+						*out = sdscatlen(*out,str,len);
+						codec_to_json(duk,-2);
+						if (json_skipped(duk,-1)) *out = sdscatlen(*out,"\xc0",1);
+						else msgpack_write(duk,out,seen,depth + 1);
+					}
+					duk_pop_2(duk);
+				}
+				duk_pop(duk);
+			}
+		break;
+		default:
+		NIL:
+			*out = sdscatlen(*out,"\xc0",1);
+	}
+}
+
+/*
+ * safe call target shared by the encoders.
+ * the top of the stack is: value, pointer to the output sds, format
+ */
+static duk_ret_t codec_encode(duk_context *duk) {
+	void *seen[CEPA_JSON_MAX_DEPTH];
+	sds *out;
+	int format;
+
+	out = duk_get_pointer(duk,-2);
+	format = duk_get_int(duk,-1);
+	duk_pop_2(duk);
+	duk_push_string(duk,"");
+	duk_dup(duk,-2);
+	if (format == CEPA_FORMAT_JSON) json_to_json(duk,-2);
+	else codec_to_json(duk,-2);
+	switch (format) {
+		case CEPA_FORMAT_CBOR:
+			cbor_write(duk,out,seen,0);
+		break;
+		case CEPA_FORMAT_MSGPACK:
+			msgpack_write(duk,out,seen,0);
+		break;
+		default:
+			if (!json_skipped(duk,-1)) json_write(duk,out,seen,0);
+	}
+	return 0;
+}
+
+// encodes the value at index into *out; on error the output is truncated to where it started, and the error thrown
+static void codec_encode_into(duk_context *duk, duk_idx_t index, sds *out, int format) {
+	size_t start = sdslen(*out);
+
+	duk_dup(duk,index);
+	duk_push_pointer(duk,out);
+	duk_push_int(duk,format);
+	if (duk_safe_call(duk,codec_encode,3,1) != 0) {
+		sdssetlen(*out,start);
+		(*out)[start] = '\0';
+		duk_throw(duk);
+	}
+	duk_pop(duk);
+}
+
+static duk_int_t codec_encode_buffer(duk_context *duk, int format) {
+	sds out;
+	void *buff;
+
+	duk_set_top(duk,1);
+	if ((out = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	duk_dup(duk,0);
+	duk_push_pointer(duk,&out);
+	duk_push_int(duk,format);
+	if (duk_safe_call(duk,codec_encode,3,1) != 0) {
+		sdsfree(out);
+		duk_throw(duk);
+	}
+	buff = duk_push_fixed_buffer(duk,sdslen(out));
+	memcpy(buff,out,sdslen(out));
+	sdsfree(out);
+	return 1;
+}
+
+/*
+ * encodes value as JSON straight into the output, without the intermediate
+ * string JSON.stringify() would create. on error the partial output is discarded.
+ */
+static duk_int_t duk_print_json(duk_context *duk) {
+	context *ctx;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	codec_encode_into(duk,0,&ctx->buffer,CEPA_FORMAT_JSON);
+	return 0;
+}
+
+static duk_int_t duk_cbor_encode(duk_context *duk) {
+	return codec_encode_buffer(duk,CEPA_FORMAT_CBOR);
+}
+
+static duk_int_t duk_msgpack_encode(duk_context *duk) {
+	return codec_encode_buffer(duk,CEPA_FORMAT_MSGPACK);
+}
+
+typedef struct {
+	const unsigned char *start;
+	const unsigned char *p;
+	const unsigned char *end;
+	const char *error;
+} codec_reader;
+
+static int codec_need(codec_reader *cr, size_t n) {
+	if ((size_t)(cr->end - cr->p) < n) {
+		cr->error = "unexpected end of input";
+		return 0;
+	}
+	return 1;
+}
+
+static uint64_t codec_be(codec_reader *cr, int n) {
+	uint64_t v = 0;
+
+	while (n-- > 0) v = (v << 8) | *cr->p++;
+	return v;
+}
+
+static double codec_half(uint16_t h) {
+	int exp = (h >> 10) & 0x1f,mant = h & 0x3ff;
+	double d;
+
+	if (exp == 0) d = ldexp(mant,-24);
+	else if (exp != 31) d = ldexp(mant + 1024,exp - 25);
+	else d = mant == 0 ? INFINITY : NAN;
+	return (h & 0x8000) ? -d : d;
+}
+
+static double codec_f32(uint32_t bits) {
+	float f;
+
+	memcpy(&f,&bits,4);
+	return (double)f;
+}
+
+static double codec_f64(uint64_t bits) {
+	double d;
+
+	memcpy(&d,&bits,8);
+	return d;
+}
+
+static void codec_push_bytes(duk_context *duk, const unsigned char *data, size_t len) {
+	void *buff;
+
+	buff = duk_push_fixed_buffer(duk,len);
+	if (len) memcpy(buff,data,len);
+}
+
+static int cbor_read(duk_context *duk, codec_reader *cr, int depth);
+
+// reads the argument of an initial byte; returns -1 for the indefinite length marker
+static int cbor_arg(codec_reader *cr, int info, uint64_t *n) {
+	if (info < 24) {
+		*n = (uint64_t)info;
+		return 1;
+	}
+	if (info == 31) return -1;
+	if (info > 27) {
+		cr->error = "invalid additional information";
+		return 0;
+	}
+	if (!codec_need(cr,1 << (info - 24))) return 0;
+	*n = codec_be(cr,1 << (info - 24));
+	return 1;
+}
+
+// concatenates the chunks of an indefinite length string onto the stack
+static int cbor_read_chunks(duk_context *duk, codec_reader *cr, int major) {
+	sds s = sdsempty();
+	uint64_t n;
+
+	for (;;) {
+		if (!codec_need(cr,1)) goto FAIL;
+		if (*cr->p == 0xff) {
+			cr->p++;
+			break;
+		}
+		if ((*cr->p >> 5) != major || cbor_arg(cr,*cr->p++ & 0x1f,&n) != 1 || !codec_need(cr,n)) {
+			if (cr->error == NULL) cr->error = "invalid string chunk";
+			goto FAIL;
+		}
+		s = sdscatlen(s,cr->p,n);
+		cr->p += n;
+	}
+	if (major == 2) codec_push_bytes(duk,(unsigned char *)s,sdslen(s));
+	else duk_push_lstring(duk,s,sdslen(s));
+	sdsfree(s);
+	return 1;
+FAIL:
+	sdsfree(s);
+	return 0;
+}
+
+static int cbor_read(duk_context *duk, codec_reader *cr, int depth) {
+	int major,info,rc;
+	uint64_t n,i;
+
+	if (depth >= CEPA_JSON_MAX_DEPTH) {
+		cr->error = "value nested too deeply";
+		return 0;
+	}
+	duk_require_stack(duk,3);
+	if (!codec_need(cr,1)) return 0;
+	major = *cr->p >> 5;
+	info = *cr->p++ & 0x1f;
+	if (major == 7) {
+		switch (info) {
+			case 20: duk_push_false(duk); return 1;
+			case 21: duk_push_true(duk); return 1;
+			case 22: duk_push_null(duk); return 1;
+			case 23: duk_push_undefined(duk); return 1;
+			case 25:
+				if (!codec_need(cr,2)) return 0;
+				duk_push_number(duk,codec_half((uint16_t)codec_be(cr,2)));
+				return 1;
+			case 26:
+				if (!codec_need(cr,4)) return 0;
+				duk_push_number(duk,codec_f32((uint32_t)codec_be(cr,4)));
+				return 1;
+			case 27:
+				if (!codec_need(cr,8)) return 0;
+				duk_push_number(duk,codec_f64(codec_be(cr,8)));
+				return 1;
+			default:
+				if (info == 24 && !codec_need(cr,1)) return 0;
+				if (info == 24) cr->p++;
+				if (info > 24) {
+					cr->error = "invalid simple value";
+					return 0;
+				}
+				duk_push_undefined(duk);
+				return 1;
+		}
+	}
+	if ((rc = cbor_arg(cr,info,&n)) == 0) return 0;
+	if (rc < 0 && (major < 2 || major == 6)) {
+		cr->error = "invalid indefinite length";
+		return 0;
+	}
+	switch (major) {
+		case 0:
+			duk_push_number(duk,(duk_double_t)n);
+		break;
+		case 1:
+			duk_push_number(duk,-1.0 - (duk_double_t)n);
+		break;
+		case 2:
+		case 3:
+			if (rc < 0) return cbor_read_chunks(duk,cr,major);
+			if (!codec_need(cr,n)) return 0;
+			if (major == 2) codec_push_bytes(duk,cr->p,n);
+			else duk_push_lstring(duk,(const char *)cr->p,n);
+			cr->p += n;
+		break;
+		case 4:
+			duk_push_array(duk);
+			for (i = 0; rc < 0 || i < n; i++) {
+				if (rc < 0 && codec_need(cr,1) && *cr->p == 0xff) {
+					cr->p++;
+					break;
+				}
+				if (!cbor_read(duk,cr,depth + 1)) return 0;
+				duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
+			}
+		break;
+		case 5:
+			duk_push_object(duk);
+			for (i = 0; rc < 0 || i < n; i++) {
+				if (rc < 0 && codec_need(cr,1) && *cr->p == 0xff) {
+					cr->p++;
+					break;
+				}
+				if (!cbor_read(duk,cr,depth + 1)) return 0;
+				if (!cbor_read(duk,cr,depth + 1)) return 0;
+				duk_put_prop(duk,-3);
+			}
+		break;
+		case 6:
+			// tags carry no meaning for javascript values, so the tagged item is returned as is
+			return cbor_read(duk,cr,depth + 1);
+	}
+	return 1;
+}
+
+static int msgpack_read(duk_context *duk, codec_reader *cr, int depth) {
+	unsigned char c;
+	uint64_t n,i;
+	int map = 0,size;
+
+	if (depth >= CEPA_JSON_MAX_DEPTH) {
+		cr->error = "value nested too deeply";
+		return 0;
+	}
+	duk_require_stack(duk,3);
+	if (!codec_need(cr,1)) return 0;
+	c = *cr->p++;
+	if (c < 0x80) {
+		duk_push_number(duk,c);
+		return 1;
+	}
+	if (c >= 0xe0) {
+		duk_push_number(duk,(signed char)c);
+		return 1;
+	}
+	if (c >= 0xa0 && c <= 0xbf) {
+		n = c & 0x1f;
+		goto STR;
+	}
+	if (c >= 0x90 && c <= 0x9f) {
+		n = c & 0x0f;
+		goto ARRAY;
+	}
+	if (c >= 0x80 && c <= 0x8f) {
+		n = c & 0x0f;
+		map = 1;
+		goto ARRAY;
+	}
+	switch (c) {
+		case 0xc0: duk_push_null(duk); return 1;
+		case 0xc2: duk_push_false(duk); return 1;
+		case 0xc3: duk_push_true(duk); return 1;
+		case 0xc4: case 0xc5: case 0xc6:
+			size = 1 << (c - 0xc4);
+			if (!codec_need(cr,size)) return 0;
+			n = codec_be(cr,size);
+			if (!codec_need(cr,n)) return 0;
+			codec_push_bytes(duk,cr->p,n);
+			cr->p += n;
+			return 1;
+		case 0xc7: case 0xc8: case 0xc9:
+		case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+			// extension types are returned as their raw payload
+			if (c <= 0xc9) {
+				size = 1 << (c - 0xc7);
+				if (!codec_need(cr,size)) return 0;
+				n = codec_be(cr,size);
+			} else {
+				n = 1 << (c - 0xd4);
+			}
+			if (!codec_need(cr,n + 1)) return 0;
+			codec_push_bytes(duk,cr->p + 1,n);
+			cr->p += n + 1;
+			return 1;
+		case 0xca:
+			if (!codec_need(cr,4)) return 0;
+			duk_push_number(duk,codec_f32((uint32_t)codec_be(cr,4)));
+			return 1;
+		case 0xcb:
+			if (!codec_need(cr,8)) return 0;
+			duk_push_number(duk,codec_f64(codec_be(cr,8)));
+			return 1;
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			size = 1 << (c - 0xcc);
+			if (!codec_need(cr,size)) return 0;
+			duk_push_number(duk,(duk_double_t)codec_be(cr,size));
+			return 1;
+		case 0xd0:
+			if (!codec_need(cr,1)) return 0;
+			duk_push_number(duk,(int8_t)codec_be(cr,1));
+			return 1;
+		case 0xd1:
+			if (!codec_need(cr,2)) return 0;
+			duk_push_number(duk,(int16_t)codec_be(cr,2));
+			return 1;
+		case 0xd2:
+			if (!codec_need(cr,4)) return 0;
+			duk_push_number(duk,(int32_t)codec_be(cr,4));
+			return 1;
+		case 0xd3:
+			if (!codec_need(cr,8)) return 0;
+			duk_push_number(duk,(duk_double_t)(int64_t)codec_be(cr,8));
+			return 1;
+		case 0xd9: case 0xda: case 0xdb:
+			size = 1 << (c - 0xd9);
+			if (!codec_need(cr,size)) return 0;
+			n = codec_be(cr,size);
+			goto STR;
+		case 0xdc: case 0xdd:
+			size = c == 0xdc ? 2 : 4;
+			if (!codec_need(cr,size)) return 0;
+			n = codec_be(cr,size);
+			goto ARRAY;
+		case 0xde: case 0xdf:
+			size = c == 0xde ? 2 : 4;
+			if (!codec_need(cr,size)) return 0;
+			n = codec_be(cr,size);
+			map = 1;
+			goto ARRAY;
+	}
+	cr->error = "invalid type byte";
+	return 0;
+STR:
+	if (!codec_need(cr,n)) return 0;
+	duk_push_lstring(duk,(const char *)cr->p,n);
+	cr->p += n;
+	return 1;
+ARRAY:
+	if (map) duk_push_object(duk);
+	else duk_push_array(duk);
+	for (i = 0; i < n; i++) {
+		if (!msgpack_read(duk,cr,depth + 1)) return 0;
+		if (map) {
+			if (!msgpack_read(duk,cr,depth + 1)) return 0;
+			duk_put_prop(duk,-3);
+		} else {
+			duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
+		}
+	}
+	return 1;
+}
+
+// decodes data into a value on top of the stack; returns 0 and sets *error on failure
+static int codec_decode(duk_context *duk, const void *data, size_t len, int format, const char **error, size_t *offset) {
+	codec_reader cr;
+	duk_idx_t top = duk_get_top(duk);
+	int rc;
+
+	cr.start = cr.p = data;
+	cr.end = cr.start + len;
+	cr.error = NULL;
+	rc = format == CEPA_FORMAT_CBOR ? cbor_read(duk,&cr,0) : msgpack_read(duk,&cr,0);
+	if (rc && cr.p != cr.end) {
+		cr.error = "trailing bytes";
+		rc = 0;
+	}
+	if (!rc) {
+		duk_set_top(duk,top);
+		*error = cr.error;
+		*offset = cr.p - cr.start;
+	}
+	return rc;
+}
+
+static duk_int_t codec_decode_buffer(duk_context *duk, int format) {
+	const void *data;
+	duk_size_t len;
+	const char *error;
+	size_t offset;
+
+	if ((data = codec_buffer(duk,0,&len)) == NULL) data = duk_require_lstring(duk,0,&len);
+	if (!codec_decode(duk,data,len,format,&error,&offset)) {
+		duk_push_sprintf(duk,"invalid %s at offset %lu: %s",format == CEPA_FORMAT_CBOR ? "CBOR" : "MessagePack",
+			(unsigned long)offset,error);
+		duk_throw(duk);
+	}
+	return 1;
+}
+
+static duk_int_t duk_cbor_decode(duk_context *duk) {
+	return codec_decode_buffer(duk,CEPA_FORMAT_CBOR);
+}
+
+static duk_int_t duk_msgpack_decode(duk_context *duk) {
+	return codec_decode_buffer(duk,CEPA_FORMAT_MSGPACK);
+}
+
+static duk_ret_t cbor_check(duk_context *duk) {
+	const char *error;
+	size_t offset;
+
+	duk_push_boolean(duk,codec_decode(duk,duk_get_pointer(duk,0),(size_t)duk_get_number(duk,1),CEPA_FORMAT_CBOR,&error,&offset));
+	return 1;
+}
+
+// whether data is one CBOR item that kv.get can decode: 1 if it is, 0 if not, -1 if out of memory
+static int cbor_valid(const char *data, size_t len) {
+	duk_context *duk;
+	int rc;
+
+	if ((duk = duk_create_heap_default()) == NULL) return -1;
+	duk_push_pointer(duk,(void *)data);
+	duk_push_number(duk,(duk_double_t)len);
+	rc = duk_safe_call(duk,cbor_check,2,1) == 0 ? duk_get_boolean(duk,-1) : -1;
+	duk_destroy_heap(duk);
+	return rc;
+}
+
+/*
+ * returns the quality the Accept header gives type, from 0 to 1000.
+ * the most specific matching media range wins; no header accepts everything.
+ */
+static int accept_quality(const char *accept, const char *type) {
+	const char *p = accept,*range,*slash,*q;
+	size_t len,tlen = strlen(type),major;
+	int quality,best = 0,specificity = -1,s;
+
+	if (accept == NULL) return 1000;
+	slash = strchr(type,'/');
+	major = slash != NULL ? (size_t)(slash - type) : tlen;
+	while (*p) {
+		while (*p == ' ' || *p == ',') p++;
+		range = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ') p++;
+		len = p - range;
+		quality = 1000;
+		while (*p && *p != ',') {
+			if (*p == ';') {
+				q = p + 1;
+				while (*q == ' ') q++;
+				if (q[0] == 'q' && q[1] == '=') quality = (int)(strtod(q + 2,NULL) * 1000);
+			}
+			p++;
+		}
+		if (len == 0) continue;
+		if (len == 3 && !strncmp(range,"*/*",3)) s = 0;
+		else if (len == major + 2 && !strncasecmp(range,type,major + 1) && range[major + 1] == '*') s = 1;
+		else if (len == tlen && !strncasecmp(range,type,len)) s = 2;
+		else continue;
+		if (s > specificity) {
+			specificity = s;
+			best = quality;
+		}
+	}
+	return best;
+}
+
+/*
+ * returns whichever of the arguments the client prefers according to its Accept header,
+ * earlier arguments winning ties, or false if it accepts none of them.
+ */
+static duk_int_t duk_accepts(duk_context *duk) {
+	context *ctx;
+	const char *accept;
+	duk_idx_t i,j,best = -1;
+	int q,bestq = 0;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	accept = onion_request_get_header(ctx->request,"Accept");
+	j = duk_get_top(duk);
+	for (i = 0; i < j; i++) {
+		q = accept_quality(accept,duk_require_string(duk,i));
+		if (q > bestq) {
+			bestq = q;
+			best = i;
+		}
+	}
+	if (best < 0) duk_push_false(duk);
+	else duk_dup(duk,best);
+	return 1;
+}
+
+/*
+ * writes value as CBOR, MessagePack, or JSON, whichever the Accept header prefers (JSON on ties),
+ * and sets Content-Type to match. returns the content type used.
+ */
+static duk_int_t duk_print_encoded(duk_context *duk) {
+	static const char *types[] = { "application/json", "application/cbor", "application/msgpack", "application/x-msgpack" };
+	static const int formats[] = { CEPA_FORMAT_JSON, CEPA_FORMAT_CBOR, CEPA_FORMAT_MSGPACK, CEPA_FORMAT_MSGPACK };
+	context *ctx;
+	const char *accept;
+	int i,q,best = 0,bestq = -1;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	duk_set_top(duk,1);
+	accept = onion_request_get_header(ctx->request,"Accept");
+	for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+		if ((q = accept_quality(accept,types[i])) > bestq) {
+			bestq = q;
+			best = i;
+		}
+	}
+	codec_encode_into(duk,0,&ctx->buffer,formats[best]);
+	if (!context_set_header(ctx,"Content-Type",types[best])) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	duk_push_string(duk,types[best]);
+	return 1;
+}
+
+// strings and buffers are both accepted wherever the crypto functions take data
+static const void *crypto_data(duk_context *duk, duk_idx_t index, duk_size_t *len) {
+	const void *data;
+
+	if ((data = codec_buffer(duk,index,len)) != NULL) return data;
+	return duk_require_lstring(duk,index,len);
+}
+
+// replaces the buffer on top of the stack according to encoding: "hex" (the default), "base64", or "buffer"
+static void crypto_encode(duk_context *duk, duk_idx_t index) {
+	const char *encoding = "hex";
+
+	if (!duk_is_null_or_undefined(duk,index)) encoding = duk_require_string(duk,index);
+	if (!strcmp(encoding,"hex")) duk_hex_encode(duk,-1);
+	else if (!strcmp(encoding,"base64")) duk_base64_encode(duk,-1);
+	else if (strcmp(encoding,"buffer")) {
+		duk_push_sprintf(duk,"unknown encoding '%s'",encoding);
+		duk_throw(duk);
+	}
+}
+
+static duk_int_t duk_crypto_hash(duk_context *duk) {
+	gnutls_digest_algorithm_t alg;
+	const char *name;
+	const void *data;
+	duk_size_t len;
+	void *out;
+	int rc;
+
+	name = duk_require_string(duk,0);
+	data = crypto_data(duk,1,&len);
+	if ((alg = gnutls_digest_get_id(name)) == GNUTLS_DIG_UNKNOWN) {
+		duk_push_sprintf(duk,"unknown hash algorithm '%s'",name);
+		duk_throw(duk);
+	}
+	out = duk_push_fixed_buffer(duk,gnutls_hash_get_len(alg));
+	if ((rc = gnutls_hash_fast(alg,data,len,out)) < 0) {
+		duk_push_sprintf(duk,"hash failed: %s",gnutls_strerror(rc));
+		duk_throw(duk);
+	}
+	crypto_encode(duk,2);
+	return 1;
+}
+
+static duk_int_t duk_crypto_hmac(duk_context *duk) {
+	gnutls_mac_algorithm_t alg;
+	const char *name;
+	const void *key,*data;
+	duk_size_t keylen,len;
+	void *out;
+	int rc;
+
+	name = duk_require_string(duk,0);
+	key = crypto_data(duk,1,&keylen);
+	data = crypto_data(duk,2,&len);
+	if ((alg = gnutls_mac_get_id(name)) == GNUTLS_MAC_UNKNOWN) {
+		duk_push_sprintf(duk,"unknown hmac algorithm '%s'",name);
+		duk_throw(duk);
+	}
+	out = duk_push_fixed_buffer(duk,gnutls_hmac_get_len(alg));
+	if ((rc = gnutls_hmac_fast(alg,key,keylen,data,len,out)) < 0) {
+		duk_push_sprintf(duk,"hmac failed: %s",gnutls_strerror(rc));
+		duk_throw(duk);
+	}
+	crypto_encode(duk,3);
+	return 1;
+}
+
+static duk_int_t duk_crypto_random(duk_context *duk) {
+	duk_int_t n;
+	void *out;
+	int rc;
+
+	n = duk_require_int(duk,0);
+	if (n < 0 || n > CEPA_RANDOM_MAX) {
+		duk_push_sprintf(duk,"randomBytes: length must be between 0 and %d",CEPA_RANDOM_MAX);
+		duk_throw(duk);
+	}
+	out = duk_push_fixed_buffer(duk,n);
+	if (n > 0 && (rc = gnutls_rnd(GNUTLS_RND_RANDOM,out,n)) < 0) {
+		duk_push_sprintf(duk,"randomBytes failed: %s",gnutls_strerror(rc));
+		duk_throw(duk);
+	}
+	crypto_encode(duk,1);
+	return 1;
+}
+
+// compares two strings or buffers in time that depends only on their length
+static duk_int_t duk_crypto_equal(duk_context *duk) {
+	const unsigned char *a,*b;
+	duk_size_t alen,blen,i;
+	unsigned char diff = 0;
+
+	a = crypto_data(duk,0,&alen);
+	b = crypto_data(duk,1,&blen);
+	if (alen != blen) {
+		duk_push_false(duk);
+		return 1;
+	}
+	for (i = 0; i < alen; i++) diff |= a[i] ^ b[i];
+	duk_push_boolean(duk,diff == 0);
+	return 1;
+}
+
+static sds *sb_get_this(duk_context *duk) {
+	sds *sb;
+
+	duk_push_this(duk);
+	duk_get_prop_string(duk,-1,"__PTR");
+	sb = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+	if (sb == NULL) {
+		duk_push_string(duk,"StringBuilder has been freed");
+		duk_throw(duk);
+	}
+	return sb;
+}
+
+static duk_int_t duk_sb_factory(duk_context *duk) {
+	sds *sb;
+
+	if ((sb = malloc(sizeof(sds))) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	if ((*sb = sdsempty()) == NULL) {
+		free(sb);
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+
+	if (duk_is_constructor_call(duk)) duk_push_this(duk);
+	else duk_push_object(duk);
+	duk_push_pointer(duk,sb);
+	duk_put_prop_string(duk,-2,"__PTR");
+	duk_put_function_list(duk,-1,SBBINDINGS);
+	duk_push_c_function(duk,duk_sb_free,1);
+	duk_set_finalizer(duk,-2);
+	return 1;
+}
+
+static duk_int_t duk_sb_append(duk_context *duk) {
+	sds *sb;
+	duk_idx_t i,j;
+	const char *str;
+	duk_size_t len;
+
+	j = duk_get_top(duk);
+	sb = sb_get_this(duk);
+	for (i = 0; i < j; i++) {
+		str = duk_safe_to_lstring(duk,i,&len);
+		*sb = sdscatlen(*sb,str,len);
+	}
+	duk_push_this(duk);
+	return 1;
+}
+
+static duk_int_t duk_sb_append_escaped(duk_context *duk) {
+	sds *sb;
+	duk_idx_t i,j;
+	const char *str;
+	duk_size_t len;
+
+	j = duk_get_top(duk);
+	sb = sb_get_this(duk);
+	for (i = 0; i < j; i++) {
+		str = duk_safe_to_lstring(duk,i,&len);
+		*sb = sdscathtml(*sb,str,len);
+	}
+	duk_push_this(duk);
+	return 1;
+}
+
+/*
+ * same semantics as Array.prototype.join(), but appends to the builder
+ * instead of creating an intermediate string
+ */
+static duk_int_t duk_sb_join(duk_context *duk) {
+	sds *sb;
+	duk_size_t i,n,len,seplen = 1;
+	const char *str,*sep = ",";
+
+	duk_require_object_coercible(duk,0);
+	if (!duk_is_undefined(duk,1)) sep = duk_safe_to_lstring(duk,1,&seplen);
+	sb = sb_get_this(duk);
+	n = duk_get_length(duk,0);
+	for (i = 0; i < n; i++) {
+		if (i > 0) *sb = sdscatlen(*sb,sep,seplen);
+		duk_get_prop_index(duk,0,(duk_uarridx_t)i);
+		if (!duk_is_null_or_undefined(duk,-1)) {
+			str = duk_safe_to_lstring(duk,-1,&len);
+			*sb = sdscatlen(*sb,str,len);
+		}
+		duk_pop(duk);
+	}
+	duk_push_this(duk);
+	return 1;
+}
+
+static duk_int_t duk_sb_length(duk_context *duk) {
+	sds *sb;
+
+	sb = sb_get_this(duk);
+	duk_push_number(duk,(duk_double_t)sdslen(*sb));
+	return 1;
+}
+
+static duk_int_t duk_sb_clear(duk_context *duk) {
+	sds *sb;
+
+	sb = sb_get_this(duk);
+	sdsclear(*sb);
+	duk_push_this(duk);
+	return 1;
+}
+
+/*
+ * move the contents of the builder into the response.
+ * when nothing has been printed yet the buffers are simply swapped, otherwise
+ * the contents are appended; no javascript string is created either way.
+ */
+static duk_int_t duk_sb_flush(duk_context *duk) {
+	context *ctx;
+	sds *sb,temp;
+
+	duk_push_heap_stash(duk);
+	duk_get_prop_string(duk,-1,"__CTX");
+	ctx = duk_get_pointer(duk,-1);
+	duk_pop_2(duk);
+
+	sb = sb_get_this(duk);
+	if (sdslen(ctx->buffer) == 0) {
+		temp = ctx->buffer;
+		ctx->buffer = *sb;
+		*sb = temp;
+	} else {
+		ctx->buffer = sdscatsds(ctx->buffer,*sb);
+		sdsclear(*sb);
+	}
+	duk_push_this(duk);
+	return 1;
+}
+
+static duk_int_t duk_sb_to_string(duk_context *duk) {
+	sds *sb;
+
+	sb = sb_get_this(duk);
+	duk_push_lstring(duk,*sb,sdslen(*sb));
+	return 1;
+}
+
+static duk_int_t duk_sb_free(duk_context *duk) {
+	sds *sb;
+
+	duk_get_prop_string(duk,0,"__PTR");
+	if ((sb = duk_get_pointer(duk,-1)) != NULL) {
+		sdsfree(*sb);
+		free(sb);
+	}
+	return 0;
+}
+
+static duk_int_t duk_sqlite_factory(duk_context *duk) {
+	const char *path;
+	sqlite3 *db;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,timeout = 50;
+	
+	path = duk_require_string(duk,0);
+	if (*path == '\0') return DUK_RET_API_ERROR;
+	if (duk_get_top(duk) > 1) timeout = duk_require_int(duk,1);
+	if (duk_get_top(duk) > 2) if (duk_get_boolean(duk,2)) flags |= SQLITE_OPEN_CREATE;
+
+	if (sqlite3_open_v2(path,&db,flags,NULL) != SQLITE_OK) {
+		duk_push_string(duk,sqlite3_errmsg(db));
+		duk_throw(duk);
+	}
+
+	sqlite3_busy_timeout(db,timeout);
+
+	duk_push_object(duk);
+	duk_push_pointer(duk,db);
+	duk_put_prop_string(duk,-2,"__PTR");
+	duk_put_function_list(duk,-1,SQLITEBINDINGS);
+	duk_push_c_function(duk,duk_sqlite_close,1);
+	duk_set_finalizer(duk,-2);
+
+	return 1;
+}
+
+static int sqlite_execute(duk_context *duk, int headers, sqlite3 *db, sqlite3_stmt *stmt) {
+	int rc,done,row,count,index;
+	const void *blob;
+	void *buff;
+
+	done = row = count = 0;
+	duk_push_array(duk);
+	while (!done) {
+		switch (sqlite3_step(stmt)) {
+			case SQLITE_BUSY:
+				duk_pop(duk);
+				duk_push_string(duk,"sqlite timeout");
+				rc = 0;
+				done = 1;
+			break;
+			case SQLITE_DONE:
+				rc = 1;
+				done = 1;
+			break;
+			case SQLITE_ROW:
+				if (count == 0) {
+					count = sqlite3_column_count(stmt);
+					if (count == 0) {
+						duk_pop(duk);
+						duk_push_int(duk,sqlite3_changes(db));
+						rc = 1;
+						goto END;
+					}
+					if (headers) {
+						duk_push_array(duk);
+						for (index = 0; index < count; index++) {
+							duk_push_string(duk,sqlite3_column_name(stmt,index));
+							duk_put_prop_index(duk,-2,index);
+						}
+						duk_put_prop_index(duk,-2,row++);
+					}
+				}
+				duk_push_array(duk);
+				for (index = 0; index < count; index++) {
+					switch(sqlite3_column_type(stmt,index)) {
+						case SQLITE_INTEGER:
+							duk_push_number(duk,(duk_double_t)sqlite3_column_int64(stmt,index));
+						break;
+						case SQLITE_FLOAT:
+							duk_push_number(duk,(duk_double_t)sqlite3_column_double(stmt,index));
+						break;
+						case SQLITE_TEXT:
+							duk_push_string(duk,(char *)sqlite3_column_text(stmt,index));
+						break;
+						case SQLITE_BLOB:
+							rc = sqlite3_column_bytes(stmt,index);
+							if (rc > 0) {
+								buff = duk_push_fixed_buffer(duk,rc);
+								blob = sqlite3_column_blob(stmt,index);
+								memcpy(buff,blob,rc);
+							} else {
+								duk_push_null(duk);
+							}
+						break;
+						default:
+							duk_push_null(duk);
+					} // end inner switch
+					duk_put_prop_index(duk,-2,index);
 				} // end for
 				duk_put_prop_index(duk,-2,row++);
 			break;
 			default:
-				duk_pop(duk);
-				duk_push_string(duk,sqlite3_errmsg(db));
-				rc = 0;
-				done = 1;
-		} // end outer switch
-	} // end while
-END:
-	sqlite3_finalize(stmt);
-	return rc;
+				duk_pop(duk);
+				duk_push_string(duk,sqlite3_errmsg(db));
+				rc = 0;
+				done = 1;
+		} // end outer switch
+	} // end while
+END:
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+static duk_int_t duk_sqlite_query(duk_context *duk) {
+	const char *sql;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int headers;
+
+	sql = duk_require_string(duk,0);
+	if (*sql == '\0') return DUK_RET_API_ERROR;
+	headers = (duk_get_top(duk) > 1 && duk_get_boolean(duk,1));
+	duk_push_this(duk);
+	duk_get_prop_string(duk,-1,"__PTR");
+	if ((db = duk_get_pointer(duk,-1)) == NULL) {
+		duk_pop(duk);
+		return DUK_RET_INTERNAL_ERROR;
+	}
+	duk_pop_2(duk);
+	if (sqlite3_prepare_v2(db,sql,-1,&stmt,NULL) != SQLITE_OK) {
+		duk_push_string(duk,sqlite3_errmsg(db));
+		duk_throw(duk);
+	}
+	if (sqlite_execute(duk,headers,db,stmt) == 0) duk_throw(duk);
+	return 1;
+}
+
+static duk_int_t duk_sqlite_prepare(duk_context *duk) {
+	const char *sql;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+
+	sql = duk_require_string(duk,0);
+	if (*sql == '\0') return DUK_RET_API_ERROR;
+	duk_push_this(duk);
+	duk_get_prop_string(duk,-1,"__PTR");
+	if ((db = duk_get_pointer(duk,-1)) == NULL) return DUK_RET_INTERNAL_ERROR;
+	duk_pop_2(duk);
+	if (sqlite3_prepare_v2(db,sql,-1,&stmt,NULL) != SQLITE_OK) {
+		duk_push_string(duk,sqlite3_errmsg(db));
+		duk_throw(duk);
+	}
+	duk_push_object(duk);
+	duk_push_pointer(duk,stmt);
+	duk_put_prop_string(duk,-2,"__PTR");
+	duk_push_pointer(duk,db);
+	duk_put_prop_string(duk,-2,"__DB");
+	duk_push_c_function(duk,duk_sqlite_bind,2);
+	duk_put_prop_string(duk,-2,"bind");
+	duk_push_c_function(duk,duk_sqlite_execute,1);
+	duk_put_prop_string(duk,-2,"execute");
+	duk_push_c_function(duk,duk_sqlite_finalize,1);
+	duk_set_finalizer(duk,-2);
+	return 1;
+}
+
+static duk_int_t duk_sqlite_close(duk_context *duk) {
+	int fin,rc;
+	sqlite3 *db;
+
+	fin = duk_get_top(duk);
+	if (!fin) duk_push_this(duk);
+	duk_get_prop_string(duk,-1,"__PTR");
+	if ((db = duk_get_pointer(duk,-1)) == NULL) {
+		duk_pop(duk);
+		if (!fin) duk_pop(duk);
+		return 0;
+	}
+	duk_pop(duk);
+	rc = sqlite3_close(db);
+	if (!fin) {
+		duk_del_prop_string(duk,-1,"__PTR");
+		duk_del_prop_string(duk,-1,"close");
+		duk_del_prop_string(duk,-1,"prepare");
+		duk_del_prop_string(duk,-1,"query");
+		if (rc != SQLITE_OK) {
+			duk_push_string(duk,sqlite3_errstr(rc));
+			duk_throw(duk);
+		}
+	} else {
+		duk_pop(duk);
+	}
+	return 0;
+}
+
+static duk_int_t duk_sqlite_bind(duk_context *duk) {
+	sqlite3_stmt *stmt;
+	int rc,index;
+	const char *str;
+	void *buff;
+	duk_size_t len;
+
+	index = duk_require_int(duk,0);
+	duk_push_this(duk);
+	duk_get_prop_string(duk,-1,"__PTR");
+	if ((stmt = duk_get_pointer(duk,-1)) == NULL) {
+		duk_pop(duk);
+		return DUK_RET_INTERNAL_ERROR;
+	}
+	duk_pop_2(duk);
+	if (duk_get_boolean(duk,2)) {
+		rc = sqlite3_bind_int64(stmt,index,(sqlite3_int64)duk_get_int(duk,1));
+	} else {
+		switch (duk_get_type(duk,1)) {
+			case DUK_TYPE_BOOLEAN:
+				rc = sqlite3_bind_int64(stmt,index,(sqlite3_int64)duk_get_boolean(duk,1));
+			break;
+			case DUK_TYPE_NUMBER:
+				rc = sqlite3_bind_double(stmt,index,(double)duk_get_number(duk,1));
+			break;
+			case DUK_TYPE_STRING:
+				str = duk_get_lstring(duk,1,&len);
+				rc = sqlite3_bind_text(stmt,index,str,(int)len,SQLITE_STATIC);
+			break;
+			case DUK_TYPE_OBJECT:
+				duk_get_prop_string(duk,1,"byteLength");
+				rc = duk_is_undefined(duk,-1);
+				duk_pop(duk);
+				if (!rc) goto BUFFER;
+				duk_get_prop_string(duk,1,"toString");
+				rc = duk_is_undefined(duk,-1);
+				duk_pop(duk);
+				if (rc) {
+					rc = sqlite3_bind_text(stmt,index,duk_json_encode(duk,1),-1,SQLITE_STATIC);
+				} else {
+					duk_get_prop_string(duk,1,"toString");
+					duk_call(duk,0);
+					rc = sqlite3_bind_text(stmt,index,duk_to_string(duk,-1),-1,SQLITE_STATIC);
+					duk_pop(duk);
+				}
+			break;
+			case DUK_TYPE_BUFFER:
+				BUFFER:
+				buff = duk_get_buffer_data(duk,1,&len);
+				rc = sqlite3_bind_blob(stmt,index,(const void *)buff,(int)len,SQLITE_STATIC);
+			break;
+			default:
+				rc = sqlite3_bind_null(stmt,index);
+		}
+	}
+	if (rc != SQLITE_OK) {
+		duk_push_string(duk,sqlite3_errstr(rc));
+		duk_throw(duk);
+	}
+	duk_push_true(duk);
+	return 1;
 }
 
-static duk_int_t duk_sqlite_query(duk_context *duk) {
-	const char *sql;
+static duk_int_t duk_sqlite_execute(duk_context *duk) {
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
-	int headers;
+	int headers,rc;
 
-	sql = duk_require_string(duk,0);
-	if (*sql == '\0') return DUK_RET_API_ERROR;
-	headers = (duk_get_top(duk) > 1 && duk_get_boolean(duk,1));
 	duk_push_this(duk);
 	duk_get_prop_string(duk,-1,"__PTR");
+	if ((stmt = duk_get_pointer(duk,-1)) == NULL) {
+		duk_pop_2(duk);
+		return DUK_RET_INTERNAL_ERROR;
+	}
+	duk_pop(duk);
+	duk_get_prop_string(duk,-1,"__DB");
 	if ((db = duk_get_pointer(duk,-1)) == NULL) {
-		duk_pop(duk);
+		duk_pop_2(duk);
 		return DUK_RET_INTERNAL_ERROR;
 	}
-	duk_pop_2(duk);
-	if (sqlite3_prepare_v2(db,sql,-1,&stmt,NULL) != SQLITE_OK) {
-		duk_push_string(duk,sqlite3_errmsg(db));
+	duk_pop(duk);
+	headers = duk_get_boolean(duk,0);
+	rc = sqlite_execute(duk,headers,db,stmt);
+	duk_del_prop_string(duk,1,"__DB");
+	duk_del_prop_string(duk,1,"__PTR");
+	duk_push_undefined(duk);
+	duk_set_finalizer(duk,1);
+	if (rc == 0) duk_throw(duk);
+	return 1;
+}
+
+static duk_int_t duk_sqlite_finalize(duk_context *duk) {
+	sqlite3_stmt *stmt;
+
+	duk_get_prop_string(duk,0,"__PTR");
+	if ((stmt = duk_get_pointer(duk,-1)) != NULL) sqlite3_finalize(stmt);
+	return 0;
+}
+
+/*
+ * the bytes and type kv stores for the value at index: strings and buffers as they are, anything else as CBOR,
+ * which replaces the value on the stack. returns NULL for null and undefined.
+ */
+static const char *kv_value(duk_context *duk, duk_idx_t index, duk_size_t *len, int *type) {
+	const char *value;
+	sds cbor;
+	void *buff;
+
+	index = duk_normalize_index(duk,index);
+	*len = 0;
+	*type = KV_STRING;
+	if (duk_is_string(duk,index)) return duk_get_lstring(duk,index,len);
+	if ((value = codec_buffer(duk,index,len)) != NULL) {
+		*type = KV_BUFFER;
+		return value;
+	}
+	if (duk_is_null_or_undefined(duk,index)) return NULL;
+	if ((cbor = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
 		duk_throw(duk);
 	}
-	if (sqlite_execute(duk,headers,db,stmt) == 0) duk_throw(duk);
+	duk_dup(duk,index);
+	duk_push_pointer(duk,&cbor);
+	duk_push_int(duk,CEPA_FORMAT_CBOR);
+	if (duk_safe_call(duk,codec_encode,3,1) != 0) {
+		sdsfree(cbor);
+		duk_throw(duk);
+	}
+	duk_pop(duk);
+	buff = duk_push_fixed_buffer(duk,sdslen(cbor));
+	memcpy(buff,cbor,sdslen(cbor));
+	sdsfree(cbor);
+	duk_replace(duk,index);
+	*type = KV_CBOR;
+	return duk_get_buffer(duk,index,len);
+}
+
+/*
+ * pushes a value copied out of kv, then frees it. collections come as CBOR, HyperLogLogs as their registers.
+ * returns 0, pushing the error message instead, if the value is CBOR that doesn't decode.
+ */
+static int kv_push_decoded(duk_context *duk, sds value, int type) {
+	const char *error;
+	size_t offset;
+	int rc = 1;
+
+	if (type == KV_BUFFER || type == KV_HLL) {
+		codec_push_bytes(duk,(const unsigned char *)value,sdslen(value));
+	} else if (type != KV_STRING) {
+		if (!(rc = codec_decode(duk,value,sdslen(value),CEPA_FORMAT_CBOR,&error,&offset))) {
+			duk_push_sprintf(duk,"invalid CBOR in kv at offset %lu: %s",(unsigned long)offset,error);
+		}
+	} else {
+		duk_push_lstring(duk,value,sdslen(value));
+	}
+	sdsfree(value);
+	return rc;
+}
+
+static void kv_push_value(duk_context *duk, sds value, int type) {
+	if (!kv_push_decoded(duk,value,type)) duk_throw(duk);
+}
+
+// seconds, to the millisecond
+static int64_t kv_ttl(duk_double_t expiry) {
+	int64_t ttl = 0;
+
+	if (expiry > 0) {
+		ttl = expiry < 1e15 ? (int64_t)(expiry * 1000) : (int64_t)1e18;
+		if (ttl == 0) ttl = 1;
+	} else if (expiry < 0) {
+		ttl = -1;
+	}
+	return ttl;
+}
+
+static duk_int_t duk_kv_get(duk_context *duk) {
+	const char *key;
+	duk_size_t len;
+	sds value,found;
+	int type;
+
+	key = duk_require_lstring(duk,0,&len);
+	if ((value = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	errno = 0;
+	if ((found = kv_copy(key,len,value,&type)) == NULL) {
+		sdsfree(value);
+		if (errno == ENOMEM) {
+			duk_push_string(duk,"out of memory");
+			duk_throw(duk);
+		}
+		if (errno != 0) {
+			duk_push_sprintf(duk,"kv.get failed: %s",strerror(errno));
+			duk_throw(duk);
+		}
+		return 0;
+	}
+	kv_push_value(duk,found,type);
 	return 1;
 }
 
-static duk_int_t duk_sqlite_prepare(duk_context *duk) {
-	const char *sql;
-	sqlite3 *db;
-	sqlite3_stmt *stmt;
+static duk_int_t duk_kv_set(duk_context *duk) {
+	const char *key,*value;
+	duk_size_t len,vlen;
+	int rc,type;
+
+	key = duk_require_lstring(duk,0,&len);
+	value = kv_value(duk,1,&vlen,&type);
+	if ((rc = kv_put(key,len,value,vlen,type,kv_ttl(duk_get_number(duk,2)),duk_get_boolean(duk,3))) < 0) {
+		duk_push_sprintf(duk,"kv.set failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_boolean(duk,rc);
+	return 1;
+}
+
+static duk_int_t kv_incr_by(duk_context *duk, int sign) {
+	const char *key;
+	duk_size_t len;
+	duk_double_t delta;
+	int64_t result;
+
+	key = duk_require_lstring(duk,0,&len);
+	delta = duk_is_undefined(duk,1) ? 1 : duk_require_number(duk,1);
+	if (delta != floor(delta) || fabs(delta) > 9007199254740992.0) {
+		duk_push_string(duk,"kv.incr: delta must be an integer");
+		duk_throw(duk);
+	}
+	if (kv_add(key,len,(int64_t)delta * sign,&result) < 0) {
+		duk_push_sprintf(duk,"kv.incr failed: %s",errno == EINVAL ? "value is not an integer" : strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_number(duk,(duk_double_t)result);
+	return 1;
+}
+
+static duk_int_t duk_kv_incr(duk_context *duk) {
+	return kv_incr_by(duk,1);
+}
+
+static duk_int_t duk_kv_decr(duk_context *duk) {
+	return kv_incr_by(duk,-1);
+}
+
+static duk_int_t duk_kv_append(duk_context *duk) {
+	const char *key,*value;
+	duk_size_t len,vlen;
+	size_t length;
+	int type;
+
+	key = duk_require_lstring(duk,0,&len);
+	if ((value = kv_value(duk,1,&vlen,&type)) == NULL || type == KV_CBOR) {
+		duk_push_string(duk,"kv.append: value must be a string or a buffer");
+		duk_throw(duk);
+	}
+	if (kv_concat(key,len,value,vlen,type,&length) < 0) {
+		duk_push_sprintf(duk,"kv.append failed: %s",errno == EINVAL ? "value is not a string or a buffer" : strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_number(duk,(duk_double_t)length);
+	return 1;
+}
+
+static duk_int_t duk_kv_cas(duk_context *duk) {
+	const char *key,*expected,*value;
+	duk_size_t len,elen,vlen;
+	int rc,etype,type;
+
+	key = duk_require_lstring(duk,0,&len);
+	expected = kv_value(duk,1,&elen,&etype);
+	value = kv_value(duk,2,&vlen,&type);
+	if ((rc = kv_swap(key,len,expected,elen,etype,value,vlen,type)) < 0) {
+		duk_push_sprintf(duk,"kv.cas failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_boolean(duk,rc);
+	return 1;
+}
+
+static duk_int_t duk_kv_getset(duk_context *duk) {
+	const char *key,*value;
+	duk_size_t len,vlen;
+	sds old;
+	int rc,type,otype;
+
+	key = duk_require_lstring(duk,0,&len);
+	value = kv_value(duk,1,&vlen,&type);
+	if ((old = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	if ((rc = kv_exchange(key,len,value,vlen,type,&old,&otype)) < 0) {
+		sdsfree(old);
+		duk_push_sprintf(duk,"kv.getset failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	if (rc == 0) {
+		sdsfree(old);
+		return 0;
+	}
+	kv_push_value(duk,old,otype);
+	return 1;
+}
+
+static duk_int_t duk_kv_touch(duk_context *duk) {
+	const char *key;
+	duk_size_t len;
+	int rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	if ((rc = kv_refresh(key,len,kv_ttl(duk_get_number(duk,1)))) < 0) {
+		duk_push_sprintf(duk,"kv.touch failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_boolean(duk,rc);
+	return 1;
+}
+
+// the keys of the array at index 0, in a buffer pushed on the stack, followed by the keys as strings to keep them alive
+static kv_item *kv_keys(duk_context *duk, duk_size_t *n) {
+	kv_item *items;
+	duk_size_t i;
+
+	if (!duk_is_array(duk,0)) {
+		duk_push_string(duk,"expected an array of keys");
+		duk_throw(duk);
+	}
+	*n = duk_get_length(duk,0);
+	items = duk_push_fixed_buffer(duk,*n * sizeof(kv_item) + 1);
+	for (i = 0; i < *n; i++) {
+		duk_require_stack(duk,1);
+		duk_get_prop_index(duk,0,(duk_uarridx_t)i);
+		items[i].key = duk_to_lstring(duk,-1,&items[i].klen);
+		items[i].value = NULL;
+		items[i].vlen = 0;
+		items[i].type = KV_STRING;
+	}
+	return items;
+}
+
+static duk_int_t duk_kv_mget(duk_context *duk) {
+	kv_item *items;
+	duk_size_t i,n;
+	sds *values;
+
+	items = kv_keys(duk,&n);
+	values = duk_push_fixed_buffer(duk,n * sizeof(sds) + 1);
+	if (kv_mcopy(items,n,values) != 0) {
+		duk_push_sprintf(duk,"kv.mget failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_array(duk);
+	for (i = 0; i < n; i++) {
+		if (values[i] == NULL) {
+			duk_push_undefined(duk);
+		} else if (!kv_push_decoded(duk,values[i],items[i].type)) {
+			// the values not pushed yet are freed before throwing
+			while (++i < n) sdsfree(values[i]);
+			duk_throw(duk);
+		}
+		values[i] = NULL;
+		duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
+	}
+	return 1;
+}
+
+static duk_int_t duk_kv_mset(duk_context *duk) {
+	kv_item *items;
+	duk_size_t n = 0;
+	duk_idx_t e;
+	long rc;
+
+	duk_require_object_coercible(duk,0);
+	duk_enum(duk,0,DUK_ENUM_OWN_PROPERTIES_ONLY);
+	e = duk_get_top_index(duk);
+	while (duk_next(duk,e,0)) {
+		n++;
+		duk_pop(duk);
+	}
+	duk_pop(duk);
+	items = duk_push_fixed_buffer(duk,n * sizeof(kv_item) + 1);
+	duk_enum(duk,0,DUK_ENUM_OWN_PROPERTIES_ONLY);
+	e = duk_get_top_index(duk);
+	n = 0;
+	// keys and values stay on the stack until the batch is done
+	while (duk_require_stack(duk,3), duk_next(duk,e,1)) {
+		items[n].key = duk_get_lstring(duk,-2,&items[n].klen);
+		items[n].value = kv_value(duk,-1,&items[n].vlen,&items[n].type);
+		n++;
+	}
+	if ((rc = kv_mput(items,n,kv_ttl(duk_get_number(duk,1)))) < 0) {
+		duk_push_sprintf(duk,"kv.mset failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
+}
+
+static duk_int_t duk_kv_mdel(duk_context *duk) {
+	kv_item *items;
+	duk_size_t n;
+	long rc;
+
+	items = kv_keys(duk,&n);
+	if ((rc = kv_mput(items,n,0)) < 0) {
+		duk_push_sprintf(duk,"kv.mdel failed: %s",strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
+}
+
+// returns { keys: [...], cursor: the last key, or undefined once there are no more }
+static duk_int_t duk_kv_scan(duk_context *duk) {
+	const char *prefix = "",*cursor = NULL;
+	duk_size_t plen = 0,clen = 0;
+	duk_double_t limit;
+	size_t *lens,offset;
+	sds keys;
+	long i,n;
+
+	if (!duk_is_null_or_undefined(duk,0)) prefix = duk_require_lstring(duk,0,&plen);
+	limit = duk_is_null_or_undefined(duk,1) ? CEPA_KV_SCAN_LIMIT : duk_require_number(duk,1);
+	if (!duk_is_null_or_undefined(duk,2)) cursor = duk_require_lstring(duk,2,&clen);
+	if (!(limit >= 1 && limit <= CEPA_KV_SCAN_MAX)) {
+		duk_push_sprintf(duk,"kv.scan: limit must be between 1 and %d",CEPA_KV_SCAN_MAX);
+		duk_throw(duk);
+	}
+	lens = duk_push_fixed_buffer(duk,(size_t)limit * sizeof(size_t));
+	if ((keys = sdsempty()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	if ((n = kv_scan(prefix,plen,cursor,clen,(size_t)limit,&keys,lens)) < 0) {
+		sdsfree(keys);
+		duk_push_sprintf(duk,"kv.scan failed: %s",errno == ENOTSUP ? "the kv index is not enabled" : strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_object(duk);
+	duk_push_array(duk);
+	for (i = 0, offset = 0; i < n; offset += lens[i], i++) {
+		duk_push_lstring(duk,keys + offset,lens[i]);
+		duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
+	}
+	duk_put_prop_string(duk,-2,"keys");
+	if (n == (long)limit) {
+		duk_push_lstring(duk,keys + offset - lens[n - 1],lens[n - 1]);
+		duk_put_prop_string(duk,-2,"cursor");
+	}
+	sdsfree(keys);
+	return 1;
+}
+
+static duk_int_t duk_kv_count(duk_context *duk) {
+	const char *prefix = "";
+	duk_size_t plen = 0;
+	long n;
+
+	if (!duk_is_null_or_undefined(duk,0)) prefix = duk_require_lstring(duk,0,&plen);
+	if ((n = kv_count(prefix,plen)) < 0) {
+		duk_push_sprintf(duk,"kv.count failed: %s",errno == ENOTSUP ? "the kv index is not enabled" : strerror(errno));
+		duk_throw(duk);
+	}
+	duk_push_number(duk,(duk_double_t)n);
+	return 1;
+}
+
+static void kv_fail(duk_context *duk, const char *name) {
+	duk_push_sprintf(duk,"kv.%s failed: %s",name,errno == EINVAL ? "key holds another type of value" : strerror(errno));
+	duk_throw(duk);
+}
+
+// the arguments from index on, as strings, in a buffer pushed on the stack that also holds their lengths
+static const char **kv_args(duk_context *duk, duk_idx_t index, const char *name, size_t **lens, size_t *n) {
+	const char **args;
+	duk_idx_t top = duk_get_top(duk);
+	size_t i;
+
+	if (top <= index) {
+		duk_push_sprintf(duk,"kv.%s: expected at least one value",name);
+		duk_throw(duk);
+	}
+	*n = top - index;
+	args = duk_push_fixed_buffer(duk,*n * (sizeof(char *) + sizeof(size_t)));
+	*lens = (size_t *)(args + *n);
+	for (i = 0; i < *n; i++) args[i] = duk_to_lstring(duk,index + i,&(*lens)[i]);
+	return args;
+}
+
+// pushes an array of values, then frees them
+static void kv_push_values(duk_context *duk, sds *values, long n) {
+	long i;
+
+	duk_push_array(duk);
+	for (i = 0; i < n; i++) {
+		duk_push_lstring(duk,values[i],sdslen(values[i]));
+		duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
+	}
+	kv_free_values(values,n);
+}
+
+static duk_int_t kv_push_to(duk_context *duk, int left) {
+	const char *key,**values;
+	duk_size_t len;
+	size_t *lens,n;
+	long rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	values = kv_args(duk,1,left ? "lpush" : "rpush",&lens,&n);
+	if ((rc = kv_push(key,len,left,values,lens,n)) < 0) kv_fail(duk,left ? "lpush" : "rpush");
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
+}
+
+static duk_int_t duk_kv_lpush(duk_context *duk) {
+	return kv_push_to(duk,1);
+}
+
+static duk_int_t duk_kv_rpush(duk_context *duk) {
+	return kv_push_to(duk,0);
+}
+
+// without a count, the value or undefined, with one, an array of up to count values
+static duk_int_t kv_pop_from(duk_context *duk, int left) {
+	const char *key;
+	duk_size_t len;
+	duk_double_t count;
+	sds *values;
+	long n;
+
+	key = duk_require_lstring(duk,0,&len);
+	count = duk_is_undefined(duk,1) ? 1 : duk_require_number(duk,1);
+	if (!(count >= 0 && count <= 4294967295.0)) {
+		duk_push_sprintf(duk,"kv.%s: invalid count",left ? "lpop" : "rpop");
+		duk_throw(duk);
+	}
+	if ((n = kv_pop(key,len,left,(size_t)count,&values)) < 0) kv_fail(duk,left ? "lpop" : "rpop");
+	if (!duk_is_undefined(duk,1)) {
+		kv_push_values(duk,values,n);
+		return 1;
+	}
+	if (n == 0) return 0;
+	duk_push_lstring(duk,values[0],sdslen(values[0]));
+	kv_free_values(values,n);
+	return 1;
+}
+
+static duk_int_t duk_kv_lpop(duk_context *duk) {
+	return kv_pop_from(duk,1);
+}
+
+static duk_int_t duk_kv_rpop(duk_context *duk) {
+	return kv_pop_from(duk,0);
+}
+
+static duk_int_t duk_kv_lrange(duk_context *duk) {
+	const char *key;
+	duk_size_t len;
+	sds *values;
+	long n;
+
+	key = duk_require_lstring(duk,0,&len);
+	if ((n = kv_range(key,len,duk_is_undefined(duk,1) ? 0 : duk_require_int(duk,1),duk_is_undefined(duk,2) ? -1 : duk_require_int(duk,2),&values)) < 0) kv_fail(duk,"lrange");
+	kv_push_values(duk,values,n);
+	return 1;
+}
 
-	sql = duk_require_string(duk,0);
-	if (*sql == '\0') return DUK_RET_API_ERROR;
-	duk_push_this(duk);
-	duk_get_prop_string(duk,-1,"__PTR");
-	if ((db = duk_get_pointer(duk,-1)) == NULL) return DUK_RET_INTERNAL_ERROR;
-	duk_pop_2(duk);
-	if (sqlite3_prepare_v2(db,sql,-1,&stmt,NULL) != SQLITE_OK) {
-		duk_push_string(duk,sqlite3_errmsg(db));
-		duk_throw(duk);
-	}
-	duk_push_object(duk);
-	duk_push_pointer(duk,stmt);
-	duk_put_prop_string(duk,-2,"__PTR");
-	duk_push_pointer(duk,db);
-	duk_put_prop_string(duk,-2,"__DB");
-	duk_push_c_function(duk,duk_sqlite_bind,2);
-	duk_put_prop_string(duk,-2,"bind");
-	duk_push_c_function(duk,duk_sqlite_execute,1);
-	duk_put_prop_string(duk,-2,"execute");
-	duk_push_c_function(duk,duk_sqlite_finalize,1);
-	duk_set_finalizer(duk,-2);
+static duk_int_t duk_kv_len(duk_context *duk) {
+	const char *key;
+	duk_size_t len;
+	long n;
+
+	key = duk_require_lstring(duk,0,&len);
+	if ((n = kv_len(key,len)) < 0) kv_fail(duk,"len");
+	duk_push_number(duk,(duk_double_t)n);
 	return 1;
 }
 
-static duk_int_t duk_sqlite_close(duk_context *duk) {
-	int fin,rc;
-	sqlite3 *db;
+// the number of own properties of the object at index
+static size_t kv_props(duk_context *duk, duk_idx_t index) {
+	size_t n = 0;
 
-	fin = duk_get_top(duk);
-	if (!fin) duk_push_this(duk);
-	duk_get_prop_string(duk,-1,"__PTR");
-	if ((db = duk_get_pointer(duk,-1)) == NULL) {
+	duk_enum(duk,index,DUK_ENUM_OWN_PROPERTIES_ONLY);
+	while (duk_next(duk,-1,0)) {
+		n++;
 		duk_pop(duk);
-		if (!fin) duk_pop(duk);
-		return 0;
 	}
 	duk_pop(duk);
-	rc = sqlite3_close(db);
-	if (!fin) {
-		duk_del_prop_string(duk,-1,"__PTR");
-		duk_del_prop_string(duk,-1,"close");
-		duk_del_prop_string(duk,-1,"prepare");
-		duk_del_prop_string(duk,-1,"query");
-		if (rc != SQLITE_OK) {
-			duk_push_string(duk,sqlite3_errstr(rc));
-			duk_throw(duk);
-		}
+	return n;
+}
+
+// kv.hset(key,field,value) or kv.hset(key,{ field: value, ... }), returning how many fields are new
+static duk_int_t duk_kv_hset(duk_context *duk) {
+	const char *key,**fields,**values;
+	duk_size_t len;
+	size_t *flens,*vlens,n;
+	duk_idx_t e;
+	long rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	n = duk_is_object(duk,1) && !duk_is_buffer(duk,1) ? kv_props(duk,1) : 1;
+	fields = duk_push_fixed_buffer(duk,n * 2 * (sizeof(char *) + sizeof(size_t)) + 1);
+	values = fields + n;
+	flens = (size_t *)(values + n);
+	vlens = flens + n;
+	if (!duk_is_object(duk,1) || duk_is_buffer(duk,1)) {
+		fields[0] = duk_to_lstring(duk,1,&flens[0]);
+		values[0] = duk_to_lstring(duk,2,&vlens[0]);
 	} else {
-		duk_pop(duk);
+		duk_enum(duk,1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+		e = duk_get_top_index(duk);
+		n = 0;
+		// fields and values stay on the stack until the command is done
+		while (duk_require_stack(duk,3), duk_next(duk,e,1)) {
+			fields[n] = duk_get_lstring(duk,-2,&flens[n]);
+			values[n] = duk_to_lstring(duk,-1,&vlens[n]);
+			n++;
+		}
 	}
-	return 0;
+	if ((rc = kv_field_put(key,len,fields,flens,values,vlens,n)) < 0) kv_fail(duk,"hset");
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
 }
 
-static duk_int_t duk_sqlite_bind(duk_context *duk) {
-	sqlite3_stmt *stmt;
-	int rc,index;
-	const char *str;
-	void *buff;
+static duk_int_t duk_kv_hget(duk_context *duk) {
+	const char *key,*field;
+	duk_size_t len,flen;
+	sds value;
+	int rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	field = duk_to_lstring(duk,1,&flen);
+	if ((rc = kv_field_copy(key,len,field,flen,&value)) < 0) kv_fail(duk,"hget");
+	if (rc == 0) return 0;
+	duk_push_lstring(duk,value,sdslen(value));
+	sdsfree(value);
+	return 1;
+}
+
+static duk_int_t duk_kv_hdel(duk_context *duk) {
+	const char *key,**fields;
 	duk_size_t len;
+	size_t *lens,n;
+	long rc;
 
-	index = duk_require_int(duk,0);
-	duk_push_this(duk);
-	duk_get_prop_string(duk,-1,"__PTR");
-	if ((stmt = duk_get_pointer(duk,-1)) == NULL) {
-		duk_pop(duk);
-		return DUK_RET_INTERNAL_ERROR;
-	}
-	duk_pop_2(duk);
-	if (duk_get_boolean(duk,2)) {
-		rc = sqlite3_bind_int64(stmt,index,(sqlite3_int64)duk_get_int(duk,1));
+	key = duk_require_lstring(duk,0,&len);
+	fields = kv_args(duk,1,"hdel",&lens,&n);
+	if ((rc = kv_field_del(key,len,fields,lens,n)) < 0) kv_fail(duk,"hdel");
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
+}
+
+// kv.zadd(key,score,member) or kv.zadd(key,{ member: score, ... }), returning how many members are new
+static duk_int_t duk_kv_zadd(duk_context *duk) {
+	const char *key,**members;
+	duk_size_t len;
+	size_t *lens,n,i;
+	double *scores;
+	duk_idx_t e;
+	long rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	n = duk_is_object(duk,1) ? kv_props(duk,1) : 1;
+	members = duk_push_fixed_buffer(duk,n * (sizeof(char *) + sizeof(size_t) + sizeof(double)) + 1);
+	lens = (size_t *)(members + n);
+	scores = (double *)(lens + n);
+	if (!duk_is_object(duk,1)) {
+		scores[0] = duk_require_number(duk,1);
+		members[0] = duk_to_lstring(duk,2,&lens[0]);
 	} else {
-		switch (duk_get_type(duk,1)) {
-			case DUK_TYPE_BOOLEAN:
-				rc = sqlite3_bind_int64(stmt,index,(sqlite3_int64)duk_get_boolean(duk,1));
-			break;
-			case DUK_TYPE_NUMBER:
-				rc = sqlite3_bind_double(stmt,index,(double)duk_get_number(duk,1));
-			break;
-			case DUK_TYPE_STRING:
-				str = duk_get_lstring(duk,1,&len);
-				rc = sqlite3_bind_text(stmt,index,str,(int)len,SQLITE_STATIC);
-			break;
-			case DUK_TYPE_OBJECT:
-				duk_get_prop_string(duk,1,"byteLength");
-				rc = duk_is_undefined(duk,-1);
-				duk_pop(duk);
-				if (!rc) goto BUFFER;
-				duk_get_prop_string(duk,1,"toString");
-				rc = duk_is_undefined(duk,-1);
-				duk_pop(duk);
-				if (rc) {
-					rc = sqlite3_bind_text(stmt,index,duk_json_encode(duk,1),-1,SQLITE_STATIC);
-				} else {
-					duk_get_prop_string(duk,1,"toString");
-					duk_call(duk,0);
-					rc = sqlite3_bind_text(stmt,index,duk_to_string(duk,-1),-1,SQLITE_STATIC);
-					duk_pop(duk);
-				}
-			break;
-			case DUK_TYPE_BUFFER:
-				BUFFER:
-				buff = duk_get_buffer_data(duk,1,&len);
-				rc = sqlite3_bind_blob(stmt,index,(const void *)buff,(int)len,SQLITE_STATIC);
-			break;
-			default:
-				rc = sqlite3_bind_null(stmt,index);
+		duk_enum(duk,1,DUK_ENUM_OWN_PROPERTIES_ONLY);
+		e = duk_get_top_index(duk);
+		n = 0;
+		while (duk_require_stack(duk,3), duk_next(duk,e,1)) {
+			members[n] = duk_get_lstring(duk,-2,&lens[n]);
+			scores[n] = duk_require_number(duk,-1);
+			duk_pop(duk);
+			n++;
 		}
 	}
-	if (rc != SQLITE_OK) {
-		duk_push_string(duk,sqlite3_errstr(rc));
-		duk_throw(duk);
+	for (i = 0; i < n; i++) {
+		if (isnan(scores[i])) {
+			duk_push_string(duk,"kv.zadd: score must be a number");
+			duk_throw(duk);
+		}
 	}
-	duk_push_true(duk);
+	if ((rc = kv_member_add(key,len,members,lens,scores,n)) < 0) kv_fail(duk,"zadd");
+	duk_push_number(duk,(duk_double_t)rc);
 	return 1;
 }
 
-static duk_int_t duk_sqlite_execute(duk_context *duk) {
-	sqlite3 *db;
-	sqlite3_stmt *stmt;
-	int headers,rc;
+static duk_int_t duk_kv_zrem(duk_context *duk) {
+	const char *key,**members;
+	duk_size_t len;
+	size_t *lens,n;
+	long rc;
 
-	duk_push_this(duk);
-	duk_get_prop_string(duk,-1,"__PTR");
-	if ((stmt = duk_get_pointer(duk,-1)) == NULL) {
-		duk_pop_2(duk);
-		return DUK_RET_INTERNAL_ERROR;
+	key = duk_require_lstring(duk,0,&len);
+	members = kv_args(duk,1,"zrem",&lens,&n);
+	if ((rc = kv_member_del(key,len,members,lens,n)) < 0) kv_fail(duk,"zrem");
+	duk_push_number(duk,(duk_double_t)rc);
+	return 1;
+}
+
+static duk_int_t duk_kv_zscore(duk_context *duk) {
+	const char *key,*member;
+	duk_size_t len,mlen;
+	double score;
+	int rc;
+
+	key = duk_require_lstring(duk,0,&len);
+	member = duk_to_lstring(duk,1,&mlen);
+	if ((rc = kv_member_score(key,len,member,mlen,&score)) < 0) kv_fail(duk,"zscore");
+	if (rc == 0) return 0;
+	duk_push_number(duk,score);
+	return 1;
+}
+
+// kv.zrange(key,min,max,limit,reverse) returns [[member,score], ...], from max down to min when reverse is true
+static duk_int_t duk_kv_zrange(duk_context *duk) {
+	const char *key;
+	duk_size_t len;
+	duk_double_t min,max,limit;
+	sds *members;
+	double *scores;
+	long i,n;
+
+	key = duk_require_lstring(duk,0,&len);
+	min = duk_is_null_or_undefined(duk,1) ? -INFINITY : duk_require_number(duk,1);
+	max = duk_is_null_or_undefined(duk,2) ? INFINITY : duk_require_number(duk,2);
+	limit = duk_is_null_or_undefined(duk,3) ? 0 : duk_require_number(duk,3);
+	if (!(limit >= 0 && limit <= 4294967295.0)) {
+		duk_push_string(duk,"kv.zrange: invalid limit");
+		duk_throw(duk);
 	}
-	duk_pop(duk);
-	duk_get_prop_string(duk,-1,"__DB");
-	if ((db = duk_get_pointer(duk,-1)) == NULL) {
-		duk_pop_2(duk);
-		return DUK_RET_INTERNAL_ERROR;
+	if ((n = kv_member_range(key,len,min,max,0,(size_t)limit,duk_get_boolean(duk,4),&members,&scores)) < 0) kv_fail(duk,"zrange");
+	duk_push_array(duk);
+	for (i = 0; i < n; i++) {
+		duk_push_array(duk);
+		duk_push_lstring(duk,members[i],sdslen(members[i]));
+		duk_put_prop_index(duk,-2,0);
+		duk_push_number(duk,scores[i]);
+		duk_put_prop_index(duk,-2,1);
+		duk_put_prop_index(duk,-2,(duk_uarridx_t)i);
 	}
-	duk_pop(duk);
-	headers = duk_get_boolean(duk,0);
-	rc = sqlite_execute(duk,headers,db,stmt);
-	duk_del_prop_string(duk,1,"__DB");
-	duk_del_prop_string(duk,1,"__PTR");
-	duk_push_undefined(duk);
-	duk_set_finalizer(duk,1);
-	if (rc == 0) duk_throw(duk);
+	kv_free_values(members,n);
+	free(scores);
 	return 1;
 }
 
-static duk_int_t duk_sqlite_finalize(duk_context *duk) {
-	sqlite3_stmt *stmt;
+static duk_int_t duk_kv_pfadd(duk_context *duk) {
+	const char *key,**elements;
+	duk_size_t len;
+	size_t *lens,n;
+	long rc;
 
-	duk_get_prop_string(duk,0,"__PTR");
-	if ((stmt = duk_get_pointer(duk,-1)) != NULL) sqlite3_finalize(stmt);
-	return 0;
+	key = duk_require_lstring(duk,0,&len);
+	elements = kv_args(duk,1,"pfadd",&lens,&n);
+	if ((rc = kv_distinct_add(key,len,elements,lens,n)) < 0) kv_fail(duk,"pfadd");
+	duk_push_boolean(duk,rc);
+	return 1;
 }
 
-static duk_int_t duk_kv_get(duk_context *duk) {
+static duk_int_t duk_kv_pfcount(duk_context *duk) {
 	const char *key;
 	duk_size_t len;
-	keyvalue *kv;
+	long n;
 
 	key = duk_require_lstring(duk,0,&len);
-	
-	pthread_rwlock_rdlock(&kvs_lock);
-	HASH_FIND(hh,kvs,key,len,kv);
-	pthread_rwlock_unlock(&kvs_lock);
+	if ((n = kv_distinct_count(key,len)) < 0) kv_fail(duk,"pfcount");
+	duk_push_number(duk,(duk_double_t)n);
+	return 1;
+}
 
-	if (kv != NULL) {
-		duk_push_string(duk,kv->value);
-		return 1;
+// parks the script until key changes, for long polling
+static duk_int_t duk_kv_wait(duk_context *duk) {
+	const char *key,*expected = NULL;
+	duk_size_t len,elen = 0;
+	duk_double_t timeout;
+	int rc,etype = -1;
+
+	key = duk_require_lstring(duk,0,&len);
+	timeout = duk_get_number(duk,1);
+	if (!duk_is_undefined(duk,2)) expected = kv_value(duk,2,&elen,&etype);
+	if ((rc = kv_await(key,len,expected,elen,etype,timeout > 0 ? kv_ttl(timeout) : 0)) < 0) {
+		duk_push_sprintf(duk,"kv.wait failed: %s",errno == EBUSY ? "too many scripts waiting" : strerror(errno));
+		duk_throw(duk);
 	}
-	return 0;
+	duk_push_boolean(duk,rc);
+	return 1;
 }
 
-static duk_int_t duk_kv_set(duk_context *duk) {
-	const char *key,*value;
+static duk_int_t duk_kv_stats(duk_context *duk) {
+	char *json;
+
+	if ((json = kv_stats()) == NULL) {
+		duk_push_string(duk,"out of memory");
+		duk_throw(duk);
+	}
+	duk_push_string(duk,json);
+	free(json);
+	duk_json_decode(duk,-1);
+	return 1;
+}
+
+/*
+ * cache.remember keeps, next to key, two keys of its own, named key, a NUL, and a suffix: "lock", held by the one request
+ * running the producer, with a random token so that only it releases the lock, and with stale-while-revalidate,
+ * "fresh", which expires when the value stops being fresh, while the value itself lives on for the stale period.
+ */
+typedef struct {
+	const char *key;
 	duk_size_t len;
-	duk_int_t expiry;
-	duk_bool_t nxflag;
-	keyvalue *kv;
-	struct sigevent sev;
-	struct itimerspec its;
-	int err;
-	char *temp;
+	const char *lock;
+	duk_size_t llen;
+	const char *fresh;
+	duk_size_t flen;
+	const char *token;
+	duk_double_t ttl;
+	duk_double_t stale;
+	duk_double_t negative;
+	int locked;
+} cache_call;
+
+static void cache_fail(duk_context *duk, cache_call *c) {
+	int err = errno;
+
+	if (c->locked) kv_swap(c->lock,c->llen,c->token,CEPA_CACHE_TOKEN,KV_BUFFER,NULL,0,KV_STRING);
+	duk_push_sprintf(duk,"cache.remember failed: %s",err == EINVAL ? "key holds another type of value" : strerror(err));
+	duk_throw(duk);
+}
 
-	key = duk_require_lstring(duk,0,&len);
-	value = duk_get_string(duk,1);
-	expiry = duk_get_int(duk,2);
-	nxflag = duk_get_boolean(duk,3);
+// key followed by a NUL and suffix, in a buffer pushed on the stack
+static const char *cache_key(duk_context *duk, const char *key, duk_size_t len, const char *suffix, duk_size_t *klen) {
+	char *buf;
 
-	pthread_rwlock_rdlock(&kvs_lock);
-	HASH_FIND(hh,kvs,key,len,kv);
-	pthread_rwlock_unlock(&kvs_lock);
+	*klen = len + 1 + strlen(suffix);
+	buf = duk_push_fixed_buffer(duk,*klen);
+	memcpy(buf,key,len);
+	buf[len] = '\0';
+	memcpy(buf + len + 1,suffix,strlen(suffix));
+	return buf;
+}
 
-	if (kv == NULL) {
-		if (value == NULL) {
-			duk_push_false(duk);
-		} else {
-			if ((kv = malloc(sizeof(keyvalue))) == NULL) {
-				duk_push_string(duk,"out of memory");
-				duk_throw(duk);
-			}
-			if ((kv->key = strdup(key)) == NULL) {
-				free(kv);
-				duk_push_string(duk,"out of memory");
-				duk_throw(duk);
-			}
-			if ((kv->value = strdup(value)) == NULL) {
-				free(kv->key);
-				free(kv);
-				duk_push_string(duk,"out of memory");
-				duk_throw(duk);
-			}
-			if (expiry > 0) {
-				sev.sigev_notify = SIGEV_SIGNAL;
-				sev.sigev_signo = SIGRTMAX - 1;
-				sev.sigev_value.sival_ptr = kv->key;
-				if (timer_create(CLOCK_REALTIME,&sev,&kv->timer) == -1) {
-					err = errno;
-					free(kv->key);
-					free(kv);
-					duk_push_sprintf(duk,"failed to create timer: %s",strerror(err));
-					duk_throw(duk);
-				}
-				its.it_value.tv_sec = expiry;
-				its.it_value.tv_nsec = 0;
-				its.it_interval.tv_sec = 0;
-				its.it_interval.tv_nsec = 0;
-				if (timer_settime(kv->timer,0,&its,NULL) == -1) {
-					err = errno;
-					free(kv->key);
-					free(kv);
-					timer_delete(kv->timer);
-					duk_push_sprintf(duk,"failed to set timer: %s",strerror(err));
-					duk_throw(duk);
-				} 
-			} else {
-				kv->timer = NULL;
-			}
-			kv->ffn = free;
-			pthread_rwlock_wrlock(&kvs_lock);
-			HASH_ADD_KEYPTR(hh,kvs,kv->key,len,kv);
-			pthread_rwlock_unlock(&kvs_lock);
-			duk_push_true(duk);
-		}
-	} else {
-		if (value == NULL) {
-			pthread_rwlock_wrlock(&kvs_lock);
-			HASH_DEL(kvs,kv);
-			pthread_rwlock_unlock(&kvs_lock);
-			if (kv->timer != NULL) timer_delete(kv->timer);
-			free(kv->key);
-			free(kv);
-			duk_push_true(duk);
-		} else {
-			if (nxflag) {
-				duk_push_false(duk);
-			} else {
-				if ((temp = strdup(value)) == NULL) {
-					duk_push_string(duk,"out of memory");
-					duk_throw(duk);
-				}
-				pthread_rwlock_wrlock(&kvs_lock);
-				free(kv->value);
-				kv->value = temp;
-				pthread_rwlock_unlock(&kvs_lock);
-				if (expiry < 0) {
-					timer_delete(kv->timer);
-					kv->timer = NULL;
-				} else if (expiry > 0) {
-					its.it_value.tv_sec = expiry;
-					its.it_value.tv_nsec = 0;
-					its.it_interval.tv_sec = 0;
-					its.it_interval.tv_nsec = 0;
-					if (timer_settime(kv->timer,0,&its,NULL) == -1) {
-						err = errno;
-						duk_push_sprintf(duk,"failed to set timer: %s",strerror(err));
-						duk_throw(duk);
-					}
-				}
-				duk_push_true(duk);
-			}
-		}
+// pushes the value of key and returns 1, or returns 0 if there is none
+static int cache_fetch(duk_context *duk, cache_call *c, const char *key, duk_size_t len) {
+	sds value,found;
+	int type;
+
+	if ((value = sdsempty()) == NULL) {
+		errno = ENOMEM;
+		cache_fail(duk,c);
 	}
+	errno = 0;
+	if ((found = kv_copy(key,len,value,&type)) == NULL) {
+		sdsfree(value);
+		if (errno != 0) cache_fail(duk,c);
+		return 0;
+	}
+	kv_push_value(duk,found,type);
 	return 1;
 }
 
-static const char *kv_get(const char *key) {
-	keyvalue *kv;
+// runs the producer, stores what it returns unless it is null and there is no negative caching, and pushes it
+static void cache_produce(duk_context *duk, cache_call *c) {
+	const char *value;
+	duk_size_t vlen;
+	int type,rc;
 
-	if (key == NULL) return NULL;
-	pthread_rwlock_rdlock(&kvs_lock);
-	HASH_FIND(hh,kvs,key,strlen(key),kv);
-	pthread_rwlock_unlock(&kvs_lock);
-	if (kv == NULL) return NULL;
-	return (const char *)kv->value;
+	duk_dup(duk,2);
+	if (duk_pcall(duk,0) != 0) {
+		if (c->locked) kv_swap(c->lock,c->llen,c->token,CEPA_CACHE_TOKEN,KV_BUFFER,NULL,0,KV_STRING);
+		duk_throw(duk);
+	}
+	if (duk_is_null_or_undefined(duk,-1)) {
+		// CBOR null, so that it reads back as null
+		rc = c->negative > 0 ? kv_put(c->key,c->len,"\xf6",1,KV_CBOR,kv_ttl(c->negative),0) : 1;
+		if (rc == 1 && c->negative > 0 && c->stale > 0) rc = kv_put(c->fresh,c->flen,"",0,KV_STRING,kv_ttl(c->negative),0);
+	} else {
+		duk_dup(duk,-1);
+		value = kv_value(duk,-1,&vlen,&type);
+		rc = kv_put(c->key,c->len,value,vlen,type,kv_ttl(c->ttl + c->stale),0);
+		if (rc == 1 && c->stale > 0) rc = kv_put(c->fresh,c->flen,"",0,KV_STRING,kv_ttl(c->ttl),0);
+		duk_pop(duk);
+	}
+	if (rc == -1) cache_fail(duk,c);
+	if (c->locked) kv_swap(c->lock,c->llen,c->token,CEPA_CACHE_TOKEN,KV_BUFFER,NULL,0,KV_STRING);
+	c->locked = 0;
 }
 
-static int kv_set(const char *key, void *value, void *ffn, int expiry, int nx) {
-	keyvalue *kv;
-	struct sigevent sev;
-	struct itimerspec its;
+static int cache_lock(duk_context *duk, cache_call *c, duk_double_t wait) {
+	int rc;
 
-	if (key == NULL) return 0;
-	pthread_rwlock_rdlock(&kvs_lock);
-	HASH_FIND(hh,kvs,key,strlen(key),kv);
-	pthread_rwlock_unlock(&kvs_lock);
+	if ((rc = kv_put(c->lock,c->llen,c->token,CEPA_CACHE_TOKEN,KV_BUFFER,kv_ttl(wait),1)) == -1) cache_fail(duk,c);
+	return c->locked = rc;
+}
 
-	if (kv == NULL) {
-		if (value == NULL) return 0;
-		if ((kv = malloc(sizeof(keyvalue))) == NULL) return 0;
-		if ((kv->key = strdup(key)) == NULL) {
-			free(kv);
-			return 0;
-		}
-		kv->value = value;
-		if (expiry > 0) {
-			sev.sigev_notify = SIGEV_SIGNAL;
-			sev.sigev_signo = SIGRTMAX - 1;
-			sev.sigev_value.sival_ptr = kv->key;
-			if (timer_create(CLOCK_REALTIME,&sev,&kv->timer) == -1) {
-				free(kv->value);
-				free(kv->key);
-				free(kv);
-				return 0;
-			}
-			its.it_value.tv_sec = expiry;
-			its.it_value.tv_nsec = 0;
-			its.it_interval.tv_sec = 0;
-			its.it_interval.tv_nsec = 0;
-			if (timer_settime(kv->timer,0,&its,NULL) == -1) {
-				timer_delete(kv->timer);
-				free(kv->value);
-				free(kv->key);
-				free(kv);
-				return 0;
-			}
-		} else {
-			kv->timer = NULL;
-		}
-		kv->ffn = ffn;
-		pthread_rwlock_wrlock(&kvs_lock);
-		HASH_ADD_KEYPTR(hh,kvs,kv->key,strlen(kv->key),kv);
-		pthread_rwlock_unlock(&kvs_lock);
-		return 1;
+static uint64_t cache_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * cache.remember(key, ttl, producer[, options]) returns the value of key, and on a miss, the value producer returns,
+ * which is stored for ttl seconds. only one request runs producer at a time; the others wait for its value.
+ * options: stale, seconds a value is still served after ttl while one request refreshes it; negative, seconds
+ * null or undefined results are cached; wait, seconds to wait for another request's producer before running it too.
+ */
+static duk_int_t duk_cache_remember(duk_context *duk) {
+	cache_call c;
+	duk_double_t wait;
+	const char *held;
+	duk_size_t hlen;
+	uint64_t deadline,now;
+	int rc,found;
+
+	memset(&c,0,sizeof(c));
+	c.key = duk_require_lstring(duk,0,&c.len);
+	c.ttl = duk_require_number(duk,1);
+	duk_require_function(duk,2);
+	if (!(c.ttl > 0)) {
+		duk_push_string(duk,"cache.remember: ttl must be positive");
+		duk_throw(duk);
 	}
-	if (value == NULL) {
-		pthread_rwlock_wrlock(&kvs_lock);
-		HASH_DEL(kvs,kv);
-		pthread_rwlock_unlock(&kvs_lock);
-		timer_delete(kv->timer);
-		if (kv->ffn != NULL) kv->ffn(kv->value);
-		free(kv->key);
-		free(kv);
-		return 1;
+	wait = CEPA_CACHE_WAIT;
+	if (duk_is_object(duk,3)) {
+		duk_get_prop_string(duk,3,"stale");
+		c.stale = duk_get_number(duk,-1);
+		duk_get_prop_string(duk,3,"negative");
+		c.negative = duk_get_number(duk,-1);
+		duk_get_prop_string(duk,3,"wait");
+		wait = duk_get_number(duk,-1);
+		duk_pop_3(duk);
+	}
+	duk_set_top(duk,4);
+	if (!(c.stale > 0)) c.stale = 0;
+	if (!(wait > 0)) wait = CEPA_CACHE_WAIT;
+	c.lock = cache_key(duk,c.key,c.len,"lock",&c.llen);
+	c.fresh = cache_key(duk,c.key,c.len,"fresh",&c.flen);
+	c.token = duk_push_fixed_buffer(duk,CEPA_CACHE_TOKEN);
+	if (gnutls_rnd(GNUTLS_RND_NONCE,(void *)c.token,CEPA_CACHE_TOKEN) < 0) {
+		duk_push_string(duk,"cache.remember: no random token");
+		duk_throw(duk);
 	}
-	if (nx > 0) return 0;
-	if (expiry < 0) {
-		timer_delete(kv->timer);
-		kv->timer = NULL;
-	} else if (expiry > 0) {
-		its.it_value.tv_sec = expiry;
-		its.it_value.tv_nsec = 0;
-		its.it_interval.tv_sec = 0;
-		its.it_interval.tv_nsec = 0;
-		if (timer_settime(kv->timer,0,&its,NULL) == -1) return 0;
+
+	deadline = cache_now() + (uint64_t)(wait * 1000);
+	for (;;) {
+		if (cache_fetch(duk,&c,c.key,c.len)) {
+			if (c.stale == 0) return 1;
+			found = cache_fetch(duk,&c,c.fresh,c.flen);
+			if (found) duk_pop(duk);
+			// a stale value is served to all but the one request that refreshes it
+			if (found || !cache_lock(duk,&c,wait)) return 1;
+			cache_produce(duk,&c);
+			return 1;
+		}
+		if (cache_lock(duk,&c,wait) || (now = cache_now()) >= deadline) break;
+		// another request is producing: wait for its lock to go, which it does once the value is stored
+		if (!cache_fetch(duk,&c,c.lock,c.llen)) continue;
+		held = duk_get_buffer_data(duk,-1,&hlen);
+		rc = held != NULL ? kv_await(c.lock,c.llen,held,hlen,KV_BUFFER,deadline - now) : -1;
+		duk_pop(duk);
+		if (rc == -1) usleep(CEPA_CACHE_POLL * 1000);
 	}
-	pthread_rwlock_wrlock(&kvs_lock);
-	if (kv->ffn != NULL) kv->ffn(kv->value);
-	kv->value = value;
-	kv->ffn = ffn;
-	pthread_rwlock_unlock(&kvs_lock);
+	cache_produce(duk,&c);
 	return 1;
 }
+
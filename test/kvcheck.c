@@ -0,0 +1,823 @@
+/*
+ * behaviour checks of the key/value store, run by make check.
+ * the store is global to a process, so each check runs in a process of its own, forked from here, and checks
+ * that need more processes fork those too. files and sockets go in a temporary directory.
+ *
+ * usage: kvcheck [check...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "kv.h"
+
+#define CHECK(c) do { if (!(c)) fail(__LINE__,#c); } while (0)
+
+#define TIMEOUT 60 // seconds a check may take
+#define PATIENCE 10000 // milliseconds to wait for another process
+
+typedef struct {
+	const char *name;
+	void (*fn)(void);
+} check;
+
+static char DIR_PATH[64];
+static char SNAPSHOT[128];
+static char AOF[128];
+static char SHARED_NAME[64];
+static int RUNNING;
+static int DONE[2] = { -1, -1 }; // a child writes a byte here once it has checked
+static int RELEASE[2] = { -1, -1 }; // and exits once the write end is closed
+
+static void fail(int line, const char *what) {
+	fprintf(stderr,"kvcheck.c:%d: %s\n",line,what);
+	_exit(1);
+}
+
+static void put(const char *key, const char *value, int type, int64_t ttl) {
+	CHECK(kv_put(key,strlen(key),value,strlen(value),type,ttl,0) == 1);
+}
+
+// as put, retried until the peer that owns key is up
+static void put_remote(const char *key, const char *value) {
+	int i;
+
+	for (i = 0; i < PATIENCE / 10 && kv_put(key,strlen(key),value,strlen(value),KV_STRING,0,0) != 1; i++) usleep(10000);
+	CHECK(i < PATIENCE / 10);
+}
+
+// whether key holds value, of type
+static int holds(const char *key, const char *value, size_t vlen, int type) {
+	sds found;
+	int t = -1,rc;
+
+	if ((found = kv_copy(key,strlen(key),sdsempty(),&t)) == NULL) return 0;
+	rc = sdslen(found) == vlen && memcmp(found,value,vlen) == 0 && t == type;
+	sdsfree(found);
+	return rc;
+}
+
+static int absent(const char *key) {
+	sds found = kv_copy(key,strlen(key),sdsempty(),NULL);
+
+	sdsfree(found);
+	return found == NULL;
+}
+
+// waits for another process to set key, failing the check if it doesn't in time
+static void await_key(const char *key) {
+	int i;
+
+	for (i = 0; i < PATIENCE / 10 && absent(key); i++) usleep(10000);
+	CHECK(!absent(key));
+}
+
+// whether list holds the values of items, in order
+static int list_holds(const char *key, const char **items, long n) {
+	sds *values;
+	long i,len;
+	int rc;
+
+	if ((len = kv_range(key,strlen(key),0,-1,&values)) != n) {
+		if (len > 0) kv_free_values(values,len);
+		return 0;
+	}
+	for (i = 0, rc = 1; i < n; i++) rc = rc && strcmp(values[i],items[i]) == 0;
+	if (len > 0) kv_free_values(values,len);
+	return rc;
+}
+
+static pid_t spawn(void (*fn)(int), int arg) {
+	pid_t pid;
+
+	if ((pid = fork()) == 0) {
+		close(RELEASE[1]);
+		close(DONE[0]);
+		fn(arg);
+		_exit(0);
+	}
+	CHECK(pid > 0);
+	return pid;
+}
+
+// blocks until the parent closes RELEASE
+static void held(void) {
+	char byte;
+
+	CHECK(read(RELEASE[0],&byte,1) == 0);
+}
+
+// closes the parent's ends of the pipes that spawn's children were given
+static void spawned(void) {
+	close(RELEASE[0]);
+	close(DONE[1]);
+}
+
+static int reaped(pid_t pid) {
+	int status;
+
+	return waitpid(pid,&status,0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#define WRITERS 4
+
+// sets keys of its own, spread over every shard, deleting every other one
+static void *put_many(void *arg) {
+	char key[24];
+	int i,w = (int)(intptr_t)arg;
+
+	for (i = 0; i < 10000; i++) {
+		snprintf(key,sizeof(key),"w%d-%d",w,i);
+		CHECK(kv_put(key,strlen(key),key,strlen(key),KV_STRING,0,0) == 1);
+		if (i % 2 == 1) CHECK(kv_put(key,strlen(key),NULL,0,KV_STRING,0,0) == 1);
+	}
+	return NULL;
+}
+
+static void check_shards(void) {
+	pthread_t threads[WRITERS];
+	char key[24];
+	sds buf,found;
+	int i,w;
+
+	CHECK(kv_init(4) == 0);
+	for (w = 0; w < WRITERS; w++) CHECK(pthread_create(&threads[w],NULL,put_many,(void *)(intptr_t)w) == 0);
+	for (w = 0; w < WRITERS; w++) pthread_join(threads[w],NULL);
+	buf = sdsempty();
+	for (w = 0; w < WRITERS; w++) {
+		for (i = 0; i < 10000; i++) {
+			snprintf(key,sizeof(key),"w%d-%d",w,i);
+			found = kv_copy(key,strlen(key),buf,NULL);
+			CHECK(i % 2 == 1 ? found == NULL : found != NULL && strcmp(found,key) == 0);
+			if (found != NULL) buf = found;
+		}
+	}
+	sdsfree(buf);
+	kv_destroy();
+}
+
+static void check_integers(void) {
+	const char *bad[] = { "\t5", "+5", " 5", "5 ", "", "-", "0x10", "1e3", "abc" };
+	int64_t n;
+	size_t i;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_add("n",1,5,&n) == 1 && n == 5);
+	CHECK(kv_add("n",1,-7,&n) == 1 && n == -2);
+	CHECK(holds("n","-2",2,KV_STRING));
+
+	put("max","9223372036854775807",KV_STRING,0);
+	CHECK(kv_add("max",3,1,&n) == -1 && errno == ERANGE);
+	CHECK(holds("max","9223372036854775807",19,KV_STRING));
+	put("min","-9223372036854775808",KV_STRING,0);
+	CHECK(kv_add("min",3,-1,&n) == -1 && errno == ERANGE);
+	CHECK(kv_add("min",3,0,&n) == 1 && n == INT64_MIN);
+	put("big","9223372036854775808",KV_STRING,0);
+	CHECK(kv_add("big",3,0,&n) == -1 && errno == EINVAL);
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		put("bad",bad[i],KV_STRING,0);
+		CHECK(kv_add("bad",3,1,&n) == -1 && errno == EINVAL);
+		CHECK(holds("bad",bad[i],strlen(bad[i]),KV_STRING));
+	}
+	put("buf","5",KV_BUFFER,0);
+	CHECK(kv_add("buf",3,1,&n) == -1 && errno == EINVAL);
+	CHECK(kv_push("list",4,0,(const char *[]){ "5" },(size_t[]){ 1 },1) == 1);
+	CHECK(kv_add("list",4,1,&n) == -1 && errno == EINVAL);
+
+	// CBOR integers stay CBOR, crossing between the encodings of their sizes and signs
+	CHECK(kv_put("cbor",4,"\x18\x64",2,KV_CBOR,0,0) == 1);
+	CHECK(kv_add("cbor",4,-101,&n) == 1 && n == -1);
+	CHECK(holds("cbor","\x20",1,KV_CBOR));
+	CHECK(kv_add("cbor",4,65536,&n) == 1 && n == 65535);
+	CHECK(holds("cbor","\x19\xff\xff",3,KV_CBOR));
+
+	// the expiry of the key is kept
+	put("ttl","1",KV_STRING,50);
+	CHECK(kv_add("ttl",3,1,&n) == 1 && n == 2);
+	CHECK(kv_expires("ttl",3) > 0 && kv_expires("ttl",3) <= 50);
+	CHECK(kv_expires("max",3) == 0 && kv_expires("none",4) == 0);
+	usleep(100000);
+	CHECK(absent("ttl"));
+	kv_destroy();
+}
+
+static void *add_many(void *arg) {
+	int64_t n;
+	int i;
+
+	for (i = 0; i < 10000; i++) CHECK(kv_add("ctr",3,1,&n) == 1);
+	return NULL;
+}
+
+static void check_contention(void) {
+	pthread_t threads[4];
+	int64_t n;
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	for (i = 0; i < 4; i++) CHECK(pthread_create(&threads[i],NULL,add_many,NULL) == 0);
+	for (i = 0; i < 4; i++) pthread_join(threads[i],NULL);
+	CHECK(kv_add("ctr",3,0,&n) == 1 && n == 40000);
+	kv_destroy();
+}
+
+#define BUDGET (64 << 10) // bytes the eviction checks allow the store
+#define HOT 8 // keys read while the others aren't
+
+static const char VALUE[] = "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789";
+
+// the store's count of evicted keys
+static long evicted(void) {
+	char *stats,*p;
+	long n;
+
+	CHECK((stats = kv_stats()) != NULL && (p = strstr(stats,"\"evicted\":")) != NULL);
+	n = strtol(p + 10,NULL,10);
+	free(stats);
+	return n;
+}
+
+// sets c0, c1... until one is evicted, then reads HOT of the survivors, in a later second than they were set
+static void evict_recent(int policy) {
+	char key[16],hot[HOT][16];
+	long before;
+	int i,n,m,reads;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_limit(NULL,BUDGET,policy) == 0);
+	for (n = 0; evicted() == 0; n++) {
+		snprintf(key,sizeof(key),"c%d",n);
+		put(key,VALUE,KV_STRING,0);
+		CHECK(kv_memory(NULL) <= BUDGET);
+	}
+	usleep(1100000);
+	for (i = m = 0; i < n && m < HOT; i++) {
+		snprintf(hot[m],sizeof(hot[m]),"c%d",i);
+		if (absent(hot[m])) continue;
+		for (reads = policy == KV_ALLKEYS_LFU ? 200 : 1; reads > 0; reads--) CHECK(!absent(hot[m]));
+		m++;
+	}
+	CHECK(m == HOT);
+	before = evicted();
+	for (i = 0; i < 20; i++) {
+		snprintf(key,sizeof(key),"n%d",i);
+		put(key,VALUE,KV_STRING,0);
+		CHECK(kv_memory(NULL) <= BUDGET);
+	}
+	CHECK(evicted() > before);
+	for (i = 0; i < HOT; i++) CHECK(!absent(hot[i]));
+	kv_destroy();
+}
+
+// only keys with an expiry go, and then writes fail
+static void evict_volatile(int arg) {
+	char key[16];
+	int i,n,rc;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_limit(NULL,BUDGET,KV_VOLATILE_TTL) == 0);
+	for (i = 0; i < 20; i++) {
+		snprintf(key,sizeof(key),"t%d",i);
+		put(key,VALUE,KV_STRING,600000 + i * 1000);
+	}
+	for (n = 0; ; n++) {
+		snprintf(key,sizeof(key),"p%d",n);
+		if ((rc = kv_put(key,strlen(key),VALUE,strlen(VALUE),KV_STRING,0,0)) != 1) break;
+		CHECK(kv_memory(NULL) <= BUDGET);
+	}
+	CHECK(rc == -1 && errno == ENOMEM);
+	CHECK(evicted() == 20);
+	for (i = 0; i < 20; i++) {
+		snprintf(key,sizeof(key),"t%d",i);
+		CHECK(absent(key));
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(key,sizeof(key),"p%d",i);
+		CHECK(!absent(key));
+	}
+	kv_destroy();
+}
+
+// a namespace's budget fails its own writes, without evicting, and leaves the rest of the store alone
+static void evict_namespace(int arg) {
+	char key[16];
+	int i,n,rc;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_limit("ns:",BUDGET / 4,KV_NOEVICTION) == 0);
+	for (n = 0; ; n++) {
+		snprintf(key,sizeof(key),"ns:%d",n);
+		if ((rc = kv_put(key,strlen(key),VALUE,strlen(VALUE),KV_STRING,0,0)) != 1) break;
+		CHECK(kv_memory("ns:") <= BUDGET / 4);
+	}
+	CHECK(rc == -1 && errno == ENOMEM && n > 0);
+	for (i = 0; i < n; i++) {
+		snprintf(key,sizeof(key),"ns:%d",i);
+		CHECK(!absent(key));
+	}
+	for (i = 0; i < 4 * n; i++) {
+		snprintf(key,sizeof(key),"o%d",i);
+		put(key,VALUE,KV_STRING,0);
+	}
+	CHECK(kv_memory("ns:") <= BUDGET / 4 && kv_memory(NULL) > BUDGET);
+	CHECK(evicted() == 0);
+	kv_destroy();
+}
+
+static void check_eviction(void) {
+	CHECK(reaped(spawn(evict_recent,KV_ALLKEYS_LRU)));
+	CHECK(reaped(spawn(evict_recent,KV_ALLKEYS_LFU)));
+	CHECK(reaped(spawn(evict_volatile,0)));
+	CHECK(reaped(spawn(evict_namespace,0)));
+}
+
+typedef struct {
+	pthread_t thread;
+	const char *key;
+	const char *expected; // NULL for no value
+	int rc;
+	int err;
+} waiter;
+
+static int64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *wait_key(void *arg) {
+	waiter *w = arg;
+
+	w->rc = kv_await(w->key,strlen(w->key),w->expected,w->expected != NULL ? strlen(w->expected) : 0,KV_STRING,PATIENCE);
+	w->err = errno;
+	return NULL;
+}
+
+static void waiting(waiter *w, const char *key, const char *expected) {
+	w->key = key;
+	w->expected = expected;
+	CHECK(pthread_create(&w->thread,NULL,wait_key,w) == 0);
+}
+
+// waiters are woken by a set or a delete of their key, well before they would time out
+static void check_waits(void) {
+	waiter w[3];
+	int64_t start;
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	kv_waiters(2);
+	start = now_ms();
+	waiting(&w[0],"w",NULL);
+	usleep(100000);
+	put("w","x",KV_STRING,0);
+	pthread_join(w[0].thread,NULL);
+	CHECK(w[0].rc == 1 && now_ms() - start < PATIENCE / 2);
+
+	start = now_ms();
+	waiting(&w[0],"w","x");
+	usleep(100000);
+	CHECK(kv_put("w",1,NULL,0,KV_STRING,0,0) == 1);
+	pthread_join(w[0].thread,NULL);
+	CHECK(w[0].rc == 1 && now_ms() - start < PATIENCE / 2);
+
+	// a key that doesn't hold what was expected returns at once, and one that does times out
+	put("w","x",KV_STRING,0);
+	CHECK(kv_await("w",1,"y",1,KV_STRING,PATIENCE) == 1);
+	start = now_ms();
+	CHECK(kv_await("w",1,"x",1,KV_STRING,100) == 0);
+	CHECK(now_ms() - start >= 100);
+	CHECK(kv_await("w",1,"x",1,KV_STRING,0) == 0);
+
+	// past kv_waiters, waiting fails rather than parking
+	waiting(&w[1],"busy",NULL);
+	waiting(&w[2],"busy",NULL);
+	usleep(200000);
+	CHECK(kv_await("busy",4,NULL,0,KV_STRING,PATIENCE) == -1 && errno == EBUSY);
+	put("busy","x",KV_STRING,0);
+	for (i = 1; i < 3; i++) {
+		pthread_join(w[i].thread,NULL);
+		CHECK(w[i].rc == 1);
+	}
+	kv_destroy();
+}
+
+static void persist_open(void) {
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_persist(SNAPSHOT,0,AOF,KV_FSYNC_ALWAYS) == 0);
+}
+
+// a value of each type, changed after it was set, written to the log and then to the snapshot when destroyed
+static void persist_write(int arg) {
+	const char *fields[] = { "f1", "f2" },*members[] = { "a", "b" },*elements[] = { "a", "b", "c", "a" };
+	size_t lens[] = { 2, 2 },ones[] = { 1, 1, 1, 1 };
+	double scores[] = { 1, 2 };
+	sds *popped;
+	int64_t n;
+
+	persist_open();
+	put("s","string",KV_STRING,0);
+	CHECK(kv_put("b",1,"a\0b",3,KV_BUFFER,0,0) == 1);
+	CHECK(kv_put("c",1,"\x82\x01\x02",3,KV_CBOR,0,0) == 1);
+	put("gone","x",KV_STRING,0);
+	CHECK(kv_put("gone",4,NULL,0,KV_STRING,0,0) == 1);
+	put("ttl","x",KV_STRING,60000);
+	put("short","x",KV_STRING,1);
+	CHECK(kv_push("l",1,0,(const char *[]){ "a", "b", "c" },(size_t[]){ 1, 1, 1 },3) == 3);
+	CHECK(kv_pop("l",1,1,1,&popped) == 1);
+	kv_free_values(popped,1);
+	CHECK(kv_field_put("h",1,fields,lens,(const char *[]){ "v1", "v2" },lens,2) == 2);
+	CHECK(kv_field_del("h",1,fields,lens,1) == 1);
+	CHECK(kv_member_add("z",1,members,ones,scores,2) == 2);
+	CHECK(kv_distinct_add("p",1,elements,ones,4) == 1);
+	CHECK(kv_add("n",1,1,&n) == 1 && kv_add("n",1,2,&n) == 1);
+	kv_destroy();
+}
+
+static void persist_verify(void) {
+	sds value = NULL;
+	double score;
+
+	CHECK(holds("s","string",6,KV_STRING));
+	CHECK(holds("b","a\0b",3,KV_BUFFER));
+	CHECK(holds("c","\x82\x01\x02",3,KV_CBOR));
+	CHECK(absent("gone"));
+	CHECK(holds("ttl","x",1,KV_STRING));
+	CHECK(absent("short"));
+	CHECK(kv_field_copy("h",1,"f2",2,&value) == 1 && strcmp(value,"v2") == 0);
+	sdsfree(value);
+	CHECK(kv_field_copy("h",1,"f1",2,&value) == 0);
+	CHECK(kv_member_score("z",1,"b",1,&score) == 1 && score == 2);
+	CHECK(kv_distinct_count("p",1) == 3);
+}
+
+// restarts from the snapshot, then changes the store and exits without writing another
+static void persist_reopen(int arg) {
+	sds *popped;
+	int64_t n;
+
+	persist_open();
+	persist_verify();
+	CHECK(list_holds("l",(const char *[]){ "b", "c" },2));
+	CHECK(holds("n","3",1,KV_STRING));
+	CHECK(kv_push("l",1,0,(const char *[]){ "d" },(size_t[]){ 1 },1) == 3);
+	CHECK(kv_pop("l",1,1,1,&popped) == 1);
+	kv_free_values(popped,1);
+	CHECK(kv_add("n",1,10,&n) == 1);
+	put("late","x",KV_STRING,0);
+	_exit(0);
+}
+
+// restarts from the snapshot and the log
+static void persist_replay(int arg) {
+	persist_open();
+	persist_verify();
+	CHECK(list_holds("l",(const char *[]){ "c", "d" },2));
+	CHECK(holds("n","13",2,KV_STRING));
+	CHECK(holds("late","x",1,KV_STRING));
+	kv_destroy();
+}
+
+static void check_persistence(void) {
+	CHECK(reaped(spawn(persist_write,0)));
+	CHECK(reaped(spawn(persist_reopen,0)));
+	CHECK(reaped(spawn(persist_replay,0)));
+}
+
+#define PUSHERS 4
+
+typedef struct {
+	pthread_t thread;
+	char key[8];
+	long pushed;
+	long popped;
+} pusher;
+
+static pusher PUSHED[PUSHERS]; // as the process that pushed left them
+
+// pushes numbers in sequence to the back of its list, popping from the front now and then
+static void *push_many(void *arg) {
+	pusher *p = arg;
+	char value[24];
+	sds *popped;
+
+	while (__atomic_load_n(&RUNNING,__ATOMIC_RELAXED)) {
+		snprintf(value,sizeof(value),"%ld",p->pushed);
+		CHECK(kv_push(p->key,strlen(p->key),0,(const char *[]){ value },(size_t[]){ strlen(value) },1) > 0);
+		if (++p->pushed % 4 == 0) {
+			CHECK(kv_pop(p->key,strlen(p->key),1,1,&popped) == 1);
+			kv_free_values(popped,1);
+			p->popped++;
+		}
+	}
+	return NULL;
+}
+
+// pushes and pops while snapshots are written every second, then exits without writing another
+static void snapshot_pushes(int arg) {
+	pusher pushers[PUSHERS];
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_persist(SNAPSHOT,1,AOF,KV_FSYNC_NO) == 0);
+	__atomic_store_n(&RUNNING,1,__ATOMIC_RELAXED);
+	for (i = 0; i < PUSHERS; i++) {
+		memset(&pushers[i],0,sizeof(pusher));
+		snprintf(pushers[i].key,sizeof(pushers[i].key),"l%d",i);
+		CHECK(pthread_create(&pushers[i].thread,NULL,push_many,&pushers[i]) == 0);
+	}
+	usleep(2500000);
+	__atomic_store_n(&RUNNING,0,__ATOMIC_RELAXED);
+	for (i = 0; i < PUSHERS; i++) pthread_join(pushers[i].thread,NULL);
+	CHECK(write(DONE[1],pushers,sizeof(pushers)) == sizeof(pushers));
+	_exit(0);
+}
+
+// each list has to hold what was pushed and not popped, every value once
+static void snapshot_replay(int arg) {
+	pusher *p;
+	sds *values;
+	long i,len;
+
+	persist_open();
+	for (p = PUSHED; p < PUSHED + PUSHERS; p++) {
+		len = kv_range(p->key,strlen(p->key),0,-1,&values);
+		CHECK(len == p->pushed - p->popped);
+		for (i = 0; i < len; i++) CHECK(strtol(values[i],NULL,10) == p->popped + i);
+		kv_free_values(values,len);
+	}
+	kv_destroy();
+}
+
+static void check_snapshot(void) {
+	pid_t pid;
+
+	CHECK(pipe(DONE) == 0);
+	pid = spawn(snapshot_pushes,0);
+	close(DONE[1]);
+	CHECK(read(DONE[0],PUSHED,sizeof(PUSHED)) == sizeof(PUSHED));
+	CHECK(reaped(pid));
+	CHECK(reaped(spawn(snapshot_replay,0)));
+}
+
+static void shared_add(int arg) {
+	char key[16];
+	int64_t n;
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_share("s:",SHARED_NAME,1 << 20) == 0);
+	for (i = 0; i < 5000; i++) CHECK(kv_add("s:n",3,1,&n) == 1);
+	snprintf(key,sizeof(key),"s:from%d",arg);
+	put(key,"x",KV_STRING,0);
+	put("local","x",KV_STRING,0);
+	kv_destroy();
+}
+
+static void check_shared(void) {
+	pid_t a,b;
+
+	shm_unlink(SHARED_NAME);
+	a = spawn(shared_add,0);
+	b = spawn(shared_add,1);
+	CHECK(reaped(a) && reaped(b));
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_share("s:",SHARED_NAME,1 << 20) == 0);
+	shm_unlink(SHARED_NAME);
+	CHECK(holds("s:n","10000",5,KV_STRING));
+	CHECK(holds("s:from0","x",1,KV_STRING) && holds("s:from1","x",1,KV_STRING));
+	CHECK(absent("local"));
+	CHECK(kv_swap("s:n",3,"10000",5,KV_STRING,"0",1,KV_STRING) == 1);
+	put("s:ttl","x",KV_STRING,60000);
+	CHECK(kv_expires("s:ttl",5) > 59000 && kv_expires("s:n",3) == 0);
+	CHECK(kv_store("s:p",3,strdup("x"),free,0,0) == -1 && errno == EINVAL);
+	kv_destroy();
+}
+
+static char FOLLOW_ADDRESS[128];
+
+static void follower(int arg) {
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_follow(FOLLOW_ADDRESS) == 0);
+	await_key("done");
+	CHECK(holds("before","1",1,KV_STRING));
+	CHECK(holds("after","2",1,KV_BUFFER));
+	CHECK(absent("deleted"));
+	CHECK(list_holds("l",(const char *[]){ "x", "y", "z" },3));
+	CHECK(holds("n","100",3,KV_STRING));
+	CHECK(kv_put("w",1,"x",1,KV_STRING,0,0) == -1 && errno == EROFS);
+	kv_destroy();
+}
+
+static void primary(int arg) {
+	int64_t n;
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	put("before","1",KV_STRING,0);
+	put("deleted","x",KV_STRING,0);
+	CHECK(kv_push("l",1,0,(const char *[]){ "x", "y" },(size_t[]){ 1, 1 },2) == 2);
+	CHECK(kv_replicate(FOLLOW_ADDRESS) == 0);
+	put("after","2",KV_BUFFER,0);
+	CHECK(kv_put("deleted",7,NULL,0,KV_STRING,0,0) == 1);
+	CHECK(kv_push("l",1,0,(const char *[]){ "z" },(size_t[]){ 1 },1) == 3);
+	for (i = 0; i < 100; i++) CHECK(kv_add("n",1,1,&n) == 1);
+	put("done","x",KV_STRING,0);
+	held();
+	kv_destroy();
+}
+
+// the follower has to see changes made before the primary connected, and after; the primary stays up until it has
+static void check_replication(void) {
+	pid_t f,p;
+
+	snprintf(FOLLOW_ADDRESS,sizeof(FOLLOW_ADDRESS),"unix:%s/follower.sock",DIR_PATH);
+	CHECK(pipe(DONE) == 0 && pipe(RELEASE) == 0);
+	f = spawn(follower,0);
+	p = spawn(primary,0);
+	spawned();
+	CHECK(reaped(f));
+	close(RELEASE[1]);
+	CHECK(reaped(p));
+}
+
+static char PEER_ADDRESSES[2][128];
+
+static void peer(int self) {
+	const char *addresses[] = { PEER_ADDRESSES[0], PEER_ADDRESSES[1] };
+	kv_item items[200];
+	sds values[200];
+	const char *names[200];
+	char *copies[200];
+	char keys[200][16],ready[16];
+	int64_t n;
+	long local,remote = 0;
+	int i;
+
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_index() == 0);
+	CHECK(kv_peers(addresses,2,self,NULL) == 0);
+	for (i = 0; i < 200; i++) {
+		snprintf(keys[i],sizeof(keys[i]),"k%d-%d",i % 2,i / 2);
+		items[i] = (kv_item){ keys[i], strlen(keys[i]), keys[i], strlen(keys[i]), KV_STRING };
+		names[i] = keys[i];
+	}
+	for (i = self; i < 200; i += 2) put_remote(keys[i],keys[i]);
+	for (i = 0; i < 100; i++) CHECK(kv_add("ctr",3,1,&n) == 1);
+	snprintf(ready,sizeof(ready),"ready%d",self);
+	put(ready,"x",KV_STRING,0);
+	snprintf(ready,sizeof(ready),"ready%d",!self);
+	await_key(ready);
+
+	for (i = 0; i < 200; i++) CHECK(holds(keys[i],keys[i],strlen(keys[i]),KV_STRING));
+	// the expiry of the other peer's keys isn't known here
+	for (i = 0; i < 200; i++) {
+		n = kv_expires(keys[i],strlen(keys[i]));
+		CHECK(n == 0 || (n == -1 && errno == ENOTSUP));
+		if (n == -1) remote++;
+	}
+	CHECK(remote > 0 && remote < 200);
+	CHECK(kv_mcopy(items,200,values) == 0);
+	for (i = 0; i < 200; i++) {
+		CHECK(values[i] != NULL && strcmp(values[i],keys[i]) == 0);
+		sdsfree(values[i]);
+	}
+	CHECK(kv_mget(names,200,copies) == 200);
+	for (i = 0; i < 200; i++) {
+		CHECK(strcmp(copies[i],keys[i]) == 0);
+		free(copies[i]);
+	}
+	CHECK(holds("ctr","200",3,KV_STRING));
+	// each peer keeps only its share of the keys
+	local = kv_count("",0);
+	CHECK(local > 0 && local < 200);
+}
+
+// two peers each write half the keys, then read all of them, and stay up until both have
+static void peer_process(int self) {
+	peer(self);
+	CHECK(write(DONE[1],"x",1) == 1);
+	held();
+	kv_destroy();
+}
+
+static void check_peers(void) {
+	pid_t a,b;
+	char byte;
+
+	snprintf(PEER_ADDRESSES[0],sizeof(PEER_ADDRESSES[0]),"unix:%s/peer0.sock",DIR_PATH);
+	snprintf(PEER_ADDRESSES[1],sizeof(PEER_ADDRESSES[1]),"unix:%s/peer1.sock",DIR_PATH);
+	CHECK(pipe(DONE) == 0 && pipe(RELEASE) == 0);
+	a = spawn(peer_process,0);
+	b = spawn(peer_process,1);
+	spawned();
+	CHECK(read(DONE[0],&byte,1) == 1 && read(DONE[0],&byte,1) == 1);
+	close(RELEASE[1]);
+	CHECK(reaped(a) && reaped(b));
+}
+
+// with the other peer down, batches that need it fail, keeping nothing of what they copied
+static void check_unreachable(void) {
+	const char *addresses[] = { PEER_ADDRESSES[0], PEER_ADDRESSES[1] };
+	kv_item items[64];
+	sds values[64];
+	char keys[64][16];
+	int i,local = 0;
+
+	snprintf(PEER_ADDRESSES[0],sizeof(PEER_ADDRESSES[0]),"unix:%s/peer0.sock",DIR_PATH);
+	snprintf(PEER_ADDRESSES[1],sizeof(PEER_ADDRESSES[1]),"unix:%s/down.sock",DIR_PATH);
+	CHECK(kv_init(4) == 0);
+	CHECK(kv_peers(addresses,2,0,NULL) == 0);
+	for (i = 0; i < 64; i++) {
+		snprintf(keys[i],sizeof(keys[i]),"k%d",i);
+		items[i] = (kv_item){ keys[i], strlen(keys[i]), NULL, 0, KV_STRING };
+		if (kv_put(keys[i],strlen(keys[i]),"x",1,KV_STRING,0,0) == 1) local++;
+	}
+	CHECK(local > 0 && local < 64);
+	for (i = 0; i < 64; i++) values[i] = (sds)keys[i];
+	CHECK(kv_mcopy(items,64,values) == -1);
+	for (i = 0; i < 64; i++) CHECK(values[i] == NULL);
+	kv_destroy();
+}
+
+static const check CHECKS[] = {
+	{ "shards",      check_shards },
+	{ "integers",    check_integers },
+	{ "contention",  check_contention },
+	{ "eviction",    check_eviction },
+	{ "waits",       check_waits },
+	{ "persistence", check_persistence },
+	{ "snapshot",    check_snapshot },
+	{ "shared",      check_shared },
+	{ "replication", check_replication },
+	{ "peers",       check_peers },
+	{ "unreachable", check_unreachable },
+	{ NULL,          NULL }
+};
+
+static int wanted(const char *name, int argc, char **argv) {
+	int i;
+
+	for (i = 1; i < argc; i++) if (strcmp(argv[i],name) == 0) return 1;
+	return argc < 2;
+}
+
+// empties the temporary directory
+static void cleanup(void) {
+	struct dirent *d;
+	char path[512];
+	DIR *dir;
+
+	if ((dir = opendir(DIR_PATH)) == NULL) return;
+	while ((d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name,".") == 0 || strcmp(d->d_name,"..") == 0) continue;
+		snprintf(path,sizeof(path),"%s/%s",DIR_PATH,d->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+}
+
+int main(int argc, char **argv) {
+	const check *c;
+	pid_t pid;
+	int failed = 0;
+
+	signal(SIGPIPE,SIG_IGN);
+	strcpy(DIR_PATH,"/tmp/kvcheck.XXXXXX");
+	if (mkdtemp(DIR_PATH) == NULL) {
+		perror("kvcheck");
+		return 1;
+	}
+	snprintf(SNAPSHOT,sizeof(SNAPSHOT),"%s/snapshot",DIR_PATH);
+	snprintf(AOF,sizeof(AOF),"%s/aof",DIR_PATH);
+	snprintf(SHARED_NAME,sizeof(SHARED_NAME),"/kvcheck-%d",(int)getpid());
+	for (c = CHECKS; c->name != NULL; c++) {
+		if (!wanted(c->name,argc,argv)) continue;
+		cleanup();
+		fflush(stdout);
+		if ((pid = fork()) == 0) {
+			alarm(TIMEOUT);
+			c->fn();
+			_exit(0);
+		}
+		if (pid > 0 && reaped(pid)) {
+			printf("ok     %s\n",c->name);
+		} else {
+			printf("FAILED %s\n",c->name);
+			failed++;
+		}
+	}
+	cleanup();
+	rmdir(DIR_PATH);
+	return failed > 0;
+}